@@ -6,12 +6,17 @@
 #include "Buffer.h"
 
 #include "hal/hal.h"
+#include "transfers.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 
 using namespace vc4cl;
 
+// guards the lazy allocation of the device buffers (of all buffers), see Buffer#ensureDeviceBuffers
+static std::mutex allocationLock;
+
 Buffer::Buffer(Context* context, cl_mem_flags flags) :
     HasContext(context), readable(true), writeable(true), hostReadable(true), hostWriteable(true), parent(nullptr)
 {
@@ -89,7 +94,7 @@ Buffer* Buffer::createSubBuffer(
         if(region->size == 0)
             return returnError<Buffer*>(
                 CL_INVALID_BUFFER_SIZE, errcode_ret, __FILE__, __LINE__, "Sub buffer has no size!");
-        if(hostPtr != nullptr && region->origin + region->size > hostSize)
+        if(region->origin + region->size > hostSize)
             return returnError<Buffer*>(CL_INVALID_VALUE, errcode_ret, __FILE__, __LINE__,
                 buildString(
                     "Sub buffer maximum (%u) exceeds parent's (%u) size!", region->origin + region->size, hostSize));
@@ -121,16 +126,17 @@ Buffer* Buffer::createSubBuffer(
     // set sub-region
     if(region != nullptr)
     {
+        // the parent buffer might be allocated concurrently
+        std::lock_guard<std::mutex> guard(allocationLock);
         if(hostPtr != nullptr)
         {
             subBuffer->hostPtr = reinterpret_cast<uint8_t*>(hostPtr) + region->origin;
         }
         subBuffer->hostSize = region->size;
         subBuffer->subBufferOffset = region->origin;
-        if(deviceBuffer->memHandle != 0)
-        {
-            subBuffer->deviceBuffer = deviceBuffer;
-        }
+        subBuffer->deviceBufferOffset = deviceBufferOffset + region->origin;
+        // if the parent is not yet allocated, the device buffer is shared on first use, see #ensureDeviceBuffers
+        subBuffer->deviceBuffer = deviceBuffer;
     }
     // TODO if region is nullptr, sub-buffer has no device buffer. On purpose? Can this happen?
     subBuffer->setHostSize();
@@ -146,7 +152,9 @@ cl_int Buffer::enqueueRead(CommandQueue* commandQueue, bool blockingRead, size_t
     if(!hostReadable)
         return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "Can't read from non host-readable buffer!");
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e = createBufferActionEvent(commandQueue, CommandType::BUFFER_READ, numEventsInWaitList, waitList, &errcode);
     if(e == nullptr)
     {
@@ -175,7 +183,9 @@ cl_int Buffer::enqueueWrite(CommandQueue* commandQueue, bool blockingWrite, size
     if(!hostWriteable)
         return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "Cannot write to non-writeable buffer");
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e =
         createBufferActionEvent(commandQueue, CommandType::BUFFER_WRITE, numEventsInWaitList, waitList, &errcode);
     if(e == nullptr)
@@ -237,7 +247,9 @@ cl_int Buffer::enqueueReadRect(CommandQueue* commandQueue, bool blocking_read, c
     if(!hostReadable)
         return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "Cannot read from non-readable buffer!");
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_READ_RECT, num_events_in_wait_list, event_wait_list, &errcode);
     if(e == nullptr)
@@ -287,7 +299,9 @@ cl_int Buffer::enqueueWriteRect(CommandQueue* commandQueue, bool blocking_write,
     if(!hostWriteable)
         return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "Cannot write to non-writeable buffer");
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_WRITE_RECT, num_events_in_wait_list, event_wait_list, &errcode);
     if(e == nullptr)
@@ -322,6 +336,10 @@ cl_int Buffer::enqueueCopyInto(CommandQueue* commandQueue, Buffer* destination,
     if(size == 0 || src_offset + size > hostSize || dst_offset + size > destination->hostSize)
         return returnError(CL_INVALID_VALUE, __FILE__, __LINE__, buildString("Invalid copy size (%u)!", size));
 
+    cl_int errcode = ensureDeviceBuffers({this, destination});
+    if(errcode != CL_SUCCESS)
+        return errcode;
+
     if(this == destination || (parent && destination->parent && parent.get() == destination->parent.get()))
     {
         /*
@@ -340,7 +358,6 @@ cl_int Buffer::enqueueCopyInto(CommandQueue* commandQueue, Buffer* destination,
             return returnError(CL_MEM_COPY_OVERLAP, __FILE__, __LINE__, "Source and destination buffers overlap!");
     }
 
-    cl_int errcode = CL_SUCCESS;
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_COPY, num_events_in_wait_list, event_wait_list, &errcode);
     if(e == nullptr)
@@ -492,7 +509,9 @@ cl_int Buffer::enqueueCopyIntoRect(CommandQueue* commandQueue, Buffer* destinati
             return returnError(CL_MEM_COPY_OVERLAP, __FILE__, __LINE__, "Source and destination regions overlap!");
     }
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffers({this, destination});
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_COPY_RECT, num_events_in_wait_list, event_wait_list, &errcode);
     if(e == nullptr)
@@ -527,7 +546,9 @@ cl_int Buffer::enqueueFill(CommandQueue* commandQueue, const void* pattern, size
     if(!hostWriteable)
         return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "Cannot fill a non host-writeable buffer!");
 
-    cl_int errcode = CL_SUCCESS;
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_FILL, num_events_in_wait_list, event_wait_list, &errcode);
     if(e == nullptr)
@@ -569,6 +590,10 @@ void* Buffer::enqueueMap(CommandQueue* commandQueue, bool blocking_map, cl_map_f
     // mapping = making the buffer available in the host-memory
     // our implementation does so automatically
 
+    cl_int errcode = ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return returnError<void*>(errcode, errcode_ret, __FILE__, __LINE__, "Failed to allocate buffer to map!");
+
     Event* e = createBufferActionEvent(
         commandQueue, CommandType::BUFFER_MAP, num_events_in_wait_list, event_wait_list, errcode_ret);
     if(e == nullptr)
@@ -589,16 +614,15 @@ void* Buffer::enqueueMap(CommandQueue* commandQueue, bool blocking_map, cl_map_f
         out_ptr = reinterpret_cast<uintptr_t>(getDeviceHostPointerWithOffset()) + offset;
     }
 
-    std::list<MappingInfo>::const_iterator info = mappings.end();
+    MappingIntervals::iterator info = mappings.end();
     {
         // we need to already add the mapping here, otherwise queuing the clEnqueueUnmapMemObject might fail for the
         // memory are not being mapped yet, if the event handler did not process this event yet.
         std::lock_guard<std::mutex> mapGuard(mappingsLock);
-        mappings.emplace_back(MappingInfo{reinterpret_cast<void*>(out_ptr), false,
+        info = mappings.addMapping(MappingInfo{reinterpret_cast<void*>(out_ptr), offset, size, false,
             hasFlag<cl_map_flags>(map_flags, CL_MAP_WRITE_INVALIDATE_REGION),
             /* only on direct match, i.e. if not combined with CL_MAP_WRITE(...) */
-            map_flags == CL_MAP_READ});
-        info = --mappings.end();
+            map_flags == CL_MAP_READ, false});
     }
 
     EventAction* action = newObject<BufferMapping>(this, info, false);
@@ -629,27 +653,25 @@ cl_int Buffer::setDestructorCallback(BufferDestructionCallback callback, void* u
 cl_int Buffer::enqueueUnmap(CommandQueue* commandQueue, void* mapped_ptr, cl_uint num_events_in_wait_list,
     const cl_event* event_wait_list, cl_event* event)
 {
-    std::list<MappingInfo>::iterator mapping = mappings.end();
+    MappingIntervals::iterator mapping = mappings.end();
     {
         std::lock_guard<std::mutex> mapGuard(mappingsLock);
         if(mapped_ptr == nullptr)
             return returnError(
                 CL_INVALID_VALUE, __FILE__, __LINE__, buildString("No such memory area to unmap %p!", mapped_ptr));
 
-        for(auto it = mappings.begin(); it != mappings.end(); ++it)
-        {
-            if(it->hostPointer == mapped_ptr && !it->unmapScheduled)
-            {
-                mapping = it;
-                break;
-            }
-        }
+        // the mapped pointers are derived from the host-pointer or the device buffer, see #enqueueMap
+        auto basePointer = reinterpret_cast<uintptr_t>(
+            useHostPtr && hostPtr != nullptr ? hostPtr : getDeviceHostPointerWithOffset());
+        auto mappedPointer = reinterpret_cast<uintptr_t>(mapped_ptr);
+        if(basePointer != 0 && mappedPointer >= basePointer)
+            mapping = mappings.findMapping(mapped_ptr, mappedPointer - basePointer);
         if(mapping == mappings.end())
             return returnError(CL_INVALID_VALUE, __FILE__, __LINE__,
                 buildString("Memory area %p was not mapped to this buffer!", mapped_ptr));
         else
             // mark this particular entry as being unmapped to make sure we do not unmap an entry twice
-            mapping->unmapScheduled = true;
+            mapping->second.unmapScheduled = true;
     }
 
     cl_int errcode = CL_SUCCESS;
@@ -727,10 +749,22 @@ void Buffer::setUseHostPointer(void* hostPtr, size_t hostSize)
     this->hostSize = hostSize;
 }
 
+bool Buffer::importHostPointer(void* hostPtr, size_t hostSize)
+{
+    uint32_t offset = 0;
+    auto importedBuffer = system()->importHostBuffer(hostPtr, static_cast<unsigned>(hostSize), offset);
+    if(!importedBuffer)
+        return false;
+    deviceBuffer = std::move(importedBuffer);
+    deviceBufferOffset = offset;
+    return true;
+}
+
 void Buffer::setAllocateHostPointer(size_t hostSize)
 {
     allocHostPtr = true;
-    this->hostPtr = deviceBuffer->hostPointer;
+    // if the device buffer is not yet allocated, the host pointer is set on allocation
+    this->hostPtr = deviceBuffer ? deviceBuffer->hostPointer : nullptr;
     this->hostSize = hostSize;
 }
 
@@ -783,13 +817,14 @@ cl_int Buffer::copyIntoHostBuffer(size_t offset, size_t size)
         return CL_INVALID_VALUE;
     if(offset + size > hostSize)
         return CL_INVALID_VALUE;
-    if(hostPtr == deviceBuffer->hostPointer)
-        // e.g. allocate host-pointer
+    if(hostPtr == getDeviceHostPointerWithOffset())
+        // e.g. allocate host-pointer or imported host memory
         return CL_SUCCESS;
     uintptr_t dest = reinterpret_cast<uintptr_t>(hostPtr) + offset;
     uintptr_t src = reinterpret_cast<uintptr_t>(getDeviceHostPointerWithOffset()) + offset;
     if(dest == src)
         return CL_SUCCESS;
+    beginHostRead();
     memmove(reinterpret_cast<void*>(dest), reinterpret_cast<void*>(src), size);
     return CL_SUCCESS;
 }
@@ -805,36 +840,221 @@ cl_int Buffer::copyFromHostBuffer(size_t offset, size_t size)
         return CL_INVALID_VALUE;
     if(offset + size > hostSize)
         return CL_INVALID_VALUE;
-    if(hostPtr == deviceBuffer->hostPointer)
-        // e.g. allocate host-pointer
+    if(hostPtr == getDeviceHostPointerWithOffset())
+        // e.g. allocate host-pointer or imported host memory
         return CL_SUCCESS;
     uintptr_t dest = reinterpret_cast<uintptr_t>(getDeviceHostPointerWithOffset()) + offset;
     uintptr_t src = reinterpret_cast<uintptr_t>(hostPtr) + offset;
+    beginHostWrite(offset, size);
     memmove(reinterpret_cast<void*>(dest), reinterpret_cast<void*>(src), size);
     return CL_SUCCESS;
 }
 
-void Buffer::setHostSize()
+void Buffer::setHostSize(size_t size)
 {
-    if(hostSize == 0)
+    if(hostSize != 0)
+        return;
+    if(size != 0)
+        hostSize = size;
+    else if(deviceBuffer)
         hostSize = deviceBuffer->size;
 }
 
+cl_int Buffer::ensureDeviceBuffer()
+{
+    return ensureDeviceBuffers({this});
+}
+
+cl_int Buffer::ensureDeviceBuffers(const std::vector<Buffer*>& buffers)
+{
+    std::lock_guard<std::mutex> guard(allocationLock);
+    // sub-buffers share the device buffer of their parent, so only the parent buffers are allocated
+    std::vector<Buffer*> pendingBuffers;
+    std::vector<unsigned> sizes;
+    for(Buffer* buffer : buffers)
+    {
+        Buffer* root = buffer->parent ? buffer->parent.get() : buffer;
+        if(!root->deviceBuffer &&
+            std::find(pendingBuffers.begin(), pendingBuffers.end(), root) == pendingBuffers.end())
+        {
+            pendingBuffers.push_back(root);
+            sizes.push_back(static_cast<unsigned>(root->hostSize));
+        }
+    }
+
+    if(!pendingBuffers.empty())
+    {
+        auto deviceBuffers = system()->allocateBuffers(sizes, "VC4CL buffer");
+        for(std::size_t i = 0; i < pendingBuffers.size(); ++i)
+        {
+            if(!deviceBuffers[i])
+                return returnError(CL_MEM_OBJECT_ALLOCATION_FAILURE, __FILE__, __LINE__,
+                    buildString("Failed to allocate enough device memory (%u)!", sizes[i]));
+            pendingBuffers[i]->deviceBuffer = std::move(deviceBuffers[i]);
+            // the application might use the host memory of this buffer (e.g. when mapped) for other buffers
+            system()->registerHostBuffer(pendingBuffers[i]->deviceBuffer);
+            DEBUG_LOG(DebugLevel::MEMORY,
+                std::cout << "Allocated " << sizes[i] << " bytes of device buffer on first use of buffer "
+                          << pendingBuffers[i] << std::endl)
+        }
+    }
+
+    for(Buffer* buffer : buffers)
+    {
+        if(!buffer->deviceBuffer)
+            buffer->deviceBuffer = buffer->parent->deviceBuffer;
+        if(buffer->allocHostPtr && buffer->hostPtr == nullptr)
+            buffer->hostPtr = buffer->getDeviceHostPointerWithOffset();
+    }
+    return CL_SUCCESS;
+}
+
 DevicePointer Buffer::getDevicePointerWithOffset()
 {
     if(!deviceBuffer)
         return DevicePointer{0};
-    return DevicePointer{static_cast<unsigned>(static_cast<unsigned>(deviceBuffer->qpuPointer) + subBufferOffset)};
+    return DevicePointer{static_cast<unsigned>(static_cast<unsigned>(deviceBuffer->qpuPointer) + deviceBufferOffset)};
 }
 
 void* Buffer::getDeviceHostPointerWithOffset()
 {
     if(!deviceBuffer)
         return nullptr;
-    auto tmp = reinterpret_cast<char*>(deviceBuffer->hostPointer) + subBufferOffset;
+    auto tmp = reinterpret_cast<char*>(deviceBuffer->hostPointer) + deviceBufferOffset;
     return reinterpret_cast<void*>(tmp);
 }
 
+void Buffer::beginHostRead()
+{
+    if(deviceBuffer)
+        deviceBuffer->beginHostRead();
+}
+
+void Buffer::beginHostWrite(size_t offset, size_t numBytes)
+{
+    if(deviceBuffer)
+        deviceBuffer->beginHostWrite(
+            static_cast<uint32_t>(deviceBufferOffset + offset), static_cast<uint32_t>(numBytes));
+}
+
+void Buffer::discardHostWrites()
+{
+    if(deviceBuffer)
+        deviceBuffer->discardHostWrites(static_cast<uint32_t>(deviceBufferOffset), static_cast<uint32_t>(hostSize));
+}
+
+MappingIntervals::iterator MappingIntervals::addMapping(const MappingInfo& info)
+{
+    // the mapping only covers its region once it is activated
+    return mappings.emplace(info.offset, MappingInfo{info.hostPointer, info.offset, info.size, info.unmapScheduled,
+                                             info.skipPopulatingBuffer, info.skipWritingBack, false});
+}
+
+MappingIntervals::iterator MappingIntervals::findMapping(const void* hostPointer, std::size_t offset)
+{
+    // multimap keeps the insertion order of equal keys, so we find the oldest mapping first
+    auto range = mappings.equal_range(offset);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        if(it->second.hostPointer == hostPointer && !it->second.unmapScheduled)
+            return it;
+    }
+    return mappings.end();
+}
+
+void MappingIntervals::activateMapping(iterator mapping)
+{
+    if(mapping->second.isActive || mapping->second.size == 0)
+        return;
+    mapping->second.isActive = true;
+    updateCoverage(mapping->second.offset, mapping->second.offset + mapping->second.size, true);
+}
+
+void MappingIntervals::removeMapping(iterator mapping)
+{
+    if(mapping->second.isActive && mapping->second.size != 0)
+        updateCoverage(mapping->second.offset, mapping->second.offset + mapping->second.size, false);
+    mappings.erase(mapping);
+}
+
+std::vector<ByteRange> MappingIntervals::getUnmappedRanges(std::size_t offset, std::size_t size) const
+{
+    std::vector<ByteRange> ranges;
+    const auto end = offset + size;
+    auto position = offset;
+    // start with the interval containing the offset, if any
+    auto it = coverage.upper_bound(offset);
+    if(it != coverage.begin() && std::prev(it)->second.first > offset)
+        --it;
+    for(; it != coverage.end() && it->first < end && position < end; ++it)
+    {
+        if(it->first > position)
+            ranges.push_back(ByteRange{static_cast<uint32_t>(position), static_cast<uint32_t>(it->first - position)});
+        position = std::max(position, it->second.first);
+    }
+    if(position < end)
+        ranges.push_back(ByteRange{static_cast<uint32_t>(position), static_cast<uint32_t>(end - position)});
+    return ranges;
+}
+
+void MappingIntervals::updateCoverage(std::size_t start, std::size_t end, bool addMapping)
+{
+    splitInterval(start);
+    splitInterval(end);
+    auto position = start;
+    auto it = coverage.lower_bound(start);
+    while(position < end)
+    {
+        if(it != coverage.end() && it->first == position)
+        {
+            // interval already covered by other mappings
+            position = it->second.first;
+            if(addMapping)
+                ++(it++)->second.second;
+            else if(--it->second.second == 0)
+                it = coverage.erase(it);
+            else
+                ++it;
+        }
+        else
+        {
+            // gap not yet covered by any mapping, can only happen when adding a mapping
+            auto gapEnd = it != coverage.end() && it->first < end ? it->first : end;
+            if(addMapping)
+                coverage.emplace_hint(it, position, std::make_pair(gapEnd, 1u));
+            position = gapEnd;
+        }
+    }
+    mergeIntervals(start);
+    mergeIntervals(end);
+}
+
+void MappingIntervals::splitInterval(std::size_t position)
+{
+    auto it = coverage.upper_bound(position);
+    if(it == coverage.begin())
+        return;
+    --it;
+    if(it->first < position && position < it->second.first)
+    {
+        coverage.emplace_hint(std::next(it), position, std::make_pair(it->second.first, it->second.second));
+        it->second.first = position;
+    }
+}
+
+void MappingIntervals::mergeIntervals(std::size_t position)
+{
+    auto next = coverage.find(position);
+    if(next == coverage.end() || next == coverage.begin())
+        return;
+    auto previous = std::prev(next);
+    if(previous->second.first == position && previous->second.second == next->second.second)
+    {
+        previous->second.first = next->second.first;
+        coverage.erase(next);
+    }
+}
+
 static std::string toString(const Buffer& buffer)
 {
     std::stringstream ss;
@@ -846,7 +1066,7 @@ static std::string toString(const Buffer& buffer)
     return ss.str();
 }
 
-BufferMapping::BufferMapping(Buffer* buffer, std::list<MappingInfo>::const_iterator mappingInfo, bool unmap) :
+BufferMapping::BufferMapping(Buffer* buffer, MappingIntervals::iterator mappingInfo, bool unmap) :
     buffer(buffer), mappingInfo(mappingInfo), unmap(unmap)
 {
 }
@@ -856,9 +1076,11 @@ BufferMapping::~BufferMapping() = default;
 cl_int BufferMapping::operator()()
 {
     /*
-     * Despite the clEnqueueMapBuffer and clEnqueueUnmapMemObject functions being called with sub-areas of the buffer
-     * (offset + size), we always copy the whole buffer from/to host memory.
+     * Only the region mapped is copied from/to host memory. No copy is required if the host memory is imported as
+     * device buffer, see SystemAccess#importHostBuffer.
      */
+    const auto offset = mappingInfo->second.offset;
+    const auto size = mappingInfo->second.size;
     cl_int status = CL_SUCCESS;
     if(unmap)
     {
@@ -866,20 +1088,41 @@ cl_int BufferMapping::operator()()
         // considered to be complete."
         //-> when un-mapping, we need to write possible changes back to the device buffer, unless the mapping was
         // read-only in which case writing to it would have been undefined behavior
-        if(!mappingInfo->skipWritingBack)
-            status = buffer->copyFromHostBuffer(0, buffer->hostSize);
+        if(!mappingInfo->second.skipWritingBack)
+            status = buffer->copyFromHostBuffer(offset, size);
         std::lock_guard<std::mutex> mapGuard(buffer->mappingsLock);
-        buffer->mappings.erase(mappingInfo);
+        buffer->mappings.removeMapping(mappingInfo);
     }
     else
     {
         //"If the buffer object is created with CL_MEM_USE_HOST_PTR [...]"
         //"The host_ptr specified in clCreateBuffer is guaranteed to contain the latest bits [...]"
         // -> when mapping, we need to write the current device buffer contents to the host buffer, unless the
-        // client notified us that it does not care about the previous contents, e.g. if the whole buffer will be
-        // overwritten anyway
-        if(!mappingInfo->skipPopulatingBuffer)
-            status = buffer->copyIntoHostBuffer(0, buffer->hostSize);
+        // client notified us that it does not care about the previous contents, e.g. if the whole region will be
+        // overwritten anyway. Parts which are already mapped by another mapping are up to date (and might already be
+        // modified by the host), so they are not copied again.
+        std::vector<ByteRange> populatedRanges;
+        {
+            std::lock_guard<std::mutex> mapGuard(buffer->mappingsLock);
+            if(!mappingInfo->second.skipPopulatingBuffer)
+                populatedRanges = buffer->mappings.getUnmappedRanges(offset, size);
+            buffer->mappings.activateMapping(mappingInfo);
+        }
+        for(const auto& range : populatedRanges)
+        {
+            status = buffer->copyIntoHostBuffer(range.offset, range.size);
+            if(status != CL_SUCCESS)
+                break;
+        }
+        if(!buffer->useHostPtr || buffer->hostPtr == buffer->getDeviceHostPointerWithOffset())
+        {
+            // the host directly accesses the device buffer via the mapped pointer, for read-only mappings, we do not
+            // need to clean the host CPU cache afterwards
+            if(mappingInfo->second.skipWritingBack)
+                buffer->beginHostRead();
+            else
+                buffer->beginHostWrite(offset, size);
+        }
     }
     return status;
 }
@@ -888,9 +1131,9 @@ std::string BufferMapping::to_string() const
 {
     std::stringstream ss;
     if(unmap)
-        ss << "unmap " << toString(*buffer.get()) << " from 0x" << mappingInfo->hostPointer;
+        ss << "unmap " << toString(*buffer.get()) << " from 0x" << mappingInfo->second.hostPointer;
     else
-        ss << "map " << toString(*buffer.get()) << " to 0x" << mappingInfo->hostPointer;
+        ss << "map " << toString(*buffer.get()) << " to 0x" << mappingInfo->second.hostPointer;
     return ss.str();
 }
 
@@ -903,14 +1146,26 @@ BufferAccess::~BufferAccess() = default;
 
 cl_int BufferAccess::operator()()
 {
+    if(writeToBuffer)
+        buffer->beginHostWrite(bufferOffset, numBytes);
+    else
+        buffer->beginHostRead();
     if(hostPtr == buffer->getDeviceHostPointerWithOffset() && bufferOffset == hostOffset)
         return CL_SUCCESS;
-    if(writeToBuffer)
-        memmove(static_cast<char*>(buffer->getDeviceHostPointerWithOffset()) + bufferOffset,
-            static_cast<char*>(hostPtr) + hostOffset, numBytes);
+    auto bufferPointer = static_cast<char*>(buffer->getDeviceHostPointerWithOffset()) + bufferOffset;
+    auto hostPointer = static_cast<char*>(hostPtr) + hostOffset;
+    if(bufferPointer < hostPointer + numBytes && hostPointer < bufferPointer + numBytes)
+    {
+        // the host pointer points into the buffer memory itself
+        if(writeToBuffer)
+            memmove(bufferPointer, hostPointer, numBytes);
+        else
+            memmove(hostPointer, bufferPointer, numBytes);
+    }
+    else if(writeToBuffer)
+        copyHostMemory(bufferPointer, buffer->deviceBuffer->cacheType, hostPointer, CacheType::BOTH_CACHED, numBytes);
     else
-        memmove(static_cast<char*>(hostPtr) + hostOffset,
-            static_cast<char*>(buffer->getDeviceHostPointerWithOffset()) + bufferOffset, numBytes);
+        copyHostMemory(hostPointer, CacheType::BOTH_CACHED, bufferPointer, buffer->deviceBuffer->cacheType, numBytes);
     return CL_SUCCESS;
 }
 
@@ -944,21 +1199,19 @@ cl_int BufferRectAccess::operator()()
         bufferOrigin[1] * bufferRowPitch + bufferOrigin[2] * bufferSlicePitch;
     uintptr_t hostPointer = reinterpret_cast<uintptr_t>(hostPtr) + hostOrigin[0] + hostOrigin[1] * hostRowPitch +
         hostOrigin[2] * hostSlicePitch;
+    if(writeToBuffer)
+        buffer->beginHostWrite(bufferOrigin[0] + bufferOrigin[1] * bufferRowPitch + bufferOrigin[2] * bufferSlicePitch,
+            getRectExtent(region, bufferRowPitch, bufferSlicePitch));
+    else
+        buffer->beginHostRead();
 
-    /* TODO: (from pocl) handle overlapping regions. Can there be any? */
-    for(std::size_t z = 0; z < region[2]; ++z)
-    {
-        for(std::size_t y = 0; y < region[1]; ++y)
-        {
-            auto bufferOffsetPointer =
-                reinterpret_cast<void*>(devicePointer + bufferRowPitch * y + bufferSlicePitch * z);
-            auto hostOffsetPointer = reinterpret_cast<void*>(hostPointer + hostRowPitch * y + hostSlicePitch * z);
-            if(writeToBuffer)
-                memmove(bufferOffsetPointer, hostOffsetPointer, region[0]);
-            else
-                memmove(hostOffsetPointer, bufferOffsetPointer, region[0]);
-        }
-    }
+    const auto bufferCaching = buffer->deviceBuffer->cacheType;
+    if(writeToBuffer)
+        copyHostRect(reinterpret_cast<void*>(devicePointer), bufferCaching, bufferRowPitch, bufferSlicePitch,
+            reinterpret_cast<const void*>(hostPointer), CacheType::BOTH_CACHED, hostRowPitch, hostSlicePitch, region);
+    else
+        copyHostRect(reinterpret_cast<void*>(hostPointer), CacheType::BOTH_CACHED, hostRowPitch, hostSlicePitch,
+            reinterpret_cast<const void*>(devicePointer), bufferCaching, bufferRowPitch, bufferSlicePitch, region);
     return CL_SUCCESS;
 }
 
@@ -986,11 +1239,29 @@ BufferFill::~BufferFill() = default;
 cl_int BufferFill::operator()()
 {
     uintptr_t start = reinterpret_cast<uintptr_t>(buffer->getDeviceHostPointerWithOffset()) + bufferOffset;
-    uintptr_t end = start + numBytes;
-    while(start < end)
+    auto deviceRange = QPUTransfers::getInstance().fillBuffer(*buffer.get(), bufferOffset, numBytes, pattern);
+    if(deviceRange.size == 0)
+    {
+        buffer->beginHostWrite(bufferOffset, numBytes);
+        fillMemory(reinterpret_cast<void*>(start), numBytes, pattern.data(), pattern.size());
+        return CL_SUCCESS;
+    }
+    // fill the unaligned head and tail not filled by the QPUs
+    if(deviceRange.offset != 0)
+    {
+        buffer->beginHostWrite(bufferOffset, deviceRange.offset);
+        fillMemory(reinterpret_cast<void*>(start), deviceRange.offset, pattern.data(), pattern.size());
+    }
+    std::size_t tailOffset = deviceRange.offset + deviceRange.size;
+    if(tailOffset < numBytes)
     {
-        memcpy(reinterpret_cast<void*>(start), pattern.data(), pattern.size());
-        start += pattern.size();
+        // the tail starts somewhere within the pattern
+        std::vector<char> tailPattern(pattern);
+        std::rotate(tailPattern.begin(),
+            tailPattern.begin() + static_cast<std::ptrdiff_t>(tailOffset % pattern.size()), tailPattern.end());
+        buffer->beginHostWrite(bufferOffset + tailOffset, numBytes - tailOffset);
+        fillMemory(reinterpret_cast<void*>(start + tailOffset), numBytes - tailOffset, tailPattern.data(),
+            tailPattern.size());
     }
     return CL_SUCCESS;
 }
@@ -1016,7 +1287,36 @@ cl_int BufferCopy::operator()()
     uintptr_t dest = reinterpret_cast<uintptr_t>(destBuffer->getDeviceHostPointerWithOffset()) + destOffset;
     if(dest == src)
         return CL_SUCCESS;
-    memmove(reinterpret_cast<void*>(dest), reinterpret_cast<void*>(src), numBytes);
+    auto deviceRange = QPUTransfers::getInstance().copyBuffer(
+        *sourceBuffer.get(), sourceOffset, *destBuffer.get(), destOffset, numBytes);
+    auto copy = [&](std::size_t offset, std::size_t size) {
+        if(src < dest + numBytes && dest < src + numBytes)
+            // copying between overlapping sub-buffers of the same buffer
+            memmove(reinterpret_cast<void*>(dest + offset), reinterpret_cast<void*>(src + offset), size);
+        else
+            copyHostMemory(reinterpret_cast<void*>(dest + offset), destBuffer->deviceBuffer->cacheType,
+                reinterpret_cast<const void*>(src + offset), sourceBuffer->deviceBuffer->cacheType, size);
+    };
+    if(deviceRange.size == 0)
+    {
+        sourceBuffer->beginHostRead();
+        destBuffer->beginHostWrite(destOffset, numBytes);
+        copy(0, numBytes);
+        return CL_SUCCESS;
+    }
+    // copy the unaligned head and tail not copied by the QPUs
+    sourceBuffer->beginHostRead();
+    if(deviceRange.offset != 0)
+    {
+        destBuffer->beginHostWrite(destOffset, deviceRange.offset);
+        copy(0, deviceRange.offset);
+    }
+    std::size_t tailOffset = deviceRange.offset + deviceRange.size;
+    if(tailOffset < numBytes)
+    {
+        destBuffer->beginHostWrite(destOffset + tailOffset, numBytes - tailOffset);
+        copy(tailOffset, numBytes - tailOffset);
+    }
     return CL_SUCCESS;
 }
 
@@ -1039,29 +1339,91 @@ BufferRectCopy::~BufferRectCopy() = default;
 
 cl_int BufferRectCopy::operator()()
 {
+    if(QPUTransfers::getInstance().copyBufferRect(*sourceBuffer.get(), *destBuffer.get(), sourceOrigin, sourceRowPitch,
+           sourceSlicePitch, destOrigin, destRowPitch, destSlicePitch, region))
+        return CL_SUCCESS;
+
     // copied from POCL (https://github.com/pocl/pocl/blob/master/lib/CL/devices/basic/basic.c), function
     // pocl_basic_copy_rect
     uintptr_t sourcePointer = reinterpret_cast<uintptr_t>(sourceBuffer->getDeviceHostPointerWithOffset()) +
         sourceOrigin[0] + sourceOrigin[1] * sourceRowPitch + sourceOrigin[2] * sourceSlicePitch;
     uintptr_t destPointer = reinterpret_cast<uintptr_t>(destBuffer->getDeviceHostPointerWithOffset()) + destOrigin[0] +
         destOrigin[1] * destRowPitch + destOrigin[2] * destSlicePitch;
+    sourceBuffer->beginHostRead();
+    destBuffer->beginHostWrite(destOrigin[0] + destOrigin[1] * destRowPitch + destOrigin[2] * destSlicePitch,
+        getRectExtent(region, destRowPitch, destSlicePitch));
+
+    copyHostRect(reinterpret_cast<void*>(destPointer), destBuffer->deviceBuffer->cacheType, destRowPitch,
+        destSlicePitch, reinterpret_cast<const void*>(sourcePointer), sourceBuffer->deviceBuffer->cacheType,
+        sourceRowPitch, sourceSlicePitch, region);
+    return CL_SUCCESS;
+}
+
+std::string BufferRectCopy::to_string() const
+{
+    std::stringstream ss;
+    ss << "copying rectangular from " << toString(*sourceBuffer.get()) << " into " << toString(*destBuffer.get());
+    return ss.str();
+}
 
-    /* TODO: (from pocl) handle overlapping regions. Can there be any? */
-    for(std::size_t z = 0; z < region[2]; ++z)
+/*
+ * The maximum number of bytes prefetched into the host CPU cache when migrating a buffer to the host, the size of the
+ * L2 cache of the BCM2835. Prefetching more would only evict the first prefetched cache lines again.
+ */
+static constexpr std::size_t MAX_HOST_PREFETCH_SIZE = 128 * 1024;
+
+BufferMigration::BufferMigration(const std::vector<Buffer*>& buffers, cl_mem_migration_flags flags) : flags(flags)
+{
+    this->buffers.reserve(buffers.size());
+    for(auto buffer : buffers)
+        this->buffers.emplace_back(buffer);
+}
+
+BufferMigration::~BufferMigration() = default;
+
+cl_int BufferMigration::operator()()
+{
+    std::vector<const DeviceBuffer*> toBeCleaned;
+    toBeCleaned.reserve(buffers.size());
+    for(auto& buffer : buffers)
     {
-        for(std::size_t y = 0; y < region[1]; ++y)
+        if(!buffer->deviceBuffer)
+            continue;
+        if(flags & CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED)
+            // the contents do not need to be preserved, so there is no need to write back the host writes
+            buffer->discardHostWrites();
+        if(flags & CL_MIGRATE_MEM_OBJECT_HOST)
         {
-            memmove(reinterpret_cast<void*>(destPointer + destRowPitch * y + destSlicePitch * z),
-                reinterpret_cast<void*>(sourcePointer + sourceRowPitch * y + sourceSlicePitch * z), region[0]);
+            // invalidate the device writes now instead of on the first host access and pull the beginning of the
+            // buffer into the host CPU cache
+            buffer->beginHostRead();
+            if(isHostCached(buffer->deviceBuffer->cacheType))
+            {
+                auto start = static_cast<const char*>(buffer->getDeviceHostPointerWithOffset());
+                auto numBytes = std::min(buffer->hostSize, MAX_HOST_PREFETCH_SIZE);
+                for(std::size_t offset = 0; offset < numBytes; offset += HostWriteTracker::CACHE_LINE_SIZE)
+                    __builtin_prefetch(start + offset, 0 /* read */, 3 /* keep in all cache levels */);
+            }
         }
+        else
+            toBeCleaned.emplace_back(buffer->deviceBuffer.get());
     }
+    // clean the host writes now instead of before the next kernel execution accessing the buffers
+    if(!toBeCleaned.empty() && !system()->cleanCPUCache(toBeCleaned))
+        // the remaining host writes are cleaned again before the next device access
+        DEBUG_LOG(DebugLevel::MEMORY,
+            std::cout << "Failed to clean the CPU cache for " << toBeCleaned.size() << " migrated buffers"
+                      << std::endl)
     return CL_SUCCESS;
 }
 
-std::string BufferRectCopy::to_string() const
+std::string BufferMigration::to_string() const
 {
     std::stringstream ss;
-    ss << "copying rectangular from " << toString(*sourceBuffer.get()) << " into " << toString(*destBuffer.get());
+    ss << "migrating " << buffers.size() << " buffers to the "
+       << ((flags & CL_MIGRATE_MEM_OBJECT_HOST) ? "host" : "device");
+    if(flags & CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED)
+        ss << " discarding their contents";
     return ss.str();
 }
 
@@ -1136,12 +1498,22 @@ cl_mem VC4CL_FUNC(clCreateBuffer)(
     Buffer* buffer = newOpenCLObject<Buffer>(toType<Context>(context), flags);
     CHECK_ALLOCATION_ERROR_CODE(buffer, errcode_ret, cl_mem)
 
-    buffer->deviceBuffer = system()->allocateBuffer(static_cast<unsigned>(size), "VC4CL buffer");
-    if(!buffer->deviceBuffer)
+    // The device buffer is only allocated on its first use, since the allocation is expensive and applications often
+    // create many buffers up front. Copying the host-pointer contents is such a use.
+    buffer->setHostSize(size);
+    if(hasFlag<cl_mem_flags>(flags, CL_MEM_USE_HOST_PTR))
+        // Try to access the host memory directly from the GPU, so we do not need to copy the data between host and
+        // device buffer. If the memory cannot be imported, the device buffer is allocated and synchronized below.
+        buffer->importHostPointer(host_ptr, size);
+    if(hasFlag<cl_mem_flags>(flags, CL_MEM_USE_HOST_PTR) || hasFlag<cl_mem_flags>(flags, CL_MEM_COPY_HOST_PTR))
     {
-        ignoreReturnValue(buffer->release(), __FILE__, __LINE__, "Already errored");
-        return returnError<cl_mem>(CL_OUT_OF_RESOURCES, errcode_ret, __FILE__, __LINE__,
-            buildString("Failed to allocate enough device memory (%u)!", size));
+        cl_int errcode = buffer->ensureDeviceBuffer();
+        if(errcode != CL_SUCCESS)
+        {
+            ignoreReturnValue(buffer->release(), __FILE__, __LINE__, "Already errored");
+            return returnError<cl_mem>(errcode, errcode_ret, __FILE__, __LINE__,
+                buildString("Failed to allocate enough device memory (%u)!", size));
+        }
     }
 
     if(hasFlag<cl_mem_flags>(flags, CL_MEM_USE_HOST_PTR))
@@ -1174,7 +1546,6 @@ cl_mem VC4CL_FUNC(clCreateBuffer)(
         //"CL_MEM_COPY_HOST_PTR can be used with CL_MEM_ALLOC_HOST_PTR"
         buffer->setCopyHostPointer(host_ptr, size);
     }
-    buffer->setHostSize();
 
     RETURN_OBJECT(buffer->toBase(), errcode_ret)
 }
@@ -2213,14 +2584,25 @@ cl_int VC4CL_FUNC(clEnqueueMigrateMemObjects)(cl_command_queue command_queue, cl
             return returnError(
                 CL_INVALID_CONTEXT, __FILE__, __LINE__, "Contexts of command-queue and buffer do not match!");
     }
+    if((flags & ~static_cast<cl_mem_migration_flags>(
+                    CL_MIGRATE_MEM_OBJECT_HOST | CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED)) != 0)
+        return returnError(CL_INVALID_VALUE, __FILE__, __LINE__, buildString("Invalid migration flags: %u", flags));
     CHECK_EVENT_WAIT_LIST(event_wait_list, num_events_in_wait_list)
 
-    // All buffers are always on the single device (the VideoCore IV GPU), so no migration is required
+    // Migrating the buffers makes sure they are allocated
+    std::vector<Buffer*> buffers;
+    buffers.reserve(num_mem_objects);
+    for(cl_uint i = 0; i < num_mem_objects; ++i)
+        buffers.push_back(toType<Buffer>(mem_objects[i]));
+    cl_int errcode = Buffer::ensureDeviceBuffers(buffers);
+    if(errcode != CL_SUCCESS)
+        return errcode;
+
+    // The buffers are always located in GPU memory accessible from the host, so the migration only does the cache
+    // maintenance otherwise done on the next access ahead of time
     Event* e = newOpenCLObject<Event>(commandQueue->context(), CL_QUEUED, CommandType::BUFFER_MIGRATE);
     CHECK_ALLOCATION(e)
-    // this command doesn't actually do anything, since buffers are always located in GPU memory and accessible from
-    // host-memory
-    EventAction* action = newObject<NoAction>(CL_SUCCESS);
+    EventAction* action = newObject<BufferMigration>(buffers, flags);
     CHECK_ALLOCATION(action)
     e->action.reset(action);
 
@@ -11,7 +11,7 @@
 #include "Memory.h"
 #include "Object.h"
 
-#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -34,11 +34,17 @@ namespace vc4cl
      * device to the host buffer.
      * - if the mapping was read-only, we can skip copying the contents back from the host to the device buffer on
      * unmapping.
+     * - only the mapped region needs to be copied, parts which are already mapped by another mapping do not need to be
+     * copied from the device buffer again.
      */
     struct MappingInfo
     {
         // The pointer to which this mapping is mapped to
         void* hostPointer;
+        // The offset of the mapped region, relative to the start of the (sub-)buffer
+        std::size_t offset;
+        // The size of the mapped region in bytes
+        std::size_t size;
         // Whether this mapping has already been requested to be unmapped
         bool unmapScheduled;
         // Whether the contents of the mapped host buffer do not need to be copied from the device buffer at mapping
@@ -47,6 +53,61 @@ namespace vc4cl
         // Whether there is no need to write any data back to the device buffer on unmapping, e.g. the mapping is
         // read-only
         bool skipWritingBack;
+        // Whether the mapping is executed, i.e. the host buffer contains the contents of the mapped region
+        bool isActive;
+    };
+
+    /**
+     * The mappings of a single buffer, sorted by their offset
+     *
+     * In addition to the mappings themselves, the parts of the buffer covered by active mappings are tracked as
+     * disjoint intervals together with the number of mappings covering them. This allows to look up a mapping as well as
+     * the already mapped parts of any region in O(log n) (plus the number of intervals overlapping the region).
+     *
+     * NOTE: This type is not thread-safe, the accesses need to be guarded by the mapping lock of the owning buffer.
+     */
+    class MappingIntervals
+    {
+    public:
+        using iterator = std::multimap<std::size_t, MappingInfo>::iterator;
+
+        iterator addMapping(const MappingInfo& info);
+        /*
+         * Returns the oldest mapping of the given pointer at the given offset which is not yet scheduled to be
+         * unmapped, or #end() if there is no such mapping.
+         */
+        iterator findMapping(const void* hostPointer, std::size_t offset);
+        /*
+         * Marks the mapping as executed, i.e. its region is mapped from now on.
+         */
+        void activateMapping(iterator mapping);
+        void removeMapping(iterator mapping);
+
+        /*
+         * Returns the parts of the given region which are not mapped by any active mapping.
+         */
+        std::vector<ByteRange> getUnmappedRanges(std::size_t offset, std::size_t size) const;
+
+        inline std::size_t size() const noexcept
+        {
+            return mappings.size();
+        }
+
+        inline iterator end() noexcept
+        {
+            return mappings.end();
+        }
+
+    private:
+        std::multimap<std::size_t, MappingInfo> mappings;
+        // start of the interval -> (end of the interval, number of active mappings covering the interval)
+        std::map<std::size_t, std::pair<std::size_t, uint32_t>> coverage;
+
+        void updateCoverage(std::size_t start, std::size_t end, bool addMapping);
+        // splits the interval containing the given position, so an interval starts at the position
+        void splitInterval(std::size_t position);
+        // merges the intervals ending and starting at the given position, if they are covered by the same mappings
+        void mergeIntervals(std::size_t position);
     };
 
     class Buffer : public Object<_cl_mem, CL_INVALID_MEM_OBJECT>, public HasContext
@@ -88,6 +149,11 @@ namespace vc4cl
             cl_mem_info param_name, size_t param_value_size, void* param_value, size_t* param_value_size_ret);
 
         void setUseHostPointer(void* hostPtr, size_t hostSize);
+        /*
+         * Tries to use the given host memory directly as device buffer (see SystemAccess#importHostBuffer), so the data
+         * does not need to be copied between host and device buffer. Returns whether the memory was imported.
+         */
+        bool importHostPointer(void* hostPtr, size_t hostSize);
         void setAllocateHostPointer(size_t hostSize);
         void setCopyHostPointer(void* hostPtr, size_t hostSize);
         cl_mem_flags getMemFlags() const __attribute__((pure));
@@ -103,12 +169,39 @@ namespace vc4cl
         bool hostReadable;
         bool hostWriteable;
 
+        // the backing device buffer, allocated lazily on first use, see #ensureDeviceBuffer
         std::shared_ptr<DeviceBuffer> deviceBuffer;
 
-        void setHostSize();
+        /*
+         * Sets the host-visible size to the given size or the size of the device buffer, if it is not yet set.
+         */
+        void setHostSize(size_t size = 0);
+
+        /*
+         * Allocates the device buffer, if not yet done.
+         *
+         * This needs to be called before the device buffer is accessed the first time, e.g. when enqueuing a command
+         * accessing this buffer. For sub-buffers, this allocates the device buffer of the parent buffer.
+         */
+        CHECK_RETURN cl_int ensureDeviceBuffer();
+        /*
+         * Allocates the device buffers of all the given buffers not yet allocated with a single allocation request.
+         */
+        CHECK_RETURN static cl_int ensureDeviceBuffers(const std::vector<Buffer*>& buffers);
 
         DevicePointer getDevicePointerWithOffset();
         void* getDeviceHostPointerWithOffset();
+        /*
+         * Prepares the device buffer for being accessed by the host, see DeviceBuffer#beginHostRead and
+         * DeviceBuffer#beginHostWrite. The offset is relative to this (sub-)buffer.
+         */
+        void beginHostRead();
+        void beginHostWrite(size_t offset, size_t numBytes);
+        /*
+         * Drops all host writes to this (sub-)buffer not yet cleaned from the host CPU cache, see
+         * DeviceBuffer#discardHostWrites
+         */
+        void discardHostWrites();
 
     protected:
         bool useHostPtr;
@@ -122,27 +215,31 @@ namespace vc4cl
         size_t hostSize = 0;
 
         mutable std::mutex mappingsLock;
-        std::list<MappingInfo> mappings;
+        MappingIntervals mappings;
 
         std::vector<std::pair<BufferDestructionCallback, void*>> callbacks;
 
         object_wrapper<Buffer> parent;
         size_t subBufferOffset = 0;
+        // the offset of the buffer contents within the (possibly shared) device buffer, e.g. for sub-buffers or buffers
+        // importing the host memory of another buffer
+        size_t deviceBufferOffset = 0;
 
         CHECK_RETURN Event* createBufferActionEvent(CommandQueue* queue, CommandType command_type,
             cl_uint num_events_in_wait_list, const cl_event* event_wait_list, cl_int* errcode_ret) const;
 
         friend class Image;
         friend struct BufferMapping;
+        friend struct BufferMigration;
     };
 
     struct BufferMapping : public EventAction
     {
         object_wrapper<Buffer> buffer;
-        std::list<MappingInfo>::const_iterator mappingInfo;
+        MappingIntervals::iterator mappingInfo;
         bool unmap;
 
-        BufferMapping(Buffer* buffer, std::list<MappingInfo>::const_iterator mappingInfo, bool unmap);
+        BufferMapping(Buffer* buffer, MappingIntervals::iterator mappingInfo, bool unmap);
         ~BufferMapping() override;
 
         cl_int operator()() override final;
@@ -230,6 +327,18 @@ namespace vc4cl
         std::string to_string() const override;
     };
 
+    struct BufferMigration final : public EventAction
+    {
+        std::vector<object_wrapper<Buffer>> buffers;
+        cl_mem_migration_flags flags;
+
+        BufferMigration(const std::vector<Buffer*>& buffers, cl_mem_migration_flags flags);
+        ~BufferMigration() override;
+
+        cl_int operator()() override final;
+        std::string to_string() const override;
+    };
+
 } /* namespace vc4cl */
 
 #endif /* VC4CL_BUFFER */
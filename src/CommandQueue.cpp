@@ -10,15 +10,21 @@
 #include "Kernel.h"
 #include "queue_handler.h"
 
+#include <algorithm>
+
 using namespace vc4cl;
 
 CommandQueue::CommandQueue(Context* context, const bool outOfOrderExecution, const bool profiling) :
     HasContext(context), outOfOrderExecution(outOfOrderExecution), profiling(profiling),
-    queue(EventQueue::getInstance())
+    queue(EventQueue::create())
 {
+    queue->setOutOfOrderExecution(outOfOrderExecution);
 }
 
-CommandQueue::~CommandQueue() noexcept = default;
+CommandQueue::~CommandQueue() noexcept
+{
+    queue->shutdown();
+}
 
 cl_int CommandQueue::getInfo(
     cl_command_queue_info param_name, size_t param_value_size, void* param_value, size_t* param_value_size_ret) const
@@ -98,6 +104,15 @@ cl_int CommandQueue::enqueueEvent(Event* event)
     if(!event->action)
         return CL_INVALID_EVENT;
 
+    // For out-of-order queues, the implicit dependencies and the submission need to be atomic, to not miss any event
+    // enqueued in between. In-order queues are ordered by the submission itself, so producers do not need to serialize.
+    std::unique_lock<std::mutex> guard(enqueueLock, std::defer_lock);
+    if(outOfOrderExecution)
+    {
+        guard.lock();
+        addImplicitDependencies(event);
+    }
+
     cl_int status = event->prepareToQueue(this);
 
     // add to queue
@@ -110,12 +125,36 @@ cl_int CommandQueue::enqueueEvent(Event* event)
 cl_int CommandQueue::setProperties(cl_command_queue_properties properties, bool enable)
 {
     if((properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    {
+        std::lock_guard<std::mutex> guard(enqueueLock);
         outOfOrderExecution = enable;
+        queue->setOutOfOrderExecution(enable);
+    }
     if((properties & CL_QUEUE_PROFILING_ENABLE) == CL_QUEUE_PROFILING_ENABLE)
         profiling = enable;
     return CL_SUCCESS;
 }
 
+void CommandQueue::addImplicitDependencies(Event* event)
+{
+    auto pendingEvents = queue->getPendingEvents();
+    if((event->type == CommandType::MARKER || event->type == CommandType::BARRIER) && event->waitList.empty())
+    {
+        // "If event_wait_list is NULL, then this particular command waits until all previous enqueued commands to
+        // command_queue have completed."
+        for(auto& pending : pendingEvents)
+            event->waitList.emplace_back(std::move(pending));
+        return;
+    }
+    // "This command blocks command execution, that is, any following commands enqueued after it do not execute until it
+    // completes."
+    // -> it is enough to depend on the last barrier still pending, since it depends on all previous barriers
+    auto barrierIt = std::find_if(pendingEvents.rbegin(), pendingEvents.rend(),
+        [](const object_wrapper<Event>& pending) -> bool { return pending->type == CommandType::BARRIER; });
+    if(barrierIt != pendingEvents.rend())
+        event->waitList.emplace_back(std::move(*barrierIt));
+}
+
 cl_int CommandQueue::flush()
 {
     // doesn't do anything, since commands/events are automatically queued
@@ -127,10 +166,9 @@ cl_int CommandQueue::finish()
     //"[...] blocks until all previously queued OpenCL commands in command_queue are issued to the associated device and
     // have completed"
 
-    // wait_for_event_finish for all events in THIS queue
-    while(auto event = queue->peek(this))
-        ignoreReturnValue(event->waitFor(), __FILE__, __LINE__,
-            "This method does not check the states of the single events as per specification");
+    // wait_for_event_finish for all events in THIS queue, this method does not check the states of the single events
+    // as per specification
+    queue->waitForAllEvents();
 
     return CL_SUCCESS;
 }
@@ -8,6 +8,9 @@
 
 #include "Context.h"
 
+#include <atomic>
+#include <mutex>
+
 namespace vc4cl
 {
     class Event;
@@ -33,9 +36,15 @@ namespace vc4cl
 
     private:
         // properties
-        bool outOfOrderExecution;
+        // can be changed while other threads enqueue events, which only lock the enqueue lock for out-of-order queues
+        std::atomic_bool outOfOrderExecution;
         bool profiling;
+        // the submission lane for the events of this command queue
         std::shared_ptr<EventQueue> queue;
+        std::mutex enqueueLock;
+
+        // adds the dependencies on previously enqueued events required for out-of-order execution
+        void addImplicitDependencies(Event* event);
     };
 
 } /* namespace vc4cl */
@@ -12,6 +12,21 @@
 
 using namespace vc4cl;
 
+void EventQueueRelease::markReleased()
+{
+    {
+        std::lock_guard<std::mutex> guard(releaseLock);
+        isReleased = true;
+    }
+    released.notify_all();
+}
+
+void EventQueueRelease::waitForRelease()
+{
+    std::unique_lock<std::mutex> lock(releaseLock);
+    released.wait(lock, [this]() -> bool { return isReleased; });
+}
+
 EventAction::~EventAction() noexcept = default;
 CustomAction::~CustomAction() noexcept = default;
 NoAction::~NoAction() noexcept = default;
@@ -34,12 +49,17 @@ cl_int Event::setUserEventStatus(cl_int execution_status)
         return returnError(CL_INVALID_VALUE, __FILE__, __LINE__,
             buildString("Event has already finished with status %d", execution_status));
 
-    std::lock_guard<std::mutex> guard(statusLock);
-    if(userStatusSet)
-        return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "User status has already been set!");
+    {
+        std::lock_guard<std::mutex> guard(statusLock);
+        if(userStatusSet)
+            return returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "User status has already been set!");
 
-    status = execution_status;
-    userStatusSet = true;
+        status = execution_status;
+        userStatusSet = true;
+        statusFinished.notify_all();
+    }
+    // wake up the event handlers of all command queues, since their events might wait on this user event
+    EventQueue::notifyEventFinished();
 
     return CL_SUCCESS;
 }
@@ -152,9 +172,14 @@ cl_int Event::waitFor() const
                 CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST, __FILE__, __LINE__, "Error in event in wait-list");
     }
 
-    if(!isFinished())
-        // no need to lock the queue mutex if we are already done
-        EventQueue::getInstance()->waitForEvent(this);
+    if(queueRelease)
+        // The event queue still holds references to the finished event until it removed it from the queue. To not
+        // return while these are still held (e.g. since the application expects the reference count to drop), we wait
+        // for the event queue to release them instead of for the status change.
+        queueRelease->waitForRelease();
+    std::unique_lock<std::mutex> lock(statusLock);
+    // woken up by updateStatus() or setUserEventStatus() as soon as this event is finished
+    statusFinished.wait(lock, [this]() -> bool { return status == CL_COMPLETE || status < 0; });
     return status;
 }
 
@@ -186,20 +211,27 @@ void Event::fireCallbacks(cl_int previousStatus)
 
 void Event::updateStatus(cl_int status, bool fireCallbacks)
 {
-    std::lock_guard<std::mutex> guard(statusLock);
-    if(status == this->status)
-        // don't repeat setting status, e.g. required in queue handler, if events on wait list are not done yet
-        return;
-    auto oldStatus = this->status;
-    this->status = status;
-    if(status == CL_SUBMITTED)
-        setTime(profile.submit_time);
-    else if(status == CL_RUNNING)
-        setTime(profile.start_time);
-    else
-        setTime(profile.end_time);
-    if(fireCallbacks)
-        this->fireCallbacks(oldStatus);
+    {
+        std::lock_guard<std::mutex> guard(statusLock);
+        if(status == this->status)
+            // don't repeat setting status, e.g. required in queue handler, if events on wait list are not done yet
+            return;
+        auto oldStatus = this->status;
+        this->status = status;
+        if(status == CL_SUBMITTED)
+            setTime(profile.submit_time);
+        else if(status == CL_RUNNING)
+            setTime(profile.start_time);
+        else
+            setTime(profile.end_time);
+        if(fireCallbacks)
+            this->fireCallbacks(oldStatus);
+        if(status != CL_COMPLETE && status >= 0)
+            return;
+        statusFinished.notify_all();
+    }
+    // wake up the event handlers of all command queues, since their events might wait on this event
+    EventQueue::notifyEventFinished();
 }
 
 CommandQueue* Event::getCommandQueue()
@@ -216,6 +248,7 @@ cl_int Event::prepareToQueue(CommandQueue* queue)
     cl_int status = retain();
     if(status != CL_SUCCESS)
         return status;
+    queueRelease = std::make_shared<EventQueueRelease>();
     profile.end_time = 0;
     profile.queue_time = 0;
     profile.start_time = 0;
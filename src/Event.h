@@ -10,6 +10,7 @@
 #include "CommandQueue.h"
 #include "extensions.h"
 
+#include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -135,6 +136,23 @@ namespace vc4cl
 
     using EventCallback = void(CL_CALLBACK*)(cl_event event, cl_int event_command_exec_status, void* user_data);
 
+    /*
+     * Signals that the event queue released all its references to a finished event.
+     *
+     * This is kept separate from the event, since releasing the last reference might destroy the event itself.
+     */
+    class EventQueueRelease
+    {
+    public:
+        void markReleased();
+        void waitForRelease();
+
+    private:
+        std::mutex releaseLock;
+        std::condition_variable released;
+        bool isReleased = false;
+    };
+
     class Event final : public Object<_cl_event, CL_INVALID_EVENT>, public HasContext
     {
     public:
@@ -160,13 +178,22 @@ namespace vc4cl
         // NOTE: Only call this after it is guaranteed that the wait list is no longer required!
         void clearWaitList();
 
+        // the release signal for the event queue, only set for events enqueued into a command queue
+        inline std::shared_ptr<EventQueueRelease> getQueueRelease() const
+        {
+            return queueRelease;
+        }
+
         const CommandType type;
         std::unique_ptr<EventAction> action;
 
     private:
         object_wrapper<CommandQueue> queue;
+        std::shared_ptr<EventQueueRelease> queueRelease;
         // required to synchronize parallel access to the status
         mutable std::mutex statusLock;
+        // triggered when the status changes to CL_COMPLETE or an error status
+        mutable std::condition_variable statusFinished;
 
         cl_int status;
         bool userStatusSet;
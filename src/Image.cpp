@@ -310,12 +310,15 @@ cl_int Image::enqueueCopyFromToBuffer(CommandQueue* commandQueue, Buffer* buffer
         return returnError(CL_INVALID_VALUE, __FILE__, __LINE__, "Region is NULL!");
     if(context() != buffer->context())
         return returnError(CL_INVALID_CONTEXT, __FILE__, __LINE__, "Context of image and buffer do not match!");
+    cl_int errcode = buffer->ensureDeviceBuffer();
+    if(errcode != CL_SUCCESS)
+        return errcode;
     //"CL_INVALID_MEM_OBJECT [...] or if dst_image is a 1D image buffer object created from src_buffer."
-    if(deviceBuffer && buffer->deviceBuffer)
+    if(deviceBuffer == buffer->deviceBuffer)
         return returnError(
             CL_INVALID_MEM_OBJECT, __FILE__, __LINE__, "Cannot copy between image and buffer using the same data!");
 
-    cl_int errcode = checkImageAccess(origin, region);
+    errcode = checkImageAccess(origin, region);
     if(errcode != CL_SUCCESS)
         return errcode;
 
@@ -385,6 +388,7 @@ void* Image::enqueueMap(CommandQueue* commandQueue, cl_bool blockingMap, cl_map_
     if(useHostPtr && hostPtr != nullptr)
     {
         //"The host_ptr specified in clCreateImage is guaranteed to contain the latest bits [...]"
+        beginHostRead();
         memcpy(hostPtr, getDeviceHostPointerWithOffset(), hostSize);
         //"The pointer value returned by clEnqueueMapImage will be derived from the host_ptr specified when the image
         // object is created."
@@ -395,16 +399,16 @@ void* Image::enqueueMap(CommandQueue* commandQueue, cl_bool blockingMap, cl_map_
         out_ptr = getDeviceHostPointerWithOffset();
     }
 
-    std::list<MappingInfo>::const_iterator info = mappings.end();
+    MappingIntervals::iterator info = mappings.end();
     {
         // we need to already add the mapping here, otherwise queuing the clEnqueueUnmapMemObject might fail for the
         // memory are not being mapped yet, if the event handler did not process this event yet.
+        // The image is always mapped as a whole, see above
         std::lock_guard<std::mutex> mapGuard(mappingsLock);
-        mappings.emplace_back(MappingInfo{reinterpret_cast<void*>(out_ptr), false,
+        info = mappings.addMapping(MappingInfo{reinterpret_cast<void*>(out_ptr), 0, hostSize, false,
             hasFlag<cl_map_flags>(mapFlags, CL_MAP_WRITE_INVALIDATE_REGION),
             /* only on direct match, i.e. if not combined with CL_MAP_WRITE(...) */
-            mapFlags == CL_MAP_READ});
-        info = --mappings.end();
+            mapFlags == CL_MAP_READ, false});
     }
 
     ImageMapping* action = newObject<ImageMapping>(this, info, false, origin, region);
@@ -614,6 +618,10 @@ ImageAccess::~ImageAccess() = default;
 
 cl_int ImageAccess::operator()()
 {
+    if(writeToImage)
+        image->deviceBuffer->beginHostWrite(0, image->deviceBuffer->size);
+    else
+        image->deviceBuffer->beginHostRead();
     if(writeToImage)
         image->accessor->writePixelData(origin, region, hostPointer, hostRowPitch, hostSlicePitch);
     else
@@ -645,6 +653,8 @@ ImageCopy::~ImageCopy() = default;
 
 cl_int ImageCopy::operator()()
 {
+    source->deviceBuffer->beginHostRead();
+    destination->deviceBuffer->beginHostWrite(0, destination->deviceBuffer->size);
     if(TextureAccessor::copyPixelData(*source->accessor, *destination->accessor, sourceOrigin, destOrigin, region))
         return CL_SUCCESS;
     else
@@ -674,6 +684,7 @@ ImageFill::~ImageFill() = default;
 
 cl_int ImageFill::operator()()
 {
+    image->deviceBuffer->beginHostWrite(0, image->deviceBuffer->size);
     image->accessor->fillPixelData(origin, region, fillColor.data());
     return CL_SUCCESS;
 }
@@ -698,7 +709,18 @@ ImageCopyBuffer::~ImageCopyBuffer() = default;
 
 cl_int ImageCopyBuffer::operator()()
 {
-    uintptr_t hostPtr = reinterpret_cast<uintptr_t>(buffer->deviceBuffer->hostPointer) + bufferOffset;
+    uintptr_t hostPtr = reinterpret_cast<uintptr_t>(buffer->getDeviceHostPointerWithOffset()) + bufferOffset;
+    if(copyIntoImage)
+    {
+        buffer->beginHostRead();
+        image->deviceBuffer->beginHostWrite(0, image->deviceBuffer->size);
+    }
+    else
+    {
+        image->deviceBuffer->beginHostRead();
+        buffer->beginHostWrite(
+            bufferOffset, imageRegion[0] * imageRegion[1] * imageRegion[2] * image->calculateElementSize());
+    }
     // OpenCL 1.2 specifies the region copied to be width [* height] [* depth], therefore the pitches match the sizes
     // (OpenCL 1.2 specification, page 111)
     const size_t rowPitch = imageRegion[0] * image->calculateElementSize();
@@ -725,7 +747,7 @@ std::string ImageCopyBuffer::to_string() const
     return ss.str();
 }
 
-ImageMapping::ImageMapping(Image* image, std::list<MappingInfo>::const_iterator mappingInfo, bool isUnmap,
+ImageMapping::ImageMapping(Image* image, MappingIntervals::iterator mappingInfo, bool isUnmap,
     const std::size_t origin[3], const std::size_t region[3]) :
     BufferMapping(image, mappingInfo, isUnmap)
 {
@@ -739,9 +761,9 @@ std::string ImageMapping::to_string() const
 {
     std::stringstream ss;
     if(unmap)
-        ss << "unmap image 0x" << buffer.get() << " from 0x" << mappingInfo->hostPointer;
+        ss << "unmap image 0x" << buffer.get() << " from 0x" << mappingInfo->second.hostPointer;
     else
-        ss << "map image 0x" << buffer.get() << " to 0x" << mappingInfo->hostPointer;
+        ss << "map image 0x" << buffer.get() << " to 0x" << mappingInfo->second.hostPointer;
     return ss.str();
 }
 
@@ -971,7 +993,16 @@ cl_mem VC4CL_FUNC(clCreateImage)(cl_context context, cl_mem_flags flags, const c
     }
 
     if(buffer != nullptr)
+    {
+        // the image shares the device buffer with the buffer it is created from
+        errcode = buffer->ensureDeviceBuffer();
+        if(errcode != CL_SUCCESS)
+        {
+            ignoreReturnValue(image->release(), __FILE__, __LINE__, "Already errored");
+            return returnError<cl_mem>(errcode, errcode_ret, __FILE__, __LINE__, "Failed to allocate image buffer!");
+        }
         image->deviceBuffer = buffer->deviceBuffer;
+    }
     else
         image->deviceBuffer = system()->allocateBuffer(static_cast<unsigned>(size), "VC4CL image");
     if(!image->deviceBuffer)
@@ -87,7 +87,8 @@ BufferArgument::~BufferArgument() noexcept = default;
 
 std::string BufferArgument::to_string() const
 {
-    return std::to_string(buffer ? static_cast<unsigned>(buffer->deviceBuffer->qpuPointer) : 0);
+    return std::to_string(
+        buffer && buffer->deviceBuffer ? static_cast<unsigned>(buffer->deviceBuffer->qpuPointer) : 0);
 }
 
 std::unique_ptr<KernelArgument> BufferArgument::clone() const
@@ -100,7 +101,8 @@ Kernel::Kernel(Program* program, const KernelHeader& info) : program(program), i
     args.resize(info.parameters.size());
 }
 
-Kernel::Kernel(const Kernel& other) : Object(), program(other.program), info(other.info), argsSetMask(other.argsSetMask)
+Kernel::Kernel(const Kernel& other) :
+    Object(), program(other.program), info(other.info), argsSetMask(other.argsSetMask), launchPlan(other.launchPlan)
 {
     args.reserve(other.args.size());
     for(const auto& arg : other.args)
@@ -109,6 +111,21 @@ Kernel::Kernel(const Kernel& other) : Object(), program(other.program), info(oth
 
 Kernel::~Kernel() noexcept = default;
 
+/*
+ * Returns the kind of UNIFORM and the number of UNIFORM words required for the given kernel argument
+ */
+static std::pair<LaunchPlan::Source, std::size_t> getUniformLayout(const KernelArgument* arg)
+{
+    if(auto scalarArg = dynamic_cast<const ScalarArgument*>(arg))
+        return std::make_pair(LaunchPlan::Source::SCALAR, scalarArg->scalarValues.size());
+    if(dynamic_cast<const TemporaryBufferArgument*>(arg))
+        return std::make_pair(LaunchPlan::Source::TEMPORARY_BUFFER, std::size_t{1});
+    if(dynamic_cast<const BufferArgument*>(arg))
+        return std::make_pair(LaunchPlan::Source::BUFFER, std::size_t{1});
+    // argument not set yet
+    return std::make_pair(LaunchPlan::Source::SCALAR, std::size_t{0});
+}
+
 cl_int Kernel::setArg(cl_uint arg_index, size_t arg_size, const void* arg_value)
 {
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
@@ -126,6 +143,7 @@ cl_int Kernel::setArg(cl_uint arg_index, size_t arg_size, const void* arg_value)
             buildString("Invalid arg index: %d of %d", arg_index, info.parameters.size()));
     }
 
+    const auto previousLayout = getUniformLayout(args[arg_index].get());
     const auto& paramInfo = info.parameters[arg_index];
     if(!paramInfo.getPointer() || paramInfo.getByValue())
     {
@@ -289,10 +307,29 @@ cl_int Kernel::setArg(cl_uint arg_index, size_t arg_size, const void* arg_value)
     }
 
     argsSetMask.set(arg_index, true);
+    if(launchPlan && getUniformLayout(args[arg_index].get()) != previousLayout)
+        // the UNIFORMs of following executions will have a different layout
+        launchPlan.reset();
 
     return CL_SUCCESS;
 }
 
+void Kernel::setBufferArg(cl_uint arg_index, Buffer* buffer)
+{
+    const auto previousLayout = getUniformLayout(args[arg_index].get());
+    args[arg_index].reset(new BufferArgument(buffer));
+    argsSetMask.set(arg_index, true);
+    if(launchPlan && getUniformLayout(args[arg_index].get()) != previousLayout)
+        launchPlan.reset();
+}
+
+std::shared_ptr<const LaunchPlan> Kernel::getLaunchPlan()
+{
+    if(!launchPlan)
+        launchPlan = LaunchPlan::create(info, args);
+    return launchPlan;
+}
+
 static std::string buildAttributeString(const std::vector<MetaData>& metaData)
 {
     std::string result = "";
@@ -642,41 +679,155 @@ cl_int Kernel::enqueueNDRange(CommandQueue* commandQueue, cl_uint work_dim, cons
 
     CHECK_EVENT_WAIT_LIST(event_wait_list, num_events_in_wait_list)
 
-    std::map<unsigned, std::unique_ptr<DeviceBuffer>> tmpBuffers;
-    std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>> persistentBuffers;
-    state = allocateAndTrackBufferArguments(tmpBuffers, persistentBuffers);
+    std::unique_ptr<KernelExecution> source;
+    state = createExecution(work_dim, work_offsets, work_sizes, local_sizes, source);
     if(state != CL_SUCCESS)
-        return returnError(state, __FILE__, __LINE__, "Error while allocating and tracking buffer kernel arguments");
-
-    Event* kernelEvent = newOpenCLObject<Event>(program->context(), CL_QUEUED, CommandType::KERNEL_NDRANGE);
-    CHECK_ALLOCATION(kernelEvent)
-
-    KernelExecution* source = newObject<KernelExecution>(this);
-    CHECK_ALLOCATION(source)
-    source->numDimensions = static_cast<cl_uchar>(work_dim);
-    source->globalOffsets = work_offsets;
-    source->globalSizes = work_sizes;
-    source->localSizes = local_sizes;
-    // need to clone the arguments to avoid race conditions
-    source->executionArguments.reserve(args.size());
-    std::transform(args.begin(), args.end(), std::back_inserter(source->executionArguments),
-        [](const auto& arg) { return arg->clone(); });
-    source->tmpBuffers = std::move(tmpBuffers);
-    source->persistentBuffers = std::move(persistentBuffers);
+        return state;
     if(commandQueue->isProfilingEnabled() || isDebugModeEnabled(DebugLevel::PERFORMANCE_COUNTERS))
         // enable performance counters for either event profiling or if the debug flag is explicitly set
         source->performanceCounters.reset(new PerformanceCounters());
 
-    kernelEvent->action.reset(source);
+    Event* kernelEvent = newOpenCLObject<Event>(program->context(), CL_QUEUED, CommandType::KERNEL_NDRANGE);
+    CHECK_ALLOCATION(kernelEvent)
+
+    kernelEvent->action.reset(source.release());
 
     kernelEvent->setEventWaitList(num_events_in_wait_list, event_wait_list);
     cl_int ret_val = commandQueue->enqueueEvent(kernelEvent);
     return kernelEvent->setAsResultOrRelease(ret_val, event);
 }
 
+cl_int Kernel::createExecution(cl_uint work_dim, const std::array<size_t, 3>& work_offsets,
+    const std::array<size_t, 3>& work_sizes, const std::array<size_t, 3>& local_sizes,
+    std::unique_ptr<KernelExecution>& execution)
+{
+    std::map<unsigned, std::shared_ptr<DeviceBuffer>> tmpBuffers;
+    std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>> persistentBuffers;
+    std::bitset<kernel_config::MAX_PARAMETER_COUNT> writtenBuffers;
+    cl_int state = allocateAndTrackBufferArguments(tmpBuffers, persistentBuffers, writtenBuffers);
+    if(state != CL_SUCCESS)
+        return returnError(state, __FILE__, __LINE__, "Error while allocating and tracking buffer kernel arguments");
+
+    std::shared_ptr<const LaunchPlan> plan = getLaunchPlan();
+    if(!plan)
+        return returnError(CL_INVALID_KERNEL_ARGS, __FILE__, __LINE__, "Failed to create the UNIFORM launch plan!");
+
+    execution.reset(newObject<KernelExecution>(this));
+    CHECK_ALLOCATION(execution)
+    execution->numDimensions = static_cast<cl_uchar>(work_dim);
+    execution->globalOffsets = work_offsets;
+    execution->globalSizes = work_sizes;
+    execution->localSizes = local_sizes;
+    // need to clone the arguments to avoid race conditions
+    execution->executionArguments.reserve(args.size());
+    std::transform(args.begin(), args.end(), std::back_inserter(execution->executionArguments),
+        [](const auto& arg) { return arg->clone(); });
+    execution->tmpBuffers = std::move(tmpBuffers);
+    execution->persistentBuffers = std::move(persistentBuffers);
+    execution->writtenBuffers = writtenBuffers;
+    execution->launchPlan = std::move(plan);
+    return CL_SUCCESS;
+}
+
+/*
+ * Recycles the device buffers allocated for temporary (__local and by-value struct) kernel arguments.
+ *
+ * Allocating and freeing the temporary buffers for every kernel execution requires several syscalls per execution
+ * (depending on the memory management used), so instead the released buffers are cached (per size class and caching
+ * type) for the following kernel executions.
+ */
+class TemporaryBufferCache : public std::enable_shared_from_this<TemporaryBufferCache>
+{
+public:
+    // The smallest size class, larger buffers are rounded up to the next power of two
+    static constexpr uint32_t MIN_BUFFER_SIZE = 64;
+    // The maximum number of unused buffers kept per size class
+    static constexpr std::size_t MAX_BUFFERS_PER_SIZE = 4;
+    // The maximum number of bytes kept in unused buffers
+    static constexpr uint32_t MAX_CACHED_BYTES = 1024 * 1024;
+
+    static std::shared_ptr<TemporaryBufferCache>& getInstance()
+    {
+        static std::shared_ptr<TemporaryBufferCache> instance{new TemporaryBufferCache()};
+        return instance;
+    }
+
+    /*
+     * Returns a buffer of at least the given size, either re-used or newly allocated.
+     *
+     * The buffer is returned to this cache when the last reference to it is released.
+     */
+    std::shared_ptr<DeviceBuffer> acquire(unsigned sizeInBytes, CacheType cacheType)
+    {
+        Key key{toSizeClass(sizeInBytes), cacheType};
+        std::unique_ptr<DeviceBuffer> buffer;
+        {
+            std::lock_guard<std::mutex> guard(cacheLock);
+            auto& bucket = cachedBuffers[key];
+            if(!bucket.empty())
+            {
+                buffer = std::move(bucket.back());
+                bucket.pop_back();
+                cachedBytes -= key.first;
+                DEBUG_LOG(DebugLevel::MEMORY,
+                    std::cout << "Re-using cached temporary buffer of " << key.first << " bytes at device address "
+                              << buffer->qpuPointer << std::endl)
+            }
+        }
+        if(!buffer)
+            buffer = system()->allocateBuffer(key.first, "VC4CL temp buffer", cacheType);
+        if(!buffer)
+            return nullptr;
+        auto self = shared_from_this();
+        return std::shared_ptr<DeviceBuffer>(buffer.release(),
+            [self, key](DeviceBuffer* buf) { self->release(key, std::unique_ptr<DeviceBuffer>{buf}); });
+    }
+
+private:
+    using Key = std::pair<uint32_t, CacheType>;
+
+    std::mutex cacheLock;
+    std::map<Key, std::vector<std::unique_ptr<DeviceBuffer>>> cachedBuffers;
+    uint32_t cachedBytes = 0;
+
+    TemporaryBufferCache() = default;
+
+    static uint32_t toSizeClass(unsigned sizeInBytes)
+    {
+        uint32_t size = MIN_BUFFER_SIZE;
+        while(size < sizeInBytes)
+            size <<= 1;
+        return size;
+    }
+
+    void release(const Key& key, std::unique_ptr<DeviceBuffer>&& buffer)
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        auto& bucket = cachedBuffers[key];
+        if(bucket.size() < MAX_BUFFERS_PER_SIZE && cachedBytes + key.first <= MAX_CACHED_BYTES)
+        {
+            cachedBytes += key.first;
+            bucket.emplace_back(std::move(buffer));
+        }
+        // otherwise, the buffer is freed when leaving this function
+    }
+};
+
+/*
+ * Returns whether the kernel (possibly) writes the memory behind the given pointer parameter
+ */
+static bool isWrittenByKernel(const ParamHeader& param)
+{
+    if(param.getConstant() || param.getAddressSpace() == AddressSpace::CONSTANT)
+        return false;
+    // if the compiler did not determine the access direction at all, we need to assume the memory is written
+    return param.getOutput() || !param.getInput();
+}
+
 CHECK_RETURN cl_int Kernel::allocateAndTrackBufferArguments(
-    std::map<unsigned, std::unique_ptr<DeviceBuffer>>& tmpBuffers,
-    std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>>& persistentBuffers) const
+    std::map<unsigned, std::shared_ptr<DeviceBuffer>>& tmpBuffers,
+    std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>>& persistentBuffers,
+    std::bitset<kernel_config::MAX_PARAMETER_COUNT>& writtenBuffers) const
 {
     /*
      * Allocate buffers for __local/struct parameters
@@ -702,23 +853,21 @@ CHECK_RETURN cl_int Kernel::allocateAndTrackBufferArguments(
             }
             else
             {
-                auto bufIt = tmpBuffers.end();
                 bool initializeMemory = !localArg->data.empty();
                 bool zeroMemory = program->context()->initializeMemoryToZero(CL_CONTEXT_MEMORY_INITIALIZE_LOCAL_KHR);
-                if(initializeMemory || zeroMemory)
-                    // we need to write from host-side
-                    bufIt =
-                        tmpBuffers.emplace(i, system()->allocateBuffer(localArg->sizeToAllocate, "VC4CL temp buffer"))
-                            .first;
-                else
-                    // no need to write from host-side
-                    bufIt =
-                        tmpBuffers
-                            .emplace(i, system()->allocateGPUOnlyBuffer(localArg->sizeToAllocate, "VC4CL temp buffer"))
-                            .first;
+                // we only need to write from host-side, if we initialize the memory, otherwise the buffer can be
+                // re-used as-is
+                auto cacheType = initializeMemory || zeroMemory ? CacheType::BOTH_CACHED : CacheType::GPU_CACHED;
+                auto bufIt = tmpBuffers
+                                 .emplace(i,
+                                     TemporaryBufferCache::getInstance()->acquire(localArg->sizeToAllocate, cacheType))
+                                 .first;
                 if(bufIt == tmpBuffers.end() || !bufIt->second)
                     // failed to allocate the temporary buffer
                     return CL_OUT_OF_RESOURCES;
+                writtenBuffers[i] = isWrittenByKernel(info.parameters.at(i));
+                if(initializeMemory || zeroMemory)
+                    bufIt->second->beginHostWrite(0, localArg->sizeToAllocate);
                 if(initializeMemory)
                 {
                     // copy the parameter values to the buffer
@@ -744,6 +893,18 @@ CHECK_RETURN cl_int Kernel::allocateAndTrackBufferArguments(
      * The kernel execution needs to make sure the buffers used as parameters are not freed while the execution is
      * running, see https://github.com/KhronosGroup/OpenCL-Docs/issues/45
      */
+    std::vector<Buffer*> argumentBuffers;
+    for(const auto& arg : args)
+    {
+        auto bufferArg = dynamic_cast<const BufferArgument*>(arg.get());
+        if(bufferArg && bufferArg->buffer && bufferArg->buffer->checkReferences())
+            argumentBuffers.push_back(bufferArg->buffer);
+    }
+    // allocates all buffers used for the first time together
+    cl_int errcode = Buffer::ensureDeviceBuffers(argumentBuffers);
+    if(errcode != CL_SUCCESS)
+        return errcode;
+
     for(unsigned i = 0; i < args.size(); ++i)
     {
         KernelArgument* arg = args.at(i).get();
@@ -757,8 +918,171 @@ CHECK_RETURN cl_int Kernel::allocateAndTrackBufferArguments(
                 // implementation (see issue referenced above).
                 return CL_INVALID_KERNEL_ARGS;
             else
+            {
                 persistentBuffers.emplace(i,
                     std::make_pair(bufferArg->buffer->deviceBuffer, bufferArg->buffer->getDevicePointerWithOffset()));
+                // kernels writing buffers created with CL_MEM_READ_ONLY is undefined behavior
+                writtenBuffers[i] = bufferArg->buffer->writeable && isWrittenByKernel(info.parameters.at(i));
+            }
+        }
+    }
+    return CL_SUCCESS;
+}
+
+std::shared_ptr<const LaunchPlan> LaunchPlan::create(
+    const KernelHeader& info, const std::vector<std::unique_ptr<KernelArgument>>& args)
+{
+    std::shared_ptr<LaunchPlan> plan = std::make_shared<LaunchPlan>();
+    plan->entries.reserve(info.uniformsUsed.countUniforms() + info.getExplicitUniformCount());
+    const auto addEntry = [&](Source source, uint16_t* offset) {
+        if(offset)
+            *offset = static_cast<uint16_t>(plan->entries.size());
+        plan->entries.emplace_back(Entry{source, 0, 0});
+    };
+
+    // the order of the implicit UNIFORMs needs to match the order expected by the compiler
+    const auto& uniforms = info.uniformsUsed;
+    if(uniforms.getWorkDimensionsUsed())
+        addEntry(Source::WORK_DIMENSIONS, nullptr);
+    if(uniforms.getLocalSizesUsed())
+        addEntry(Source::LOCAL_SIZES, nullptr);
+    if(uniforms.getLocalIDsUsed())
+        addEntry(Source::LOCAL_IDS, &plan->localIDsOffset);
+    if(uniforms.getNumGroupsXUsed())
+        addEntry(Source::NUM_GROUPS_X, nullptr);
+    if(uniforms.getNumGroupsYUsed())
+        addEntry(Source::NUM_GROUPS_Y, nullptr);
+    if(uniforms.getNumGroupsZUsed())
+        addEntry(Source::NUM_GROUPS_Z, nullptr);
+    if(uniforms.getGroupIDXUsed())
+        addEntry(Source::GROUP_ID_X, &plan->groupIDOffsets[0]);
+    if(uniforms.getGroupIDYUsed())
+        addEntry(Source::GROUP_ID_Y, &plan->groupIDOffsets[1]);
+    if(uniforms.getGroupIDZUsed())
+        addEntry(Source::GROUP_ID_Z, &plan->groupIDOffsets[2]);
+    if(uniforms.getGlobalOffsetXUsed())
+        addEntry(Source::GLOBAL_OFFSET_X, nullptr);
+    if(uniforms.getGlobalOffsetYUsed())
+        addEntry(Source::GLOBAL_OFFSET_Y, nullptr);
+    if(uniforms.getGlobalOffsetZUsed())
+        addEntry(Source::GLOBAL_OFFSET_Z, nullptr);
+    if(uniforms.getGlobalDataAddressUsed())
+        addEntry(Source::GLOBAL_DATA_ADDRESS, nullptr);
+
+    for(uint16_t i = 0; i < args.size(); ++i)
+    {
+        auto layout = getUniformLayout(args[i].get());
+        if(layout.second == 0)
+            // argument is not set, should have been caught before
+            return nullptr;
+        for(std::size_t element = 0; element < layout.second; ++element)
+            plan->entries.emplace_back(Entry{layout.first, static_cast<uint8_t>(element), i});
+    }
+
+    // UNIFORMs for the "loop-work-groups" optimization are appended to the kernel UNIFORMs
+    if(uniforms.getUniformAddressUsed())
+        addEntry(Source::UNIFORM_ADDRESS, &plan->uniformAddressOffset);
+    if(uniforms.getMaxGroupIDXUsed())
+        addEntry(Source::MAX_GROUP_ID_X, nullptr);
+    if(uniforms.getMaxGroupIDYUsed())
+        addEntry(Source::MAX_GROUP_ID_Y, nullptr);
+    if(uniforms.getMaxGroupIDZUsed())
+        addEntry(Source::MAX_GROUP_ID_Z, nullptr);
+
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+        std::cout << "Created launch plan for kernel '" << info.name << "' with " << plan->entries.size()
+                  << " UNIFORMs per QPU" << std::endl)
+    return plan;
+}
+
+cl_int LaunchPlan::writeTemplate(
+    uint32_t* block, const KernelExecution& execution, uint32_t globalDataAddress) const
+{
+    const auto& globalSizes = execution.globalSizes;
+    const auto& localSizes = execution.localSizes;
+    const auto& globalOffsets = execution.globalOffsets;
+    for(const Entry& entry : entries)
+    {
+        switch(entry.source)
+        {
+        case Source::WORK_DIMENSIONS:
+            *block++ = execution.numDimensions; /* get_work_dim() */
+            break;
+        case Source::LOCAL_SIZES:
+            // since locals values top at 255, all 3 dimensions can be unified into one 32-bit UNIFORM
+            // when read, the values are shifted by 8 * ndim bits and ANDed with 0xFF
+            *block++ = static_cast<uint32_t>(
+                localSizes[2] << 16 | localSizes[1] << 8 | localSizes[0]); /* get_local_size(dim) */
+            break;
+        case Source::LOCAL_IDS:
+        case Source::GROUP_ID_X:
+        case Source::GROUP_ID_Y:
+        case Source::GROUP_ID_Z:
+        case Source::UNIFORM_ADDRESS:
+            // the first QPU of the first work-group has all-zero IDs, the UNIFORM address is set per QPU
+            *block++ = 0;
+            break;
+        case Source::NUM_GROUPS_X:
+        case Source::MAX_GROUP_ID_X:
+            *block++ = static_cast<uint32_t>(globalSizes[0] / localSizes[0]); /* get_num_groups(0) */
+            break;
+        case Source::NUM_GROUPS_Y:
+        case Source::MAX_GROUP_ID_Y:
+            *block++ = static_cast<uint32_t>(globalSizes[1] / localSizes[1]); /* get_num_groups(1) */
+            break;
+        case Source::NUM_GROUPS_Z:
+        case Source::MAX_GROUP_ID_Z:
+            *block++ = static_cast<uint32_t>(globalSizes[2] / localSizes[2]); /* get_num_groups(2) */
+            break;
+        case Source::GLOBAL_OFFSET_X:
+            *block++ = static_cast<uint32_t>(globalOffsets[0]); /* get_global_offset(0) */
+            break;
+        case Source::GLOBAL_OFFSET_Y:
+            *block++ = static_cast<uint32_t>(globalOffsets[1]); /* get_global_offset(1) */
+            break;
+        case Source::GLOBAL_OFFSET_Z:
+            *block++ = static_cast<uint32_t>(globalOffsets[2]); /* get_global_offset(2) */
+            break;
+        case Source::GLOBAL_DATA_ADDRESS:
+            *block++ = globalDataAddress; // base address for the global-data block
+            break;
+        case Source::TEMPORARY_BUFFER:
+        {
+            auto tmpBufferIt = execution.tmpBuffers.find(entry.argument);
+            if(tmpBufferIt == execution.tmpBuffers.end())
+                return CL_INVALID_KERNEL_ARGS;
+            // if the __local parameter is lowered into VPM, there is no temporary buffer and we pass a null-pointer
+            *block++ = tmpBufferIt->second ? static_cast<uint32_t>(tmpBufferIt->second->qpuPointer) : 0u;
+            DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+                std::cout << "Setting parameter " << entry.argument << " to temporary buffer "
+                          << (tmpBufferIt->second ? tmpBufferIt->second->qpuPointer : DevicePointer{0}) << std::endl)
+            break;
+        }
+        case Source::BUFFER:
+        {
+            auto persistentBufferIt = execution.persistentBuffers.find(entry.argument);
+            if(persistentBufferIt == execution.persistentBuffers.end())
+                return CL_INVALID_KERNEL_ARGS;
+            // Since the buffer pointer might be NULL, we have to check for this first
+            // NOTE: For sub-buffers, the offset is added to the device pointer
+            auto devicePtr =
+                persistentBufferIt->second.first.get() ? persistentBufferIt->second.second : DevicePointer{0u};
+            *block++ = static_cast<uint32_t>(devicePtr);
+            DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+                std::cout << "Setting parameter " << entry.argument << " to buffer " << devicePtr << std::endl)
+            break;
+        }
+        case Source::SCALAR:
+        {
+            // the plan is created from the same arguments as the execution arguments, so the type is guaranteed
+            // NOTE: we use the actual number of vector elements here instead of the expected number, since e.g. for
+            // 64-bit integer we need 2 UNIFORMs for every vector element
+            const auto& scalarValues =
+                static_cast<const ScalarArgument*>(execution.executionArguments.at(entry.argument).get())
+                    ->scalarValues;
+            *block++ = scalarValues.at(entry.element).getUnsigned();
+            break;
+        }
         }
     }
     return CL_SUCCESS;
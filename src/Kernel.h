@@ -21,6 +21,8 @@ namespace vc4cl
     struct DeviceBuffer;
     struct DevicePointer;
     struct KernelArgument;
+    struct KernelExecution;
+    struct LaunchPlan;
     class Buffer;
     class SystemAccess;
     struct PerformanceCounters;
@@ -33,6 +35,12 @@ namespace vc4cl
         ~Kernel() noexcept override;
 
         CHECK_RETURN cl_int setArg(cl_uint arg_index, size_t arg_size, const void* arg_value);
+        /*
+         * Sets the given buffer as (already validated) pointer argument, skipping the checks of #setArg. Unlike with
+         * #setArg, the buffer can belong to any context, e.g. for the internal kernels of the runtime (see
+         * QPUTransfers).
+         */
+        void setBufferArg(cl_uint arg_index, Buffer* buffer);
         CHECK_RETURN cl_int getInfo(
             cl_kernel_info param_name, size_t param_value_size, void* param_value, size_t* param_value_size_ret);
         CHECK_RETURN cl_int getWorkGroupInfo(cl_kernel_work_group_info param_name, size_t param_value_size,
@@ -45,6 +53,20 @@ namespace vc4cl
         CHECK_RETURN cl_int enqueueNDRange(CommandQueue* commandQueue, cl_uint work_dim,
             const size_t* global_work_offset, const size_t* global_work_size, const size_t* local_work_size,
             cl_uint num_events_in_wait_list, const cl_event* event_wait_list, cl_event* event);
+        /*
+         * Creates an execution of this kernel with the current argument values for the given (already validated) work
+         * sizes, without enqueuing it.
+         */
+        CHECK_RETURN cl_int createExecution(cl_uint work_dim, const std::array<size_t, 3>& work_offsets,
+            const std::array<size_t, 3>& work_sizes, const std::array<size_t, 3>& local_sizes,
+            std::unique_ptr<KernelExecution>& execution);
+
+        /*
+         * Returns the UNIFORM layout for executions of this kernel with the currently set arguments.
+         *
+         * The plan is created on the first call and re-used until an argument with a different UNIFORM layout is set.
+         */
+        std::shared_ptr<const LaunchPlan> getLaunchPlan();
 
         object_wrapper<Program> program;
         const KernelHeader info;
@@ -53,9 +75,12 @@ namespace vc4cl
         std::bitset<kernel_config::MAX_PARAMETER_COUNT> argsSetMask;
 
     private:
+        std::shared_ptr<const LaunchPlan> launchPlan;
+
         CHECK_RETURN cl_int allocateAndTrackBufferArguments(
-            std::map<unsigned, std::unique_ptr<DeviceBuffer>>& tmpBuffers,
-            std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>>& persistentBuffers) const;
+            std::map<unsigned, std::shared_ptr<DeviceBuffer>>& tmpBuffers,
+            std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>>& persistentBuffers,
+            std::bitset<kernel_config::MAX_PARAMETER_COUNT>& writtenBuffers) const;
     };
 
     struct KernelArgument
@@ -155,6 +180,101 @@ namespace vc4cl
         std::unique_ptr<KernelArgument> clone() const override;
     };
 
+    /*
+     * Pre-computed layout of the UNIFORMs passed to a single QPU for the execution of a kernel.
+     *
+     * The plan is created once from the implicit UNIFORMs used by the kernel and the kinds of the kernel arguments and
+     * then re-used by all executions of the kernel. For every execution, the UNIFORM block of the first QPU is written
+     * once as template, all other blocks are copied from it and only the few words which differ between the QPUs and
+     * work-groups are patched.
+     */
+    struct LaunchPlan
+    {
+        enum class Source : uint8_t
+        {
+            WORK_DIMENSIONS,
+            LOCAL_SIZES,
+            LOCAL_IDS,
+            NUM_GROUPS_X,
+            NUM_GROUPS_Y,
+            NUM_GROUPS_Z,
+            GROUP_ID_X,
+            GROUP_ID_Y,
+            GROUP_ID_Z,
+            GLOBAL_OFFSET_X,
+            GLOBAL_OFFSET_Y,
+            GLOBAL_OFFSET_Z,
+            GLOBAL_DATA_ADDRESS,
+            // the address of the temporary buffer of a __local or by-value struct argument (zero if lowered)
+            TEMPORARY_BUFFER,
+            // the address of a buffer object argument (zero for NULL buffers)
+            BUFFER,
+            // a single word of a scalar or vector argument
+            SCALAR,
+            UNIFORM_ADDRESS,
+            MAX_GROUP_ID_X,
+            MAX_GROUP_ID_Y,
+            MAX_GROUP_ID_Z
+        };
+
+        struct Entry
+        {
+            Source source;
+            // the word index within a scalar argument
+            uint8_t element;
+            // the index of the kernel argument, only set for argument entries
+            uint16_t argument;
+        };
+
+        static constexpr uint16_t NO_OFFSET = 0xFFFF;
+
+        // one entry for every UNIFORM word of a single QPU
+        std::vector<Entry> entries;
+        // the word offsets of the UNIFORMs which differ between QPUs and work-groups, NO_OFFSET if not used
+        uint16_t localIDsOffset = NO_OFFSET;
+        uint16_t uniformAddressOffset = NO_OFFSET;
+        std::array<uint16_t, kernel_config::NUM_DIMENSIONS> groupIDOffsets{{NO_OFFSET, NO_OFFSET, NO_OFFSET}};
+
+        static CHECK_RETURN std::shared_ptr<const LaunchPlan> create(
+            const KernelHeader& info, const std::vector<std::unique_ptr<KernelArgument>>& args);
+
+        inline std::size_t getUniformsPerQPU() const noexcept
+        {
+            return entries.size();
+        }
+
+        /*
+         * Writes the UNIFORMs of the first QPU for the first work-group of the given execution.
+         */
+        CHECK_RETURN cl_int writeTemplate(
+            uint32_t* block, const KernelExecution& execution, uint32_t globalDataAddress) const;
+
+        inline void setLocalIDs(uint32_t* block, const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& localIDs,
+            uint8_t mergeFactor) const noexcept
+        {
+            // since locals values top at 255, all 3 dimensions can be unified into one 32-bit UNIFORM
+            if(localIDsOffset != NO_OFFSET)
+                block[localIDsOffset] =
+                    static_cast<uint32_t>(localIDs[2] << 16 | localIDs[1] << 8 | (localIDs[0] * mergeFactor));
+        }
+
+        inline void setGroupIDs(
+            uint32_t* block, const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& groupIDs) const noexcept
+        {
+            for(std::size_t i = 0; i < kernel_config::NUM_DIMENSIONS; ++i)
+            {
+                if(groupIDOffsets[i] != NO_OFFSET)
+                    block[groupIDOffsets[i]] = static_cast<uint32_t>(groupIDs[i]);
+            }
+        }
+
+        inline void setUniformAddress(uint32_t* block, uint32_t address) const noexcept
+        {
+            if(uniformAddressOffset != NO_OFFSET)
+                block[uniformAddressOffset] = address;
+        }
+    };
+
     struct KernelExecution final : public EventAction
     {
         object_wrapper<Kernel> kernel;
@@ -181,13 +301,19 @@ namespace vc4cl
          * Tracks temporary and preexisting device buffers to guarantee they exist until the kernel finishes
          *
          * We start tracking them from the moment we create the KernelExecution event for following reasons:
-         * - For temporary buffer, we can correctly return a failure to allocate enough resources
+         * - For temporary buffer, we can correctly return a failure to allocate enough resources. The temporary
+         *   buffers are recycled for following kernel executions when they are released.
          * - For persistent buffers, we guarantee they are not freed until the execution actually starts.
          *   See also https://github.com/KhronosGroup/OpenCL-Docs/issues/45
          */
-        std::map<unsigned, std::unique_ptr<DeviceBuffer>> tmpBuffers;
+        std::map<unsigned, std::shared_ptr<DeviceBuffer>> tmpBuffers;
         // The value is the buffer + the actual address (buffer + offset, for sub-buffers)
         std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>> persistentBuffers;
+        // The indices of the temporary and persistent buffers (possibly) written by the kernel
+        std::bitset<kernel_config::MAX_PARAMETER_COUNT> writtenBuffers;
+
+        // The UNIFORM layout for the kernel arguments at the point the execution was created
+        std::shared_ptr<const LaunchPlan> launchPlan;
 
         // The optional performance counters to be filled upon this kernel execution
         std::unique_ptr<PerformanceCounters> performanceCounters;
@@ -8,6 +8,9 @@
 
 #include "hal/hal.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <iomanip>
 
 using namespace vc4cl;
@@ -17,10 +20,98 @@ std::ostream& vc4cl::operator<<(std::ostream& s, const DevicePointer& ptr)
     return s << "0x" << std::hex << std::setfill('0') << std::setw(8) << ptr.pointer << std::dec << std::setfill(' ');
 }
 
-DeviceBuffer::DeviceBuffer(
-    const std::shared_ptr<SystemAccess>& sys, uint32_t handle, DevicePointer devPtr, void* hostPtr, uint32_t size) :
+HostWriteTracker::HostWriteTracker(uint32_t bufferSize) : bufferSize(bufferSize)
+{
+    addAll();
+}
+
+void HostWriteTracker::addRange(uint32_t offset, uint32_t numBytes)
+{
+    if(numBytes == 0 || offset >= bufferSize)
+        return;
+    // extend the range to whole cache lines, since we can only flush whole cache lines anyway
+    uint32_t start = offset & ~(CACHE_LINE_SIZE - 1);
+    auto end = static_cast<uint32_t>(std::min(
+        (static_cast<uint64_t>(offset) + numBytes + CACHE_LINE_SIZE - 1) & ~uint64_t{CACHE_LINE_SIZE - 1},
+        static_cast<uint64_t>(bufferSize)));
+
+    // find the first range overlapping or directly adjacent to the new range and merge all these ranges
+    auto it = ranges.upper_bound(start);
+    if(it != ranges.begin() && std::prev(it)->second >= start)
+        --it;
+    while(it != ranges.end() && it->first <= end)
+    {
+        start = std::min(start, it->first);
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+    ranges.emplace(start, end);
+
+    if(ranges.size() > MAX_RANGES)
+    {
+        // flushing a few unmodified cache lines is cheaper than tracking (and flushing) too many single ranges
+        start = ranges.begin()->first;
+        end = ranges.rbegin()->second;
+        ranges.clear();
+        ranges.emplace(start, end);
+    }
+}
+
+void HostWriteTracker::addAll()
+{
+    ranges.clear();
+    if(bufferSize > 0)
+        ranges.emplace(0, bufferSize);
+}
+
+void HostWriteTracker::removeRange(uint32_t offset, uint32_t numBytes)
+{
+    // shrink the range to the completely covered cache lines, the last (partial) line of the buffer is completely
+    // covered if the range reaches the end of the buffer
+    auto start = static_cast<uint32_t>(
+        std::min((static_cast<uint64_t>(offset) + CACHE_LINE_SIZE - 1) & ~uint64_t{CACHE_LINE_SIZE - 1},
+            static_cast<uint64_t>(bufferSize)));
+    auto end = static_cast<uint64_t>(offset) + numBytes;
+    end = end >= bufferSize ? bufferSize : (end & ~uint64_t{CACHE_LINE_SIZE - 1});
+    if(start >= end)
+        return;
+
+    auto it = ranges.upper_bound(start);
+    if(it != ranges.begin() && std::prev(it)->second > start)
+        --it;
+    while(it != ranges.end() && it->first < end)
+    {
+        auto rangeStart = it->first;
+        auto rangeEnd = it->second;
+        it = ranges.erase(it);
+        // keep the parts of the range outside of the removed range
+        if(rangeStart < start)
+            ranges.emplace(rangeStart, start);
+        if(rangeEnd > end)
+            ranges.emplace(static_cast<uint32_t>(end), rangeEnd);
+    }
+}
+
+std::vector<ByteRange> HostWriteTracker::takeRanges()
+{
+    std::vector<ByteRange> result;
+    result.reserve(ranges.size());
+    for(const auto& range : ranges)
+        result.emplace_back(ByteRange{range.first, range.second - range.first});
+    ranges.clear();
+    return result;
+}
+
+bool HostWriteTracker::isClean() const
+{
+    return ranges.empty();
+}
+
+DeviceBuffer::DeviceBuffer(const std::shared_ptr<SystemAccess>& sys, uint32_t handle, DevicePointer devPtr,
+    void* hostPtr, uint32_t size, CacheType cacheType) :
     memHandle(handle),
-    qpuPointer(devPtr), hostPointer(hostPtr), size(size), system(sys)
+    qpuPointer(devPtr), hostPointer(hostPtr), size(size), cacheType(cacheType), system(sys),
+    coherenceState(CoherenceState::HOST_OWNED), hostWrites(size)
 {
 }
 
@@ -40,3 +131,118 @@ void DeviceBuffer::dumpContent() const
         printf(" %08x", reinterpret_cast<const unsigned*>(hostPointer)[i]);
     }
 }
+
+CoherenceState DeviceBuffer::getCoherenceState() const
+{
+    std::lock_guard<std::mutex> guard(coherenceLock);
+    return coherenceState;
+}
+
+void DeviceBuffer::beginHostRead() const
+{
+    std::lock_guard<std::mutex> guard(coherenceLock);
+    invalidateIfDeviceOwned();
+}
+
+void DeviceBuffer::beginHostWrite(uint32_t offset, uint32_t numBytes) const
+{
+    std::lock_guard<std::mutex> guard(coherenceLock);
+    invalidateIfDeviceOwned();
+    hostWrites.addRange(offset, numBytes);
+    if(!hostWrites.isClean())
+        coherenceState = CoherenceState::HOST_OWNED;
+}
+
+std::vector<ByteRange> DeviceBuffer::takeHostWrites() const
+{
+    std::lock_guard<std::mutex> guard(coherenceLock);
+    if(coherenceState == CoherenceState::HOST_OWNED)
+        coherenceState = CoherenceState::SHARED;
+    return hostWrites.takeRanges();
+}
+
+void DeviceBuffer::discardHostWrites(uint32_t offset, uint32_t numBytes) const
+{
+    std::lock_guard<std::mutex> guard(coherenceLock);
+    hostWrites.removeRange(offset, numBytes);
+    if(coherenceState == CoherenceState::HOST_OWNED && hostWrites.isClean())
+        coherenceState = CoherenceState::SHARED;
+}
+
+bool DeviceBuffer::beginDeviceAccess(bool deviceWrites) const
+{
+    bool isCoherent = true;
+    {
+        std::lock_guard<std::mutex> guard(coherenceLock);
+        if(coherenceState == CoherenceState::HOST_OWNED)
+        {
+            isCoherent = false;
+            if(deviceWrites)
+                // the pending host writes would be discarded by the next invalidation anyway
+                hostWrites.takeRanges();
+        }
+        if(deviceWrites)
+            coherenceState = CoherenceState::DEVICE_OWNED;
+    }
+    if(!isCoherent && system)
+        system->reportIncoherentAccess(*this);
+    return isCoherent;
+}
+
+void DeviceBuffer::invalidateIfDeviceOwned() const
+{
+    if(coherenceState != CoherenceState::DEVICE_OWNED)
+        return;
+    // if the invalidation fails, we retry it on the next host access
+    if(!system || system->invalidateCPUCache(*this))
+        coherenceState = CoherenceState::SHARED;
+}
+
+/*
+ * The size of the replicated pattern block, a multiple of all pattern sizes supported by clEnqueueFillBuffer (powers of
+ * two up to 128 bytes) and of the cache line size. Large enough to amortize the overhead of the single copies, but
+ * small enough to stay in the L1 data cache (16 KB on the BCM2835).
+ */
+static constexpr std::size_t FILL_BLOCK_SIZE = 4096;
+// The largest supported pattern, the size of a 16-element vector of 64-bit values
+static constexpr std::size_t MAX_PATTERN_SIZE = 128;
+
+void vc4cl::fillMemory(void* destination, std::size_t numBytes, const void* pattern, std::size_t patternSize)
+{
+    auto out = static_cast<uint8_t*>(destination);
+    if(patternSize == 1)
+    {
+        memset(out, *static_cast<const uint8_t*>(pattern), numBytes);
+        return;
+    }
+    if(patternSize == 0 || patternSize > MAX_PATTERN_SIZE)
+    {
+        // fall back to copying the pattern one at a time
+        for(std::size_t offset = 0; offset < numBytes; offset += patternSize)
+            memcpy(out + offset, pattern, std::min(patternSize, numBytes - offset));
+        return;
+    }
+
+    // The block contains an additional pattern, so we can start copying from any position within the first pattern
+    // and still copy a whole block
+    const std::size_t blockSize = FILL_BLOCK_SIZE - FILL_BLOCK_SIZE % patternSize;
+    alignas(HostWriteTracker::CACHE_LINE_SIZE) std::array<uint8_t, FILL_BLOCK_SIZE + MAX_PATTERN_SIZE> block;
+    memcpy(block.data(), pattern, patternSize);
+    for(std::size_t filled = patternSize; filled < blockSize + patternSize; filled *= 2)
+        memcpy(block.data() + filled, block.data(), std::min(filled, blockSize + patternSize - filled));
+
+    // unaligned head up to the next cache line
+    auto misalignment = reinterpret_cast<uintptr_t>(out) % HostWriteTracker::CACHE_LINE_SIZE;
+    std::size_t head = misalignment == 0 ? 0 : HostWriteTracker::CACHE_LINE_SIZE - misalignment;
+    head = std::min(head, numBytes);
+    memcpy(out, block.data(), head);
+    out += head;
+    numBytes -= head;
+
+    // aligned body, the position within the pattern does not change from block to block
+    const uint8_t* source = block.data() + head % patternSize;
+    for(; numBytes >= blockSize; numBytes -= blockSize, out += blockSize)
+        memcpy(out, source, blockSize);
+    // tail
+    memcpy(out, source, numBytes);
+}
@@ -9,8 +9,11 @@
 #define VC4CL_DEVICE_BUFFER
 
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <ostream>
+#include <vector>
 
 namespace vc4cl
 {
@@ -34,6 +37,84 @@ namespace vc4cl
 
     std::ostream& operator<<(std::ostream& s, const DevicePointer& ptr);
 
+    enum class CacheType : uint8_t
+    {
+        UNCACHED = 0,
+        HOST_CACHED = 1,
+        GPU_CACHED = 2,
+        BOTH_CACHED = 3
+    };
+
+    /*
+     * Returns whether accesses of the host CPU to memory of the given caching type are cached
+     */
+    constexpr bool isHostCached(CacheType type)
+    {
+        return type == CacheType::HOST_CACHED || type == CacheType::BOTH_CACHED;
+    }
+
+    /*
+     * A range of bytes within a buffer
+     */
+    struct ByteRange
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    /*
+     * Tracks the byte ranges of a buffer written by the host since the last clean of the host CPU caches
+     *
+     * The ranges are extended to whole cache lines and overlapping or adjacent ranges are merged, so the clean only
+     * needs a single cache operation per coherent range.
+     *
+     * NOTE: This type is not thread-safe, the owning device buffer guards the accesses.
+     */
+    class HostWriteTracker
+    {
+    public:
+        // The size of a CPU cache line, the largest line size of the supported ARM cores
+        static constexpr uint32_t CACHE_LINE_SIZE = 64;
+        // The maximum number of distinct ranges tracked, any further range merges all ranges into a single one
+        static constexpr std::size_t MAX_RANGES = 32;
+
+        // Initially, the whole buffer is treated as written, since it was not yet cleaned at all
+        explicit HostWriteTracker(uint32_t bufferSize);
+
+        void addRange(uint32_t offset, uint32_t numBytes);
+        void addAll();
+        /*
+         * Removes the cache lines completely covered by the given range, e.g. if their contents became undefined.
+         * Partially covered cache lines are kept, since they might contain other written data.
+         */
+        void removeRange(uint32_t offset, uint32_t numBytes);
+
+        /*
+         * Returns the coalesced ranges written since the last call to this function (in ascending order) and resets
+         * the tracked ranges.
+         */
+        std::vector<ByteRange> takeRanges();
+        bool isClean() const;
+
+    private:
+        const uint32_t bufferSize;
+        // the start offsets mapped to the end offsets (exclusive) of the non-overlapping ranges
+        std::map<uint32_t, uint32_t> ranges;
+    };
+
+    /*
+     * The coherence state between the host CPU cache and the memory of a device buffer
+     */
+    enum class CoherenceState : uint8_t
+    {
+        // Neither side has outstanding writes, the host and the GPU can access the buffer without cache maintenance
+        SHARED,
+        // The host wrote (parts of) the buffer, the host CPU cache needs to be cleaned before the GPU reads the buffer
+        HOST_OWNED,
+        // The GPU (possibly) wrote the buffer, the host CPU cache needs to be invalidated before the host accesses it
+        DEVICE_OWNED
+    };
+
     /*
      * Container for the various pointers required for a GPU buffer object
      *
@@ -50,9 +131,11 @@ namespace vc4cl
         void* const hostPointer;
         // size of the buffer, in bytes
         const uint32_t size;
+        // the caching of the buffer memory, e.g. to select the best way to access it from the host
+        const CacheType cacheType;
 
         DeviceBuffer(const std::shared_ptr<SystemAccess>& sys, uint32_t handle, DevicePointer devPtr, void* hostPtr,
-            uint32_t size);
+            uint32_t size, CacheType cacheType = CacheType::BOTH_CACHED);
         DeviceBuffer(const DeviceBuffer&) = delete;
         DeviceBuffer(DeviceBuffer&&) = delete;
         ~DeviceBuffer();
@@ -62,9 +145,62 @@ namespace vc4cl
 
         void dumpContent() const;
 
+        CoherenceState getCoherenceState() const;
+
+        /*
+         * Needs to be called before the host reads the buffer.
+         *
+         * If the GPU (possibly) wrote the buffer since the host last accessed it, the host CPU cache is invalidated for
+         * the whole buffer, since we do not know which parts the GPU actually wrote.
+         */
+        void beginHostRead() const;
+        /*
+         * Needs to be called before the host writes the given range of the buffer.
+         *
+         * In addition to the invalidation (see #beginHostRead), the range is marked to be cleaned from the host CPU
+         * cache before the GPU accesses the buffer the next time.
+         */
+        void beginHostWrite(uint32_t offset, uint32_t numBytes) const;
+
+        /*
+         * Returns all ranges written by the host since the last clean and resets them.
+         */
+        std::vector<ByteRange> takeHostWrites() const;
+        /*
+         * Drops the host writes to the given range, without cleaning them from the host CPU cache.
+         *
+         * This can be used if the contents of the range are undefined, e.g. for buffers migrated with
+         * CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, so the next device access does not need to clean them.
+         */
+        void discardHostWrites(uint32_t offset, uint32_t numBytes) const;
+
+        /*
+         * Needs to be called before the GPU accesses the buffer, after the host writes are cleaned from the host CPU
+         * cache. If the GPU (possibly) writes the buffer, the buffer becomes owned by the GPU.
+         *
+         * Returns false if there are host writes which are not yet cleaned, i.e. the GPU might read stale data.
+         */
+        bool beginDeviceAccess(bool deviceWrites) const;
+
     private:
         std::shared_ptr<SystemAccess> system;
+        // guards the coherence state and the host writes
+        mutable std::mutex coherenceLock;
+        mutable CoherenceState coherenceState;
+        mutable HostWriteTracker hostWrites;
+
+        // invalidates the host CPU cache if the buffer is owned by the GPU, requires the coherence lock to be locked
+        void invalidateIfDeviceOwned() const;
     };
+
+    /*
+     * Fills the given number of bytes with the repeated pattern, starting with the first byte of the pattern.
+     *
+     * The pattern is replicated into a block of several cache lines, which is then written with full-width (aligned)
+     * stores. The destination is never read, so this is also fast for uncached device memory. If the number of bytes
+     * is not a multiple of the pattern size, the last pattern is truncated.
+     */
+    void fillMemory(void* destination, std::size_t numBytes, const void* pattern, std::size_t patternSize);
 } // namespace vc4cl
 
 #endif /* VC4CL_DEVICE_BUFFER */
@@ -55,6 +55,9 @@ void ObjectTracker::addObject(BaseObject* obj)
 
 void ObjectTracker::removeObject(BaseObject* obj)
 {
+    // The object is destroyed after the lock is released, since destroying e.g. a command queue waits for its event
+    // handler thread, which might need to release objects itself
+    std::unique_ptr<BaseObject> removedObject;
     std::lock_guard<std::recursive_mutex> guard(liveObjectsTracker.trackerMutex);
     DEBUG_LOG(DebugLevel::OBJECTS,
         std::cout << "Releasing live-time of object: " << obj->getBasePointer() << " (" << obj->typeName << ')'
@@ -63,7 +66,10 @@ void ObjectTracker::removeObject(BaseObject* obj)
     auto it = std::find_if(liveObjectsTracker.liveObjects.begin(), liveObjectsTracker.liveObjects.end(),
         [obj](const std::unique_ptr<BaseObject>& ptr) -> bool { return ptr.get() == obj; });
     if(it != liveObjectsTracker.liveObjects.end())
+    {
+        removedObject = std::move(*it);
         liveObjectsTracker.liveObjects.erase(it);
+    }
     else
         DEBUG_LOG(DebugLevel::OBJECTS,
             std::cout << "Removing object not previously tracked: " << obj->getBasePointer() << " (" << obj->typeName
@@ -10,7 +10,9 @@
 #include "extensions.h"
 #include "hal/hal.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iterator>
 #include <sstream>
@@ -327,6 +329,7 @@ cl_int Program::compile(
     intermediateCode.clear();
     binaryCode.clear();
     moduleInfo.kernels.clear();
+    releaseDeviceImage();
 #if HAS_COMPILER
     cl_int state = precompile_program(this, options, embeddedHeaders);
 #else
@@ -366,6 +369,7 @@ cl_int Program::link(const std::string& options, const std::vector<object_wrappe
     {
         // if the program was already compiled, clear all results
         moduleInfo.kernels.clear();
+        releaseDeviceImage();
         status = extractModuleInfo();
     }
 #else
@@ -549,6 +553,7 @@ cl_int Program::extractModuleInfo()
         // no kernel meta-data was found!
         return returnError(CL_INVALID_PROGRAM, __FILE__, __LINE__, "No kernel offset found!");
 
+    globalData.clear();
     if(moduleInfo.getGlobalDataSize() > 0)
     {
         uint64_t* globalsPtr = &binaryCode[moduleInfo.getGlobalDataOffset()];
@@ -559,6 +564,84 @@ cl_int Program::extractModuleInfo()
     return CL_SUCCESS;
 }
 
+std::shared_ptr<ProgramDeviceImage> Program::getDeviceImage()
+{
+    std::lock_guard<std::mutex> imageGuard(deviceImageLock);
+    if(deviceImage)
+        return deviceImage;
+    if(binaryCode.empty() || moduleInfo.kernels.empty())
+        return nullptr;
+
+    /*
+     * +---------------+ <- global data address
+     * |  Data Segment |
+     * +---------------+
+     * |  Stack-frames |
+     * +---------------+ <- code offset
+     * |  Module       |
+     * |  (QPU Code)   |
+     * +---------------+
+     */
+    const auto globalDataSize = static_cast<uint32_t>(globalData.size() * sizeof(uint64_t));
+    const auto stackFramesSize =
+        static_cast<uint32_t>(system()->getNumQPUs() * moduleInfo.getStackFrameSize() * sizeof(uint64_t));
+    const auto codeSize = static_cast<uint32_t>(binaryCode.size() * sizeof(uint64_t));
+
+    std::unique_ptr<DeviceBuffer> buffer =
+        system()->allocateBuffer(globalDataSize + stackFramesSize + codeSize, "VC4CL program image");
+    if(!buffer)
+        return nullptr;
+
+    auto hostPtr = reinterpret_cast<uint8_t*>(buffer->hostPointer);
+    if(!globalData.empty())
+        memcpy(hostPtr, globalData.data(), globalDataSize);
+    memcpy(hostPtr + globalDataSize + stackFramesSize, binaryCode.data(), codeSize);
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+        std::cout << "Uploaded " << globalDataSize << " bytes of global data and " << codeSize
+                  << " bytes of kernel code to device buffer " << buffer->qpuPointer << std::endl)
+
+    deviceImage.reset(new ProgramDeviceImage{std::move(buffer), globalDataSize, globalDataSize + stackFramesSize});
+    return deviceImage;
+}
+
+void Program::restoreGlobalData(const ProgramDeviceImage& image)
+{
+    // Kernels are allowed to modify (non-constant) global data, but every execution needs to see the initial values.
+    // Instead of copying the global data for every execution, we only write back the cache lines actually modified.
+    std::lock_guard<std::mutex> imageGuard(deviceImageLock);
+    if(&image != deviceImage.get() || globalData.empty())
+        // the program was rebuilt in the meantime, the old image is freed anyway
+        return;
+    static constexpr uint32_t CACHE_LINE_SIZE = HostWriteTracker::CACHE_LINE_SIZE;
+    auto globalsPtr = reinterpret_cast<uint8_t*>(image.buffer->hostPointer);
+    auto initialPtr = reinterpret_cast<const uint8_t*>(globalData.data());
+    // only the global data might have been modified by the kernel, so we do not need to invalidate the whole image
+    auto invalidatedSize = std::min(
+        image.buffer->size, (image.globalDataSize + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+    // if the invalidation failed, we might compare against stale data, so always restore the global data
+    auto isInvalidated = system()->invalidateCPUCache(*image.buffer, ByteRange{0, invalidatedSize});
+    uint32_t numRestoredBytes = 0;
+    for(uint32_t offset = 0; offset < image.globalDataSize; offset += CACHE_LINE_SIZE)
+    {
+        auto numBytes = std::min(CACHE_LINE_SIZE, image.globalDataSize - offset);
+        if(isInvalidated && memcmp(globalsPtr + offset, initialPtr + offset, numBytes) == 0)
+            continue;
+        image.buffer->beginHostWrite(offset, numBytes);
+        memcpy(globalsPtr + offset, initialPtr + offset, numBytes);
+        numRestoredBytes += numBytes;
+    }
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION, {
+        if(numRestoredBytes > 0)
+            std::cout << "Restored " << numRestoredBytes << " bytes of global data modified by kernel" << std::endl;
+    })
+}
+
+void Program::releaseDeviceImage()
+{
+    std::lock_guard<std::mutex> imageGuard(deviceImageLock);
+    deviceImage.reset();
+}
+
 using BuildCallback = void(CL_CALLBACK*)(cl_program program, void* user_data);
 
 static cl_int buildInner(object_wrapper<Program> program, std::string options, BuildCallback callback, void* userData)
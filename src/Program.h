@@ -9,8 +9,10 @@
 
 #include "Bitfield.h"
 #include "Context.h"
+#include "Memory.h"
 #include "shared/BinaryHeader.h"
 
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
@@ -56,6 +58,32 @@ namespace vc4cl
         BINARY
     };
 
+    /*
+     * The device-resident copy of the global data segment (followed by the space for the stack-frames) and the machine
+     * code of a program.
+     *
+     * The image is uploaded once and then shared by all executions of the kernels of the program, see executor.cpp
+     */
+    struct ProgramDeviceImage
+    {
+        std::unique_ptr<DeviceBuffer> buffer;
+        // the size of the global data segment in bytes, the stack-frames are located directly behind it
+        uint32_t globalDataSize;
+        // the offset of the copy of the module binary (containing the kernel code) in bytes
+        uint32_t codeOffset;
+
+        inline DevicePointer getGlobalDataAddress() const
+        {
+            return buffer->qpuPointer;
+        }
+
+        inline DevicePointer getKernelCodeAddress(const KernelHeader& info) const
+        {
+            return DevicePointer{static_cast<uint32_t>(buffer->qpuPointer) + codeOffset +
+                static_cast<uint32_t>(info.getOffset() * sizeof(uint64_t))};
+        }
+    };
+
     using ProgramReleaseCallback = void(CL_CALLBACK*)(cl_program program, void* user_data);
     struct SPIRVSpecializationConstant
     {
@@ -111,8 +139,29 @@ namespace vc4cl
 
         CHECK_RETURN cl_int setSpecializationConstant(cl_uint id, std::size_t numBytes, const void* data);
 
+        /*
+         * Returns the device image of this program's global data and machine code, uploading it on the first call.
+         *
+         * Returns nullptr if the program is not yet compiled or the device buffer could not be allocated. The image
+         * stays valid for as long as it is referenced, even if the program is rebuilt in the meantime.
+         */
+        std::shared_ptr<ProgramDeviceImage> getDeviceImage();
+
+        /*
+         * Writes the initial values back into the global data segment of the given device image, if they were modified
+         * by a kernel execution.
+         *
+         * NOTE: This only needs to be called after executing kernels which access the global data.
+         */
+        void restoreGlobalData(const ProgramDeviceImage& image);
+
     private:
         cl_int extractModuleInfo();
+        void releaseDeviceImage();
+
+        // guards the creation and release of the device image as well as the restoring of its global data
+        std::mutex deviceImageLock;
+        std::shared_ptr<ProgramDeviceImage> deviceImage;
 
         std::vector<std::pair<ProgramReleaseCallback, void*>> callbacks;
         std::vector<SPIRVSpecializationConstant> specializations;
@@ -341,6 +341,28 @@ void RasterFormatAccessor::writePixelData(const std::array<std::size_t, 3>& pixe
     }
 }
 
+void RasterFormatAccessor::fillPixelData(const std::array<std::size_t, 3>& pixelCoordinates,
+    const std::array<std::size_t, 3>& pixelRegion, void* fillColor) const
+{
+    const std::size_t pixelWidth = image.calculateElementSize();
+    // if whole rows are filled, all rows of a slice are consecutive in memory and can be filled at once
+    const bool fillWholeRows = pixelCoordinates[0] == 0 && pixelRegion[0] * pixelWidth == image.imageRowPitch;
+    const std::size_t numRows = fillWholeRows ? 1 : pixelRegion[1];
+    const std::size_t numBytes = pixelRegion[0] * pixelWidth * (fillWholeRows ? pixelRegion[1] : 1);
+    std::array<std::size_t, 3> outputCoords{};
+    outputCoords[0] = pixelCoordinates[0];
+    for(std::size_t z = 0; z < pixelRegion[2]; ++z)
+    {
+        outputCoords[2] = pixelCoordinates[2] + z;
+        for(std::size_t y = 0; y < numRows; ++y)
+        {
+            outputCoords[1] = pixelCoordinates[1] + y;
+            void* outPtr = calculatePixelOffset(image.deviceBuffer->hostPointer, outputCoords);
+            fillMemory(outPtr, numBytes, fillColor, pixelWidth);
+        }
+    }
+}
+
 Coordinates2D Microtile::getTileSize(const Image& image)
 {
     // see Broadcom specification, page 105
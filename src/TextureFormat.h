@@ -108,6 +108,8 @@ namespace vc4cl
         void writePixelData(const std::array<std::size_t, 3>& pixelCoordinates,
             const std::array<std::size_t, 3>& pixelRegion, void* source, std::size_t sourceRowPitch,
             std::size_t sourceSlicePitch) const override;
+        void fillPixelData(const std::array<std::size_t, 3>& pixelCoordinates,
+            const std::array<std::size_t, 3>& pixelRegion, void* fillColor) const override;
     };
 
     enum class TileType
@@ -58,8 +58,8 @@ cl_int VC4CL_FUNC(clEnqueueMarkerWithWaitList)(
 
     CHECK_EVENT_WAIT_LIST(event_wait_list, num_events_in_wait_list)
 
-    // since our commands are always executed in-order, no special handling is necessary (it always waits for all
-    // events to finish)
+    // for in-order queues, no special handling is necessary (it always waits for all previous events to finish). For
+    // out-of-order queues, the command queue adds the implicit dependencies on the previous events.
     cl_int errcode = CL_SUCCESS;
     auto e = newOpenCLObject<Event>(toType<CommandQueue>(command_queue)->context(), CL_QUEUED, CommandType::MARKER);
     CHECK_ALLOCATION(e)
@@ -123,8 +123,8 @@ cl_int VC4CL_FUNC(clEnqueueBarrierWithWaitList)(
 
     CHECK_EVENT_WAIT_LIST(event_wait_list, num_events_in_wait_list)
 
-    // since our commands are always executed in-order, no special handling is necessary (it always waits for all events
-    // to finish)
+    // for in-order queues, no special handling is necessary (it always waits for all previous events to finish). For
+    // out-of-order queues, the command queue makes all following events depend on this barrier.
     cl_int errcode = CL_SUCCESS;
     auto e = newOpenCLObject<Event>(toType<CommandQueue>(command_queue)->context(), CL_QUEUED, CommandType::BARRIER);
     CHECK_ALLOCATION(e)
@@ -10,16 +10,19 @@
 #include "Kernel.h"
 #include "PerformanceCounter.h"
 #include "hal/hal.h"
+#include "queue_handler.h"
 
 #include <CL/opencl.h>
 
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <map>
 #include <thread>
+#include <vector>
 
 using namespace vc4cl;
 
@@ -28,10 +31,6 @@ using namespace vc4cl;
 // that long (e.g. 1min)
 static const std::chrono::milliseconds KERNEL_TIMEOUT{1000};
 
-// get_work_dim, get_local_size, get_local_id, get_num_groups (x, y, z), get_global_offset (x, y, z), global-data,
-// uniform address, max_group_id (x, y, z)
-static const unsigned MAX_HIDDEN_PARAMETERS = 14;
-
 static unsigned AS_GPU_ADDRESS(const unsigned* ptr, DeviceBuffer* buffer)
 {
     const char* tmp = *reinterpret_cast<const char**>(&ptr);
@@ -39,79 +38,43 @@ static unsigned AS_GPU_ADDRESS(const unsigned* ptr, DeviceBuffer* buffer)
         static_cast<uint32_t>(buffer->qpuPointer) + ((tmp) - reinterpret_cast<char*>(buffer->hostPointer)));
 }
 
-static size_t get_size(
-    uint8_t numQPUS, size_t code_size, size_t num_uniforms, size_t global_data_size, size_t stackFrameSizeInWords)
+static size_t get_size(uint8_t numQPUS, size_t num_uniforms, size_t numBlocks)
 {
-    // we duplicate the UNIFORMs to be able to update one block while the second one is used for execution
-    size_t uniformSize = 2 * sizeof(unsigned) * num_uniforms;
+    // we have multiple UNIFORM blocks to be able to update some blocks while the other ones are used for execution
+    size_t uniformSize = numBlocks * sizeof(unsigned) * num_uniforms;
     // we need 2 32-bit words (code pointer, uniform pointer) per QPU for a single launch message block.
-    // we need 2 launch message blocks, one per UNIFORM block (see above)
-    size_t launchMessageSize = 2 * 2 * sizeof(uint32_t) * numQPUS;
-    size_t rawSize = code_size + uniformSize + global_data_size +
-        numQPUS * stackFrameSizeInWords * sizeof(uint64_t) /* word-size */ + launchMessageSize;
+    // we need one launch message block per UNIFORM block (see above)
+    size_t launchMessageSize = numBlocks * 2 * sizeof(uint32_t) * numQPUS;
+    size_t rawSize = uniformSize + launchMessageSize;
     // round up to next multiple of alignment
     return (rawSize / PAGE_ALIGNMENT + 1) * PAGE_ALIGNMENT;
 }
 
-static unsigned* set_work_item_info(unsigned* ptr, cl_uint num_dimensions,
+static void log_work_item_info(cl_uint num_dimensions,
     const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& global_offsets,
     const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& global_sizes,
     const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& local_sizes,
     const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& group_indices,
-    const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& local_indices, unsigned global_data,
-    unsigned uniformAddress, const KernelUniforms& uniformsUsed, uint8_t workItemMergeFactor)
+    const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& local_indices, uint8_t workItemMergeFactor)
 {
-    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION, {
-        std::cout << "Setting work-item infos:" << std::endl;
-        std::cout << "\t" << num_dimensions << " dimensions with offsets: " << global_offsets[0] << ", "
-                  << global_offsets[1] << ", " << global_offsets[2] << std::endl;
-        std::cout << "\tGlobal IDs (sizes): " << group_indices[0] * local_sizes[0] + local_indices[0] << "("
-                  << global_sizes[0] << "), " << group_indices[1] * local_sizes[1] + local_indices[1] << "("
-                  << global_sizes[1] << "), " << group_indices[2] * local_sizes[2] + local_indices[2] << "("
-                  << global_sizes[2] << ")" << std::endl;
-        if (workItemMergeFactor > 1)
-            std::cout << "\tLocal IDs (sizes): " << (local_indices[0] * workItemMergeFactor) << "-"
-                      << std::min((local_indices[0] + 1) * workItemMergeFactor, local_sizes[0]) << "(" << local_sizes[0] << "), "
-                      << local_indices[1] << "(" << local_sizes[1] << "), " << local_indices[2] << "(" << local_sizes[2] << ")" << std::endl;
-        else
-            std::cout << "\tLocal IDs (sizes): " << local_indices[0] << "(" << local_sizes[0] << "), " << local_indices[1]
-                      << "(" << local_sizes[1] << "), " << local_indices[2] << "(" << local_sizes[2] << ")" << std::endl;
-        std::cout << "\tGroup IDs (sizes): " << group_indices[0] << "(" << (global_sizes[0] / local_sizes[0]) << "), "
-                  << group_indices[1] << "(" << (global_sizes[1] / local_sizes[1]) << "), " << group_indices[2] << "("
-                  << (global_sizes[2] / local_sizes[2]) << ")" << std::endl;
-    })
-    // composes UNIFORMS for the values
-    if(uniformsUsed.getWorkDimensionsUsed())
-        *ptr++ = num_dimensions; /* get_work_dim() */
-    // since locals values top at 255, all 3 dimensions can be unified into one 32-bit UNIFORM
-    // when read, the values are shifted by 8 * ndim bits and ANDed with 0xFF
-    if(uniformsUsed.getLocalSizesUsed())
-        *ptr++ = static_cast<unsigned>(
-            local_sizes[2] << 16 | local_sizes[1] << 8 | local_sizes[0]); /* get_local_size(dim) */
-    if(uniformsUsed.getLocalIDsUsed())
-        *ptr++ = static_cast<unsigned>(
-            local_indices[2] << 16 | local_indices[1] << 8 | (local_indices[0] * workItemMergeFactor)); /* get_local_id(dim) */
-    if(uniformsUsed.getNumGroupsXUsed())
-        *ptr++ = static_cast<unsigned>(global_sizes[0] / local_sizes[0]); /* get_num_groups(0) */
-    if(uniformsUsed.getNumGroupsYUsed())
-        *ptr++ = static_cast<unsigned>(global_sizes[1] / local_sizes[1]); /* get_num_groups(1) */
-    if(uniformsUsed.getNumGroupsZUsed())
-        *ptr++ = static_cast<unsigned>(global_sizes[2] / local_sizes[2]); /* get_num_groups(2) */
-    if(uniformsUsed.getGroupIDXUsed())
-        *ptr++ = static_cast<unsigned>(group_indices[0]); /* get_group_id(0) */
-    if(uniformsUsed.getGroupIDYUsed())
-        *ptr++ = static_cast<unsigned>(group_indices[1]); /* get_group_id(1) */
-    if(uniformsUsed.getGroupIDZUsed())
-        *ptr++ = static_cast<unsigned>(group_indices[2]); /* get_group_id(2) */
-    if(uniformsUsed.getGlobalOffsetXUsed())
-        *ptr++ = static_cast<unsigned>(global_offsets[0]); /* get_global_offset(0) */
-    if(uniformsUsed.getGlobalOffsetYUsed())
-        *ptr++ = static_cast<unsigned>(global_offsets[1]); /* get_global_offset(1) */
-    if(uniformsUsed.getGlobalOffsetZUsed())
-        *ptr++ = static_cast<unsigned>(global_offsets[2]); /* get_global_offset(2) */
-    if(uniformsUsed.getGlobalDataAddressUsed())
-        *ptr++ = global_data; // base address for the global-data block
-    return ptr;
+    std::cout << "Setting work-item infos:" << std::endl;
+    std::cout << "\t" << num_dimensions << " dimensions with offsets: " << global_offsets[0] << ", "
+              << global_offsets[1] << ", " << global_offsets[2] << std::endl;
+    std::cout << "\tGlobal IDs (sizes): " << group_indices[0] * local_sizes[0] + local_indices[0] << "("
+              << global_sizes[0] << "), " << group_indices[1] * local_sizes[1] + local_indices[1] << "("
+              << global_sizes[1] << "), " << group_indices[2] * local_sizes[2] + local_indices[2] << "("
+              << global_sizes[2] << ")" << std::endl;
+    if(workItemMergeFactor > 1)
+        std::cout << "\tLocal IDs (sizes): " << (local_indices[0] * workItemMergeFactor) << "-"
+                  << std::min((local_indices[0] + 1) * workItemMergeFactor, local_sizes[0]) << "(" << local_sizes[0]
+                  << "), " << local_indices[1] << "(" << local_sizes[1] << "), " << local_indices[2] << "("
+                  << local_sizes[2] << ")" << std::endl;
+    else
+        std::cout << "\tLocal IDs (sizes): " << local_indices[0] << "(" << local_sizes[0] << "), " << local_indices[1]
+                  << "(" << local_sizes[1] << "), " << local_indices[2] << "(" << local_sizes[2] << ")" << std::endl;
+    std::cout << "\tGroup IDs (sizes): " << group_indices[0] << "(" << (global_sizes[0] / local_sizes[0]) << "), "
+              << group_indices[1] << "(" << (global_sizes[1] / local_sizes[1]) << "), " << group_indices[2] << "("
+              << (global_sizes[2] / local_sizes[2]) << ")" << std::endl;
 }
 
 static bool increment_index(std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& indices,
@@ -150,16 +113,16 @@ static void dumpBuffer(std::ostream& os, const DeviceBuffer* buffer)
 }
 
 static void dumpMemoryState(std::ostream& os, const Kernel* kernel, const KernelExecution& args,
-    DeviceBuffer& mainBuffer, const uint32_t* qpu_code, uint32_t* firstUniformPointer, bool printHead)
+    const ProgramDeviceImage& image, DeviceBuffer& mainBuffer, uint32_t* firstUniformPointer, bool printHead)
 {
     // add additional pointers for the dump-analyzer
     // qpu base-pointer (global-data pointer) | qpu code-pointer | qpu UNIFORM-pointer | num uniforms
-    // | implicit uniform bit-field
+    // | implicit uniform bit-field | global-data segment size | code size
     if(printHead)
     {
-        unsigned tmp = static_cast<unsigned>(mainBuffer.qpuPointer);
+        unsigned tmp = static_cast<unsigned>(image.getGlobalDataAddress());
         os.write(reinterpret_cast<char*>(&tmp), sizeof(unsigned));
-        tmp = AS_GPU_ADDRESS(qpu_code, &mainBuffer);
+        tmp = static_cast<unsigned>(image.getKernelCodeAddress(kernel->info));
         os.write(reinterpret_cast<char*>(&tmp), sizeof(unsigned));
         tmp = AS_GPU_ADDRESS(firstUniformPointer, &mainBuffer);
         os.write(reinterpret_cast<char*>(&tmp), sizeof(unsigned));
@@ -168,7 +131,15 @@ static void dumpMemoryState(std::ostream& os, const Kernel* kernel, const Kernel
         os.write(reinterpret_cast<char*>(&tmp), sizeof(unsigned));
         tmp = static_cast<unsigned>(kernel->info.uniformsUsed.value);
         os.write(reinterpret_cast<char*>(&tmp), sizeof(unsigned));
+        // the global data (with the stack-frames) and the code are not contiguous with the UNIFORMs anymore
+        uint32_t dataSize = image.codeOffset;
+        os.write(reinterpret_cast<char*>(&dataSize), sizeof(unsigned));
+        uint32_t codeSize = static_cast<uint32_t>(kernel->info.getLength() * sizeof(uint64_t));
+        os.write(reinterpret_cast<char*>(&codeSize), sizeof(unsigned));
         // write buffer contents
+        const auto imagePtr = reinterpret_cast<const char*>(image.buffer->hostPointer);
+        os.write(imagePtr, dataSize);
+        os.write(imagePtr + image.codeOffset + kernel->info.getOffset() * sizeof(uint64_t), codeSize);
         os.write(reinterpret_cast<char*>(mainBuffer.hostPointer), static_cast<uint32_t>(mainBuffer.size));
     }
     // append additionally the kernel parameter for this execution
@@ -202,33 +173,58 @@ static void dumpMemoryState(std::ostream& os, const Kernel* kernel, const Kernel
     }
 }
 
-static bool flushHostCache(SystemAccess& system, const std::unique_ptr<DeviceBuffer>& kernelBuffer,
-    const std::map<unsigned, std::unique_ptr<DeviceBuffer>>& tmpBuffers,
-    const std::map<unsigned, std::pair<std::shared_ptr<DeviceBuffer>, DevicePointer>>& persistentBuffers)
+/*
+ * Cleans the host writes to the given buffers from the host CPU cache and transfers the ownership of the buffers
+ * (possibly) written by the kernel to the GPU.
+ *
+ * The value of the pairs is whether the buffer is (possibly) written by the GPU.
+ */
+static bool prepareDeviceAccess(SystemAccess& system, const std::vector<std::pair<const DeviceBuffer*, bool>>& buffers)
 {
-    std::vector<const DeviceBuffer*> toBeFlushed;
-    toBeFlushed.reserve(1 + tmpBuffers.size() + persistentBuffers.size());
-    toBeFlushed.emplace_back(kernelBuffer.get());
-    for(auto& buf : tmpBuffers)
-    {
-        if(buf.second && buf.second->hostPointer)
-            toBeFlushed.emplace_back(buf.second.get());
-    }
-    for(auto& buf : persistentBuffers)
-        toBeFlushed.emplace_back(buf.second.first.get());
-
-    auto status = system.flushCPUCache(toBeFlushed);
+    std::vector<const DeviceBuffer*> toBeCleaned;
+    toBeCleaned.reserve(buffers.size());
+    for(const auto& entry : buffers)
+        toBeCleaned.emplace_back(entry.first);
+    auto status = system.cleanCPUCache(toBeCleaned);
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-        std::cout << "Flushing cache for " << toBeFlushed.size() << " host-accessible device buffers "
+        std::cout << "Cleaning cache for " << toBeCleaned.size() << " host-accessible device buffers "
                   << (status ? "succeeded" : "failed") << std::endl)
+    for(const auto& entry : buffers)
+        status = entry.first->beginDeviceAccess(entry.second) && status;
     return status;
 }
 
+static std::vector<std::pair<const DeviceBuffer*, bool>> getAccessedBuffers(
+    const KernelExecution& args, const DeviceBuffer& kernelBuffer, const DeviceBuffer& programImage)
+{
+    std::vector<std::pair<const DeviceBuffer*, bool>> buffers;
+    buffers.reserve(2 + args.tmpBuffers.size() + args.persistentBuffers.size());
+    // The QPUs only read the UNIFORMs, launch messages and the kernel code. The stack-frames are never read by the host
+    // and the global data possibly modified by the kernel is invalidated separately, see Program#restoreGlobalData(),
+    // so the program image does not need to be invalidated as a whole.
+    buffers.emplace_back(&kernelBuffer, false);
+    buffers.emplace_back(&programImage, false);
+    for(const auto& buf : args.tmpBuffers)
+    {
+        if(buf.second && buf.second->hostPointer)
+            buffers.emplace_back(buf.second.get(), args.writtenBuffers.test(buf.first));
+    }
+    for(const auto& buf : args.persistentBuffers)
+    {
+        if(buf.second.first)
+            buffers.emplace_back(buf.second.first.get(), args.writtenBuffers.test(buf.first));
+    }
+    return buffers;
+}
+
 cl_int executeKernel(KernelExecution& args)
 {
     const Kernel* kernel = args.kernel.get();
     CHECK_KERNEL(kernel)
 
+    // the event queues of all command queues run in parallel, but only one can access the QPUs at a time
+    std::lock_guard<DeviceArbiter> deviceGuard(DeviceArbiter::getInstance());
+
     // the number of QPUs is the product of all local sizes
     auto mergeFactor = std::max(kernel->info.workItemMergeFactor, uint8_t{1});
     size_t localSize = args.localSizes[0] * args.localSizes[1] * args.localSizes[2];
@@ -266,9 +262,26 @@ cl_int executeKernel(KernelExecution& args)
     //
     // ALLOCATE BUFFER
     //
-    size_t buffer_size = get_size(args.system->getNumQPUs(), kernel->info.getLength() * sizeof(uint64_t),
-        numQPUs * (MAX_HIDDEN_PARAMETERS + kernel->info.getExplicitUniformCount()),
-        kernel->program->globalData.size() * sizeof(uint64_t), kernel->program->moduleInfo.getStackFrameSize());
+    // The global data and the kernel code are uploaded once per program and shared by all executions, see
+    // Program#getDeviceImage(). The stack-frames located in the same image can only be used by a single execution at a
+    // time, which is guaranteed by the device arbiter.
+    Program* program = args.kernel->program.get();
+    std::shared_ptr<ProgramDeviceImage> image = program->getDeviceImage();
+    if(!image)
+        return CL_OUT_OF_RESOURCES;
+
+    const LaunchPlan& plan = *args.launchPlan;
+    const size_t uniformsPerQPU = plan.getUniformsPerQPU();
+
+    // The work-groups are submitted in batches (if supported by the execution mode) to reduce the per-work-group
+    // overhead. We have UNIFORM blocks for two batches, so we can prepare the next batch while the current one is
+    // executed.
+    const size_t numGroups =
+        isWorkGroupLoopEnabled ? size_t{1} : group_limits[0] * group_limits[1] * group_limits[2];
+    const size_t batchSize =
+        std::max(std::min(numGroups, static_cast<size_t>(args.system->getMaxExecutionBatchSize())), size_t{1});
+    const size_t numBlocks = numGroups > batchSize ? 2 * batchSize : batchSize;
+    size_t buffer_size = get_size(args.system->getNumQPUs(), numQPUs * uniformsPerQPU, numBlocks);
 
     std::unique_ptr<DeviceBuffer> buffer(
         args.system->allocateBuffer(static_cast<unsigned>(buffer_size), "VC4CL kernel"));
@@ -281,170 +294,122 @@ cl_int executeKernel(KernelExecution& args)
     /*
      * source: https://github.com/hermanhermitage/videocoreiv-qpu/blob/master/qpu-tutorial/qpu-02.c
      *
+     * Program image:          Kernel buffer:
      * +---------------+
      * |  Data Segment |
-     * +---------------+ <----+
-     * |  QPU Code     |      |
-     * |  ...          |      |
-     * +---------------+ <--+ |
-     * |  Uniforms     |    | |
-     * +---------------+    | |
-     * |  QPU0 Uniform -----+ |
-     * |  QPU0 Start   -------+
      * +---------------+
+     * |  Stack-frames |
+     * +---------------+ <----------------------------+
+     * |  QPU Code     |        +---------------+     |
+     * |  ...          |        |  Uniforms     | <-+ |
+     * +---------------+        +---------------+   | |
+     *                          |  QPU0 Uniform ----+ |
+     *                          |  QPU0 Start   ------+
+     *                          +---------------+
      */
     unsigned* p = reinterpret_cast<unsigned*>(buffer->hostPointer);
 
-    // Copy global data into GPU memory
-    const unsigned global_data = AS_GPU_ADDRESS(p, buffer.get());
-    if(!kernel->program->globalData.empty())
-    {
-        const void* data_start = kernel->program->globalData.data();
-        const unsigned data_length = static_cast<unsigned>(kernel->program->globalData.size() * sizeof(uint64_t));
-        memcpy(p, data_start, data_length);
-        p += data_length / sizeof(unsigned);
-        DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-            std::cout << "Copied " << data_length << " bytes of global data to device buffer" << std::endl)
-    }
+    const unsigned global_data = static_cast<unsigned>(image->getGlobalDataAddress());
 
     // Reserve space for stack-frames and fill it with zeros (e.g. for cl_khr_initialize_memory extension)
     uint32_t maxQPUS = args.system->getNumQPUs();
-    uint32_t stackFrameSize = static_cast<uint32_t>(kernel->program->moduleInfo.getStackFrameSize() * sizeof(uint64_t));
-    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-        std::cout << "Reserving space for " << maxQPUS << " stack-frames of " << stackFrameSize << " bytes each"
-                  << std::endl)
-    if(kernel->program->context()->initializeMemoryToZero(CL_CONTEXT_MEMORY_INITIALIZE_PRIVATE_KHR))
-        memset(p, '\0', maxQPUS * stackFrameSize);
-    p += (maxQPUS * stackFrameSize) / sizeof(unsigned);
-
-    // Copy QPU program into GPU memory
-    const unsigned* qpu_code = p;
-    const void* code_start = &kernel->program->binaryCode[kernel->info.getOffset()];
-    memcpy(p, code_start, kernel->info.getLength() * sizeof(uint64_t));
-    p += kernel->info.getLength() * sizeof(uint64_t) / sizeof(unsigned);
+    uint32_t stackFrameSize = static_cast<uint32_t>(program->moduleInfo.getStackFrameSize() * sizeof(uint64_t));
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-        std::cout << "Copied " << kernel->info.getLength() * sizeof(uint64_t)
-                  << " bytes of kernel code to device buffer" << std::endl)
+        std::cout << "Using " << maxQPUS << " stack-frames of " << stackFrameSize << " bytes each" << std::endl)
+    if(stackFrameSize > 0 && program->context()->initializeMemoryToZero(CL_CONTEXT_MEMORY_INITIALIZE_PRIVATE_KHR))
+    {
+        image->buffer->beginHostWrite(image->globalDataSize, maxQPUS * stackFrameSize);
+        memset(reinterpret_cast<uint8_t*>(image->buffer->hostPointer) + image->globalDataSize, '\0',
+            maxQPUS * stackFrameSize);
+    }
+
+    const unsigned qpu_code = static_cast<unsigned>(image->getKernelCodeAddress(kernel->info));
 
-    // 2 times (for each UNIFORM block) 16 times (for each possible QPU)
-    std::array<std::array<unsigned*, 16>, 2> uniformPointers;
-    // Build Uniforms
-    const unsigned* qpu_uniform_0 = p;
+    // the start of every UNIFORM block, the UNIFORMs of all QPUs of a block are located directly after each other
+    std::vector<unsigned*> uniformBlocks(numBlocks);
+    // Build Uniforms, the values which are the same for all QPUs are only calculated once for the first QPU and then
+    // copied to all other QPUs
+    unsigned* qpu_uniform_0 = p;
+    cl_int uniformStatus = plan.writeTemplate(qpu_uniform_0, args, global_data);
+    if(uniformStatus != CL_SUCCESS)
+        return uniformStatus;
     for(unsigned i = 0; i < numQPUs; ++i)
     {
-        uniformPointers[0][i] = p;
-        p = set_work_item_info(p, args.numDimensions, args.globalOffsets, args.globalSizes, args.localSizes,
-            group_indices, local_indices, global_data, AS_GPU_ADDRESS(p, buffer.get()), kernel->info.uniformsUsed, mergeFactor);
-        for(unsigned u = 0; u < kernel->info.parameters.size(); ++u)
-        {
-            auto tmpBufferIt = args.tmpBuffers.find(u);
-            auto persistentBufferIt = args.persistentBuffers.find(u);
-            if(tmpBufferIt != args.tmpBuffers.end())
-            {
-                if(!tmpBufferIt->second)
-                {
-                    // the __local parameter is lowered into VPM, so there is no temporary buffer
-                    *p++ = 0u;
-                    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-                        std::cout << "Setting lowered parameter " << (kernel->info.uniformsUsed.countUniforms() + u)
-                                  << " to null-pointer" << std::endl)
-                }
-                else
-                {
-                    // there exists a temporary buffer for the __local/struct parameter, so set its address as
-                    // kernel argument
-                    *p++ = static_cast<unsigned>(tmpBufferIt->second->qpuPointer);
-                    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-                        std::cout << "Setting parameter " << (kernel->info.uniformsUsed.countUniforms() + u)
-                                  << " to temporary buffer " << tmpBufferIt->second->qpuPointer << std::endl)
-                }
-            }
-            else if(persistentBufferIt != args.persistentBuffers.end())
-            {
-                // the argument is a pointer to a buffer, use its device pointer as kernel argument value.
-                // Since the buffer pointer might be NULL, we have to check for this first
-                // NOTE: For sub-buffers, the offset is added to the device pointer
-                auto devicePtr =
-                    persistentBufferIt->second.first.get() ? persistentBufferIt->second.second : DevicePointer{0u};
-                *p++ = static_cast<uint32_t>(devicePtr);
-                DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-                    std::cout << "Setting parameter " << (kernel->info.uniformsUsed.countUniforms() + u)
-                              << " to buffer " << devicePtr << std::endl)
-            }
-            else if(auto scalarArg = dynamic_cast<const ScalarArgument*>(args.executionArguments.at(u).get()))
-            {
-                // "default" scalar or vector of scalar kernel argument
-                // we use the actual number of vector elements here instead of the expected number, since e.g. for
-                // 64-bit integer we need 2 UNIFORMs for every vector element
-                for(cl_uchar i = 0; i < scalarArg->scalarValues.size(); ++i)
-                    *p++ = scalarArg->scalarValues.at(i).getUnsigned();
-                DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-                    std::cout << "Setting parameter " << (kernel->info.uniformsUsed.countUniforms() + u)
-                              << " to scalar " << scalarArg->to_string() << std::endl)
-            }
-            else
-            {
-                // At this point all argument types should be handled already
-                return CL_INVALID_KERNEL_ARGS;
-            }
-        }
-        // append UNIFORMs for "loop-work-groups" optimization to end of kernel UNIFORMs
-        if(kernel->info.uniformsUsed.getUniformAddressUsed())
-            *p++ = AS_GPU_ADDRESS(uniformPointers[0][i], buffer.get());
-        if(kernel->info.uniformsUsed.getMaxGroupIDXUsed())
-            *p++ = static_cast<unsigned>(group_limits[0]);
-        if(kernel->info.uniformsUsed.getMaxGroupIDYUsed())
-            *p++ = static_cast<unsigned>(group_limits[1]);
-        if(kernel->info.uniformsUsed.getMaxGroupIDZUsed())
-            *p++ = static_cast<unsigned>(group_limits[2]);
+        if(i != 0)
+            std::memcpy(p, qpu_uniform_0, uniformsPerQPU * sizeof(uint32_t));
+        plan.setLocalIDs(p, local_indices, mergeFactor);
+        plan.setUniformAddress(p, AS_GPU_ADDRESS(p, buffer.get()));
+        DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+            log_work_item_info(args.numDimensions, args.globalOffsets, args.globalSizes, args.localSizes,
+                group_indices, local_indices, mergeFactor))
+        p += uniformsPerQPU;
 
         increment_index(local_indices, args.localSizes, 1);
     }
 
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-        std::cout << (kernel->info.uniformsUsed.countUniforms() + kernel->info.parameters.size()) << " parameters set."
+        std::cout << uniformsPerQPU << " UNIFORMs for " << kernel->info.parameters.size() << " parameters set."
                   << std::endl)
 
-    // We duplicate the UNIFORM buffer, so we can have one being used by the background execution and the other is
-    // prepared for the next execution
-    unsigned* qpu_uniform_1 = p;
+    // All other UNIFORM blocks are copies of the first block, only the UNIFORM addresses and group IDs differ
+    const auto uniformSize = static_cast<size_t>(p - qpu_uniform_0);
+    uniformBlocks[0] = qpu_uniform_0;
+    for(size_t block = 1; block < numBlocks; ++block)
     {
-        auto uniformSize = static_cast<size_t>(qpu_uniform_1 - qpu_uniform_0);
-        std::memcpy(qpu_uniform_1, qpu_uniform_0, uniformSize * sizeof(uint32_t));
-        p += uniformSize;
-
-        // the UNIFORMs of the second block are exactly the size of the first block after the corresponding UNIFORMs
-        // of the first block
+        uniformBlocks[block] = p;
+        std::memcpy(p, qpu_uniform_0, uniformSize * sizeof(uint32_t));
         for(unsigned i = 0; i < numQPUs; ++i)
-            uniformPointers[1][i] = uniformPointers[0][i] + uniformSize;
+            plan.setUniformAddress(p + i * uniformsPerQPU, AS_GPU_ADDRESS(p + i * uniformsPerQPU, buffer.get()));
+        p += uniformSize;
     }
 
-    /* Build QPU Launch messages */
-    auto uniformsPerQPU = kernel->info.uniformsUsed.countUniforms() + kernel->info.getExplicitUniformCount();
-    unsigned* qpu_msg_0 = p;
-    for(unsigned i = 0; i < numQPUs; ++i)
+    /* Build QPU Launch messages, one block per UNIFORM block */
+    std::vector<std::pair<uint32_t*, unsigned>> launchMessages(numBlocks);
+    for(size_t block = 0; block < numBlocks; ++block)
     {
-        *p++ = AS_GPU_ADDRESS(qpu_uniform_0 + i * uniformsPerQPU, buffer.get());
-        *p++ = AS_GPU_ADDRESS(qpu_code, buffer.get());
-    }
-    unsigned* qpu_msg_1 = p;
-    for(unsigned i = 0; i < numQPUs; ++i)
-    {
-        *p++ = AS_GPU_ADDRESS(qpu_uniform_1 + i * uniformsPerQPU, buffer.get());
-        *p++ = AS_GPU_ADDRESS(qpu_code, buffer.get());
+        launchMessages[block] = std::make_pair(p, AS_GPU_ADDRESS(p, buffer.get()));
+        for(unsigned i = 0; i < numQPUs; ++i)
+        {
+            *p++ = AS_GPU_ADDRESS(uniformBlocks[block] + i * uniformsPerQPU, buffer.get());
+            *p++ = qpu_code;
+        }
     }
 
+    // assigns the next work-groups to the UNIFORM blocks of the given batch, returns the number of work-groups assigned
+    size_t remainingGroups = numGroups;
+    auto assignWorkGroups = [&](size_t batch) -> size_t {
+        auto numBatchGroups = std::min(batchSize, remainingGroups);
+        for(size_t block = batch * batchSize; block < batch * batchSize + numBatchGroups; ++block)
+        {
+            // only the group IDs differ between the work-groups, the local IDs of the QPUs stay the same
+            for(cl_uint i = 0; i < numQPUs; ++i)
+                plan.setGroupIDs(uniformBlocks[block] + i * uniformsPerQPU, group_indices);
+            increment_index(group_indices, group_limits, 1);
+        }
+        remainingGroups -= numBatchGroups;
+        return numBatchGroups;
+    };
+    auto getLaunchMessages = [&](size_t batch, size_t numBatchGroups) {
+        auto first = launchMessages.begin() + static_cast<std::ptrdiff_t>(batch * batchSize);
+        return std::vector<std::pair<uint32_t*, unsigned>>(
+            first, first + static_cast<std::ptrdiff_t>(numBatchGroups));
+    };
+
+    size_t currentBatch = 0;
+    size_t numBatchGroups = assignWorkGroups(currentBatch);
+
     const std::string dumpFile("/tmp/vc4cl-dump-" + kernel->info.name + "-" + std::to_string(rand()) + ".bin");
     std::ofstream f;
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION, {
         // Dump all memory content accessed by this kernel execution
         std::cout << "Dumping kernel buffer to " << dumpFile << std::endl;
         f.open(dumpFile, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
-        dumpMemoryState(f, kernel, args, *buffer, qpu_code, uniformPointers[0][0], true);
+        dumpMemoryState(f, kernel, args, *image, *buffer, uniformBlocks[0], true);
     })
 
-    // flush the host caches for all host-writable buffers
-    flushHostCache(*args.system, buffer, args.tmpBuffers, args.persistentBuffers);
+    // clean the host writes to all buffers accessed by the kernel from the host cache, e.g. the program image is only
+    // cleaned if it was modified since the last execution
+    prepareDeviceAccess(*args.system, getAccessedBuffers(args, *buffer, *image->buffer));
 
     //
     // EXECUTION
@@ -453,70 +418,75 @@ cl_int executeKernel(KernelExecution& args)
     auto timeout = KERNEL_TIMEOUT * std::max(std::size_t{30}, group_limits[0] * group_limits[1] * group_limits[2]);
 
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-        std::cout << "Running work-group " << group_indices[0] << ", " << group_indices[1] << ", " << group_indices[2]
-                  << " with a timeout of " << std::chrono::duration_cast<std::chrono::microseconds>(timeout).count()
-                  << " us" << std::endl)
-    // toggle between the first and second launch message block to toggle between the first and second UNIFORMs
-    // block
-    auto qpu_msg_current = qpu_msg_0;
-    auto qpu_msg_next = qpu_msg_1;
-    auto* uniformPointers_current = &uniformPointers[0];
-    auto* uniformPointers_next = &uniformPointers[1];
+        std::cout << "Running " << numBatchGroups << " of " << numGroups << " work-group(s) with a timeout of "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(timeout).count() << " us" << std::endl)
     // enable performance counters depending on whether they are configured, move to heap to be able to manually control
     // object lifetime
     std::unique_ptr<PerformanceCollector> perfCollector;
     if(args.performanceCounters)
         perfCollector.reset(new PerformanceCollector(*args.performanceCounters, args.kernel->info, numQPUs,
             group_limits[0] * group_limits[1] * group_limits[2]));
+    // The handles of the batches last executed from the two UNIFORM windows. The next batch is submitted before
+    // waiting for the current one, so (if supported by the execution mode) the QPUs never run out of work-groups.
+    std::array<ExecutionHandle, 2> results{{ExecutionHandle{true}, ExecutionHandle{true}}};
+    const bool canQueueBatches = args.system->canQueueExecutions();
     // on first execution, flush code cache
     auto start = std::chrono::high_resolution_clock::now();
-    auto result = args.system->executeQPU(static_cast<unsigned>(numQPUs),
-        std::make_pair(qpu_msg_current, AS_GPU_ADDRESS(qpu_msg_current, buffer.get())), true, timeout);
+    results[currentBatch] = args.system->executeQPUBatch(
+        static_cast<unsigned>(numQPUs), getLaunchMessages(currentBatch, numBatchGroups), true, timeout);
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION, {
         // NOTE: This disables background-execution!
-        auto success = result.waitFor();
+        auto success = results[currentBatch].waitFor();
         auto end = std::chrono::high_resolution_clock::now();
         std::cout << "Execution: " << (success ? "successful" : "failed") << " after "
                   << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
     })
 
-    while(!isWorkGroupLoopEnabled && increment_index(group_indices, group_limits, 1))
+    bool status = true;
+    while(remainingGroups > 0)
     {
-        // switch between current and next launch message and UNIFORM blocks
-        std::swap(qpu_msg_current, qpu_msg_next);
-        std::swap(uniformPointers_current, uniformPointers_next);
-        local_indices[0] = local_indices[1] = local_indices[2] = 0;
-        // re-set indices and offsets for all QPUs
-        for(cl_uint i = 0; i < numQPUs; ++i)
+        // switch between the UNIFORM windows of the current and next batch
+        currentBatch = 1 - currentBatch;
+        // the batch previously executed from this window needs to finish before its UNIFORMs can be overwritten
+        if(!results[currentBatch].waitFor())
         {
-            set_work_item_info((*uniformPointers_current)[i], args.numDimensions, args.globalOffsets, args.globalSizes,
-                args.localSizes, group_indices, local_indices, global_data,
-                AS_GPU_ADDRESS((*uniformPointers_current)[i], buffer.get()), kernel->info.uniformsUsed, mergeFactor);
-
-            increment_index(local_indices, args.localSizes, 1);
+            status = false;
+            break;
+        }
+        buffer->beginHostWrite(static_cast<uint32_t>(reinterpret_cast<char*>(uniformBlocks[currentBatch * batchSize]) -
+                                   reinterpret_cast<char*>(buffer->hostPointer)),
+            static_cast<uint32_t>(std::min(batchSize, remainingGroups) * uniformSize * sizeof(uint32_t)));
+        numBatchGroups = assignWorkGroups(currentBatch);
+        // If the execution mode cannot queue executions, the batch of the other window needs to finish first. At least
+        // the next batch was prepared while it was running.
+        if(!canQueueBatches && !results[1 - currentBatch].waitFor())
+        {
+            status = false;
+            break;
         }
-        // wait for and check previous work-group (possible asynchronous) execution
-        if(!result.waitFor())
-            return CL_OUT_OF_RESOURCES;
-        flushHostCache(*args.system, buffer, {}, {});
+        prepareDeviceAccess(*args.system, {std::make_pair(buffer.get(), false)});
         DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-            std::cout << "Running work-group " << group_indices[0] << ", " << group_indices[1] << ", "
-                      << group_indices[2] << std::endl)
+            std::cout << "Running " << numBatchGroups << " further work-group(s), " << remainingGroups
+                      << " remaining" << std::endl)
         // all following executions, don't flush cache
-        result = args.system->executeQPU(static_cast<unsigned>(numQPUs),
-            std::make_pair(qpu_msg_current, AS_GPU_ADDRESS(qpu_msg_current, buffer.get())), false, timeout);
+        results[currentBatch] = args.system->executeQPUBatch(
+            static_cast<unsigned>(numQPUs), getLaunchMessages(currentBatch, numBatchGroups), false, timeout);
         // NOTE: This disables background-execution!
         DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
-            std::cout << "Execution: " << (result.waitFor() ? "successful" : "failed") << std::endl)
+            std::cout << "Execution: " << (results[currentBatch].waitFor() ? "successful" : "failed") << std::endl)
     }
 
-    // wait for (possible asynchronous) execution before freeing the buffers
-    auto status = result.waitFor();
+    // wait for all (possibly asynchronous) executions before freeing the buffers, even if one of them failed
+    status = results[1 - currentBatch].waitFor() && status;
+    status = results[currentBatch].waitFor() && status;
     perfCollector.reset();
+    // kernels without access to the global data can't have modified it
+    if(kernel->info.uniformsUsed.getGlobalDataAddressUsed())
+        program->restoreGlobalData(*image);
 
     DEBUG_LOG(DebugLevel::KERNEL_EXECUTION, {
         // Append the buffers after the kernel execution
-        dumpMemoryState(f, kernel, args, *buffer, qpu_code, uniformPointers[0][0], false);
+        dumpMemoryState(f, kernel, args, *image, *buffer, uniformBlocks[0], false);
     })
 
     //
@@ -524,7 +494,7 @@ cl_int executeKernel(KernelExecution& args)
     //
 
     // even though the buffers are already freed when the KernelExecution event is freed, we clear the maps here,
-    // since we do not need the buffers anymore
+    // since we do not need the buffers anymore. This also makes the temporary buffers available for re-use.
     args.tmpBuffers.clear();
     args.persistentBuffers.clear();
     args.executionArguments.clear();
@@ -14,6 +14,7 @@ namespace vc4cl
      */
     class ExecutionHandle
     {
+    public:
         /**
          * Container for the different states of a kernel execution
          */
@@ -27,7 +28,6 @@ namespace vc4cl
             FAILED
         };
 
-    public:
         explicit ExecutionHandle(std::function<bool()>&& func) : func(std::move(func)), status(ExecutionState::PENDING)
         {
         }
@@ -102,16 +102,18 @@ static MemoryFlag toFlags(CacheType type)
 std::unique_ptr<DeviceBuffer> Mailbox::allocateBuffer(
     const std::shared_ptr<SystemAccess>& system, unsigned sizeInBytes, CacheType cacheType)
 {
-    // munmap requires an alignment of the system page size (4096), so we need to enforce it here
+    // mmap requires an alignment of the system page size (4096), so we need to enforce it here
     unsigned handle = memAlloc(sizeInBytes, PAGE_ALIGNMENT, toFlags(cacheType));
     if(handle != 0)
     {
         DevicePointer qpuPointer = memLock(handle);
-        void* hostPointer = mapmem(V3D::busAddressToPhysicalAddress(static_cast<unsigned>(qpuPointer)), sizeInBytes);
+        void* hostPointer = MemoryMapper::getPhysicalMemory().mapMemory(
+            V3D::busAddressToPhysicalAddress(static_cast<unsigned>(qpuPointer)), sizeInBytes);
         DEBUG_LOG(DebugLevel::MEMORY,
             std::cout << "Allocated " << sizeInBytes << " bytes of buffer: handle " << handle << ", device address "
                       << std::hex << "0x" << qpuPointer << ", host address " << hostPointer << std::dec << std::endl)
-        return std::unique_ptr<DeviceBuffer>{new DeviceBuffer(system, handle, qpuPointer, hostPointer, sizeInBytes)};
+        return std::unique_ptr<DeviceBuffer>{
+            new DeviceBuffer(system, handle, qpuPointer, hostPointer, sizeInBytes, cacheType)};
     }
     return nullptr;
 }
@@ -119,7 +121,7 @@ std::unique_ptr<DeviceBuffer> Mailbox::allocateBuffer(
 bool Mailbox::deallocateBuffer(const DeviceBuffer* buffer)
 {
     if(buffer->hostPointer != nullptr)
-        unmapmem(buffer->hostPointer, buffer->size);
+        MemoryMapper::getPhysicalMemory().unmapMemory(buffer->hostPointer, buffer->size);
     if(buffer->memHandle != 0)
     {
         if(!memUnlock(buffer->memHandle))
@@ -0,0 +1,238 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+
+#include "MemoryPool.h"
+
+#include "../common.h"
+#include "../vc4cl_config.h"
+
+#include <algorithm>
+
+using namespace vc4cl;
+
+static_assert(MemoryPool::MIN_BLOCK_SIZE >= device_config::BUFFER_ALIGNMENT,
+    "Blocks of the memory pool need to satisfy the buffer alignment");
+static_assert(MemoryPool::SLAB_SIZE % PAGE_ALIGNMENT == 0, "Slabs need to be a multiple of the page size");
+static_assert(MemoryPool::SLAB_SIZE / MemoryPool::MIN_BLOCK_SIZE <= 0xFFFF, "Block indices need to fit into 16 bits");
+
+static unsigned toSizeClass(uint32_t blockSize)
+{
+    unsigned sizeClass = 0;
+    while((MemoryPool::MIN_BLOCK_SIZE << sizeClass) < blockSize)
+        ++sizeClass;
+    return sizeClass;
+}
+
+static uint32_t toBlockSize(unsigned sizeInBytes)
+{
+    uint32_t blockSize = MemoryPool::MIN_BLOCK_SIZE;
+    while(blockSize < sizeInBytes)
+        blockSize <<= 1;
+    return blockSize;
+}
+
+static const char* toString(CacheType cacheType)
+{
+    switch(cacheType)
+    {
+    case CacheType::UNCACHED:
+        return "uncached";
+    case CacheType::HOST_CACHED:
+        return "host cached";
+    case CacheType::GPU_CACHED:
+        return "GPU cached";
+    case CacheType::BOTH_CACHED:
+        return "host and GPU cached";
+    }
+    return "unknown";
+}
+
+MemoryPool::MemoryPool(SystemAccess& system) : system(system) {}
+
+MemoryPool::~MemoryPool()
+{
+    DEBUG_LOG(DebugLevel::MEMORY, {
+        for(unsigned i = 0; i < NUM_CACHE_TYPES; ++i)
+            dumpStatistics(static_cast<CacheType>(i));
+    })
+    // Move the slabs out of the pool before freeing them, so the deallocation of the backing buffers is forwarded to
+    // the actual memory management
+    auto tmp = std::move(slabs);
+    slabs.clear();
+    for(auto& arena : arenas)
+    {
+        for(auto& sizeClass : arena)
+            sizeClass.clear();
+    }
+    tmp.clear();
+}
+
+bool MemoryPool::isPoolable(unsigned sizeInBytes)
+{
+    return sizeInBytes > 0 && sizeInBytes <= MAX_BLOCK_SIZE;
+}
+
+std::unique_ptr<DeviceBuffer> MemoryPool::allocateBuffer(
+    const std::shared_ptr<SystemAccess>& owner, unsigned sizeInBytes, CacheType cacheType)
+{
+    if(!isPoolable(sizeInBytes))
+        return nullptr;
+    std::lock_guard<std::mutex> guard(poolLock);
+    return allocateBlock(owner, sizeInBytes, cacheType);
+}
+
+void MemoryPool::allocateBuffers(const std::shared_ptr<SystemAccess>& owner, const std::vector<unsigned>& sizesInBytes,
+    CacheType cacheType, std::vector<std::unique_ptr<DeviceBuffer>>& buffers)
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    for(std::size_t i = 0; i < sizesInBytes.size(); ++i)
+    {
+        if(!buffers[i] && isPoolable(sizesInBytes[i]))
+            buffers[i] = allocateBlock(owner, sizesInBytes[i], cacheType);
+    }
+}
+
+std::unique_ptr<DeviceBuffer> MemoryPool::allocateBlock(
+    const std::shared_ptr<SystemAccess>& owner, unsigned sizeInBytes, CacheType cacheType)
+{
+    auto blockSize = toBlockSize(sizeInBytes);
+
+    auto& candidates = arenas[static_cast<unsigned>(cacheType)][toSizeClass(blockSize)];
+    auto slabIt = std::find_if(
+        candidates.begin(), candidates.end(), [](const Slab* slab) -> bool { return !slab->freeBlocks.empty(); });
+    Slab* slab = slabIt != candidates.end() ? *slabIt : allocateSlab(blockSize, cacheType);
+    if(!slab)
+        return nullptr;
+
+    auto blockIndex = slab->freeBlocks.back();
+    slab->freeBlocks.pop_back();
+    auto offset = static_cast<uint32_t>(blockIndex) * blockSize;
+    auto hostPointer = reinterpret_cast<uint8_t*>(slab->backing->hostPointer) + offset;
+    if(system.isEmulated)
+        // emulated buffers are always zero-initialized, keep this behavior for sub-allocated buffers
+        memset(hostPointer, '\0', blockSize);
+
+    auto& stats = statistics[static_cast<unsigned>(cacheType)];
+    stats.usedBytes += blockSize;
+    stats.peakUsedBytes = std::max(stats.peakUsedBytes, stats.usedBytes);
+    ++stats.numAllocations;
+
+    DevicePointer qpuPointer{static_cast<uint32_t>(slab->backing->qpuPointer) + offset};
+    DEBUG_LOG(DebugLevel::MEMORY,
+        std::cout << "Sub-allocated " << sizeInBytes << " bytes of buffer from slab: handle "
+                  << slab->backing->memHandle << ", device address " << std::hex << "0x" << qpuPointer
+                  << ", host address " << static_cast<void*>(hostPointer) << std::dec << std::endl)
+    return std::unique_ptr<DeviceBuffer>{
+        new DeviceBuffer(owner, slab->backing->memHandle, qpuPointer, hostPointer, sizeInBytes, cacheType)};
+}
+
+bool MemoryPool::deallocateBuffer(const DeviceBuffer* buffer)
+{
+    // declared before the lock, so a released slab is freed after the lock is released, since freeing the backing
+    // buffer calls back into this function
+    std::unique_ptr<Slab> releasedSlab;
+    std::lock_guard<std::mutex> guard(poolLock);
+    auto slabIt = slabs.find(buffer->memHandle);
+    if(slabIt == slabs.end() || slabIt->second->backing.get() == buffer)
+        // not allocated via this pool or the backing allocation itself
+        return false;
+    Slab* slab = slabIt->second.get();
+    auto offset = static_cast<uint32_t>(
+        reinterpret_cast<const uint8_t*>(buffer->hostPointer) - reinterpret_cast<uint8_t*>(slab->backing->hostPointer));
+    slab->freeBlocks.push_back(static_cast<uint16_t>(offset / slab->blockSize));
+    statistics[static_cast<unsigned>(slab->cacheType)].usedBytes -= slab->blockSize;
+
+    DEBUG_LOG(DebugLevel::MEMORY,
+        std::cout << "Returned " << buffer->size << " bytes of buffer to slab: handle " << buffer->memHandle
+                  << ", device address " << std::hex << "0x" << buffer->qpuPointer << ", host address "
+                  << buffer->hostPointer << std::dec << std::endl)
+
+    if(slab->isEmpty())
+    {
+        // Keep a single empty slab per size class to not re-allocate a slab for every buffer created and released in
+        // a loop, but free any additional empty slab to not hog GPU memory
+        const auto& candidates =
+            arenas[static_cast<unsigned>(slab->cacheType)][toSizeClass(slab->blockSize)];
+        auto numEmpty = std::count_if(
+            candidates.begin(), candidates.end(), [](const Slab* other) -> bool { return other->isEmpty(); });
+        if(numEmpty > 1)
+            releasedSlab = releaseSlab(slab);
+    }
+    return true;
+}
+
+MemoryPool::Statistics MemoryPool::getStatistics(CacheType cacheType) const
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    return statistics[static_cast<unsigned>(cacheType)];
+}
+
+MemoryPool::Slab* MemoryPool::allocateSlab(uint32_t blockSize, CacheType cacheType)
+{
+    // The backing allocations are owned by the pool which is owned by the system access object, so they must not hold a
+    // strong reference to it. Otherwise, the system access object would be kept alive by its own members.
+    std::shared_ptr<SystemAccess> nonOwningSystem(std::shared_ptr<SystemAccess>{}, &system);
+    auto backing = system.allocateBackendBuffer(nonOwningSystem, SLAB_SIZE, "VC4CL memory pool", cacheType);
+    if(!backing)
+    {
+        DEBUG_LOG(DebugLevel::MEMORY,
+            std::cout << "[VC4CL] Failed to allocate slab of " << SLAB_SIZE << " bytes for memory pool" << std::endl)
+        return nullptr;
+    }
+    std::unique_ptr<Slab> slab{new Slab{std::move(backing), blockSize, cacheType, {}}};
+    auto numBlocks = SLAB_SIZE / blockSize;
+    slab->freeBlocks.reserve(numBlocks);
+    // hand out the blocks in ascending order
+    for(auto i = numBlocks; i > 0; --i)
+        slab->freeBlocks.push_back(static_cast<uint16_t>(i - 1));
+
+    Slab* result = slab.get();
+    slabs.emplace(result->backing->memHandle, std::move(slab));
+    arenas[static_cast<unsigned>(cacheType)][toSizeClass(blockSize)].push_back(result);
+
+    auto& stats = statistics[static_cast<unsigned>(cacheType)];
+    ++stats.numSlabs;
+    stats.reservedBytes += SLAB_SIZE;
+    ++stats.numSlabAllocations;
+    DEBUG_LOG(DebugLevel::MEMORY, {
+        std::cout << "Allocated slab for " << numBlocks << " blocks of " << blockSize << " bytes: handle "
+                  << result->backing->memHandle << std::endl;
+        dumpStatistics(cacheType);
+    })
+    return result;
+}
+
+std::unique_ptr<MemoryPool::Slab> MemoryPool::releaseSlab(Slab* slab)
+{
+    auto& candidates = arenas[static_cast<unsigned>(slab->cacheType)][toSizeClass(slab->blockSize)];
+    candidates.erase(std::remove(candidates.begin(), candidates.end(), slab), candidates.end());
+    auto& stats = statistics[static_cast<unsigned>(slab->cacheType)];
+    --stats.numSlabs;
+    stats.reservedBytes -= SLAB_SIZE;
+    auto cacheType = slab->cacheType;
+
+    // Remove the slab from the lookup before freeing the backing buffer, so the deallocation is forwarded to the actual
+    // memory management
+    auto slabIt = slabs.find(slab->backing->memHandle);
+    auto tmp = std::move(slabIt->second);
+    slabs.erase(slabIt);
+    DEBUG_LOG(DebugLevel::MEMORY, {
+        std::cout << "Releasing empty slab: handle " << tmp->backing->memHandle << std::endl;
+        dumpStatistics(cacheType);
+    })
+    return tmp;
+}
+
+void MemoryPool::dumpStatistics(CacheType cacheType) const
+{
+    const auto& stats = statistics[static_cast<unsigned>(cacheType)];
+    if(stats.numSlabAllocations == 0)
+        return;
+    std::cout << "[VC4CL] Memory pool (" << toString(cacheType) << "): " << stats.numSlabs << " slabs with "
+              << stats.reservedBytes << " bytes, " << stats.usedBytes << " bytes used (peak " << stats.peakUsedBytes
+              << " bytes), " << stats.numAllocations << " buffer allocations served by " << stats.numSlabAllocations
+              << " slab allocations" << std::endl;
+}
@@ -0,0 +1,125 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+#ifndef VC4CL_MEMORY_POOL_H
+#define VC4CL_MEMORY_POOL_H
+
+#include "hal.h"
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace vc4cl
+{
+    /**
+     * Sub-allocator for small device buffers.
+     *
+     * Allocating a buffer via the actual memory management interface (mailbox, VCSM) requires several syscalls (e.g.
+     * allocation, locking and mapping into the host address space), which is very expensive for small buffers. This
+     * pool instead carves small buffers out of larger, long-lived backing allocations (slabs).
+     *
+     * Each slab is split into blocks of a single power-of-two size class. The slabs are managed separately per caching
+     * type, since the caching behavior is a property of the whole backing allocation. Since the slabs are page-aligned
+     * and the block sizes are at least BUFFER_ALIGNMENT bytes, all sub-allocated buffers are correctly aligned.
+     */
+    class MemoryPool
+    {
+    public:
+        // The smallest block size, also guarantees the alignment of the buffers
+        static constexpr uint32_t MIN_BLOCK_SIZE = 64;
+        // The largest buffer size to be served by the pool, larger buffers are directly allocated
+        static constexpr uint32_t MAX_BLOCK_SIZE = 16 * 1024;
+        // The size of a single backing allocation, a multiple of PAGE_ALIGNMENT
+        static constexpr uint32_t SLAB_SIZE = 16 * PAGE_ALIGNMENT;
+
+        struct Statistics
+        {
+            // the number of currently allocated slabs
+            uint32_t numSlabs = 0;
+            // the total number of bytes allocated for the slabs
+            uint32_t reservedBytes = 0;
+            // the number of bytes of the slabs handed out (including the padding to the block size)
+            uint32_t usedBytes = 0;
+            // the maximum number of bytes handed out at the same time
+            uint32_t peakUsedBytes = 0;
+            // the total number of buffers allocated via the pool
+            uint64_t numAllocations = 0;
+            // the total number of slabs allocated via the actual memory management
+            uint64_t numSlabAllocations = 0;
+        };
+
+        explicit MemoryPool(SystemAccess& system);
+        MemoryPool(const MemoryPool&) = delete;
+        MemoryPool(MemoryPool&&) = delete;
+        ~MemoryPool();
+
+        MemoryPool& operator=(const MemoryPool&) = delete;
+        MemoryPool& operator=(MemoryPool&&) = delete;
+
+        static bool isPoolable(unsigned sizeInBytes);
+
+        /*
+         * Allocates a buffer of the given size from one of the slabs, allocating a new slab if required.
+         *
+         * NOTE: The contents of the buffer are not initialized.
+         */
+        std::unique_ptr<DeviceBuffer> allocateBuffer(
+            const std::shared_ptr<SystemAccess>& owner, unsigned sizeInBytes, CacheType cacheType);
+        /*
+         * Allocates all poolable buffers of the given sizes whose entry in the output vector is not yet set, while
+         * accessing the pool only once.
+         *
+         * NOTE: The contents of the buffers are not initialized.
+         */
+        void allocateBuffers(const std::shared_ptr<SystemAccess>& owner, const std::vector<unsigned>& sizesInBytes,
+            CacheType cacheType, std::vector<std::unique_ptr<DeviceBuffer>>& buffers);
+        /*
+         * Returns the given buffer to its slab.
+         *
+         * Returns false if the buffer is not allocated via this pool.
+         */
+        bool deallocateBuffer(const DeviceBuffer* buffer);
+
+        Statistics getStatistics(CacheType cacheType) const;
+
+    private:
+        static constexpr unsigned NUM_SIZE_CLASSES = 9;
+        static constexpr unsigned NUM_CACHE_TYPES = 4;
+
+        struct Slab
+        {
+            std::unique_ptr<DeviceBuffer> backing;
+            uint32_t blockSize;
+            CacheType cacheType;
+            std::vector<uint16_t> freeBlocks;
+
+            inline bool isEmpty() const
+            {
+                return freeBlocks.size() == backing->size / blockSize;
+            }
+        };
+
+        SystemAccess& system;
+        mutable std::mutex poolLock;
+        // all slabs, accessible via the memory handle of the backing allocation
+        std::map<uint32_t, std::unique_ptr<Slab>> slabs;
+        // the slabs per caching type and size class
+        std::array<std::array<std::vector<Slab*>, NUM_SIZE_CLASSES>, NUM_CACHE_TYPES> arenas;
+        std::array<Statistics, NUM_CACHE_TYPES> statistics;
+
+        // allocates a single block, requires the pool lock to be held
+        std::unique_ptr<DeviceBuffer> allocateBlock(
+            const std::shared_ptr<SystemAccess>& owner, unsigned sizeInBytes, CacheType cacheType);
+        Slab* allocateSlab(uint32_t blockSize, CacheType cacheType);
+        // removes the slab from the pool, the caller needs to free it after releasing the lock
+        std::unique_ptr<Slab> releaseSlab(Slab* slab);
+        void dumpStatistics(CacheType cacheType) const;
+    };
+
+} /* namespace vc4cl */
+
+#endif /* VC4CL_MEMORY_POOL_H */
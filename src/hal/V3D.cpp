@@ -9,94 +9,120 @@
 #include "hal.h"
 #include "userland.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <sys/mman.h>
 #include <system_error>
+#include <thread>
 #include <unistd.h>
 
 using namespace vc4cl;
 
 static const uint32_t V3D_BASE_OFFSET = 0x00c00000;
 
-// The offsets are byte-offsets, but we need to convert them to 32-bit word offsets
-static constexpr uint32_t V3D_IDENT0 = 0x0000 / sizeof(uint32_t);
-static constexpr uint32_t V3D_IDENT1 = 0x0004 / sizeof(uint32_t);
-static constexpr uint32_t V3D_L2CACTL = 0x00020 / sizeof(uint32_t);
-static constexpr uint32_t V3D_SLCACTL = 0x00024 / sizeof(uint32_t);
-// constexpr uint32_t V3D_IDENT2 = 0x0008 / sizeof(uint32_t);
-static constexpr uint32_t V3D_QPU_RESERVATIONS0 = 0x0410 / sizeof(uint32_t);
-// constexpr uint32_t V3D_QPU_RESERVATIONS1 = 0x0414 / sizeof(uint32_t);
-static constexpr uint32_t V3D_SRQPC = 0x00430 / sizeof(uint32_t);
-static constexpr uint32_t V3D_SRQUA = 0x00434 / sizeof(uint32_t);
-static constexpr uint32_t V3D_SRQCS = 0x0043c / sizeof(uint32_t);
-static constexpr uint32_t V3D_VPMBASE = 0x00504 / sizeof(uint32_t);
-static constexpr uint32_t V3D_COUNTER_CLEAR = 0x0670 / sizeof(uint32_t);
-static constexpr uint32_t V3D_COUNTER_ENABLE = 0x0674 / sizeof(uint32_t);
-static constexpr uint32_t V3D_COUNTER_VALUE_BASE = 0x0680 / sizeof(uint32_t);
-static constexpr uint32_t V3D_COUNTER_MAPPING_BASE = 0x0684 / sizeof(uint32_t);
-static constexpr uint32_t V3D_ERRORS = 0x0F20 / sizeof(uint32_t);
-// offset between two counter-enable, two counter-value or two counter-mapping registers
-static constexpr uint32_t V3D_COUNTER_INCREMENT = 0x0008 / sizeof(uint32_t);
 static constexpr uint32_t V3D_LENGTH = ((V3D_ERRORS - V3D_IDENT0) + 16) * sizeof(uint32_t);
 
-V3D::V3D()
+// The duration to actively wait for executions with unknown runtime
+static const std::chrono::microseconds DEFAULT_SPIN_WINDOW{100};
+// The maximum expected runtime of an execution to actively wait for the whole execution
+static const std::chrono::microseconds MAX_SPIN_WINDOW{2000};
+static const std::chrono::microseconds MIN_SLEEP_DURATION{50};
+static const std::chrono::microseconds MAX_SLEEP_DURATION{4000};
+// The maximum number of different executions to remember the runtime for
+static constexpr std::size_t MAX_EXPECTED_RUNTIMES = 64;
+
+V3DRegisters::~V3DRegisters() noexcept = default;
+
+/*
+ * The actual hardware registers mapped into the host address space
+ */
+class MappedV3DRegisters final : public V3DRegisters
 {
-    bcm_host_init();
-    v3dBasePointer = static_cast<uint32_t*>(
-        mapmem(busAddressToPhysicalAddress(bcm_host_get_peripheral_address() + V3D_BASE_OFFSET), V3D_LENGTH));
-    DEBUG_LOG(DebugLevel::SYSCALL, std::cout << "[VC4CL] V3D base: " << v3dBasePointer << std::endl)
-}
+public:
+    MappedV3DRegisters()
+    {
+        bcm_host_init();
+        v3dBasePointer = static_cast<uint32_t*>(
+            mapmem(V3D::busAddressToPhysicalAddress(bcm_host_get_peripheral_address() + V3D_BASE_OFFSET), V3D_LENGTH));
+        DEBUG_LOG(DebugLevel::SYSCALL, std::cout << "[VC4CL] V3D base: " << v3dBasePointer << std::endl)
+    }
+
+    ~MappedV3DRegisters() noexcept override
+    {
+        unmapmem(v3dBasePointer, V3D_LENGTH);
+        bcm_host_deinit();
+    }
 
-V3D::~V3D()
+    uint32_t read(uint32_t wordOffset) const override
+    {
+        return v3dBasePointer[wordOffset];
+    }
+
+    void write(uint32_t wordOffset, uint32_t value) override
+    {
+        v3dBasePointer[wordOffset] = value;
+    }
+
+private:
+    uint32_t* v3dBasePointer;
+};
+
+V3D::V3D(V3DSubmissionMode mode) : V3D(std::unique_ptr<V3DRegisters>{new MappedV3DRegisters()}, mode) {}
+
+V3D::V3D(std::unique_ptr<V3DRegisters>&& registers, V3DSubmissionMode mode) :
+    registers(std::move(registers)), submissionMode(mode), isQueueInitialized(false), numQueuedPrograms(0),
+    numFinishedPrograms(0), lastCompletedCount(0), lastCodeAddress(0)
 {
-    unmapmem(v3dBasePointer, V3D_LENGTH);
-    bcm_host_deinit();
 }
 
+V3D::~V3D() = default;
+
 uint32_t V3D::getSystemInfo(const SystemInfo key) const
 {
     switch(key)
     {
     case SystemInfo::VPM_MEMORY_SIZE:
-        if((v3dBasePointer[V3D_IDENT1] >> 28) == 0)
+        if((registers->read(V3D_IDENT1) >> 28) == 0)
             // 0 => 16K
             return 16 * 1024;
-        return (v3dBasePointer[V3D_IDENT1] >> 28) * 1024;
+        return (registers->read(V3D_IDENT1) >> 28) * 1024;
     case SystemInfo::VPM_USER_MEMORY_SIZE:
         //"Contains the amount of VPM memory reserved for all user programs, in multiples of 256 bytes (4x 16-way 32-bit
         // vectors)."
-        return (v3dBasePointer[V3D_VPMBASE] & 0x1F) * 256;
+        return (registers->read(V3D_VPMBASE) & 0x1F) * 256;
     case SystemInfo::SEMAPHORES_COUNT:
         // FIXME (similar to error with QPU count), this returns 0 but should return 16
         // return (v3dBasePointer[V3D_IDENT1) >> 16) & 0xFF;
         return 16;
     case SystemInfo::SLICE_TMU_COUNT:
-        return (v3dBasePointer[V3D_IDENT1] >> 12) & 0xF;
+        return (registers->read(V3D_IDENT1) >> 12) & 0xF;
     case SystemInfo::SLICE_QPU_COUNT:
-        return (v3dBasePointer[V3D_IDENT1] >> 8) & 0xF;
+        return (registers->read(V3D_IDENT1) >> 8) & 0xF;
     case SystemInfo::SLICES_COUNT:
-        return (v3dBasePointer[V3D_IDENT1] >> 4) & 0xF;
+        return (registers->read(V3D_IDENT1) >> 4) & 0xF;
     case SystemInfo::QPU_COUNT:
         return 12;
         // FIXME somehow from time to time (e.g. every first call after reboot??) this returns 196, but why??
         // return ((*(uint32_t*)(mmap_ptr + V3D_IDENT1) >> 4) & 0xF) * ((*(uint32_t*)(mmap_ptr + V3D_IDENT1) >> 8) &
         // 0xF);
     case SystemInfo::HDR_SUPPORT:
-        return (v3dBasePointer[V3D_IDENT1] >> 24) & 0x1;
+        return (registers->read(V3D_IDENT1) >> 24) & 0x1;
     case SystemInfo::V3D_REVISION:
-        return v3dBasePointer[V3D_IDENT1] & 0xF;
+        return registers->read(V3D_IDENT1) & 0xF;
     case SystemInfo::USER_PROGRAMS_COMPLETED_COUNT:
-        return (v3dBasePointer[V3D_SRQCS] >> 16) & 0xFF;
+        return (registers->read(V3D_SRQCS) >> 16) & 0xFF;
     case SystemInfo::USER_REQUESTS_COUNT:
-        return (v3dBasePointer[V3D_SRQCS] >> 8) & 0xFF;
+        return (registers->read(V3D_SRQCS) >> 8) & 0xFF;
     case SystemInfo::PROGRAM_QUEUE_FULL:
-        return (v3dBasePointer[V3D_SRQCS] >> 7) & 0x1;
+        return (registers->read(V3D_SRQCS) >> 7) & 0x1;
     case SystemInfo::PROGRAM_QUEUE_LENGTH:
-        return v3dBasePointer[V3D_SRQCS] & 0x3F;
+        return registers->read(V3D_SRQCS) & 0x3F;
     }
     return 0;
 }
@@ -111,20 +137,20 @@ bool V3D::setCounter(uint8_t counterIndex, const CounterType type)
     // 1. enable counter
     // http://maazl.de/project/vc4asm/doc/VideoCoreIV-addendum.html states (section 10):
     //"You need to set bit 31 (allegedly reserved) to enable performance counters at all."
-    v3dBasePointer[V3D_COUNTER_ENABLE] |= (1u << 31) | (1u << counterIndex);
+    registers->write(V3D_COUNTER_ENABLE, registers->read(V3D_COUNTER_ENABLE) | (1u << 31) | (1u << counterIndex));
     // 2. set mapping
-    v3dBasePointer[V3D_COUNTER_MAPPING_BASE + counterIndex * V3D_COUNTER_INCREMENT] =
-        static_cast<uint32_t>(type) & 0x1F;
+    registers->write(
+        V3D_COUNTER_MAPPING_BASE + counterIndex * V3D_COUNTER_INCREMENT, static_cast<uint32_t>(type) & 0x1F);
     // 3. reset counter
     // TODO difference between reset here and reset in resetCounterValue??
-    v3dBasePointer[V3D_COUNTER_VALUE_BASE + counterIndex * V3D_COUNTER_INCREMENT] = 0;
+    registers->write(V3D_COUNTER_VALUE_BASE + counterIndex * V3D_COUNTER_INCREMENT, 0);
 
     return true;
 }
 
 void V3D::resetCounterValue(uint8_t counterIndex)
 {
-    v3dBasePointer[V3D_COUNTER_CLEAR] = (1 << counterIndex);
+    registers->write(V3D_COUNTER_CLEAR, 1u << counterIndex);
 }
 
 // https://github.com/jonasarrow/vc4top: "Detected by observation, if the GPU is gated, deadbeef is returned"
@@ -133,7 +159,7 @@ static const uint32_t POWEROFF_VALUE = 0xdeadbeef;
 
 int64_t V3D::getCounter(uint8_t counterIndex) const
 {
-    uint32_t val = static_cast<uint32_t>(v3dBasePointer[V3D_COUNTER_VALUE_BASE + counterIndex * V3D_COUNTER_INCREMENT]);
+    uint32_t val = registers->read(V3D_COUNTER_VALUE_BASE + counterIndex * V3D_COUNTER_INCREMENT);
     if(val == POWEROFF_VALUE)
         return static_cast<int64_t>(-1);
     return static_cast<int64_t>(val);
@@ -143,7 +169,7 @@ void V3D::disableCounter(uint8_t counterIndex)
 {
     resetCounterValue(counterIndex);
     // TODO correct?? the or?
-    v3dBasePointer[V3D_COUNTER_ENABLE] |= 0xFFFF ^ (1 << counterIndex);
+    registers->write(V3D_COUNTER_ENABLE, registers->read(V3D_COUNTER_ENABLE) | (0xFFFFu ^ (1u << counterIndex)));
 }
 
 bool V3D::setReservation(const uint8_t qpu, const QPUReservation val)
@@ -155,9 +181,9 @@ bool V3D::setReservation(const uint8_t qpu, const QPUReservation val)
     uint32_t bitOffset = (qpu % 8) * 4;
     uint32_t writeVal = (static_cast<uint8_t>(val) & 0xFu) << bitOffset;
     // clear old values
-    v3dBasePointer[V3D_QPU_RESERVATIONS0 + registerOffset] &= ~(0xFu << bitOffset);
+    uint32_t currentVal = registers->read(V3D_QPU_RESERVATIONS0 + registerOffset) & ~(0xFu << bitOffset);
     // set new values
-    v3dBasePointer[V3D_QPU_RESERVATIONS0 + registerOffset] |= writeVal;
+    registers->write(V3D_QPU_RESERVATIONS0 + registerOffset, currentVal | writeVal);
 
     return true;
 }
@@ -166,72 +192,262 @@ QPUReservation V3D::getReservation(const uint8_t qpu) const
 {
     uint32_t registerOffset = qpu / 8;
     uint32_t bitOffset = (qpu % 8) * 4;
-    uint32_t rawValue = v3dBasePointer[V3D_QPU_RESERVATIONS0 + registerOffset] >> bitOffset;
+    uint32_t rawValue = registers->read(V3D_QPU_RESERVATIONS0 + registerOffset) >> bitOffset;
     return static_cast<QPUReservation>(rawValue & 0xF);
 }
 
 bool V3D::hasError(const ErrorType type) const
 {
     // read bit
-    uint32_t val = v3dBasePointer[V3D_ERRORS] >> static_cast<uint8_t>(type);
+    uint32_t val = registers->read(V3D_ERRORS) >> static_cast<uint8_t>(type);
     // reset bit
-    v3dBasePointer[V3D_ERRORS] = 1 << static_cast<uint8_t>(type);
+    registers->write(V3D_ERRORS, 1u << static_cast<uint8_t>(type));
     return val == 1;
 }
 
+void V3D::clearCaches(const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer)
+{
+    // The UNIFORMs (and launch messages) are rewritten by the host for every submission and might still be cached from
+    // a previous submission using the same memory, so the L2 and uniforms caches always need to be cleared.
+    // The TMU caches only need to be cleared if any other host-written data might have changed since the last
+    // submission, which is indicated by the buffer-flush flag (e.g. set for the first work-group of every kernel
+    // execution).
+    uint32_t sliceCacheBits = V3D_SLCACTL_UCCS;
+    if(flushBuffer)
+        sliceCacheBits |= V3D_SLCACTL_T0CCS | V3D_SLCACTL_T1CCS;
+    // The instruction caches only need to be cleared if the executed code changed. Since a program image might be
+    // reallocated at the address of a previously freed one, we also clear them for every buffer-flush.
+    for(const auto& addresses : controlAddresses)
+    {
+        if(flushBuffer || addresses.first[1] != lastCodeAddress)
+            sliceCacheBits |= V3D_SLCACTL_ICCS;
+        lastCodeAddress = addresses.first[1];
+    }
+    registers->write(V3D_L2CACTL, V3D_L2CACTL_L2CCLR);
+    registers->write(V3D_SLCACTL, sliceCacheBits);
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+        std::cout << "Clearing V3D caches: L2, uniforms" << (flushBuffer ? ", TMU" : "")
+                  << ((sliceCacheBits & V3D_SLCACTL_ICCS) ? ", instructions" : "") << std::endl)
+}
+
 ExecutionHandle V3D::executeQPU(
     unsigned numQPUs, std::pair<uint32_t*, unsigned> addressPairs, bool flushBuffer, std::chrono::milliseconds timeout)
 {
+    if(submissionMode == V3DSubmissionMode::PIPELINED)
+        return executeQPUBatch(numQPUs, {addressPairs}, flushBuffer, timeout);
+
     // see
     // https://github.com/raspberrypi/userland/blob/master/host_applications/linux/apps/hello_pi/hello_fft/gpu_fft_base.c,
     // function gpu_fft_base_exec_direct
     // TODO interrupts?? not in Broadcom spec
     // https://vc4-notes.tumblr.com/post/125039428234/v3d-registers-not-on-videocore-iv-3d-architecture
     // see errata: https://elinux.org/VideoCore_IV_3D_Architecture_Reference_Guide_errata
-
-    // clear cache (if set)
-    // FIXME when the buffer-flush is disabled (for any consecutive execution), the updated UNIFORM-values are not used,
-    // but the old ones!
-    //-> which results in incorrect executions (except the first one)
-    // XXX can this be re-enabled, if we allocate the host-pointer (Mailbox.cpp) with direct access-mode?
-    // if(flushBuffer)
-    {
-        // clear L2 cache
-        v3dBasePointer[V3D_L2CACTL] = 1 << 2;
-        // clear uniforms and instructions caches (TMU too)
-        v3dBasePointer[V3D_SLCACTL] = 0xFFFFFFFF;
-    }
+    std::lock_guard<std::mutex> guard(queueLock);
+    clearCaches({addressPairs}, flushBuffer);
 
     // reset user program states
-    v3dBasePointer[V3D_SRQCS] = (1 << 7) | (1 << 8) | (1 << 16);
+    registers->write(V3D_SRQCS, (1 << 7) | (1 << 8) | (1 << 16));
 
     // write uniforms and instructions addresses for all QPUs
     uint32_t* addressBase = addressPairs.first;
     for(unsigned i = 0; i < numQPUs; ++i)
     {
-        v3dBasePointer[V3D_SRQUA] = addressBase[0];
-        v3dBasePointer[V3D_SRQPC] = addressBase[1];
+        registers->write(V3D_SRQUA, addressBase[0]);
+        registers->write(V3D_SRQPC, addressBase[1]);
         addressBase += 2;
     }
 
     const auto start = std::chrono::high_resolution_clock::now();
-    auto basePointer = v3dBasePointer;
-    auto checkFunc = [basePointer, numQPUs, start, timeout]() -> bool {
-        // wait for completion
-        while(true)
+    const RuntimeKey key{addressPairs.first[1], numQPUs};
+    auto checkFunc = [this, numQPUs, key, start, timeout]() -> bool {
+        return waitForCompletion(
+            [this, numQPUs]() -> bool { return ((registers->read(V3D_SRQCS) >> 16) & 0xFF) == numQPUs; }, key, start,
+            timeout);
+    };
+    return ExecutionHandle{checkFunc};
+}
+
+ExecutionHandle V3D::executeQPUBatch(unsigned numQPUs,
+    const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+    std::chrono::milliseconds timeout)
+{
+    if(controlAddresses.empty())
+        return ExecutionHandle{false};
+    if(submissionMode == V3DSubmissionMode::PIPELINED)
+        return executePipelined(numQPUs, controlAddresses, flushBuffer, timeout);
+
+    // the request queue is reset for every block, so we need to wait for every block before executing the next one
+    for(std::size_t i = 0; i + 1 < controlAddresses.size(); ++i)
+    {
+        auto result = executeQPU(numQPUs, controlAddresses[i], flushBuffer && i == 0, timeout);
+        if(!result.waitFor())
+            return ExecutionHandle{false};
+    }
+    return executeQPU(numQPUs, controlAddresses.back(), flushBuffer && controlAddresses.size() == 1, timeout);
+}
+
+uint32_t V3D::readQueueStatus()
+{
+    auto status = registers->read(V3D_SRQCS);
+    // The completed count is only 8 bit wide and wraps around. Since there are never more than (queue capacity + number
+    // of QPUs) programs queued or running, less than 256 programs can finish between two reads.
+    auto completedCount = (status >> 16) & 0xFF;
+    numFinishedPrograms += (completedCount - lastCompletedCount) & 0xFF;
+    lastCompletedCount = completedCount;
+    return status;
+}
+
+ExecutionHandle V3D::executePipelined(unsigned numQPUs,
+    const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+    std::chrono::milliseconds timeout)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::lock_guard<std::mutex> guard(queueLock);
+    clearCaches(controlAddresses, flushBuffer);
+    if(!isQueueInitialized)
+    {
+        // reset user program states once, afterwards we only track the rolling counts
+        registers->write(V3D_SRQCS, (1 << 7) | (1 << 8) | (1 << 16));
+        lastCompletedCount = 0;
+        isQueueInitialized = true;
+    }
+
+    for(const auto& addresses : controlAddresses)
+    {
+        uint32_t* addressBase = addresses.first;
+        for(unsigned i = 0; i < numQPUs; ++i)
+        {
+            // wait for a free entry in the request queue, entries are freed as soon as the QPUs start the programs
+            while((readQueueStatus() & 0x3F) >= PROGRAM_QUEUE_CAPACITY)
+            {
+                if(std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::high_resolution_clock::now() - start) > timeout)
+                {
+                    DEBUG_LOG(DebugLevel::SYSCALL,
+                        std::cout << "Timed out waiting for free entries in the user program request queue"
+                                  << std::endl)
+                    return drainAfterFailure(timeout);
+                }
+            }
+            registers->write(V3D_SRQUA, addressBase[0]);
+            registers->write(V3D_SRQPC, addressBase[1]);
+            ++numQueuedPrograms;
+            addressBase += 2;
+        }
+    }
+
+    const RuntimeKey key{controlAddresses.front().first[1], numQPUs * static_cast<uint32_t>(controlAddresses.size())};
+    auto checkFunc = [this, key, start, timeout]() -> bool {
+        return waitForCompletion([this]() -> bool { return isQueueDrained(); }, key, start, timeout);
+    };
+    return ExecutionHandle{checkFunc};
+}
+
+bool V3D::isQueueDrained()
+{
+    /*
+     * The programs might finish out of order (e.g. if they have different runtimes), so a completed count covering the
+     * number of programs of a submission does not mean that all of its programs finished. Only if the completed count
+     * reaches the number of all queued programs, there is no program left which could still be running.
+     */
+    std::lock_guard<std::mutex> guard(queueLock);
+    readQueueStatus();
+    return numFinishedPrograms >= numQueuedPrograms;
+}
+
+ExecutionHandle V3D::drainAfterFailure(std::chrono::milliseconds timeout)
+{
+    /*
+     * Some programs of the failed submission might already be queued or running and still access the UNIFORMs and
+     * launch messages. Since the caller frees these when the execution is finished, the returned handle only reports
+     * the failure after all these programs finished (or they timed out too).
+     */
+    auto drainFunc = [this, timeout]() -> bool {
+        const auto start = std::chrono::high_resolution_clock::now();
+        while(!isQueueDrained())
         {
-            if(((basePointer[V3D_SRQCS] >> 16) & 0xFF) == numQPUs)
-                return true;
             if(std::chrono::duration_cast<std::chrono::milliseconds>(
                    std::chrono::high_resolution_clock::now() - start) > timeout)
+            {
+                DEBUG_LOG(DebugLevel::SYSCALL,
+                    std::cout << "Timed out waiting for the already queued programs of a failed submission"
+                              << std::endl)
                 break;
-            // TODO sleep some time?? so CPU is not fully used for waiting
-            // e.g. sleep for the theoretical execution time of the kernel (e.g. #instructions / QPU clock) and then
-            // begin active waiting
+            }
+            std::this_thread::sleep_for(MIN_SLEEP_DURATION);
         }
         return false;
     };
-    return ExecutionHandle{checkFunc};
+    return ExecutionHandle{drainFunc};
+}
+
+std::chrono::microseconds V3D::getExpectedRuntime(uint32_t codeAddress, uint32_t numPrograms) const
+{
+    std::lock_guard<std::mutex> guard(runtimeLock);
+    auto it = expectedRuntimes.find(RuntimeKey{codeAddress, numPrograms});
+    return it != expectedRuntimes.end() ? it->second : std::chrono::microseconds{0};
+}
+
+bool V3D::waitForCompletion(const std::function<bool()>& isFinished, RuntimeKey key,
+    std::chrono::high_resolution_clock::time_point start, std::chrono::milliseconds timeout)
+{
+    using namespace std::chrono;
+    const auto expectedRuntime = getExpectedRuntime(key.first, key.second);
+    // Short executions are waited for actively to not add the latency of sleeping to their runtime. Longer (or unknown)
+    // executions are only actively waited for a short time, since the reduced latency does not matter for them.
+    auto spinWindow = DEFAULT_SPIN_WINDOW;
+    if(expectedRuntime.count() > 0 && expectedRuntime <= MAX_SPIN_WINDOW)
+        // add some margin for the variance in execution times
+        spinWindow = expectedRuntime + expectedRuntime / 4;
+    // The sleep durations are limited relative to the expected runtime to not overshoot the actual end of the
+    // execution too much
+    auto maxSleep = expectedRuntime.count() > 0 ?
+        std::max(MIN_SLEEP_DURATION, std::min(MAX_SLEEP_DURATION, expectedRuntime / 8)) :
+        MAX_SLEEP_DURATION;
+
+    auto sleepDuration = MIN_SLEEP_DURATION;
+    unsigned numSleeps = 0;
+    bool success = false;
+    while(true)
+    {
+        if(isFinished())
+        {
+            success = true;
+            break;
+        }
+        auto now = high_resolution_clock::now();
+        if(duration_cast<milliseconds>(now - start) > timeout)
+            break;
+        if(now - start > spinWindow)
+        {
+            // back off with exponentially growing sleeps, so the host CPU can be used by other threads
+            std::this_thread::sleep_for(sleepDuration);
+            sleepDuration = std::min(sleepDuration * 2, maxSleep);
+            ++numSleeps;
+        }
+    }
+
+    const auto runtime = duration_cast<microseconds>(high_resolution_clock::now() - start);
+    if(success)
+    {
+        std::lock_guard<std::mutex> guard(runtimeLock);
+        auto it = expectedRuntimes.find(key);
+        if(it != expectedRuntimes.end())
+            // smooth the learned runtime, e.g. to not overreact to single outliers
+            it->second = (it->second * 3 + runtime) / 4;
+        else
+        {
+            if(expectedRuntimes.size() >= MAX_EXPECTED_RUNTIMES)
+                expectedRuntimes.erase(expectedRuntimes.begin());
+            expectedRuntimes.emplace(key, runtime);
+        }
+    }
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+        std::cout << "QPU execution " << (success ? "finished" : "timed out") << " after " << runtime.count()
+                  << " us (expected " << expectedRuntime.count() << " us), actively waited for "
+                  << duration_cast<microseconds>(spinWindow).count() << " us, slept " << numSleeps << " times"
+                  << std::endl)
+    return success;
 }
 
 bool V3D::readValue(SystemQuery query, uint32_t& output) noexcept
@@ -263,32 +479,7 @@ uint32_t V3D::busAddressToPhysicalAddress(uint32_t busAddress)
 
 void* vc4cl::mapmem(unsigned base, unsigned size)
 {
-    // TODO this is called once to initialize V3D and every time a buffer is mapped.
-    // Can't we cache the memory fd?
-    int mem_fd;
-    unsigned offset = base % V3D::MEMORY_PAGE_SIZE;
-    base = base - offset;
-    /*
-    size = size + offset;
-    */
-    /* open /dev/mem */
-    if((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0)
-    {
-        std::cout << "[VC4CL] can't open /dev/mem" << std::endl;
-        std::cout << "[VC4CL] This program should be run as root. Try prefixing command with: sudo" << std::endl;
-        throw std::system_error(errno, std::system_category(), "Failed to open /dev/mem");
-    }
-    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED /*|MAP_FIXED*/, mem_fd, base);
-    DEBUG_LOG(DebugLevel::SYSCALL, printf("[VC4CL] base=0x%x, mem=%p\n", base, mem))
-    if(mem == MAP_FAILED)
-    {
-        std::cout << "[VC4CL] mmap error " << mem << std::endl;
-        perror("[VC4CL] Error in mapmem");
-        close(mem_fd);
-        throw std::system_error(errno, std::system_category(), "Error in mapmem");
-    }
-    close(mem_fd);
-    return reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(mem) + offset);
+    return MemoryMapper::getPhysicalMemory().mapDirect(base, size);
 }
 
 void vc4cl::unmapmem(void* addr, unsigned size)
@@ -306,3 +497,146 @@ void vc4cl::unmapmem(void* addr, unsigned size)
         throw std::system_error(errno, std::system_category(), "Error in unmapmem");
     }
 }
+
+MemoryMapper::MemoryMapper(const std::string& devicePath, int openFlags, uint32_t chunkSize) :
+    devicePath(devicePath), openFlags(openFlags), chunkSize(chunkSize), fd(-1)
+{
+}
+
+MemoryMapper::~MemoryMapper()
+{
+    for(auto& chunk : chunks)
+        munmap(chunk.second.hostBase, chunkSize);
+    for(auto& mapping : separateMappings)
+        munmap(mapping.second.first, mapping.second.second);
+    if(fd >= 0)
+    {
+        close(fd);
+        DEBUG_LOG(DebugLevel::SYSCALL,
+            std::cout << "[VC4CL] Memory file descriptor closed for " << devicePath << ": " << fd << std::endl)
+    }
+}
+
+void* MemoryMapper::mapMemory(uint32_t physicalAddress, uint32_t size)
+{
+    std::lock_guard<std::mutex> guard(mappingLock);
+    uint32_t chunkBase = physicalAddress - (physicalAddress % chunkSize);
+    if(physicalAddress - chunkBase + size > chunkSize)
+        // crosses a chunk boundary, use a separate mapping
+        return mapSeparately(physicalAddress, size);
+    auto chunkIt = chunks.find(chunkBase);
+    if(chunkIt == chunks.end())
+    {
+        if(unmappableChunks.find(chunkBase) != unmappableChunks.end())
+            return mapSeparately(physicalAddress, size);
+        auto hostBase = reinterpret_cast<uint8_t*>(mapRange(chunkBase, chunkSize, false));
+        if(hostBase == nullptr)
+        {
+            // The whole chunk might not be accessible, e.g. if it exceeds the GPU memory area and access to /dev/mem
+            // is restricted (STRICT_DEVMEM). Mapping just the memory area might still work.
+            DEBUG_LOG(DebugLevel::SYSCALL,
+                std::cout << "[VC4CL] Failed to map memory chunk at 0x" << std::hex << chunkBase << std::dec
+                          << ", falling back to separate mappings" << std::endl)
+            unmappableChunks.emplace(chunkBase);
+            return mapSeparately(physicalAddress, size);
+        }
+        chunkIt = chunks.emplace(chunkBase, Chunk{hostBase, 0}).first;
+    }
+    ++chunkIt->second.numUsers;
+    return chunkIt->second.hostBase + (physicalAddress - chunkBase);
+}
+
+void MemoryMapper::unmapMemory(void* hostPointer, uint32_t size)
+{
+    std::lock_guard<std::mutex> guard(mappingLock);
+    auto mappingIt = separateMappings.find(hostPointer);
+    if(mappingIt != separateMappings.end())
+    {
+        unmapmem(mappingIt->second.first, static_cast<unsigned>(mappingIt->second.second));
+        separateMappings.erase(mappingIt);
+        return;
+    }
+    auto address = reinterpret_cast<uint8_t*>(hostPointer);
+    auto chunkIt = std::find_if(chunks.begin(), chunks.end(), [&](const std::pair<const uint32_t, Chunk>& chunk) {
+        return address >= chunk.second.hostBase && address + size <= chunk.second.hostBase + chunkSize;
+    });
+    if(chunkIt == chunks.end() || chunkIt->second.numUsers == 0)
+        throw std::invalid_argument("Memory area to unmap is not mapped");
+    --chunkIt->second.numUsers;
+    if(chunkIt->second.numUsers == 0)
+        releaseIdleChunks();
+}
+
+void* MemoryMapper::mapDirect(uint32_t physicalAddress, uint32_t size)
+{
+    std::lock_guard<std::mutex> guard(mappingLock);
+    uint32_t offset = physicalAddress % V3D::MEMORY_PAGE_SIZE;
+    return reinterpret_cast<uint8_t*>(mapRange(physicalAddress - offset, size)) + offset;
+}
+
+std::size_t MemoryMapper::getNumMappings() const
+{
+    std::lock_guard<std::mutex> guard(mappingLock);
+    return chunks.size() + separateMappings.size();
+}
+
+MemoryMapper& MemoryMapper::getPhysicalMemory()
+{
+    static MemoryMapper physicalMemory("/dev/mem", O_RDWR | O_SYNC);
+    return physicalMemory;
+}
+
+int MemoryMapper::getFileDescriptor()
+{
+    if(fd < 0)
+    {
+        if((fd = open(devicePath.data(), openFlags)) < 0)
+        {
+            std::cout << "[VC4CL] can't open " << devicePath << std::endl;
+            std::cout << "[VC4CL] This program should be run as root. Try prefixing command with: sudo" << std::endl;
+            throw std::system_error(errno, std::system_category(), "Failed to open " + devicePath);
+        }
+        DEBUG_LOG(DebugLevel::SYSCALL,
+            std::cout << "[VC4CL] Memory file descriptor opened for " << devicePath << ": " << fd << std::endl)
+    }
+    return fd;
+}
+
+void* MemoryMapper::mapSeparately(uint32_t physicalAddress, uint32_t size)
+{
+    uint32_t offset = physicalAddress % V3D::MEMORY_PAGE_SIZE;
+    auto mapping = reinterpret_cast<uint8_t*>(mapRange(physicalAddress - offset, size + offset));
+    separateMappings.emplace(mapping + offset, std::make_pair(mapping, size + offset));
+    return mapping + offset;
+}
+
+void* MemoryMapper::mapRange(uint32_t physicalBase, std::size_t size, bool throwOnError)
+{
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED /*|MAP_FIXED*/, getFileDescriptor(),
+        static_cast<off_t>(physicalBase));
+    DEBUG_LOG(DebugLevel::SYSCALL, printf("[VC4CL] base=0x%x, size=%zu, mem=%p\n", physicalBase, size, mem))
+    if(mem == MAP_FAILED && !throwOnError)
+        return nullptr;
+    if(mem == MAP_FAILED)
+    {
+        std::cout << "[VC4CL] mmap error " << mem << std::endl;
+        perror("[VC4CL] Error in mapmem");
+        throw std::system_error(errno, std::system_category(), "Error in mapmem");
+    }
+    return mem;
+}
+
+void MemoryMapper::releaseIdleChunks()
+{
+    std::size_t numIdle = 0;
+    for(auto it = chunks.begin(); it != chunks.end();)
+    {
+        if(it->second.numUsers == 0 && ++numIdle > MAX_IDLE_CHUNKS)
+        {
+            unmapmem(it->second.hostBase, chunkSize);
+            it = chunks.erase(it);
+        }
+        else
+            ++it;
+    }
+}
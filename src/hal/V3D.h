@@ -13,8 +13,13 @@
 
 #include <chrono>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <utility>
+#include <vector>
 
 namespace vc4cl
 {
@@ -196,12 +201,77 @@ namespace vc4cl
         VPM_ALLOCATING_WHILE_BUSY = 0
     };
 
+    // The offsets are byte-offsets, but we need to convert them to 32-bit word offsets
+    static constexpr uint32_t V3D_IDENT0 = 0x0000 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_IDENT1 = 0x0004 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_L2CACTL = 0x00020 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_SLCACTL = 0x00024 / sizeof(uint32_t);
+    // constexpr uint32_t V3D_IDENT2 = 0x0008 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_QPU_RESERVATIONS0 = 0x0410 / sizeof(uint32_t);
+    // constexpr uint32_t V3D_QPU_RESERVATIONS1 = 0x0414 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_SRQPC = 0x00430 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_SRQUA = 0x00434 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_SRQCS = 0x0043c / sizeof(uint32_t);
+    static constexpr uint32_t V3D_VPMBASE = 0x00504 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_COUNTER_CLEAR = 0x0670 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_COUNTER_ENABLE = 0x0674 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_COUNTER_VALUE_BASE = 0x0680 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_COUNTER_MAPPING_BASE = 0x0684 / sizeof(uint32_t);
+    static constexpr uint32_t V3D_ERRORS = 0x0F20 / sizeof(uint32_t);
+    // offset between two counter-enable, two counter-value or two counter-mapping registers
+    static constexpr uint32_t V3D_COUNTER_INCREMENT = 0x0008 / sizeof(uint32_t);
+
+    // "L2 Cache Clear"
+    static constexpr uint32_t V3D_L2CACTL_L2CCLR = 1u << 2;
+    // the slice cache clear bits, one bit per slice for the instruction, uniforms, TMU0 and TMU1 caches
+    static constexpr uint32_t V3D_SLCACTL_ICCS = 0xFu;
+    static constexpr uint32_t V3D_SLCACTL_UCCS = 0xFu << 8;
+    static constexpr uint32_t V3D_SLCACTL_T0CCS = 0xFu << 16;
+    static constexpr uint32_t V3D_SLCACTL_T1CCS = 0xFu << 24;
+
+    /**
+     * Access to the V3D registers by their word offsets
+     *
+     * This is either the actual hardware registers mapped into the host address space, or a model of the registers,
+     * e.g. to test the user program submission without the actual hardware (see EmulatedV3DRegisters).
+     */
+    class V3DRegisters
+    {
+    public:
+        virtual ~V3DRegisters() noexcept;
+
+        virtual uint32_t read(uint32_t wordOffset) const = 0;
+        virtual void write(uint32_t wordOffset, uint32_t value) = 0;
+    };
+
+    enum class V3DSubmissionMode
+    {
+        // The user program request queue is reset for every submission and only one submission can be active at a time
+        SINGLE,
+        /*
+         * The user program request queue is kept filled across the work-groups of a submission, the completion of the
+         * submissions is tracked via the rolling completed count without resetting it.
+         */
+        PIPELINED
+    };
+
     class V3D
     {
     public:
-        V3D();
+        // The number of entries of the user program request queue
+        static constexpr uint32_t PROGRAM_QUEUE_CAPACITY = 16;
+        // The maximum number of launch message blocks submitted at once in pipelined mode
+        static constexpr unsigned MAX_BATCH_SIZE = 16;
+
+        explicit V3D(V3DSubmissionMode mode = V3DSubmissionMode::SINGLE);
+        V3D(std::unique_ptr<V3DRegisters>&& registers, V3DSubmissionMode mode);
+        V3D(const V3D&) = delete;
+        V3D(V3D&&) = delete;
         ~V3D();
 
+        V3D& operator=(const V3D&) = delete;
+        V3D& operator=(V3D&&) = delete;
+
         uint32_t getSystemInfo(SystemInfo key) const __attribute__((pure));
 
         CHECK_RETURN bool setCounter(uint8_t counterIndex, CounterType type);
@@ -216,6 +286,30 @@ namespace vc4cl
 
         CHECK_RETURN ExecutionHandle executeQPU(unsigned numQPUs, std::pair<uint32_t*, unsigned> addressPairs,
             bool flushBuffer, std::chrono::milliseconds timeout);
+        /*
+         * Executes the given launch message blocks one after the other.
+         *
+         * In pipelined mode, the user programs of all blocks are queued directly after each other, waiting only for
+         * free entries in the user program request queue. Since the programs might finish out of order, the returned
+         * handle waits for all queued programs (including the ones queued by other submissions) to finish.
+         */
+        CHECK_RETURN ExecutionHandle executeQPUBatch(unsigned numQPUs,
+            const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+            std::chrono::milliseconds timeout);
+
+        inline V3DSubmissionMode getSubmissionMode() const noexcept
+        {
+            return submissionMode;
+        }
+
+        /*
+         * Returns the learned runtime of executing the given number of user programs starting at the given code
+         * address, zero if unknown.
+         *
+         * The runtime is used to determine how long to actively wait for the completion of an execution, before backing
+         * off with sleeps.
+         */
+        std::chrono::microseconds getExpectedRuntime(uint32_t codeAddress, uint32_t numPrograms) const;
 
         static uint32_t busAddressToPhysicalAddress(uint32_t busAddress) __attribute__((const));
         static constexpr uint32_t MEMORY_PAGE_SIZE = 4 * 1024; // 4 KB
@@ -223,11 +317,117 @@ namespace vc4cl
         bool readValue(SystemQuery query, uint32_t& output) noexcept;
 
     private:
-        uint32_t* v3dBasePointer;
+        std::unique_ptr<V3DRegisters> registers;
+        const V3DSubmissionMode submissionMode;
+
+        // guards the state of the user program request queue and of the caches
+        std::mutex queueLock;
+        bool isQueueInitialized;
+        // the total number of user programs queued and finished since the initialization of the queue
+        uint64_t numQueuedPrograms;
+        uint64_t numFinishedPrograms;
+        // the last read value of the (8-bit, rolling) completed count register field
+        uint32_t lastCompletedCount;
+        // the code address of the last user program queued, to determine whether the instruction caches need to be
+        // cleared
+        uint32_t lastCodeAddress;
+
+        // the code address of the user programs and the number of programs executed
+        using RuntimeKey = std::pair<uint32_t, uint32_t>;
+        mutable std::mutex runtimeLock;
+        // the smoothed runtimes of previous executions
+        std::map<RuntimeKey, std::chrono::microseconds> expectedRuntimes;
+
+        // clears the caches required for executing the given launch messages, requires the queue lock to be held
+        void clearCaches(const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer);
+        /*
+         * Waits for the given condition to become true, first spinning for a window depending on the expected runtime
+         * and then backing off with exponentially growing sleeps.
+         *
+         * NOTE: When directly accessing the V3D registers, there is no host interrupt to wait for.
+         */
+        bool waitForCompletion(const std::function<bool()>& isFinished, RuntimeKey key,
+            std::chrono::high_resolution_clock::time_point start, std::chrono::milliseconds timeout);
+        // reads the queue status and updates the number of finished programs, requires the queue lock to be held
+        uint32_t readQueueStatus();
+        ExecutionHandle executePipelined(unsigned numQPUs,
+            const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+            std::chrono::milliseconds timeout);
+        // whether all queued programs finished
+        bool isQueueDrained();
+        // returns a failed execution handle, which waits for all queued programs to finish first
+        ExecutionHandle drainAfterFailure(std::chrono::milliseconds timeout);
     };
 
     void* mapmem(unsigned base, unsigned size);
     void unmapmem(void* addr, unsigned size);
 
+    /**
+     * Manages the mappings of physical memory (e.g. the GPU memory window) into the host address space.
+     *
+     * Instead of opening the memory device and mapping the memory for every buffer, the device file is opened once and
+     * the memory is mapped in large chunks which are shared by all buffers located within them. The host address of
+     * such a buffer is then simply calculated from the chunk base address.
+     */
+    class MemoryMapper
+    {
+    public:
+        // Physical memory is mapped in chunks of this size (and alignment)
+        static constexpr uint32_t DEFAULT_CHUNK_SIZE = 16 * 1024 * 1024;
+        // The number of chunks not used by any buffer which are kept mapped
+        static constexpr std::size_t MAX_IDLE_CHUNKS = 2;
+
+        explicit MemoryMapper(
+            const std::string& devicePath, int openFlags, uint32_t chunkSize = DEFAULT_CHUNK_SIZE);
+        MemoryMapper(const MemoryMapper&) = delete;
+        MemoryMapper(MemoryMapper&&) = delete;
+        ~MemoryMapper();
+
+        MemoryMapper& operator=(const MemoryMapper&) = delete;
+        MemoryMapper& operator=(MemoryMapper&&) = delete;
+
+        /*
+         * Returns the host address of the given physical memory area, mapping the chunk(s) containing it if required.
+         */
+        void* mapMemory(uint32_t physicalAddress, uint32_t size);
+        void unmapMemory(void* hostPointer, uint32_t size);
+
+        /*
+         * Maps the given physical memory area into a separate mapping, which is not shared and needs to be unmapped
+         * via unmapmem().
+         */
+        void* mapDirect(uint32_t physicalAddress, uint32_t size);
+
+        // Returns the number of currently active memory mappings
+        std::size_t getNumMappings() const;
+
+        // Returns the memory mapper for "/dev/mem"
+        static MemoryMapper& getPhysicalMemory();
+
+    private:
+        struct Chunk
+        {
+            uint8_t* hostBase;
+            uint32_t numUsers;
+        };
+
+        const std::string devicePath;
+        const int openFlags;
+        const uint32_t chunkSize;
+        int fd;
+        mutable std::mutex mappingLock;
+        // the mapped chunks by their physical base address
+        std::map<uint32_t, Chunk> chunks;
+        // the mappings of memory areas crossing chunk boundaries or located in unmappable chunks, by their host address
+        std::map<void*, std::pair<void*, std::size_t>> separateMappings;
+        // the physical base addresses of the chunks which could not be mapped as a whole
+        std::set<uint32_t> unmappableChunks;
+
+        int getFileDescriptor();
+        void* mapSeparately(uint32_t physicalAddress, uint32_t size);
+        void* mapRange(uint32_t physicalBase, std::size_t size, bool throwOnError = true);
+        void releaseIdleChunks();
+    };
+
 } /* namespace vc4cl */
 #endif /* VC4CL_V3D */
@@ -9,9 +9,12 @@
 #include "userland.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 
@@ -38,24 +41,53 @@ VCHI::~VCHI()
     vchi_disconnect(vchiHandle);
 }
 
-static std::atomic_uintptr_t currentJobId{0};
-static std::mutex jobStatusLock;
-std::condition_variable jobStatusCondition;
-std::atomic_bool isJobDone{false};
+namespace
+{
+    /*
+     * The completion state of a single submission, set by the callback of the last job of the submission
+     */
+    struct JobCompletion
+    {
+        std::condition_variable condition;
+        bool isDone = false;
+    };
+} // namespace
+
+// guards the table of pending submissions as well as the completion states
+static std::mutex jobTableLock;
+// the submissions not yet completed and still waited for by their job ID. The job ID (and not a pointer to the
+// completion state) is passed to the GPU service, so callbacks of submissions no longer waited for (e.g. timed out) are
+// simply ignored.
+static std::map<uintptr_t, std::shared_ptr<JobCompletion>> pendingJobs;
+static std::atomic_uintptr_t nextJobId{0};
 
 static void onJobDone(uintptr_t jobId)
 {
-    // make sure we don't e.g. update the next job if our current one timed out
-    std::lock_guard<std::mutex> guard(jobStatusLock);
-    if(currentJobId == jobId)
+    std::lock_guard<std::mutex> guard(jobTableLock);
+    auto it = pendingJobs.find(jobId);
+    if(it != pendingJobs.end())
     {
-        isJobDone = true;
-        jobStatusCondition.notify_all();
+        it->second->isDone = true;
+        it->second->condition.notify_all();
+        pendingJobs.erase(it);
     }
 }
 
+std::size_t VCHI::getNumPendingSubmissions()
+{
+    std::lock_guard<std::mutex> guard(jobTableLock);
+    return pendingJobs.size();
+}
+
 ExecutionHandle VCHI::executeQPU(unsigned numQPUs, std::pair<uint32_t*, uint32_t> controlAddress, bool flushBuffer,
     std::chrono::milliseconds timeout) const
+{
+    return executeQPUBatch(numQPUs, {controlAddress}, flushBuffer, timeout);
+}
+
+ExecutionHandle VCHI::executeQPUBatch(unsigned numQPUs,
+    const std::vector<std::pair<uint32_t*, uint32_t>>& controlAddresses, bool flushBuffer,
+    std::chrono::milliseconds timeout) const
 {
     if(timeout.count() > 0xFFFFFFFF)
     {
@@ -63,42 +95,63 @@ ExecutionHandle VCHI::executeQPU(unsigned numQPUs, std::pair<uint32_t*, uint32_t
             std::cout << "Timeout is too big, needs fit into a 32-bit integer: " << timeout.count() << std::endl)
         return ExecutionHandle{false};
     }
+    if(controlAddresses.empty() || controlAddresses.size() > MAX_BATCH_SIZE)
+    {
+        DEBUG_LOG(DebugLevel::SYSCALL,
+            std::cout << "Invalid number of jobs to submit at once: " << controlAddresses.size() << std::endl)
+        return ExecutionHandle{false};
+    }
 
+    auto jobId = ++nextJobId;
+    auto completion = std::make_shared<JobCompletion>();
     {
-        std::lock_guard<std::mutex> guard(jobStatusLock);
-        ++currentJobId;
-        isJobDone = false;
+        std::lock_guard<std::mutex> guard(jobTableLock);
+        pendingJobs.emplace(jobId, completion);
     }
 
-    gpu_job_s execJob{};
-    execJob.command = EXECUTE_QPU;
-    execJob.u.q.jobs = numQPUs;
-    execJob.u.q.noflush = !flushBuffer;
-    execJob.u.q.timeout = static_cast<uint32_t>(timeout.count());
-    uint32_t* addressBase = controlAddress.first;
-    for(unsigned i = 0; i < numQPUs; ++i)
+    std::array<gpu_job_s, MAX_BATCH_SIZE> execJobs{};
+    for(std::size_t j = 0; j < controlAddresses.size(); ++j)
     {
-        // layout is similar to V3D registers, per-QPU UNIFORM address and code address
-        execJob.u.q.control[i][0] = addressBase[0];
-        execJob.u.q.control[i][1] = addressBase[1];
-        addressBase += 2;
+        auto& execJob = execJobs[j];
+        execJob.command = EXECUTE_QPU;
+        execJob.u.q.jobs = numQPUs;
+        // the caches only need to be flushed before the first job of the batch
+        execJob.u.q.noflush = !flushBuffer || j != 0;
+        execJob.u.q.timeout = static_cast<uint32_t>(timeout.count());
+        uint32_t* addressBase = controlAddresses[j].first;
+        for(unsigned i = 0; i < numQPUs; ++i)
+        {
+            // layout is similar to V3D registers, per-QPU UNIFORM address and code address
+            execJob.u.q.control[i][0] = addressBase[0];
+            execJob.u.q.control[i][1] = addressBase[1];
+            addressBase += 2;
+        }
     }
-    execJob.callback.func = reinterpret_cast<void (*)()>(onJobDone);
-    execJob.callback.cookie = reinterpret_cast<void*>(currentJobId.load());
+    // the jobs are executed in order, so only the last job needs to notify us about the completion of the whole batch
+    auto& lastJob = execJobs[controlAddresses.size() - 1];
+    lastJob.callback.func = reinterpret_cast<void (*)()>(onJobDone);
+    lastJob.callback.cookie = reinterpret_cast<void*>(jobId);
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    if(vc_gpuserv_execute_code(1, &execJob) != 0)
+    if(vc_gpuserv_execute_code(static_cast<int>(controlAddresses.size()), execJobs.data()) != 0)
+    {
+        std::lock_guard<std::mutex> guard(jobTableLock);
+        pendingJobs.erase(jobId);
         return ExecutionHandle{false};
+    }
 
-    auto checkFunc = [start, timeout]() -> bool {
-        std::unique_lock<std::mutex> guard(jobStatusLock);
+    auto checkFunc = [start, timeout, jobId, completion]() -> bool {
+        std::unique_lock<std::mutex> guard(jobTableLock);
         // can't use wait_for here, since this function is not called immediately and putting the start to the start of
         // the function would extend our timeout
         // we need to wait a little bit longer here to allow the VPU timeout to be handled
-        jobStatusCondition.wait_until(
-            guard, start + timeout + std::chrono::seconds{1}, []() -> bool { return isJobDone; });
-        return isJobDone;
+        completion->condition.wait_until(
+            guard, start + timeout + std::chrono::seconds{1}, [&completion]() -> bool { return completion->isDone; });
+        if(!completion->isDone)
+            // ignore the completion of the timed out submission
+            pendingJobs.erase(jobId);
+        return completion->isDone;
     };
     return ExecutionHandle{std::move(checkFunc)};
 }
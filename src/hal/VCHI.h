@@ -17,14 +17,35 @@ namespace vc4cl
     class VCHI
     {
     public:
+        /*
+         * The maximum number of jobs submitted at once.
+         *
+         * All jobs of a batch are sent to the VideoCore within a single VCHIQ message, which is limited to a bit less
+         * than 4 KB.
+         */
+        static constexpr unsigned MAX_BATCH_SIZE = 16;
+
         VCHI();
         ~VCHI();
 
         CHECK_RETURN ExecutionHandle executeQPU(unsigned numQPUs, std::pair<uint32_t*, uint32_t> controlAddress,
             bool flushBuffer, std::chrono::milliseconds timeout) const;
+        /*
+         * Submits all given launch message blocks as a single batch of jobs, which are executed one after the other.
+         *
+         * The returned handle tracks the completion of the whole batch.
+         */
+        CHECK_RETURN ExecutionHandle executeQPUBatch(unsigned numQPUs,
+            const std::vector<std::pair<uint32_t*, uint32_t>>& controlAddresses, bool flushBuffer,
+            std::chrono::milliseconds timeout) const;
 
         bool readValue(SystemQuery query, uint32_t& output) noexcept;
 
+        /*
+         * Returns the number of submissions which are not yet completed and still waited for (i.e. not timed out)
+         */
+        static std::size_t getNumPendingSubmissions();
+
     private:
         opaque_vchi_instance_handle_t* vchiHandle;
         vchi_connection_t* connectionHandle;
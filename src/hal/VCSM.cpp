@@ -8,6 +8,7 @@
 
 #include "userland.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <fcntl.h>
@@ -89,7 +90,8 @@ std::unique_ptr<DeviceBuffer> VCSM::allocateBuffer(
     DEBUG_LOG(DebugLevel::MEMORY,
         std::cout << "Allocated " << sizeInBytes << " bytes of buffer: handle " << handle << ", device address "
                   << std::hex << "0x" << qpuPointer << ", host address " << hostPointer << std::dec << std::endl)
-    return std::unique_ptr<DeviceBuffer>{new DeviceBuffer(system, handle, qpuPointer, hostPointer, sizeInBytes)};
+    return std::unique_ptr<DeviceBuffer>{
+        new DeviceBuffer(system, handle, qpuPointer, hostPointer, sizeInBytes, cacheType)};
 }
 
 bool VCSM::deallocateBuffer(const DeviceBuffer* buffer)
@@ -122,18 +124,38 @@ static std::unique_ptr<vcsm_user_clean_invalid2_s, decltype(&free)> allocateInva
     return data;
 }
 
-bool VCSM::flushCPUCache(const std::vector<const DeviceBuffer*>& buffers)
+static bool executeCacheOperations(
+    const std::vector<std::pair<const DeviceBuffer*, ByteRange>>& ranges, unsigned short operation)
 {
-    auto data = allocateInvalidateCleanData(static_cast<uint8_t>(buffers.size()));
-    for(uint8_t i = 0; i < data->op_count; ++i)
+    // the number of operations per call is limited by the 8-bit operation count
+    static constexpr std::size_t MAX_OPERATIONS = 255;
+    for(std::size_t first = 0; first < ranges.size(); first += MAX_OPERATIONS)
     {
-        data->s[i].invalidate_mode = VC_SM_CACHE_OP_FLUSH;
-        data->s[i].block_count = 1;
-        data->s[i].start_address = buffers[i]->hostPointer;
-        data->s[i].block_size = buffers[i]->size;
-        data->s[i].inter_block_stride = 0;
+        auto data = allocateInvalidateCleanData(
+            static_cast<uint8_t>(std::min(ranges.size() - first, MAX_OPERATIONS)));
+        for(uint8_t i = 0; i < data->op_count; ++i)
+        {
+            const auto& range = ranges[first + i];
+            data->s[i].invalidate_mode = operation;
+            data->s[i].block_count = 1;
+            data->s[i].start_address = reinterpret_cast<uint8_t*>(range.first->hostPointer) + range.second.offset;
+            data->s[i].block_size = range.second.size;
+            data->s[i].inter_block_stride = 0;
+        }
+        if(vcsm_clean_invalid2(data.get()) != 0)
+            return false;
     }
-    return vcsm_clean_invalid2(data.get()) == 0;
+    return true;
+}
+
+bool VCSM::cleanCPUCache(const std::vector<std::pair<const DeviceBuffer*, ByteRange>>& ranges)
+{
+    return executeCacheOperations(ranges, VC_SM_CACHE_OP_CLEAN);
+}
+
+bool VCSM::invalidateCPUCache(const DeviceBuffer& buffer, ByteRange range)
+{
+    return executeCacheOperations({std::make_pair(&buffer, range)}, VC_SM_CACHE_OP_INV);
 }
 
 uint32_t VCSM::getTotalCMAMemory()
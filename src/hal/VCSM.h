@@ -23,7 +23,14 @@ namespace vc4cl
             const std::string& name, CacheType cacheType);
         bool deallocateBuffer(const DeviceBuffer* buffer);
 
-        bool flushCPUCache(const std::vector<const DeviceBuffer*>& buffers);
+        /*
+         * Cleans the host CPU cache for the given ranges of the given buffers
+         */
+        bool cleanCPUCache(const std::vector<std::pair<const DeviceBuffer*, ByteRange>>& ranges);
+        /*
+         * Invalidates the host CPU cache for the given range of the given buffer
+         */
+        bool invalidateCPUCache(const DeviceBuffer& buffer, ByteRange range);
 
         static uint32_t getTotalCMAMemory();
         bool readValue(SystemQuery query, uint32_t& output) noexcept;
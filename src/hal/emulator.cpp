@@ -15,6 +15,7 @@
 #include <algorithm>
 #include <array>
 #include <fstream>
+#include <map>
 #include <numeric>
 
 using namespace vc4cl;
@@ -78,7 +79,7 @@ static uint32_t roundToCacheLineSize(uint32_t numBytes)
 }
 
 std::unique_ptr<DeviceBuffer> vc4cl::allocateEmulatorBuffer(
-    const std::shared_ptr<SystemAccess>& system, unsigned sizeInBytes)
+    const std::shared_ptr<SystemAccess>& system, unsigned sizeInBytes, CacheType cacheType)
 {
     std::lock_guard<std::mutex> guard(memoryLock);
     // 1. allocate
@@ -97,7 +98,7 @@ std::unique_ptr<DeviceBuffer> vc4cl::allocateEmulatorBuffer(
 
     // 3. get host pointer
     auto hostPointer = it->data();
-    return std::make_unique<DeviceBuffer>(system, handle, qpuPointer, hostPointer, sizeInBytes);
+    return std::make_unique<DeviceBuffer>(system, handle, qpuPointer, hostPointer, sizeInBytes, cacheType);
 }
 
 bool vc4cl::deallocateEmulatorBuffer(const DeviceBuffer* buffer)
@@ -131,6 +132,54 @@ uint32_t vc4cl::getEmulatedSystemQuery(SystemQuery query)
     return 0;
 }
 
+/*
+ * The emulated buffers are not cached, so there is nothing to do for the cache operations. Instead, we validate the
+ * operations and coherence state transitions issued by the runtime.
+ */
+static EmulatedCacheStatistics cacheStatistics;
+static std::mutex cacheStatisticsLock;
+
+static bool isValidCacheOperation(const DeviceBuffer& buffer, ByteRange range)
+{
+    // a range needs to start at a cache line and end at a cache line or the buffer end
+    auto end = range.offset + range.size;
+    return range.size > 0 && range.offset % HostWriteTracker::CACHE_LINE_SIZE == 0 && end <= buffer.size &&
+        (end % HostWriteTracker::CACHE_LINE_SIZE == 0 || end == buffer.size);
+}
+
+bool vc4cl::emulateCacheClean(const std::vector<std::pair<const DeviceBuffer*, ByteRange>>& ranges)
+{
+    std::lock_guard<std::mutex> guard(cacheStatisticsLock);
+    for(const auto& range : ranges)
+    {
+        ++cacheStatistics.numCleanedRanges;
+        if(!isValidCacheOperation(*range.first, range.second))
+            ++cacheStatistics.numInvalidOperations;
+    }
+    return true;
+}
+
+bool vc4cl::emulateCacheInvalidate(const DeviceBuffer& buffer, ByteRange range)
+{
+    std::lock_guard<std::mutex> guard(cacheStatisticsLock);
+    ++cacheStatistics.numInvalidatedBuffers;
+    if(!isValidCacheOperation(buffer, range))
+        ++cacheStatistics.numInvalidOperations;
+    return true;
+}
+
+void vc4cl::emulateIncoherentAccess()
+{
+    std::lock_guard<std::mutex> guard(cacheStatisticsLock);
+    ++cacheStatistics.numIncoherentAccesses;
+}
+
+EmulatedCacheStatistics vc4cl::getEmulatedCacheStatistics()
+{
+    std::lock_guard<std::mutex> guard(cacheStatisticsLock);
+    return cacheStatistics;
+}
+
 #ifdef COMPILER_HEADER
 static void dumpEmulationLog(std::string&& fileName, std::wistream& logStream)
 {
@@ -169,10 +218,14 @@ bool vc4cl::emulateQPU(unsigned numQPUs, uint32_t bufferQPUAddress, std::chrono:
         // This should be the same for all executions anyway
         if(i == 0)
         {
+            // the kernel code is located in the program image, which is a different buffer than the UNIFORMs. Since we
+            // do not know the exact code size, we pass the remainder of the buffer, the emulation stops at the
+            // program end signal anyway.
             auto kernelAddress = toDevicePointer(controlPtr[i * 2 + 1]);
-            numInstructions = static_cast<uint32_t>((uniformAddresses.front() - kernelAddress) / sizeof(uint64_t));
-            kernelPtr = reinterpret_cast<uint64_t*>(buffer.data()) +
-                ((kernelAddress - (bufferIndex << INDEX_OFFSET)) / sizeof(uint64_t));
+            auto& codeBuffer = allocatedMemory.at(kernelAddress >> INDEX_OFFSET);
+            auto codeOffset = kernelAddress & ADDRESS_MASK;
+            numInstructions = static_cast<uint32_t>((codeBuffer.size() - codeOffset) / sizeof(uint64_t));
+            kernelPtr = reinterpret_cast<uint64_t*>(codeBuffer.data()) + (codeOffset / sizeof(uint64_t));
         }
     }
 
@@ -208,3 +261,133 @@ bool vc4cl::emulateQPU(unsigned numQPUs, uint32_t bufferQPUAddress, std::chrono:
     return false;
 #endif
 }
+
+// VPM size of 12 KB, HDR support, 16 semaphores, 2 TMUs and 4 QPUs per slice, 3 slices and revision 2
+static constexpr uint32_t EMULATED_IDENT1 = 0xC1102432;
+// the number of QPUs according to the identification register above
+static constexpr uint32_t EMULATED_NUM_QPUS = 12;
+
+EmulatedV3DRegisters::EmulatedV3DRegisters(bool completeOnStatusRead) :
+    completeOnStatusRead(completeOnStatusRead), requestCount(0), completedCount(0), hasQueueError(false),
+    nextUniformAddress(0)
+{
+    values[V3D_IDENT1] = EMULATED_IDENT1;
+}
+
+EmulatedV3DRegisters::~EmulatedV3DRegisters() noexcept = default;
+
+uint32_t EmulatedV3DRegisters::read(uint32_t wordOffset) const
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    if(wordOffset == V3D_SRQCS)
+    {
+        if(completeOnStatusRead)
+            completeQueuedPrograms(1);
+        return ((completedCount & 0xFF) << 16) | ((requestCount & 0xFF) << 8) | (hasQueueError ? 1u << 7 : 0u) |
+            (static_cast<uint32_t>(programQueue.size()) & 0x3F);
+    }
+    auto it = values.find(wordOffset);
+    return it != values.end() ? it->second : 0;
+}
+
+void EmulatedV3DRegisters::write(uint32_t wordOffset, uint32_t value)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    switch(wordOffset)
+    {
+    case V3D_SRQCS:
+        // the bits are "write 1 to clear"
+        if(value & (1u << 7))
+            hasQueueError = false;
+        if(value & (1u << 8))
+            requestCount = 0;
+        if(value & (1u << 16))
+            completedCount = 0;
+        if(value & ((1u << 8) | (1u << 16)))
+            ++statistics.numCountResets;
+        break;
+    case V3D_SRQUA:
+        nextUniformAddress = value;
+        break;
+    case V3D_SRQPC:
+        // writing the program address queues the program
+        if(programQueue.size() >= V3D::PROGRAM_QUEUE_CAPACITY)
+        {
+            hasQueueError = true;
+            ++statistics.numQueueOverflows;
+            break;
+        }
+        programQueue.push_back(UserProgram{nextUniformAddress, value});
+        ++requestCount;
+        ++statistics.numQueuedPrograms;
+        statistics.maxQueueLength =
+            std::max(statistics.maxQueueLength, static_cast<uint32_t>(programQueue.size()));
+        break;
+    default:
+        values[wordOffset] = value;
+        writtenValues[wordOffset].push_back(value);
+    }
+}
+
+uint32_t EmulatedV3DRegisters::completePrograms(uint32_t numPrograms)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    return completeQueuedPrograms(numPrograms);
+}
+
+uint32_t EmulatedV3DRegisters::startPrograms(uint32_t numPrograms)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    uint32_t numStarted = 0;
+    while(numStarted < numPrograms && !programQueue.empty() && runningPrograms.size() < EMULATED_NUM_QPUS)
+    {
+        runningPrograms.push_back(programQueue.front());
+        programQueue.pop_front();
+        ++numStarted;
+    }
+    return numStarted;
+}
+
+bool EmulatedV3DRegisters::completeProgram(uint32_t uniformAddress)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    auto it = std::find_if(runningPrograms.begin(), runningPrograms.end(),
+        [uniformAddress](const UserProgram& program) -> bool { return program.uniformAddress == uniformAddress; });
+    if(it == runningPrograms.end())
+        return false;
+    runningPrograms.erase(it);
+    ++completedCount;
+    ++statistics.numCompletedPrograms;
+    return true;
+}
+
+EmulatedV3DRegisters::Statistics EmulatedV3DRegisters::getStatistics() const
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    return statistics;
+}
+
+std::vector<uint32_t> EmulatedV3DRegisters::takeWrittenValues(uint32_t wordOffset)
+{
+    std::lock_guard<std::mutex> guard(registerLock);
+    std::vector<uint32_t> result;
+    std::swap(result, writtenValues[wordOffset]);
+    return result;
+}
+
+uint32_t EmulatedV3DRegisters::completeQueuedPrograms(uint32_t numPrograms) const
+{
+    uint32_t numCompleted = 0;
+    while(numCompleted < numPrograms && !(runningPrograms.empty() && programQueue.empty()))
+    {
+        // the already started programs were submitted before the still queued ones
+        if(!runningPrograms.empty())
+            runningPrograms.pop_front();
+        else
+            programQueue.pop_front();
+        ++completedCount;
+        ++statistics.numCompletedPrograms;
+        ++numCompleted;
+    }
+    return numCompleted;
+}
@@ -7,19 +7,124 @@
 #ifndef VC4CL_EMULATOR
 #define VC4CL_EMULATOR
 
+#include "V3D.h"
 #include "hal.h"
 
+#include <deque>
+#include <map>
+#include <mutex>
+
 namespace vc4cl
 {
     uint32_t getTotalEmulatedMemory();
     std::unique_ptr<DeviceBuffer> allocateEmulatorBuffer(
-        const std::shared_ptr<SystemAccess>& system, unsigned sizeInBytes);
+        const std::shared_ptr<SystemAccess>& system, unsigned sizeInBytes, CacheType cacheType);
     bool deallocateEmulatorBuffer(const DeviceBuffer* buffer);
 
     uint32_t getEmulatedSystemQuery(SystemQuery query);
 
+    /*
+     * Statistics of the emulated host CPU cache maintenance, allows the tests to validate the coherence state
+     * transitions of the device buffers
+     */
+    struct EmulatedCacheStatistics
+    {
+        // the number of ranges cleaned from the host CPU cache
+        uint32_t numCleanedRanges = 0;
+        // the number of buffers (or ranges of buffers) invalidated in the host CPU cache
+        uint32_t numInvalidatedBuffers = 0;
+        // the number of cache operations which are not aligned to the cache lines or exceed their buffer
+        uint32_t numInvalidOperations = 0;
+        // the number of GPU accesses to buffers with host writes not yet cleaned from the host CPU cache
+        uint32_t numIncoherentAccesses = 0;
+    };
+
+    bool emulateCacheClean(const std::vector<std::pair<const DeviceBuffer*, ByteRange>>& ranges);
+    bool emulateCacheInvalidate(const DeviceBuffer& buffer, ByteRange range);
+    void emulateIncoherentAccess();
+    EmulatedCacheStatistics getEmulatedCacheStatistics();
+
     bool emulateQPU(unsigned numQPUs, uint32_t bufferQPUAddress, std::chrono::milliseconds timeout);
 
+    /*
+     * Register-level model of the V3D registers used for the direct execution of user programs, allows to test the
+     * user program submission without the actual hardware.
+     *
+     * The user program request queue is modeled with its hardware capacity of 16 entries as well as the 8-bit rolling
+     * request and completed counts and the queue error flag. The queued programs are not actually executed, they are
+     * completed either on request or (if enabled) one on every read of the queue status register, emulating the
+     * progress of the QPUs while the host polls the status. To emulate programs with different runtimes, programs can
+     * also be started explicitly and then completed in any order. All other registers simply store the values written.
+     */
+    class EmulatedV3DRegisters final : public V3DRegisters
+    {
+    public:
+        struct Statistics
+        {
+            // the total number of programs queued
+            uint32_t numQueuedPrograms = 0;
+            // the total number of programs completed
+            uint32_t numCompletedPrograms = 0;
+            // the maximum number of programs in the queue at the same time
+            uint32_t maxQueueLength = 0;
+            // the number of programs dropped, since they were written while the queue was full
+            uint32_t numQueueOverflows = 0;
+            // the number of resets of the request or completed count
+            uint32_t numCountResets = 0;
+        };
+
+        explicit EmulatedV3DRegisters(bool completeOnStatusRead = true);
+        ~EmulatedV3DRegisters() noexcept override;
+
+        uint32_t read(uint32_t wordOffset) const override;
+        void write(uint32_t wordOffset, uint32_t value) override;
+
+        /*
+         * Completes up to the given number of started and queued programs in order of submission, returns the number of
+         * completed programs
+         */
+        uint32_t completePrograms(uint32_t numPrograms);
+        /*
+         * Starts up to the given number of queued programs (limited by the number of QPUs) without completing them,
+         * which frees their entries in the request queue. Returns the number of started programs.
+         */
+        uint32_t startPrograms(uint32_t numPrograms);
+        /*
+         * Completes the started program with the given UNIFORM address, regardless of the order of submission.
+         *
+         * Returns whether such a program was running.
+         */
+        bool completeProgram(uint32_t uniformAddress);
+        Statistics getStatistics() const;
+        /*
+         * Returns all values written to the given register since the last call, e.g. to check the cache clear bits
+         */
+        std::vector<uint32_t> takeWrittenValues(uint32_t wordOffset);
+
+    private:
+        struct UserProgram
+        {
+            uint32_t uniformAddress;
+            uint32_t codeAddress;
+        };
+
+        const bool completeOnStatusRead;
+        mutable std::mutex registerLock;
+        mutable std::deque<UserProgram> programQueue;
+        // the programs started, but not yet completed, in order of submission
+        mutable std::deque<UserProgram> runningPrograms;
+        mutable uint32_t requestCount;
+        mutable uint32_t completedCount;
+        mutable bool hasQueueError;
+        mutable Statistics statistics;
+        uint32_t nextUniformAddress;
+        std::map<uint32_t, uint32_t> values;
+        std::map<uint32_t, std::vector<uint32_t>> writtenValues;
+
+        // requires the register lock to be held
+        uint32_t completeQueuedPrograms(uint32_t numPrograms) const;
+    };
+
 } /* namespace vc4cl */
 
 #endif /* VC4CL_EMULATOR */
@@ -7,6 +7,7 @@
 #include "hal.h"
 
 #include "Mailbox.h"
+#include "MemoryPool.h"
 #include "V3D.h"
 #include "VCHI.h"
 #ifndef NO_VCSM
@@ -15,7 +16,10 @@
 #include "emulator.h"
 #include "userland.h"
 
+#include "../vc4cl_config.h"
+
 #include <cstdlib>
+#include <iterator>
 #include <unistd.h>
 
 using namespace vc4cl;
@@ -86,6 +90,64 @@ static std::pair<bool, CacheType> getForcedCacheType()
     return std::make_pair(false, CacheType::UNCACHED);
 }
 
+static std::chrono::milliseconds getQueryCacheDuration()
+{
+    auto envvar = std::getenv("VC4CL_QUERY_CACHE_TIME");
+    if(!envvar)
+        // by default, cache dynamic values for a short time, long enough to not query them multiple times per API call
+        return std::chrono::milliseconds{100};
+    std::string env(envvar);
+    auto start = env.find_first_of("0123456789");
+    if(start != std::string::npos)
+        return std::chrono::milliseconds{strtoul(env.data() + start, nullptr, 0)};
+    return std::chrono::milliseconds{0};
+}
+
+static bool isStaticQuery(SystemQuery query)
+{
+    switch(query)
+    {
+    case SystemQuery::CURRENT_QPU_CLOCK_RATE_IN_HZ:
+    case SystemQuery::CURRENT_ARM_CLOCK_RATE_IN_HZ:
+    case SystemQuery::QPU_TEMPERATURE_IN_MILLI_DEGREES:
+        return false;
+    case SystemQuery::NUM_QPUS:
+    case SystemQuery::TOTAL_GPU_MEMORY_IN_BYTES:
+    case SystemQuery::TOTAL_ARM_MEMORY_IN_BYTES:
+    case SystemQuery::MAXIMUM_QPU_CLOCK_RATE_IN_HZ:
+    case SystemQuery::MAXIMUM_ARM_CLOCK_RATE_IN_HZ:
+    case SystemQuery::TOTAL_VPM_MEMORY_IN_BYTES:
+        return true;
+    }
+    return false;
+}
+
+static const char* toString(SystemQuery query)
+{
+    switch(query)
+    {
+    case SystemQuery::NUM_QPUS:
+        return "number of QPUs";
+    case SystemQuery::TOTAL_GPU_MEMORY_IN_BYTES:
+        return "total GPU memory (in bytes)";
+    case SystemQuery::TOTAL_ARM_MEMORY_IN_BYTES:
+        return "total ARM memory (in bytes)";
+    case SystemQuery::CURRENT_QPU_CLOCK_RATE_IN_HZ:
+        return "current QPU clock rate (in Hz)";
+    case SystemQuery::MAXIMUM_QPU_CLOCK_RATE_IN_HZ:
+        return "maximum QPU clock rate (in Hz)";
+    case SystemQuery::CURRENT_ARM_CLOCK_RATE_IN_HZ:
+        return "current ARM clock rate (in Hz)";
+    case SystemQuery::MAXIMUM_ARM_CLOCK_RATE_IN_HZ:
+        return "maximum ARM clock rate (in Hz)";
+    case SystemQuery::QPU_TEMPERATURE_IN_MILLI_DEGREES:
+        return "QPU temperature (in milli degrees)";
+    case SystemQuery::TOTAL_VPM_MEMORY_IN_BYTES:
+        return "total VPM memory (in bytes)";
+    }
+    return "unknown";
+}
+
 static std::unique_ptr<Mailbox> initializeMailbox(bool isEmulated, ExecutionMode execMode, MemoryManagement memoryMode)
 {
     if(isEmulated || std::getenv("VC4CL_NO_MAILBOX"))
@@ -105,7 +167,11 @@ static std::unique_ptr<V3D> initializeV3D(bool isEmulated, ExecutionMode execMod
 
     if(isDebugModeEnabled(DebugLevel::PERFORMANCE_COUNTERS) || execMode == ExecutionMode::V3D_REGISTER_POKING ||
         isRoot() /* we are root (or at least have root rights), so we can access the registers */)
-        return std::unique_ptr<V3D>(new V3D());
+    {
+        auto submissionMode = std::getenv("VC4CL_V3D_PIPELINED_SUBMISSION") ? V3DSubmissionMode::PIPELINED :
+                                                                               V3DSubmissionMode::SINGLE;
+        return std::unique_ptr<V3D>(new V3D(submissionMode));
+    }
 
     // by default, do not activate, since it requires root access
     return nullptr;
@@ -124,6 +190,14 @@ static std::unique_ptr<VCSM> initializeVCSM(bool isEmulated, MemoryManagement me
 }
 #endif
 
+static std::unique_ptr<MemoryPool> initializeMemoryPool(SystemAccess& system)
+{
+    if(std::getenv("VC4CL_NO_MEMORY_POOL"))
+        // explicitly disabled
+        return nullptr;
+    return std::unique_ptr<MemoryPool>{new MemoryPool(system)};
+}
+
 static std::unique_ptr<VCHI> initializeVCHI(bool isEmulated, ExecutionMode execMode)
 {
     if(isEmulated || std::getenv("VC4CL_NO_VCHI"))
@@ -139,13 +213,13 @@ SystemAccess::SystemAccess() :
     isEmulated(getEmulated()), 
     executionMode(getExecMode()), 
     memoryManagement(getMemoryMode()),	
-    forcedCacheType(getForcedCacheType()), 
+    forcedCacheType(getForcedCacheType()), queryCacheDuration(getQueryCacheDuration()),
     mailbox(initializeMailbox(isEmulated, executionMode, memoryManagement)),
     v3d(initializeV3D(isEmulated, executionMode)), 
     #ifndef NO_VCSM
     vcsm(initializeVCSM(isEmulated, memoryManagement)),
     #endif
-    vchi(initializeVCHI(isEmulated, executionMode))
+    vchi(initializeVCHI(isEmulated, executionMode)), memoryPool(initializeMemoryPool(*this))
 {
     if(isEmulated)
         DEBUG_LOG(DebugLevel::SYSTEM_ACCESS, std::cout << "[VC4CL] Using emulated system accesses " << std::endl)
@@ -173,6 +247,10 @@ SystemAccess::SystemAccess() :
         DEBUG_LOG(DebugLevel::SYSTEM_ACCESS,
             std::cout << "[VC4CL] Using VCHI for: "
                       << (executionMode == ExecutionMode::VCHI_GPU_SERVICE ? "kernel execution" : "") << std::endl)
+    if(memoryPool)
+        DEBUG_LOG(DebugLevel::SYSTEM_ACCESS,
+            std::cout << "[VC4CL] Using memory pool for buffers of up to " << MemoryPool::MAX_BLOCK_SIZE << " bytes"
+                      << std::endl)
 
     if(forcedCacheType.first)
     {
@@ -195,6 +273,9 @@ SystemAccess::SystemAccess() :
         DEBUG_LOG(
             DebugLevel::SYSTEM_ACCESS, std::cout << "[VC4CL] Forcing memory caching type: " << cacheType << std::endl)
     }
+    DEBUG_LOG(DebugLevel::SYSTEM_ACCESS,
+        std::cout << "[VC4CL] Caching dynamic system query values for " << queryCacheDuration.count() << " ms"
+                  << std::endl)
 }
 
 uint32_t SystemAccess::getTotalVPMMemory()
@@ -209,20 +290,48 @@ uint32_t SystemAccess::getTotalVPMMemory()
 
 uint32_t SystemAccess::querySystem(SystemQuery query, uint32_t defaultValue)
 {
+    std::lock_guard<std::mutex> guard(queryCacheLock);
+    auto& entry = queryCache[static_cast<unsigned>(query)];
+    auto now = std::chrono::steady_clock::now();
+    bool isStatic = isStaticQuery(query);
+    if(entry.isCached && (isStatic || now - entry.timestamp < queryCacheDuration))
+        return entry.isValid ? entry.value : defaultValue;
+
     uint32_t value = defaultValue;
+    entry.isValid = queryInterfaces(query, value);
+    entry.value = value;
+    entry.timestamp = now;
+    entry.isCached = true;
+    DEBUG_LOG(DebugLevel::SYSTEM_ACCESS, {
+        std::cout << "[VC4CL] Cached system query '" << toString(query) << "': ";
+        if(entry.isValid)
+            std::cout << value << " ("
+                      << (isStatic ? std::string("static") : std::to_string(queryCacheDuration.count()) + " ms") << ")";
+        else
+            std::cout << "not supported, using default " << defaultValue;
+        std::cout << std::endl;
+    })
+    return value;
+}
+
+bool SystemAccess::queryInterfaces(SystemQuery query, uint32_t& value)
+{
     if(isEmulated)
-        return getEmulatedSystemQuery(query);
+    {
+        value = getEmulatedSystemQuery(query);
+        return true;
+    }
     #ifndef NO_VCSM
     if(vcsm && vcsm->readValue(query, value))
-        return value;
+        return true;
     #endif
     if(v3d && v3d->readValue(query, value))
-        return value;
+        return true;
     if(vchi && vchi->readValue(query, value))
-        return value;
+        return true;
     if(mailbox && mailbox->readValue(query, value))
-        return value;
-    return defaultValue;
+        return true;
+    return false;
 }
 
 std::string SystemAccess::getModelType()
@@ -294,16 +403,81 @@ std::string SystemAccess::getProcessorType()
 std::unique_ptr<DeviceBuffer> SystemAccess::allocateBuffer(
     unsigned sizeInBytes, const std::string& name, CacheType cacheType)
 {
-    if(isEmulated)
-        return allocateEmulatorBuffer(shared_from_this(), sizeInBytes);
     auto effectiveCacheType = forcedCacheType.first ? forcedCacheType.second : cacheType;
-    #ifndef NO_VCSM
-    if(vcsm && (memoryManagement == MemoryManagement::VCSM || memoryManagement == MemoryManagement::VCSM_CMA))
-        return vcsm->allocateBuffer(shared_from_this(), sizeInBytes, name, effectiveCacheType);
-    #endif
-    if(mailbox && memoryManagement == MemoryManagement::MAILBOX)
-        return mailbox->allocateBuffer(shared_from_this(), sizeInBytes, effectiveCacheType);
-    return nullptr;
+    if(memoryPool && MemoryPool::isPoolable(sizeInBytes))
+    {
+        if(auto buffer = memoryPool->allocateBuffer(shared_from_this(), sizeInBytes, effectiveCacheType))
+            return buffer;
+        // fall back to allocating the buffer directly
+    }
+    return allocateBackendBuffer(shared_from_this(), sizeInBytes, name, effectiveCacheType);
+}
+
+std::vector<std::unique_ptr<DeviceBuffer>> SystemAccess::allocateBuffers(
+    const std::vector<unsigned>& sizesInBytes, const std::string& name, CacheType cacheType)
+{
+    auto effectiveCacheType = forcedCacheType.first ? forcedCacheType.second : cacheType;
+    std::vector<std::unique_ptr<DeviceBuffer>> buffers(sizesInBytes.size());
+    if(memoryPool)
+        memoryPool->allocateBuffers(shared_from_this(), sizesInBytes, effectiveCacheType, buffers);
+    for(std::size_t i = 0; i < sizesInBytes.size(); ++i)
+    {
+        // allocate the buffers not served by the pool directly
+        if(!buffers[i])
+            buffers[i] = allocateBackendBuffer(shared_from_this(), sizesInBytes[i], name, effectiveCacheType);
+    }
+    return buffers;
+}
+
+std::shared_ptr<DeviceBuffer> SystemAccess::importHostBuffer(void* hostPointer, unsigned sizeInBytes, uint32_t& offset)
+{
+    /*
+     * We do not import arbitrary host memory (e.g. heap memory), since the GPU can only access it after moving the
+     * pages into (physically contiguous) GPU memory and re-mapping them, which cannot be done atomically and changes
+     * the semantics of the application memory, e.g. on fork(). The host mappings of our own device buffers on the other
+     * hand are already pinned for the GPU, so we can simply share them.
+     */
+    std::shared_ptr<DeviceBuffer> buffer;
+    std::string reason;
+    auto start = reinterpret_cast<uintptr_t>(hostPointer);
+    {
+        std::lock_guard<std::mutex> guard(hostBuffersLock);
+        // the last device buffer starting at or before the host memory is the only one which can contain it
+        auto it = hostBuffers.upper_bound(start);
+        if(it != hostBuffers.begin())
+            buffer = std::prev(it)->second.lock();
+    }
+    if(!buffer || start + sizeInBytes > reinterpret_cast<uintptr_t>(buffer->hostPointer) + buffer->size)
+    {
+        buffer.reset();
+        reason = "host memory is not owned by the runtime";
+    }
+    else if((start - reinterpret_cast<uintptr_t>(buffer->hostPointer)) % device_config::BUFFER_ALIGNMENT != 0)
+    {
+        buffer.reset();
+        reason = "host memory is not aligned to the device buffer alignment";
+    }
+    else
+        offset = static_cast<uint32_t>(start - reinterpret_cast<uintptr_t>(buffer->hostPointer));
+
+    DEBUG_LOG(DebugLevel::MEMORY, {
+        if(buffer)
+            std::cout << "Imported " << sizeInBytes << " bytes of host memory at " << hostPointer
+                      << " without copying: handle " << buffer->memHandle << ", device address " << std::hex
+                      << buffer->qpuPointer << std::dec << " + " << offset << std::endl;
+        else
+            std::cout << "Cannot import " << sizeInBytes << " bytes of host memory at " << hostPointer << " ("
+                      << reason << "), falling back to copying" << std::endl;
+    })
+    return buffer;
+}
+
+void SystemAccess::registerHostBuffer(const std::shared_ptr<DeviceBuffer>& buffer)
+{
+    if(!buffer || !buffer->hostPointer)
+        return;
+    std::lock_guard<std::mutex> guard(hostBuffersLock);
+    hostBuffers[reinterpret_cast<uintptr_t>(buffer->hostPointer)] = buffer;
 }
 
 std::unique_ptr<DeviceBuffer> SystemAccess::allocateGPUOnlyBuffer(
@@ -314,8 +488,17 @@ std::unique_ptr<DeviceBuffer> SystemAccess::allocateGPUOnlyBuffer(
 
 bool SystemAccess::deallocateBuffer(const DeviceBuffer* buffer)
 {
+    {
+        std::lock_guard<std::mutex> guard(hostBuffersLock);
+        auto it = hostBuffers.find(reinterpret_cast<uintptr_t>(buffer->hostPointer));
+        // the buffer is only registered as long as it is alive
+        if(it != hostBuffers.end() && it->second.expired())
+            hostBuffers.erase(it);
+    }
+    if(memoryPool && memoryPool->deallocateBuffer(buffer))
+        return true;
     if(isEmulated)
-        deallocateEmulatorBuffer(buffer);
+        return deallocateEmulatorBuffer(buffer);
     #ifndef NO_VCSM	
     if(vcsm && (memoryManagement == MemoryManagement::VCSM || memoryManagement == MemoryManagement::VCSM_CMA))
         return vcsm->deallocateBuffer(buffer);
@@ -325,13 +508,83 @@ bool SystemAccess::deallocateBuffer(const DeviceBuffer* buffer)
     return false;
 }
 
-bool SystemAccess::flushCPUCache(const std::vector<const DeviceBuffer*>& buffers)
+std::unique_ptr<DeviceBuffer> SystemAccess::allocateBackendBuffer(
+    const std::shared_ptr<SystemAccess>& owner, unsigned sizeInBytes, const std::string& name, CacheType cacheType)
 {
+    if(isEmulated)
+        return allocateEmulatorBuffer(owner, sizeInBytes, cacheType);
     #ifndef NO_VCSM
     if(vcsm && (memoryManagement == MemoryManagement::VCSM || memoryManagement == MemoryManagement::VCSM_CMA))
-        return vcsm->flushCPUCache(buffers);
+        return vcsm->allocateBuffer(owner, sizeInBytes, name, cacheType);
     #endif
-    return false;
+    if(mailbox && memoryManagement == MemoryManagement::MAILBOX)
+        return mailbox->allocateBuffer(owner, sizeInBytes, cacheType);
+    return nullptr;
+}
+
+/*
+ * NOTE: The memory allocated via the mailbox is mapped via /dev/mem with O_SYNC and therefore not cached by the host,
+ * so it never requires any host CPU cache maintenance.
+ */
+bool SystemAccess::cleanCPUCache(const std::vector<const DeviceBuffer*>& buffers)
+{
+    // only the ranges written by the host since the last clean need to be cleaned
+    std::vector<std::pair<const DeviceBuffer*, ByteRange>> ranges;
+    for(auto buffer : buffers)
+    {
+        if(!buffer || !buffer->hostPointer)
+            continue;
+        auto writtenRanges = buffer->takeHostWrites();
+        if(!isHostCached(buffer->cacheType))
+            // the host writes to uncached memory are not held back in the host CPU cache
+            continue;
+        for(const auto& range : writtenRanges)
+            ranges.emplace_back(buffer, range);
+    }
+    if(ranges.empty())
+        // none of the buffers was written by the host since it was last cleaned
+        return true;
+    if(isEmulated)
+        return emulateCacheClean(ranges);
+    #ifndef NO_VCSM
+    if(vcsm && (memoryManagement == MemoryManagement::VCSM || memoryManagement == MemoryManagement::VCSM_CMA))
+    {
+        if(vcsm->cleanCPUCache(ranges))
+            return true;
+        // keep the ranges to be cleaned again with the next clean
+        for(const auto& range : ranges)
+            range.first->beginHostWrite(range.second.offset, range.second.size);
+        return false;
+    }
+    #endif
+    return true;
+}
+
+bool SystemAccess::invalidateCPUCache(const DeviceBuffer& buffer)
+{
+    return invalidateCPUCache(buffer, ByteRange{0, buffer.size});
+}
+
+bool SystemAccess::invalidateCPUCache(const DeviceBuffer& buffer, ByteRange range)
+{
+    if(!buffer.hostPointer || !isHostCached(buffer.cacheType))
+        return true;
+    if(isEmulated)
+        return emulateCacheInvalidate(buffer, range);
+    #ifndef NO_VCSM
+    if(vcsm && (memoryManagement == MemoryManagement::VCSM || memoryManagement == MemoryManagement::VCSM_CMA))
+        return vcsm->invalidateCPUCache(buffer, range);
+    #endif
+    return true;
+}
+
+void SystemAccess::reportIncoherentAccess(const DeviceBuffer& buffer)
+{
+    if(isEmulated)
+        emulateIncoherentAccess();
+    DEBUG_LOG(DebugLevel::MEMORY,
+        std::cout << "Device access to buffer " << buffer.qpuPointer
+                  << " with host writes not cleaned from the host CPU cache" << std::endl)
 }
 
 ExecutionHandle SystemAccess::executeQPU(unsigned numQPUs, std::pair<uint32_t*, unsigned> controlAddress,
@@ -348,6 +601,50 @@ ExecutionHandle SystemAccess::executeQPU(unsigned numQPUs, std::pair<uint32_t*,
     return ExecutionHandle{false};
 }
 
+ExecutionHandle SystemAccess::executeQPUBatch(unsigned numQPUs,
+    const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+    std::chrono::milliseconds timeout)
+{
+    if(controlAddresses.empty())
+        return ExecutionHandle{false};
+    if(controlAddresses.size() == 1)
+        return executeQPU(numQPUs, controlAddresses.front(), flushBuffer, timeout);
+    if(vchi && !isEmulated && executionMode == ExecutionMode::VCHI_GPU_SERVICE)
+        return vchi->executeQPUBatch(numQPUs, controlAddresses, flushBuffer, timeout);
+    if(v3d && !isEmulated && executionMode == ExecutionMode::V3D_REGISTER_POKING)
+        return v3d->executeQPUBatch(numQPUs, controlAddresses, flushBuffer, timeout);
+    // no batch submission supported, execute the blocks one after the other
+    for(std::size_t i = 0; i + 1 < controlAddresses.size(); ++i)
+    {
+        auto result = executeQPU(numQPUs, controlAddresses[i], flushBuffer && i == 0, timeout);
+        if(!result.waitFor())
+            return ExecutionHandle{false};
+    }
+    return executeQPU(numQPUs, controlAddresses.back(), false, timeout);
+}
+
+unsigned SystemAccess::getMaxExecutionBatchSize() const noexcept
+{
+    // the emulator also supports batches to be able to test the batched execution of work-groups
+    if(isEmulated || executionMode == ExecutionMode::VCHI_GPU_SERVICE)
+        return VCHI::MAX_BATCH_SIZE;
+    if(v3d && executionMode == ExecutionMode::V3D_REGISTER_POKING &&
+        v3d->getSubmissionMode() == V3DSubmissionMode::PIPELINED)
+        return V3D::MAX_BATCH_SIZE;
+    return 1;
+}
+
+bool SystemAccess::canQueueExecutions() const noexcept
+{
+    // the emulator executes synchronously, so there is never anything in flight
+    if(isEmulated || executionMode == ExecutionMode::VCHI_GPU_SERVICE)
+        return true;
+    // The single submission mode resets the user program request queue for every execution. In pipelined mode, the
+    // completion of an execution is only known once all queued programs finished, since the programs might finish out
+    // of order and the V3D only provides a completed count.
+    return false;
+}
+
 std::shared_ptr<SystemAccess>& vc4cl::system()
 {
     static std::shared_ptr<SystemAccess> sys{new SystemAccess()};
@@ -10,7 +10,11 @@
 #include "../Memory.h"
 #include "../executor.h"
 
+#include <array>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 namespace vc4cl
@@ -18,20 +22,13 @@ namespace vc4cl
     constexpr uint32_t PAGE_ALIGNMENT = 4096;
 
     class Mailbox;
+    class MemoryPool;
     class V3D;
     #ifndef NO_VCSM
     class VCSM;
     #endif
     class VCHI;
 
-    enum class CacheType : uint8_t
-    {
-        UNCACHED = 0,
-        HOST_CACHED = 1,
-        GPU_CACHED = 2,
-        BOTH_CACHED = 3
-    };
-
     enum class ExecutionMode : uint8_t
     {
         MAILBOX_IOCTL,
@@ -61,6 +58,9 @@ namespace vc4cl
         TOTAL_VPM_MEMORY_IN_BYTES
     };
 
+    // The number of SystemQuery values
+    constexpr unsigned NUM_SYSTEM_QUERIES = static_cast<unsigned>(SystemQuery::TOTAL_VPM_MEMORY_IN_BYTES) + 1;
+
     /**
      * Abstraction for any system access.
      *
@@ -123,32 +123,126 @@ namespace vc4cl
             return vchi.get();
         }
 
+        inline MemoryPool* getMemoryPoolIfAvailable()
+        {
+            return memoryPool.get();
+        }
+
         std::unique_ptr<DeviceBuffer> allocateBuffer(
             unsigned sizeInBytes, const std::string& name, CacheType cacheType = CacheType::BOTH_CACHED);
+        /*
+         * Allocates buffers of all the given sizes at once, the entries for buffers failed to allocate are empty.
+         */
+        std::vector<std::unique_ptr<DeviceBuffer>> allocateBuffers(const std::vector<unsigned>& sizesInBytes,
+            const std::string& name, CacheType cacheType = CacheType::BOTH_CACHED);
+        /*
+         * Makes the given host memory accessible to the GPU without copying it, e.g. for buffers created with
+         * CL_MEM_USE_HOST_PTR.
+         *
+         * Only host memory which is already pinned for the GPU can be imported without re-mapping it, i.e. memory
+         * within the host mapping of a device buffer registered via #registerHostBuffer (e.g. the DMA buffer of a
+         * VCSM-CMA allocation, which the application obtained by mapping an OpenCL buffer). The returned device buffer
+         * is shared with its owner, the offset is set to the start of the host memory within the device buffer.
+         *
+         * Returns an empty pointer if the memory cannot be imported, in which case the caller needs to fall back to
+         * copying the data into a separately allocated buffer.
+         */
+        std::shared_ptr<DeviceBuffer> importHostBuffer(void* hostPointer, unsigned sizeInBytes, uint32_t& offset);
+        /*
+         * Registers the host mapping of the given device buffer to be shared with buffers importing host memory within
+         * it, see #importHostBuffer
+         */
+        void registerHostBuffer(const std::shared_ptr<DeviceBuffer>& buffer);
         std::unique_ptr<DeviceBuffer> allocateGPUOnlyBuffer(
             unsigned sizeInBytes, const std::string& name, CacheType cacheType = CacheType::GPU_CACHED);
         bool deallocateBuffer(const DeviceBuffer* buffer);
-        bool flushCPUCache(const std::vector<const DeviceBuffer*>& buffers);
+        /*
+         * Cleans the ranges written by the host since the last clean from the host CPU cache, buffers not written by
+         * the host are skipped.
+         */
+        bool cleanCPUCache(const std::vector<const DeviceBuffer*>& buffers);
+        /*
+         * Invalidates the whole buffer in the host CPU cache, discarding any cached data.
+         */
+        bool invalidateCPUCache(const DeviceBuffer& buffer);
+        /*
+         * Invalidates the given range (starting and ending at cache lines or the buffer end) of the buffer in the host
+         * CPU cache, discarding any cached data.
+         */
+        bool invalidateCPUCache(const DeviceBuffer& buffer, ByteRange range);
+        /*
+         * Reports an access of the GPU to a buffer with host writes which are not yet cleaned from the host CPU cache.
+         */
+        void reportIncoherentAccess(const DeviceBuffer& buffer);
 
         CHECK_RETURN ExecutionHandle executeQPU(unsigned numQPUs, std::pair<uint32_t*, unsigned> controlAddress,
             bool flushBuffer, std::chrono::milliseconds timeout);
+        /*
+         * Executes the given launch message blocks (e.g. one per work-group) one after the other.
+         *
+         * If supported by the execution mode, all blocks are submitted at once and the returned handle tracks the
+         * completion of the whole batch, otherwise the blocks are executed separately. The caches are only flushed (if
+         * requested) before the first block.
+         */
+        CHECK_RETURN ExecutionHandle executeQPUBatch(unsigned numQPUs,
+            const std::vector<std::pair<uint32_t*, unsigned>>& controlAddresses, bool flushBuffer,
+            std::chrono::milliseconds timeout);
+        /*
+         * The maximum number of launch message blocks which can be submitted at once via #executeQPUBatch.
+         */
+        unsigned getMaxExecutionBatchSize() const noexcept;
+        /*
+         * Whether further executions can be submitted before the previously submitted executions have finished.
+         */
+        bool canQueueExecutions() const noexcept;
 
         const bool isEmulated;
         const ExecutionMode executionMode;
         const MemoryManagement memoryManagement;
         const std::pair<bool, CacheType> forcedCacheType;
+        // The duration for which the values of dynamic system queries (e.g. current clock rate, temperature) are cached
+        const std::chrono::milliseconds queryCacheDuration;
 
     private:
         SystemAccess();
 
+        /*
+         * Cached results of the system queries.
+         *
+         * Static values (e.g. number of QPUs, memory sizes) are cached for the whole process lifetime, dynamic values
+         * for the configured duration.
+         */
+        struct CachedQuery
+        {
+            std::chrono::steady_clock::time_point timestamp;
+            uint32_t value = 0;
+            bool isCached = false;
+            // whether any interface could answer the query
+            bool isValid = false;
+        };
+        std::array<CachedQuery, NUM_SYSTEM_QUERIES> queryCache;
+        std::mutex queryCacheLock;
+
+        bool queryInterfaces(SystemQuery query, uint32_t& value);
+
+        std::unique_ptr<DeviceBuffer> allocateBackendBuffer(const std::shared_ptr<SystemAccess>& owner,
+            unsigned sizeInBytes, const std::string& name, CacheType cacheType);
+
+        // the device buffers which can be imported, by the start address of their host mapping, see #importHostBuffer
+        std::map<uintptr_t, std::weak_ptr<DeviceBuffer>> hostBuffers;
+        std::mutex hostBuffersLock;
+
         std::unique_ptr<Mailbox> mailbox;
         std::unique_ptr<V3D> v3d;
 	#ifndef NO_VCSM
         std::unique_ptr<VCSM> vcsm;
 	#endif
         std::unique_ptr<VCHI> vchi;
+        // needs to be destroyed before the actual memory management, since it frees its slabs via them
+        std::unique_ptr<MemoryPool> memoryPool;
 
         friend std::shared_ptr<SystemAccess>& system();
+        friend class MemoryPool;
     };
 
     std::shared_ptr<SystemAccess>& system();
@@ -6,7 +6,9 @@
 
 #include "userland.h"
 
+#include <deque>
 #include <dlfcn.h>
+#include <mutex>
 #include <string>
 #include <system_error>
 #include <vector>
@@ -202,6 +204,95 @@ int vcsm_clean_invalid2(struct vcsm_user_clean_invalid2_s* s)
     return func(s);
 }
 
+#if defined(MOCK_HAL) && MOCK_HAL
+// Fake VCHI GPU service, allows to test the submission and completion tracking of jobs without the actual firmware.
+// The submitted jobs are only completed on request, the general command interface always fails.
+
+static std::mutex mockJobsLock;
+static std::deque<gpu_callback_s> mockPendingJobs;
+
+int32_t vchi_initialise(opaque_vchi_instance_handle_t** instance_handle)
+{
+    *instance_handle = nullptr;
+    return 0;
+}
+
+int32_t vchi_connect(
+    vchi_connection_t** /* connections */, const uint32_t /* num_connections */,
+    opaque_vchi_instance_handle_t* /* instance_handle */)
+{
+    return 0;
+}
+
+int32_t vchi_disconnect(opaque_vchi_instance_handle_t* /* instance_handle */)
+{
+    return 0;
+}
+
+void vc_vchi_gencmd_init(
+    opaque_vchi_instance_handle_t* /* initialise_instance */, vchi_connection_t** /* connections */,
+    uint32_t /* num_connections */)
+{
+}
+
+void vc_gencmd_stop(void) {}
+
+int vc_gencmd(char* /* response */, int /* maxlen */, const char* /* format */)
+{
+    return -1;
+}
+
+int32_t vc_gpuserv_init(void)
+{
+    return 0;
+}
+
+void vc_gpuserv_deinit(void)
+{
+    std::lock_guard<std::mutex> guard(mockJobsLock);
+    mockPendingJobs.clear();
+}
+
+int32_t vc_gpuserv_execute_code(int num_jobs, struct gpu_job_s jobs[])
+{
+    std::lock_guard<std::mutex> guard(mockJobsLock);
+    for(int i = 0; i < num_jobs; ++i)
+    {
+        if(jobs[i].command != EXECUTE_QPU || jobs[i].u.q.jobs == 0 || jobs[i].u.q.jobs > 12)
+            return -1;
+    }
+    for(int i = 0; i < num_jobs; ++i)
+        mockPendingJobs.push_back(jobs[i].callback);
+    return 0;
+}
+
+uint32_t mock_gpuserv_get_pending_jobs(void)
+{
+    std::lock_guard<std::mutex> guard(mockJobsLock);
+    return static_cast<uint32_t>(mockPendingJobs.size());
+}
+
+uint32_t mock_gpuserv_complete_jobs(uint32_t num_jobs)
+{
+    uint32_t numCompleted = 0;
+    while(numCompleted < num_jobs)
+    {
+        gpu_callback_s callback{};
+        {
+            std::lock_guard<std::mutex> guard(mockJobsLock);
+            if(mockPendingJobs.empty())
+                break;
+            callback = mockPendingJobs.front();
+            mockPendingJobs.pop_front();
+        }
+        // like the actual GPU service, the callback is called with the cookie as parameter and without any lock held
+        if(callback.func)
+            reinterpret_cast<void (*)(uintptr_t)>(callback.func)(reinterpret_cast<uintptr_t>(callback.cookie));
+        ++numCompleted;
+    }
+    return numCompleted;
+}
+#else
 int32_t vchi_initialise(opaque_vchi_instance_handle_t** instance_handle)
 {
     static auto func = resolveBcmHostLibrarySymbol<decltype(vchi_initialise)>("vchi_initialise");
@@ -257,3 +348,4 @@ int32_t vc_gpuserv_execute_code(int num_jobs, struct gpu_job_s jobs[])
     static auto func = resolveBcmHostLibrarySymbol<decltype(vc_gpuserv_execute_code)>("vc_gpuserv_execute_code");
     return func(num_jobs, jobs);
 }
+#endif
@@ -147,6 +147,13 @@ extern "C"
 
     int32_t vc_gpuserv_execute_code(int num_jobs, struct gpu_job_s jobs[]);
 
+#if defined(MOCK_HAL) && MOCK_HAL
+    // Accessors of the fake GPU service used for testing, the submitted jobs are completed in order of submission
+    uint32_t mock_gpuserv_get_pending_jobs(void);
+    // Completes up to the given number of pending jobs, returns the number of jobs completed
+    uint32_t mock_gpuserv_complete_jobs(uint32_t num_jobs);
+#endif
+
     ////
     // VideoCore Shared Memory user-space library
     // see "/opt/vc/include/interface/vcsm/user-vcsm.h" (or "/usr/include/interface/vcsm/user-vcsm.h")
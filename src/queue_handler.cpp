@@ -9,10 +9,12 @@
 #include "Buffer.h"
 #include "Event.h"
 
+#include <algorithm>
 #include <atomic>
-#include <chrono>
 #include <condition_variable>
+#include <cstdlib>
 #include <deque>
+#include <functional>
 #include <mutex>
 #include <queue>
 #include <sys/prctl.h>
@@ -20,161 +22,480 @@
 
 using namespace vc4cl;
 
-static const std::chrono::steady_clock::duration WAIT_DURATION =
-    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(10));
+// all currently existing event queues, to be woken up when any event finishes
+struct EventQueueRegistry
+{
+    std::mutex registryMutex;
+    std::vector<EventQueue*> eventQueues;
+};
 
-EventQueue::EventQueue() : continueRunning(true), eventHandler(std::bind(&EventQueue::runEventQueue, this))
+static EventQueueRegistry& getRegistry()
+{
+    // Intentionally never destroyed, since event queues whose event handler thread is detached might still be destroyed
+    // after the static objects are destroyed on process exit
+    static EventQueueRegistry* registry = new EventQueueRegistry();
+    return *registry;
+}
+
+/*
+ * Simple pool of worker threads executing the events of out-of-order command queues
+ */
+class WorkerPool
+{
+public:
+    WorkerPool(unsigned numThreads, const char* name) : name(name)
+    {
+        for(unsigned i = 0; i < numThreads; ++i)
+            // the pools live until the process exits, so the workers do not need to be joined
+            std::thread(&WorkerPool::runWorker, this).detach();
+    }
+
+    void post(std::function<void()>&& task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(taskMutex);
+            tasks.emplace_back(std::move(task));
+        }
+        taskAvailable.notify_one();
+    }
+
+private:
+    const char* name;
+    std::deque<std::function<void()>> tasks;
+    std::mutex taskMutex;
+    std::condition_variable taskAvailable;
+
+    void runWorker()
+    {
+        prctl(PR_SET_NAME, name, 0, 0, 0);
+        while(true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(taskMutex);
+                taskAvailable.wait(lock, [this]() -> bool { return !tasks.empty(); });
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+static WorkerPool& getWorkerPool(CommandType type)
+{
+    // The pools are intentionally never destroyed, since event queues (and therefore tasks) may still be alive while
+    // the static objects are destroyed on process exit.
+    // Kernel executions are executed on a single worker, since the QPUs can only run one kernel at a time anyway.
+    static WorkerPool* deviceWorkers = new WorkerPool(1, "VC4CL QPU Work");
+    static WorkerPool* hostWorkers =
+        new WorkerPool(std::max(2u, std::thread::hardware_concurrency()), "VC4CL Host Work");
+    if(type == CommandType::KERNEL_NDRANGE || type == CommandType::KERNEL_TASK)
+        return *deviceWorkers;
+    return *hostWorkers;
+}
+
+EventQueue::EventQueue() :
+    continueRunning(true), outOfOrderExecution(false), numPendingEvents(0), numWakeups(0), isSleeping(false)
 {
     DEBUG_LOG(DebugLevel::EVENTS, std::cout << "Starting queue handler thread..." << std::endl);
 }
 
 EventQueue::~EventQueue() noexcept
 {
-    DEBUG_LOG(DebugLevel::EVENTS, std::cout << "Stopping queue handler thread..." << std::endl)
-    continueRunning = false;
-    // wake up event handler, so we can stop it
-    eventAvailable.notify_all();
-    eventHandler.join();
+    {
+        auto& registry = getRegistry();
+        std::lock_guard<std::mutex> guard(registry.registryMutex);
+        registry.eventQueues.erase(
+            std::remove(registry.eventQueues.begin(), registry.eventQueues.end(), this), registry.eventQueues.end());
+    }
+    if(eventHandler.joinable())
+    {
+        // should not happen, since shutdown() is always called before
+        continueRunning = false;
+        wakeUp();
+        if(eventHandler.get_id() == std::this_thread::get_id())
+            eventHandler.detach();
+        else
+            eventHandler.join();
+    }
 }
 
 void EventQueue::pushEvent(Event* event)
 {
-    std::lock_guard<std::mutex> guard(bufferMutex);
-    eventBuffer.emplace_back(object_wrapper<Event>{event});
-    eventAvailable.notify_all();
+    ++numPendingEvents;
+    object_wrapper<Event> wrapper{event};
+    while(!submittedEvents.push(std::move(wrapper)))
+    {
+        // The ring is full, so we empty it ourselves. This is also required if we are called from the event handler
+        // thread (e.g. from an event callback), since it would otherwise wait for itself.
+        std::lock_guard<std::mutex> guard(bufferMutex);
+        drainSubmittedEvents();
+    }
+    wakeUp();
+}
+
+void EventQueue::drainSubmittedEvents()
+{
+    object_wrapper<Event> event;
+    while(submittedEvents.pop(event))
+        eventBuffer.emplace_back(QueuedEvent{std::move(event), false});
 }
 
 Event* EventQueue::peekQueue()
 {
     std::lock_guard<std::mutex> guard(bufferMutex);
-    if(eventBuffer.empty())
+    drainSubmittedEvents();
+    if(eventBuffer.empty() || eventBuffer.front().isDispatched)
         return nullptr;
-    return eventBuffer.front().get();
+    return eventBuffer.front().event.get();
 }
 
 void EventQueue::popFromEventQueue()
 {
-    std::lock_guard<std::mutex> guard(bufferMutex);
-    if(eventBuffer.empty())
-        return;
-    eventBuffer.pop_front();
+    object_wrapper<Event> event;
+    {
+        std::lock_guard<std::mutex> guard(bufferMutex);
+        if(eventBuffer.empty())
+            return;
+        event = std::move(eventBuffer.front().event);
+        eventBuffer.pop_front();
+    }
+    // The event is released outside of the lock, since this might release the last reference to the command queue and
+    // therefore shut down this event queue
+    releaseEvent(std::move(event));
 }
 
-object_wrapper<Event> EventQueue::peek(CommandQueue* queue)
+void EventQueue::removeEvent(const Event* event)
 {
-    std::lock_guard<std::mutex> guard(bufferMutex);
+    object_wrapper<Event> removedEvent;
+    {
+        std::lock_guard<std::mutex> guard(bufferMutex);
+        auto it = std::find_if(eventBuffer.begin(), eventBuffer.end(),
+            [event](const QueuedEvent& entry) -> bool { return entry.event.get() == event; });
+        if(it == eventBuffer.end())
+            return;
+        removedEvent = std::move(it->event);
+        eventBuffer.erase(it);
+    }
+    // the event is released outside of the lock, see popFromEventQueue()
+    releaseEvent(std::move(removedEvent));
+}
 
-    for(auto& e : eventBuffer)
+void EventQueue::releaseEvent(object_wrapper<Event>&& event)
+{
+    // The waiting threads are only notified after our last reference is released, so they do not see it anymore. Since
+    // this might destroy the event, its release signal needs to be retrieved before.
+    auto queueRelease = event->getQueueRelease();
+    event = object_wrapper<Event>{};
+    if(queueRelease)
+        queueRelease->markReleased();
+    finishEvent();
+}
+
+void EventQueue::finishEvent()
+{
+    if(--numPendingEvents == 0)
     {
-        if(e->getCommandQueue() == queue)
-            return e;
+        // the lock is required to not miss a waiting thread which checked the counter but did not yet start waiting
+        {
+            std::lock_guard<std::mutex> guard(finishMutex);
+        }
+        allEventsFinished.notify_all();
     }
-    return {};
 }
 
-void EventQueue::waitForEvent(const Event* event)
+std::vector<object_wrapper<Event>> EventQueue::getPendingEvents()
 {
-    std::unique_lock<std::mutex> lock(listenMutex);
+    std::lock_guard<std::mutex> guard(bufferMutex);
+    drainSubmittedEvents();
+    std::vector<object_wrapper<Event>> events;
+    events.reserve(eventBuffer.size());
+    for(const auto& entry : eventBuffer)
+        events.emplace_back(entry.event);
+    return events;
+}
 
-    while(!event->isFinished())
+void EventQueue::setOutOfOrderExecution(bool enable)
+{
+    outOfOrderExecution = enable;
+    wakeUp();
+}
+
+void EventQueue::wakeUp()
+{
+    ++numWakeups;
+    // Only notify (and therefore lock) if the event handler is actually waiting. Since both the counter and the flag are
+    // sequentially consistent, either we see the flag set or the event handler sees the incremented counter.
+    if(isSleeping)
     {
-        // lock on some semaphore triggered when done
-        // this is triggered for every event, so re-check for this particular event
-        eventProcessed.wait_for(lock, WAIT_DURATION);
+        {
+            std::lock_guard<std::mutex> guard(eventMutex);
+        }
+        eventAvailable.notify_all();
     }
 }
 
-std::shared_ptr<EventQueue> EventQueue::getInstance()
+void EventQueue::shutdown()
 {
-    // use a shared_ptr to make sure, the thread is only cleaned up after all command queues accessing it are deleted.
-    static std::shared_ptr<EventQueue> queue(new EventQueue());
+    DEBUG_LOG(DebugLevel::EVENTS, std::cout << "Stopping queue handler thread..." << std::endl)
+    continueRunning = false;
+    // wake up event handler, so we can stop it
+    wakeUp();
+    if(eventHandler.get_id() == std::this_thread::get_id())
+        // the command queue is destroyed by releasing its last event in the event handler thread. The thread holds its
+        // own reference to this object and will stop after finishing the current event.
+        eventHandler.detach();
+    else if(eventHandler.joinable())
+        eventHandler.join();
+}
+
+void EventQueue::waitForAllEvents()
+{
+    std::unique_lock<std::mutex> lock(finishMutex);
+    allEventsFinished.wait(lock, [this]() -> bool { return numPendingEvents == 0; });
+}
+
+void EventQueue::notifyEventFinished()
+{
+    auto& registry = getRegistry();
+    std::lock_guard<std::mutex> guard(registry.registryMutex);
+    for(auto queue : registry.eventQueues)
+        queue->wakeUp();
+}
+
+std::shared_ptr<EventQueue> EventQueue::create()
+{
+    std::shared_ptr<EventQueue> queue(new EventQueue());
+    {
+        auto& registry = getRegistry();
+        std::lock_guard<std::mutex> guard(registry.registryMutex);
+        registry.eventQueues.push_back(queue.get());
+    }
+    queue->eventHandler = std::thread(&EventQueue::runEventQueue, queue);
     return queue;
 }
 
-void EventQueue::runEventQueue()
+void DeviceArbiter::lock()
+{
+    std::unique_lock<std::mutex> lock(arbiterMutex);
+    auto ticket = nextTicket++;
+    turnFinished.wait(lock, [&]() -> bool { return currentTicket == ticket; });
+}
+
+void DeviceArbiter::unlock()
+{
+    {
+        std::lock_guard<std::mutex> guard(arbiterMutex);
+        ++currentTicket;
+    }
+    turnFinished.notify_all();
+}
+
+DeviceArbiter& DeviceArbiter::getInstance()
+{
+    static DeviceArbiter arbiter;
+    return arbiter;
+}
+
+static unsigned getConfiguredHostTransferThreads()
+{
+    auto envvar = std::getenv("VC4CL_HOST_TRANSFER_THREADS");
+    if(envvar)
+    {
+        std::string env(envvar);
+        auto start = env.find_first_of("0123456789");
+        if(start != std::string::npos)
+            return std::max(1u, static_cast<unsigned>(strtoul(env.data() + start, nullptr, 0)));
+    }
+    // by default, use all cores, since a single core cannot saturate the memory bandwidth
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+unsigned vc4cl::getNumHostTransferThreads()
+{
+    static const unsigned numThreads = getConfiguredHostTransferThreads();
+    return numThreads;
+}
+
+void vc4cl::runParallelHostTasks(std::size_t numTasks, const std::function<void(std::size_t)>& task)
+{
+    // Intentionally never destroyed, like the other worker pools. The calling thread executes tasks too, so the pool
+    // needs one thread less.
+    static WorkerPool* transferWorkers = getNumHostTransferThreads() > 1 ?
+        new WorkerPool(getNumHostTransferThreads() - 1, "VC4CL Transfer") :
+        nullptr;
+    if(numTasks <= 1 || transferWorkers == nullptr)
+    {
+        for(std::size_t i = 0; i < numTasks; ++i)
+            task(i);
+        return;
+    }
+
+    // The helpers and the calling thread take the next not yet started task until all are taken, so the tasks are
+    // executed even if the helpers are delayed by tasks of other callers
+    std::atomic<std::size_t> nextTask{0};
+    std::mutex helperMutex;
+    std::condition_variable helperFinished;
+    auto numHelpers = std::min(numTasks - 1, static_cast<std::size_t>(getNumHostTransferThreads() - 1));
+    std::size_t runningHelpers = numHelpers;
+    auto runTasks = [&]() {
+        for(auto i = nextTask++; i < numTasks; i = nextTask++)
+            task(i);
+    };
+    for(std::size_t i = 0; i < numHelpers; ++i)
+    {
+        transferWorkers->post([&]() {
+            runTasks();
+            std::lock_guard<std::mutex> guard(helperMutex);
+            --runningHelpers;
+            // notify while holding the lock, since the waiting thread destroys the condition variable after waking up
+            helperFinished.notify_all();
+        });
+    }
+    runTasks();
+    // the helpers access the local state, so we need to wait for all of them, not only for the tasks to finish
+    std::unique_lock<std::mutex> lock(helperMutex);
+    helperFinished.wait(lock, [&]() -> bool { return runningHelpers == 0; });
+}
+
+void EventQueue::runEventQueue(std::shared_ptr<EventQueue> queue)
 {
     // Sets the POSIX thread name
     prctl(PR_SET_NAME, "VC4CL Queue Handler", 0, 0, 0);
-    while(continueRunning)
-    {
-        Event* event = peekQueue();
-        if(event)
-            event->updateStatus(CL_SUBMITTED);
-        /*
-         * Usually, all events in a wait-list are enqueued and therefore finished before this event is executed.
-         * There is an exception though if the event waits for a user-event which is never enqueued!
-         * So we need to check the wait list whether it is actually all finished.
-         *
-         * OpenCL 1.2 specification, section 5.9:
-         * "In order for the execution status of an enqueued command to change from CL_SUBMITTED to CL_RUNNING , all
-         * events that this command is waiting on must have completed successfully i.e. their execution status must be
-         * CL_COMPLETE."
-         * -> we need to check for wait list between CL_SUBMITTED and CL_RUNNING
-         *
-         * It is the applications responsibility to avoid deadlocks when using user-events, see NOTE on OpenCL 1.2,
-         * section 5.9 paragraph for 'clReleaseEvent'.
-         *
-         * FIXME waiting events block the queue. Can we skip them and continue with the next one?
-         * We could at least do that for out-of-order queues or if the next event is from a different queue.
-         * See OpenCL 1.2, section 5.11
-         */
-        WaitListStatus waitListStatus = WaitListStatus::PENDING;
-        if(event && ((waitListStatus = event->getWaitListStatus()) != WaitListStatus::PENDING))
+    while(queue->continueRunning)
+    {
+        uint64_t lastWakeup = queue->numWakeups;
+        bool madeProgress = queue->outOfOrderExecution ? queue->dispatchReadyEvents(queue) : queue->processFirstEvent();
+        if(!madeProgress)
         {
-            if(waitListStatus == WaitListStatus::ERROR)
+            // Any wake-up (new event, finished event of any queue, incl. user events, or shutdown) after we checked the
+            // events above increments the counter, so we cannot miss it even if it happened before we wait here
+            std::unique_lock<std::mutex> lock(queue->eventMutex);
+            queue->isSleeping = true;
+            queue->eventAvailable.wait(lock, [&]() -> bool { return queue->numWakeups != lastWakeup; });
+            queue->isSleeping = false;
+        }
+    }
+    DEBUG_LOG(DebugLevel::EVENTS, std::cout << "Queue handler thread stopped" << std::endl)
+}
+
+bool EventQueue::processFirstEvent()
+{
+    Event* event = peekQueue();
+    if(event)
+        event->updateStatus(CL_SUBMITTED);
+    /*
+     * Usually, all events in a wait-list are enqueued and therefore finished before this event is executed.
+     * There is an exception though if the event waits for a user-event which is never enqueued!
+     * So we need to check the wait list whether it is actually all finished.
+     *
+     * OpenCL 1.2 specification, section 5.9:
+     * "In order for the execution status of an enqueued command to change from CL_SUBMITTED to CL_RUNNING , all
+     * events that this command is waiting on must have completed successfully i.e. their execution status must be
+     * CL_COMPLETE."
+     * -> we need to check for wait list between CL_SUBMITTED and CL_RUNNING
+     *
+     * It is the applications responsibility to avoid deadlocks when using user-events, see NOTE on OpenCL 1.2,
+     * section 5.9 paragraph for 'clReleaseEvent'.
+     *
+     * Since every command queue has its own event queue, waiting events only block the events of the same command
+     * queue. For out-of-order queues, see dispatchReadyEvents().
+     */
+    WaitListStatus waitListStatus = WaitListStatus::PENDING;
+    if(event && ((waitListStatus = event->getWaitListStatus()) != WaitListStatus::PENDING))
+    {
+        executeEvent(event, waitListStatus);
+        // we need to leave the event in the queue until it is finished processing to allow CommandQueue#finish() to
+        // track it
+        popFromEventQueue();
+        return true;
+    }
+    return false;
+}
+
+bool EventQueue::dispatchReadyEvents(const std::shared_ptr<EventQueue>& self)
+{
+    /*
+     * OpenCL 1.2 specification, section 5.11:
+     * "If the CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE property of a command-queue is set, then there is no guarantee
+     * that command A will complete before command B starts execution."
+     *
+     * -> Dispatch all events whose wait lists are satisfied, independent of their submission order. The implicit
+     * dependencies of markers and barriers are added to the wait lists on submission, see CommandQueue#enqueueEvent().
+     */
+    std::vector<std::pair<object_wrapper<Event>, WaitListStatus>> readyEvents;
+    {
+        std::lock_guard<std::mutex> guard(bufferMutex);
+        drainSubmittedEvents();
+        for(auto& entry : eventBuffer)
+        {
+            if(entry.isDispatched)
+                continue;
+            auto waitListStatus = entry.event->getWaitListStatus();
+            if(waitListStatus == WaitListStatus::PENDING)
+                continue;
+            entry.isDispatched = true;
+            readyEvents.emplace_back(entry.event, waitListStatus);
+        }
+    }
+
+    for(auto& ready : readyEvents)
+    {
+        ready.first->updateStatus(CL_SUBMITTED);
+        auto type = ready.first->type;
+        auto event = std::move(ready.first);
+        auto waitListStatus = ready.second;
+        // the task keeps this event queue alive, since the command queue might be released while the event is executed
+        getWorkerPool(type).post([self, event, waitListStatus]() mutable {
+            executeEvent(event.get(), waitListStatus);
+            // the event is still referenced by the event buffer, so we can drop our reference before removing it
+            const Event* executedEvent = event.get();
+            event = object_wrapper<Event>{};
+            self->removeEvent(executedEvent);
+        });
+    }
+    return !readyEvents.empty();
+}
+
+void EventQueue::executeEvent(Event* event, WaitListStatus waitListStatus)
+{
+    if(waitListStatus == WaitListStatus::ERROR)
+    {
+        // at least one event in the wait list had an error, so we abort this execution
+        event->updateStatus(CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST);
+    }
+    else
+    {
+        event->updateStatus(CL_RUNNING);
+        if(event->action)
+        {
+            try
             {
-                // at least one event in the wait list had an error, so we abort this execution
-                event->updateStatus(CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST);
+                DEBUG_LOG(DebugLevel::EVENTS,
+                    std::cout << "Executing event action: " << event->action->to_string() << std::endl);
+                cl_int status = event->action->operator()();
+                if(status != CL_SUCCESS)
+                    event->updateStatus(status);
+                else
+                    event->updateStatus(CL_COMPLETE);
             }
-            else
+            catch(const std::exception& err)
             {
-                event->updateStatus(CL_RUNNING);
-                if(event->action)
-                {
-                    try
-                    {
-                        DEBUG_LOG(DebugLevel::EVENTS,
-                            std::cout << "Executing event action: " << event->action->to_string() << std::endl);
-                        cl_int status = event->action->operator()();
-                        if(status != CL_SUCCESS)
-                            event->updateStatus(status);
-                        else
-                            event->updateStatus(CL_COMPLETE);
-                    }
-                    catch(const std::exception& err)
-                    {
-                        event->updateStatus(returnError(CL_OUT_OF_RESOURCES, __FILE__, __LINE__,
-                            std::string{"Exception thrown during even execution: "} + err.what()));
-                    }
-                }
-                else
-                    event->updateStatus(
-                        returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "No event source specified!"));
-
-                // TODO error-handling (via context-pfn_notify) on errors? Neither PoCL nor beignet seem to use
-                // context's pfn_notify
-                cl_int status = event->release();
-                if(status != CL_SUCCESS)
-                    event->updateStatus(status, false);
+                event->updateStatus(returnError(CL_OUT_OF_RESOURCES, __FILE__, __LINE__,
+                    std::string{"Exception thrown during even execution: "} + err.what()));
             }
-            // clear the wait list of this event to allow resources of waited-for events to be released before we
-            // release this event itself.
-            event->clearWaitList();
-            eventProcessed.notify_all();
-            // we need to leave the event in the queue until it is finished processing to allow CommandQueue#finish() to
-            // track it
-            popFromEventQueue();
         }
         else
-        {
-            std::unique_lock<std::mutex> lock(eventMutex);
-            // sometimes locks infinite (race condition on event set after the check above but before the wait()?)
-            //-> for now, simply wait for a maximum amount of time and check again
-            // Also, this waits for an event's wait-list to become finished (esp. user events) and therefore should not
-            // wait forever but must wake up in small intervals!
-            eventAvailable.wait_for(lock, WAIT_DURATION);
-            eventProcessed.notify_all();
-        }
+            event->updateStatus(returnError(CL_INVALID_OPERATION, __FILE__, __LINE__, "No event source specified!"));
+
+        // TODO error-handling (via context-pfn_notify) on errors? Neither PoCL nor beignet seem to use
+        // context's pfn_notify
+        cl_int status = event->release();
+        if(status != CL_SUCCESS)
+            event->updateStatus(status, false);
     }
-    DEBUG_LOG(DebugLevel::EVENTS, std::cout << "Queue handler thread stopped" << std::endl)
+    // clear the wait list of this event to allow resources of waited-for events to be released before we
+    // release this event itself.
+    event->clearWaitList();
 }
@@ -9,10 +9,13 @@
 
 #include "Event.h"
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <vector>
 #include <mutex>
 #include <thread>
 
@@ -21,7 +24,115 @@ namespace vc4cl
     class CommandQueue;
 
     /**
-     * Singleton handler of the actual event executions
+     * Bounded lock-free multi-producer single-consumer ring buffer
+     *
+     * Every slot has a sequence number, which tells the producers whether the slot is free and the consumer whether the
+     * slot is already written, see http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+     *
+     * NOTE: Only a single thread may consume elements at the same time, which needs to be guaranteed by the caller.
+     */
+    template <typename T, std::size_t Capacity>
+    class SubmissionRing
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity needs to be a power of two");
+
+    public:
+        SubmissionRing()
+        {
+            head.value.store(0, std::memory_order_relaxed);
+            tail.value = 0;
+            for(std::size_t i = 0; i < Capacity; ++i)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        /**
+         * Tries to append the given element, returns false if the ring is full.
+         */
+        bool push(T&& value)
+        {
+            auto pos = head.value.load(std::memory_order_relaxed);
+            while(true)
+            {
+                Slot& slot = slots[pos & (Capacity - 1)];
+                auto sequence = slot.sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+                if(diff == 0)
+                {
+                    if(head.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.value = std::move(value);
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if(diff < 0)
+                    // the slot is not yet consumed, the ring is full
+                    return false;
+                else
+                    // another producer claimed the slot
+                    pos = head.value.load(std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Tries to take the oldest element, returns false if the ring is empty.
+         */
+        bool pop(T& value)
+        {
+            Slot& slot = slots[tail.value & (Capacity - 1)];
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            if(sequence != tail.value + 1)
+                // the slot is not (completely) written yet
+                return false;
+            value = std::move(slot.value);
+            slot.sequence.store(tail.value + Capacity, std::memory_order_release);
+            ++tail.value;
+            return true;
+        }
+
+    private:
+        static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+        struct Slot
+        {
+            std::atomic<std::size_t> sequence;
+            T value;
+        };
+
+        /*
+         * Pads the value to a whole cache line, so it does not share a cache line with any following member.
+         *
+         * Unlike alignas(), this does not require an over-aligned allocation of the object containing the ring.
+         */
+        template <typename V>
+        struct Padded
+        {
+            V value;
+            uint8_t padding[CACHE_LINE_SIZE - sizeof(V)];
+        };
+
+        // the next position to be written by the producers
+        Padded<std::atomic<std::size_t>> head;
+        // the next position to be read by the consumer
+        Padded<std::size_t> tail;
+        std::array<Slot, Capacity> slots;
+    };
+
+    /**
+     * Ordered submission lane handling the actual event executions of a single command queue
+     *
+     * Every command queue has its own event handler thread, so an event blocked by its wait list (e.g. waiting for a
+     * user event) only stalls the events of its own command queue. Host-side commands of independent command queues
+     * can be executed in parallel, the access to the QPUs is serialized between the lanes via the DeviceArbiter.
+     *
+     * New events are submitted via a lock-free ring, so submitting threads neither contend with each other on a lock
+     * nor with the event handler thread. The events are moved from the ring into the actual event buffer by whichever
+     * thread accesses the event buffer next.
+     *
+     * For command queues with out-of-order execution enabled, the events are not executed in submission order. Instead,
+     * every event whose wait list is satisfied is dispatched to a worker thread (kernel executions to the single device
+     * worker, all other commands to the host workers), so independent commands do not block each other. The ordering
+     * constraints (explicit wait lists, markers and barriers) are all expressed via the events' wait lists.
      */
     class EventQueue
     {
@@ -39,39 +150,126 @@ namespace vc4cl
         void pushEvent(Event* event);
 
         /**
-         * Returns the first (oldest) event scheduled via the given command queue, if any such event exists.
+         * Returns all events scheduled in this event queue which did not yet finish, in submission order.
+         */
+        std::vector<object_wrapper<Event>> getPendingEvents();
+
+        void setOutOfOrderExecution(bool enable);
+
+        /**
+         * Stops the event handler thread.
+         *
+         * NOTE: This needs to be called before the owning command queue is destroyed. Since the events hold a reference
+         * to their command queue, the queue is empty at that point.
+         */
+        void shutdown();
+
+        /**
+         * Blocks the caller until all events scheduled in this event queue have finished execution.
          */
-        object_wrapper<Event> peek(CommandQueue* queue);
+        void waitForAllEvents();
 
         /**
-         * Blocks the caller until the given event has finished execution.
+         * Wakes up the event handlers of all event queues, since an event they might depend on has finished.
          */
-        void waitForEvent(const Event* event);
+        static void notifyEventFinished();
 
-        static std::shared_ptr<EventQueue> getInstance();
+        static std::shared_ptr<EventQueue> create();
 
     private:
         EventQueue();
 
+        struct QueuedEvent
+        {
+            object_wrapper<Event> event;
+            // whether the event is already handed to a worker thread (for out-of-order execution only)
+            bool isDispatched;
+        };
+
+        static constexpr std::size_t SUBMISSION_RING_SIZE = 256;
+
         std::atomic_bool continueRunning;
+        std::atomic_bool outOfOrderExecution;
 
-        std::deque<object_wrapper<Event>> eventBuffer{};
-        // this is triggered after every finished cl_event
-        std::condition_variable eventProcessed{};
-        // this is triggered if a new event is available
-        std::condition_variable eventAvailable{};
-        std::mutex listenMutex{};
+        // newly submitted events, only consumed while holding the buffer mutex
+        SubmissionRing<object_wrapper<Event>, SUBMISSION_RING_SIZE> submittedEvents;
+        std::deque<QueuedEvent> eventBuffer{};
         std::mutex bufferMutex{};
+
+        // the number of submitted events which are not yet finished processing
+        std::atomic<uint32_t> numPendingEvents;
+        // this is triggered if the number of pending events drops to zero
+        std::condition_variable allEventsFinished{};
+        std::mutex finishMutex{};
+
+        // this is triggered if a new event is available or an event (of any event queue) has finished
+        std::condition_variable eventAvailable{};
+        // guards the sleeping of the event handler thread
         std::mutex eventMutex{};
+        // incremented on every wake-up, allows the event handler to detect wake-ups while it was not waiting
+        std::atomic<uint64_t> numWakeups;
+        // set while the event handler thread is waiting for a wake-up
+        std::atomic_bool isSleeping;
 
-        // the actual thread needs to be initialized after all the mutices
+        // the thread keeps a reference to this object, so it can outlive the command queue, if the command queue is
+        // destroyed from the event handler thread
         std::thread eventHandler;
 
         Event* peekQueue();
         void popFromEventQueue();
+        void removeEvent(const Event* event);
+        void wakeUp();
+        // moves all submitted events into the event buffer, requires the buffer mutex to be locked
+        void drainSubmittedEvents();
+        // releases the reference of the event buffer to the removed event and notifies the threads waiting for it
+        void releaseEvent(object_wrapper<Event>&& event);
+        void finishEvent();
 
-        void runEventQueue();
+        bool processFirstEvent();
+        bool dispatchReadyEvents(const std::shared_ptr<EventQueue>& self);
+
+        static void executeEvent(Event* event, WaitListStatus waitListStatus);
+
+        static void runEventQueue(std::shared_ptr<EventQueue> queue);
     };
+
+    /**
+     * Arbitrates the access to the QPUs between the event queues of all command queues
+     *
+     * The event queues are granted access in the order they request it, i.e. the kernel executions which become ready
+     * first are executed first.
+     *
+     * This type satisfies the Lockable requirements and can be used with e.g. std::lock_guard.
+     */
+    class DeviceArbiter
+    {
+    public:
+        void lock();
+        void unlock();
+
+        static DeviceArbiter& getInstance();
+
+    private:
+        DeviceArbiter() = default;
+
+        std::mutex arbiterMutex;
+        std::condition_variable turnFinished;
+        uint64_t nextTicket = 0;
+        uint64_t currentTicket = 0;
+    };
+
+    /**
+     * Returns the number of host threads (including the calling thread) executing the tasks of #runParallelHostTasks.
+     */
+    unsigned getNumHostTransferThreads();
+
+    /**
+     * Executes the given task for all indices in the range [0, numTasks) in parallel on a dedicated pool of host
+     * threads and the calling thread. Returns after all tasks are finished.
+     *
+     * NOTE: The tasks must not block on other work, since the pool is shared by all callers.
+     */
+    void runParallelHostTasks(std::size_t numTasks, const std::function<void(std::size_t)>& task);
 } /* namespace vc4cl */
 
 #endif /* VC4CL_QUEUEHANDLER */
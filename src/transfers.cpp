@@ -0,0 +1,416 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+
+#include "transfers.h"
+
+#include "Buffer.h"
+#include "Kernel.h"
+#include "Platform.h"
+#include "Program.h"
+#include "hal/hal.h"
+#include "queue_handler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace vc4cl;
+
+/*
+ * All kernels are executed as a single work-group with one work-item per QPU, each work-item handling every n-th
+ * vector (or row), so a single execution transfers the whole range. The offsets and pitches are given in vectors.
+ */
+static const char* TRANSFER_KERNELS = R"(
+__kernel void vc4cl_copy(const __global uint16* restrict src, __global uint16* restrict dst, uint srcOffset,
+    uint dstOffset, uint numVectors)
+{
+    for(uint i = get_global_id(0); i < numVectors; i += get_global_size(0))
+        dst[dstOffset + i] = src[srcOffset + i];
+}
+
+__kernel void vc4cl_fill(__global uint16* dst, uint dstOffset, uint numVectors, uint16 evenPattern, uint16 oddPattern)
+{
+    for(uint i = get_global_id(0); i < numVectors; i += get_global_size(0))
+        dst[dstOffset + i] = (i & 1) ? oddPattern : evenPattern;
+}
+
+__kernel void vc4cl_copy_rect(const __global uint16* restrict src, __global uint16* restrict dst, uint srcOffset,
+    uint dstOffset, uint srcRowPitch, uint srcSlicePitch, uint dstRowPitch, uint dstSlicePitch, uint rowVectors,
+    uint numRows, uint numSlices)
+{
+    for(uint row = get_global_id(0); row < numRows * numSlices; row += get_global_size(0))
+    {
+        uint y = row % numRows;
+        uint z = row / numRows;
+        const __global uint16* in = src + srcOffset + z * srcSlicePitch + y * srcRowPitch;
+        __global uint16* out = dst + dstOffset + z * dstSlicePitch + y * dstRowPitch;
+        for(uint x = 0; x < rowVectors; ++x)
+            out[x] = in[x];
+    }
+}
+)";
+
+static std::size_t getConfiguredThreshold()
+{
+    auto envvar = std::getenv("VC4CL_QPU_TRANSFER_THRESHOLD");
+    if(!envvar)
+        return QPUTransfers::DEFAULT_THRESHOLD;
+    std::string env(envvar);
+    auto start = env.find_first_of("0123456789");
+    if(start != std::string::npos)
+        return strtoul(env.data() + start, nullptr, 0);
+    return QPUTransfers::DEFAULT_THRESHOLD;
+}
+
+static uint32_t getDeviceAddress(Buffer& buffer, std::size_t offset)
+{
+    return static_cast<uint32_t>(buffer.getDevicePointerWithOffset()) + static_cast<uint32_t>(offset);
+}
+
+QPUTransfers::QPUTransfers() :
+    status(KernelStatus::NOT_LOADED), threshold(getConfiguredThreshold()), copyKernel(nullptr), fillKernel(nullptr),
+    copyRectKernel(nullptr)
+{
+}
+
+QPUTransfers& QPUTransfers::getInstance()
+{
+    static QPUTransfers instance;
+    return instance;
+}
+
+ByteRange QPUTransfers::copyBuffer(
+    Buffer& source, std::size_t sourceOffset, Buffer& destination, std::size_t destOffset, std::size_t numBytes)
+{
+    const auto minimumSize = threshold.load();
+    if(minimumSize == 0 || numBytes < minimumSize || !source.deviceBuffer || !destination.deviceBuffer)
+        return ByteRange{0, 0};
+    auto sourceAddress = getDeviceAddress(source, sourceOffset);
+    auto destAddress = getDeviceAddress(destination, destOffset);
+    // the QPUs copy the vectors in parallel, so the behavior for overlapping ranges is undefined
+    if(sourceAddress < destAddress + numBytes && destAddress < sourceAddress + numBytes)
+        return ByteRange{0, 0};
+    // we can only copy vectors if both ranges have the same misalignment, which is then copied by the host
+    if(sourceAddress % VECTOR_SIZE != destAddress % VECTOR_SIZE)
+        return ByteRange{0, 0};
+    auto head = (VECTOR_SIZE - sourceAddress % VECTOR_SIZE) % VECTOR_SIZE;
+    auto numVectors = static_cast<uint32_t>((numBytes - std::min(head, numBytes)) / VECTOR_SIZE);
+    if(numVectors * VECTOR_SIZE < minimumSize)
+        return ByteRange{0, 0};
+
+    cl_mem sourceMemory = source.toBase();
+    cl_mem destMemory = destination.toBase();
+    // the buffers (and sub-buffers) are aligned to whole vectors, so the offsets are too
+    auto sourceVector = static_cast<uint32_t>((sourceOffset + head) / VECTOR_SIZE);
+    auto destVector = static_cast<uint32_t>((destOffset + head) / VECTOR_SIZE);
+    if(!execute(&QPUTransfers::copyKernel,
+           {{sizeof(cl_mem), &sourceMemory}, {sizeof(cl_mem), &destMemory}, {sizeof(cl_uint), &sourceVector},
+               {sizeof(cl_uint), &destVector}, {sizeof(cl_uint), &numVectors}}))
+        return ByteRange{0, 0};
+    return ByteRange{static_cast<uint32_t>(head), static_cast<uint32_t>(numVectors * VECTOR_SIZE)};
+}
+
+ByteRange QPUTransfers::fillBuffer(
+    Buffer& buffer, std::size_t offset, std::size_t numBytes, const std::vector<char>& pattern)
+{
+    const auto minimumSize = threshold.load();
+    if(minimumSize == 0 || numBytes < minimumSize || !buffer.deviceBuffer || pattern.empty() ||
+        (2 * VECTOR_SIZE) % pattern.size() != 0)
+        return ByteRange{0, 0};
+    auto address = getDeviceAddress(buffer, offset);
+    auto head = (VECTOR_SIZE - address % VECTOR_SIZE) % VECTOR_SIZE;
+    auto numVectors = static_cast<uint32_t>((numBytes - std::min(head, numBytes)) / VECTOR_SIZE);
+    if(numVectors * VECTOR_SIZE < minimumSize)
+        return ByteRange{0, 0};
+
+    // the pattern is replicated into two vectors, starting at the position within the pattern of the first vector
+    std::array<char, 2 * VECTOR_SIZE> vectors{};
+    for(std::size_t i = 0; i < vectors.size(); ++i)
+        vectors[i] = pattern[(head + i) % pattern.size()];
+    cl_mem memory = buffer.toBase();
+    auto firstVector = static_cast<uint32_t>((offset + head) / VECTOR_SIZE);
+    if(!execute(&QPUTransfers::fillKernel,
+           {{sizeof(cl_mem), &memory}, {sizeof(cl_uint), &firstVector}, {sizeof(cl_uint), &numVectors},
+               {VECTOR_SIZE, vectors.data()}, {VECTOR_SIZE, vectors.data() + VECTOR_SIZE}}))
+        return ByteRange{0, 0};
+    return ByteRange{static_cast<uint32_t>(head), static_cast<uint32_t>(numVectors * VECTOR_SIZE)};
+}
+
+bool QPUTransfers::copyBufferRect(Buffer& source, Buffer& destination, const std::array<std::size_t, 3>& sourceOrigin,
+    std::size_t sourceRowPitch, std::size_t sourceSlicePitch, const std::array<std::size_t, 3>& destOrigin,
+    std::size_t destRowPitch, std::size_t destSlicePitch, const std::array<std::size_t, 3>& region)
+{
+    const auto minimumSize = threshold.load();
+    if(minimumSize == 0 || region[0] * region[1] * region[2] < minimumSize || !source.deviceBuffer ||
+        !destination.deviceBuffer)
+        return false;
+    auto sourceOffset = sourceOrigin[0] + sourceOrigin[1] * sourceRowPitch + sourceOrigin[2] * sourceSlicePitch;
+    auto destOffset = destOrigin[0] + destOrigin[1] * destRowPitch + destOrigin[2] * destSlicePitch;
+    // all rows need to start at and consist of whole vectors
+    if(getDeviceAddress(source, sourceOffset) % VECTOR_SIZE != 0 ||
+        getDeviceAddress(destination, destOffset) % VECTOR_SIZE != 0 || region[0] % VECTOR_SIZE != 0 ||
+        sourceRowPitch % VECTOR_SIZE != 0 || sourceSlicePitch % VECTOR_SIZE != 0 || destRowPitch % VECTOR_SIZE != 0 ||
+        destSlicePitch % VECTOR_SIZE != 0)
+        return false;
+
+    cl_mem sourceMemory = source.toBase();
+    cl_mem destMemory = destination.toBase();
+    std::array<uint32_t, 9> values = {static_cast<uint32_t>(sourceOffset / VECTOR_SIZE),
+        static_cast<uint32_t>(destOffset / VECTOR_SIZE), static_cast<uint32_t>(sourceRowPitch / VECTOR_SIZE),
+        static_cast<uint32_t>(sourceSlicePitch / VECTOR_SIZE), static_cast<uint32_t>(destRowPitch / VECTOR_SIZE),
+        static_cast<uint32_t>(destSlicePitch / VECTOR_SIZE), static_cast<uint32_t>(region[0] / VECTOR_SIZE),
+        static_cast<uint32_t>(region[1]), static_cast<uint32_t>(region[2])};
+    std::vector<std::pair<std::size_t, const void*>> arguments = {
+        {sizeof(cl_mem), &sourceMemory}, {sizeof(cl_mem), &destMemory}};
+    for(const auto& value : values)
+        arguments.emplace_back(sizeof(cl_uint), &value);
+    return execute(&QPUTransfers::copyRectKernel, arguments);
+}
+
+std::size_t QPUTransfers::getThreshold() const
+{
+    return threshold.load();
+}
+
+void QPUTransfers::setThreshold(std::size_t numBytes)
+{
+    threshold = numBytes;
+}
+
+static Kernel* createKernel(Program* program, const std::string& name)
+{
+    for(const auto& info : program->moduleInfo.kernels)
+    {
+        if(info.name == name)
+            return newOpenCLObject<Kernel>(program, info);
+    }
+    return nullptr;
+}
+
+bool QPUTransfers::loadKernels()
+{
+    if(status != KernelStatus::NOT_LOADED)
+        return status == KernelStatus::LOADED;
+    // only try once, if the compilation fails, it will fail the next time too
+    status = KernelStatus::UNAVAILABLE;
+
+    // The internal objects are not tied to any user context (which would then never be released, since the program
+    // keeps a reference to its context), so we use our own context
+    auto& platform = Platform::getVC4CLPlatform();
+    Context* context = newOpenCLObject<Context>(
+        &platform.VideoCoreIVGPU, &platform, std::vector<cl_context_properties>{}, nullptr, nullptr);
+    if(!context)
+        return false;
+    std::vector<char> source(TRANSFER_KERNELS, TRANSFER_KERNELS + strlen(TRANSFER_KERNELS));
+    Program* program = newOpenCLObject<Program>(context, source, CreationType::SOURCE);
+    if(!program)
+        return false;
+    cl_int state = program->compile("", {});
+    if(state == CL_SUCCESS)
+        state = program->link("", {});
+    if(state != CL_SUCCESS)
+    {
+        DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+            std::cout << "Failed to compile the QPU transfer kernels, executing all transfers on the host: "
+                      << program->buildInfo.log << std::endl)
+        return false;
+    }
+
+    copyKernel = createKernel(program, "vc4cl_copy");
+    fillKernel = createKernel(program, "vc4cl_fill");
+    copyRectKernel = createKernel(program, "vc4cl_copy_rect");
+    if(!copyKernel || !fillKernel || !copyRectKernel)
+        return false;
+    status = KernelStatus::LOADED;
+    return true;
+}
+
+bool QPUTransfers::execute(
+    Kernel* QPUTransfers::*kernel, const std::vector<std::pair<std::size_t, const void*>>& arguments)
+{
+    std::unique_ptr<KernelExecution> execution;
+    {
+        std::lock_guard<std::mutex> guard(kernelLock);
+        if(!loadKernels())
+            return false;
+        Kernel* transferKernel = this->*kernel;
+        for(cl_uint i = 0; i < arguments.size(); ++i)
+        {
+            const auto& parameter = transferKernel->info.parameters[i];
+            if(parameter.getPointer() && !parameter.getByValue())
+                // the buffers belong to the user contexts and not to the internal context of our program, which would
+                // be rejected by Kernel#setArg
+                transferKernel->setBufferArg(i, toType<Buffer>(*static_cast<const cl_mem*>(arguments[i].second)));
+            else if(transferKernel->setArg(i, arguments[i].first, arguments[i].second) != CL_SUCCESS)
+                return false;
+        }
+        // a single work-group with all QPUs
+        const std::size_t numQPUs = system()->getNumQPUs();
+        if(transferKernel->createExecution(1, {0, 0, 0}, {numQPUs, 1, 1}, {numQPUs, 1, 1}, execution) != CL_SUCCESS)
+            return false;
+    }
+    DEBUG_LOG(DebugLevel::KERNEL_EXECUTION,
+        std::cout << "Executing transfer on the QPUs: " << execution->to_string() << std::endl)
+    // the execution took a snapshot of the arguments, so we can run it without holding the lock
+    return (*execution)() == CL_COMPLETE;
+}
+
+// The minimum number of bytes of a host transfer to be split across multiple host threads
+static constexpr std::size_t PARALLEL_HOST_TRANSFER_THRESHOLD = 1024 * 1024;
+// The minimum number of bytes copied by every single host thread
+static constexpr std::size_t MIN_HOST_TRANSFER_BYTES_PER_THREAD = 256 * 1024;
+static constexpr std::size_t CACHE_LINE_SIZE = HostWriteTracker::CACHE_LINE_SIZE;
+
+static std::size_t getNumHostTransferTasks(std::size_t numBytes)
+{
+    if(numBytes < PARALLEL_HOST_TRANSFER_THRESHOLD)
+        return 1;
+    return std::max(std::size_t{1},
+        std::min(static_cast<std::size_t>(getNumHostTransferThreads()), numBytes / MIN_HOST_TRANSFER_BYTES_PER_THREAD));
+}
+
+/*
+ * Copies between memory areas where at least one is not cached by the host.
+ *
+ * Every access to uncached memory is a separate bus transaction, so the uncached side is accessed in whole aligned
+ * cache lines, which the compiler turns into the widest available loads/stores (e.g. LDM/STM or NEON VLD1/VST1).
+ */
+static void copyLines(uint8_t* destination, const uint8_t* source, std::size_t numBytes, bool alignDestination)
+{
+    auto address = reinterpret_cast<uintptr_t>(alignDestination ? destination : source);
+    auto head = std::min(numBytes, (CACHE_LINE_SIZE - address % CACHE_LINE_SIZE) % CACHE_LINE_SIZE);
+    memcpy(destination, source, head);
+    std::size_t offset = head;
+    for(; offset + CACHE_LINE_SIZE <= numBytes; offset += CACHE_LINE_SIZE)
+        memcpy(destination + offset, source + offset, CACHE_LINE_SIZE);
+    memcpy(destination + offset, source + offset, numBytes - offset);
+}
+
+static void copyChunk(uint8_t* destination, CacheType destinationCaching, const uint8_t* source,
+    CacheType sourceCaching, std::size_t numBytes)
+{
+    if(!isHostCached(sourceCaching))
+        copyLines(destination, source, numBytes, false);
+    else if(!isHostCached(destinationCaching))
+        copyLines(destination, source, numBytes, true);
+    else
+        // the C library already selects the best copy for cached memory, e.g. non-temporal stores for large copies
+        memcpy(destination, source, numBytes);
+}
+
+void vc4cl::copyHostMemory(void* destination, CacheType destinationCaching, const void* source,
+    CacheType sourceCaching, std::size_t numBytes)
+{
+    auto dest = static_cast<uint8_t*>(destination);
+    auto src = static_cast<const uint8_t*>(source);
+    const auto numTasks = getNumHostTransferTasks(numBytes);
+    if(numTasks <= 1)
+    {
+        copyChunk(dest, destinationCaching, src, sourceCaching, numBytes);
+        return;
+    }
+    // the chunks start at destination cache lines, so no two threads write the same cache line
+    const auto destAddress = reinterpret_cast<uintptr_t>(dest);
+    auto chunkStart = [&](std::size_t task) -> std::size_t {
+        if(task == 0)
+            return 0;
+        auto offset = numBytes * task / numTasks;
+        auto alignedOffset = ((destAddress + offset + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)) - destAddress;
+        return std::min(alignedOffset, numBytes);
+    };
+    runParallelHostTasks(numTasks, [&](std::size_t task) {
+        auto start = chunkStart(task);
+        auto end = chunkStart(task + 1);
+        if(end > start)
+            copyChunk(dest + start, destinationCaching, src + start, sourceCaching, end - start);
+    });
+}
+
+std::size_t vc4cl::getRectExtent(const std::array<std::size_t, 3>& region, std::size_t rowPitch, std::size_t slicePitch)
+{
+    if(region[0] == 0 || region[1] == 0 || region[2] == 0)
+        return 0;
+    return (region[2] - 1) * slicePitch + (region[1] - 1) * rowPitch + region[0];
+}
+
+void vc4cl::copyHostRect(void* destination, CacheType destinationCaching, std::size_t destRowPitch,
+    std::size_t destSlicePitch, const void* source, CacheType sourceCaching, std::size_t sourceRowPitch,
+    std::size_t sourceSlicePitch, std::array<std::size_t, 3> region)
+{
+    auto dest = static_cast<uint8_t*>(destination);
+    auto src = static_cast<const uint8_t*>(source);
+    if(region[0] == 0 || region[1] == 0 || region[2] == 0)
+        return;
+    if(dest == src && destRowPitch == sourceRowPitch && destSlicePitch == sourceSlicePitch)
+        return;
+
+    // merge rows without any gaps into a single row per slice and slices without any gaps into a single row
+    if(region[1] > 1 && sourceRowPitch == region[0] && destRowPitch == region[0])
+    {
+        region[0] *= region[1];
+        region[1] = 1;
+    }
+    if(region[1] == 1 && region[2] > 1 && sourceSlicePitch == region[0] && destSlicePitch == region[0])
+    {
+        region[0] *= region[2];
+        region[2] = 1;
+    }
+    // single-row slices are handled as rows of a single slice
+    if(region[1] == 1 && region[2] > 1)
+    {
+        region[1] = region[2];
+        region[2] = 1;
+        sourceRowPitch = sourceSlicePitch;
+        destRowPitch = destSlicePitch;
+    }
+
+    const std::size_t numRows = region[1] * region[2];
+    auto rowOffset = [&region](std::size_t row, std::size_t rowPitch, std::size_t slicePitch) -> std::size_t {
+        return (row % region[1]) * rowPitch + (row / region[1]) * slicePitch;
+    };
+
+    const auto sourceExtent = getRectExtent(region, sourceRowPitch, sourceSlicePitch);
+    const auto destExtent = getRectExtent(region, destRowPitch, destSlicePitch);
+    std::vector<uint8_t> temporary;
+    if(src < dest + destExtent && dest < src + sourceExtent)
+    {
+        if(numRows == 1)
+        {
+            memmove(dest, src, region[0]);
+            return;
+        }
+        if(sourceRowPitch == destRowPitch && sourceSlicePitch == destSlicePitch)
+        {
+            // with the same pitches, a destination row can only overlap source rows with a lower (if the destination
+            // lies behind the source) or higher index, which are then copied first
+            for(std::size_t i = 0; i < numRows; ++i)
+            {
+                auto row = dest > src ? numRows - 1 - i : i;
+                auto offset = rowOffset(row, sourceRowPitch, sourceSlicePitch);
+                memmove(dest + offset, src + offset, region[0]);
+            }
+            return;
+        }
+        // there is no copy order not overwriting source data in general, so copy from a snapshot of the source
+        temporary.resize(sourceExtent);
+        copyHostMemory(temporary.data(), CacheType::BOTH_CACHED, src, sourceCaching, sourceExtent);
+        src = temporary.data();
+        sourceCaching = CacheType::BOTH_CACHED;
+    }
+
+    // the source and destination do not overlap, so the rows (or parts of a single row) can be copied in any order
+    if(numRows == 1)
+    {
+        copyHostMemory(dest, destinationCaching, src, sourceCaching, region[0]);
+        return;
+    }
+    const auto numTasks = std::min(getNumHostTransferTasks(region[0] * numRows), numRows);
+    runParallelHostTasks(numTasks, [&](std::size_t task) {
+        for(auto row = numRows * task / numTasks; row < numRows * (task + 1) / numTasks; ++row)
+            copyChunk(dest + rowOffset(row, destRowPitch, destSlicePitch), destinationCaching,
+                src + rowOffset(row, sourceRowPitch, sourceSlicePitch), sourceCaching, region[0]);
+    });
+}
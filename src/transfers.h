@@ -0,0 +1,138 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+
+#ifndef VC4CL_TRANSFERS
+#define VC4CL_TRANSFERS
+
+#include "Memory.h"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace vc4cl
+{
+    class Buffer;
+    class Kernel;
+
+    /*
+     * Executes large buffer copies and fills on the QPUs instead of the host CPU
+     *
+     * Copying or filling large buffers on the host occupies the (on older models single) ARM core also running the
+     * event handlers for a long time, while reaching only a fraction of the memory bandwidth available to the QPUs.
+     *
+     * The kernels are compiled from OpenCL C source into an internal program on first use. If no compiler is available
+     * or the compilation fails, all transfers are executed on the host.
+     *
+     * Only the parts of the transfers aligned to whole 16-element vectors are executed on the QPUs, and only if they
+     * are at least as large as the configured threshold. The callers need to execute the remaining parts on the host.
+     * The QPUs are acquired via the DeviceArbiter like for any other kernel execution.
+     */
+    class QPUTransfers
+    {
+    public:
+        // The size of the single elements accessed by the QPUs, a 16-element vector of 32-bit values
+        static constexpr std::size_t VECTOR_SIZE = 64;
+        // The default minimum number of bytes to be transferred by the QPUs
+        static constexpr std::size_t DEFAULT_THRESHOLD = 1024 * 1024;
+
+        QPUTransfers(const QPUTransfers&) = delete;
+        QPUTransfers(QPUTransfers&&) = delete;
+        ~QPUTransfers() = default;
+
+        QPUTransfers& operator=(const QPUTransfers&) = delete;
+        QPUTransfers& operator=(QPUTransfers&&) = delete;
+
+        static QPUTransfers& getInstance();
+
+        /*
+         * Copies the largest vector-aligned part of the given range on the QPUs.
+         *
+         * Returns the part (relative to the start of the range) which was copied, the range is empty if nothing was
+         * copied on the QPUs.
+         */
+        ByteRange copyBuffer(Buffer& source, std::size_t sourceOffset, Buffer& destination, std::size_t destOffset,
+            std::size_t numBytes);
+        /*
+         * Fills the largest vector-aligned part of the given range with the pattern on the QPUs.
+         *
+         * Returns the part (relative to the start of the range) which was filled, the range is empty if nothing was
+         * filled on the QPUs.
+         */
+        ByteRange fillBuffer(
+            Buffer& buffer, std::size_t offset, std::size_t numBytes, const std::vector<char>& pattern);
+        /*
+         * Copies the whole rectangular region on the QPUs.
+         *
+         * Returns false if nothing was copied, e.g. if the region or pitches are not vector-aligned.
+         */
+        bool copyBufferRect(Buffer& source, Buffer& destination, const std::array<std::size_t, 3>& sourceOrigin,
+            std::size_t sourceRowPitch, std::size_t sourceSlicePitch, const std::array<std::size_t, 3>& destOrigin,
+            std::size_t destRowPitch, std::size_t destSlicePitch, const std::array<std::size_t, 3>& region);
+
+        /*
+         * The minimum number of bytes to be transferred by the QPUs, a threshold of zero disables the QPU transfers.
+         *
+         * Defaults to the value of the VC4CL_QPU_TRANSFER_THRESHOLD environment variable, if set.
+         */
+        std::size_t getThreshold() const;
+        void setThreshold(std::size_t numBytes);
+
+    private:
+        QPUTransfers();
+
+        enum class KernelStatus
+        {
+            // the internal program was not yet compiled
+            NOT_LOADED,
+            LOADED,
+            // the compilation failed, all transfers are executed on the host
+            UNAVAILABLE
+        };
+
+        // guards the loading of the kernels and the setting of their arguments
+        std::mutex kernelLock;
+        KernelStatus status;
+        std::atomic<std::size_t> threshold;
+        // the kernels are owned by the object tracker and live until the library is unloaded
+        Kernel* copyKernel;
+        Kernel* fillKernel;
+        Kernel* copyRectKernel;
+
+        // requires the kernel lock to be held
+        bool loadKernels();
+        bool execute(Kernel* QPUTransfers::*kernel, const std::vector<std::pair<std::size_t, const void*>>& arguments);
+    };
+
+    /*
+     * Copies the given number of bytes between the (not overlapping) memory areas on the host.
+     *
+     * Large copies are split into chunks of whole cache lines, which are copied in parallel by the host transfer
+     * threads (see #runParallelHostTasks). The way the chunks are copied is selected by the host caching of the source
+     * and destination memory, e.g. reading from memory not cached by the host is done in whole cache lines.
+     */
+    void copyHostMemory(void* destination, CacheType destinationCaching, const void* source, CacheType sourceCaching,
+        std::size_t numBytes);
+
+    /*
+     * Returns the number of bytes from the first to the last byte (inclusive) of the given rectangular region
+     */
+    std::size_t getRectExtent(const std::array<std::size_t, 3>& region, std::size_t rowPitch, std::size_t slicePitch);
+
+    /*
+     * Copies the rectangular region from the source into the destination memory area on the host.
+     *
+     * Contiguous rows and slices are collapsed into single copies and large regions are split across the host transfer
+     * threads. Overlapping memory areas are copied in the direction not overwriting any not yet copied source data, or
+     * via a temporary copy of the source if the pitches differ.
+     */
+    void copyHostRect(void* destination, CacheType destinationCaching, std::size_t destRowPitch,
+        std::size_t destSlicePitch, const void* source, CacheType sourceCaching, std::size_t sourceRowPitch,
+        std::size_t sourceSlicePitch, std::array<std::size_t, 3> region);
+} /* namespace vc4cl */
+
+#endif /* VC4CL_TRANSFERS */
@@ -0,0 +1,554 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+
+#include "TestBenchmarks.h"
+
+#include "src/Kernel.h"
+#include "src/Memory.h"
+#include "src/Platform.h"
+#include "src/hal/hal.h"
+#include "src/icd_loader.h"
+#include "src/queue_handler.h"
+#include "src/transfers.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+using namespace vc4cl;
+
+using Clock = std::chrono::steady_clock;
+
+static void printTiming(const std::string& name, Clock::duration duration, std::size_t iterations)
+{
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    std::cout << "[Benchmark] " << name << ": " << (nanos / static_cast<decltype(nanos)>(iterations)) << " ns ("
+              << iterations << " iterations)" << std::endl;
+}
+
+static void printBandwidth(const std::string& name, Clock::duration duration, std::size_t numBytes)
+{
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    std::cout << "[Benchmark] " << name << ": "
+              << (static_cast<double>(numBytes) / static_cast<double>(std::max(micros, decltype(micros){1})))
+              << " MB/s (" << numBytes << " bytes)" << std::endl;
+}
+
+TestBenchmarks::TestBenchmarks() : context(nullptr), queue(nullptr)
+{
+    TEST_ADD(TestBenchmarks::testLaunchPlanUniforms);
+    TEST_ADD(TestBenchmarks::testEventRoundTrips);
+    TEST_ADD(TestBenchmarks::testConcurrentSubmission);
+    TEST_ADD(TestBenchmarks::testFillPatterns);
+    TEST_ADD(TestBenchmarks::testRectTransfers);
+    TEST_ADD(TestBenchmarks::testHostTransferBandwidth);
+}
+
+bool TestBenchmarks::setup()
+{
+    cl_int state = CL_SUCCESS;
+    cl_device_id device_id = Platform::getVC4CLPlatform().VideoCoreIVGPU.toBase();
+    context = VC4CL_FUNC(clCreateContext)(nullptr, 1, &device_id, nullptr, nullptr, &state);
+    queue = VC4CL_FUNC(clCreateCommandQueue)(context, Platform::getVC4CLPlatform().VideoCoreIVGPU.toBase(), 0, &state);
+    return state == CL_SUCCESS && context != nullptr && queue != nullptr;
+}
+
+/*
+ * Writes the UNIFORMs of all QPUs the way it was done before the introduction of the launch plan, by re-deriving the
+ * layout from the kernel meta-data and the argument types for every QPU.
+ */
+static uint32_t* deriveUniforms(uint32_t* p, const KernelExecution& execution, const KernelUniforms& uniforms,
+    std::size_t numParameters, const std::array<std::size_t, kernel_config::NUM_DIMENSIONS>& groupIDs,
+    std::size_t localID)
+{
+    if(uniforms.getWorkDimensionsUsed())
+        *p++ = execution.numDimensions;
+    if(uniforms.getLocalSizesUsed())
+        *p++ = static_cast<uint32_t>(
+            execution.localSizes[2] << 16 | execution.localSizes[1] << 8 | execution.localSizes[0]);
+    if(uniforms.getLocalIDsUsed())
+        *p++ = static_cast<uint32_t>(localID);
+    if(uniforms.getNumGroupsXUsed())
+        *p++ = static_cast<uint32_t>(execution.globalSizes[0] / execution.localSizes[0]);
+    if(uniforms.getNumGroupsYUsed())
+        *p++ = static_cast<uint32_t>(execution.globalSizes[1] / execution.localSizes[1]);
+    if(uniforms.getNumGroupsZUsed())
+        *p++ = static_cast<uint32_t>(execution.globalSizes[2] / execution.localSizes[2]);
+    if(uniforms.getGroupIDXUsed())
+        *p++ = static_cast<uint32_t>(groupIDs[0]);
+    if(uniforms.getGroupIDYUsed())
+        *p++ = static_cast<uint32_t>(groupIDs[1]);
+    if(uniforms.getGroupIDZUsed())
+        *p++ = static_cast<uint32_t>(groupIDs[2]);
+    if(uniforms.getGlobalOffsetXUsed())
+        *p++ = static_cast<uint32_t>(execution.globalOffsets[0]);
+    if(uniforms.getGlobalOffsetYUsed())
+        *p++ = static_cast<uint32_t>(execution.globalOffsets[1]);
+    if(uniforms.getGlobalOffsetZUsed())
+        *p++ = static_cast<uint32_t>(execution.globalOffsets[2]);
+    if(uniforms.getGlobalDataAddressUsed())
+        *p++ = 0;
+    for(unsigned u = 0; u < numParameters; ++u)
+    {
+        auto tmpBufferIt = execution.tmpBuffers.find(u);
+        auto persistentBufferIt = execution.persistentBuffers.find(u);
+        if(tmpBufferIt != execution.tmpBuffers.end())
+            *p++ = tmpBufferIt->second ? static_cast<uint32_t>(tmpBufferIt->second->qpuPointer) : 0u;
+        else if(persistentBufferIt != execution.persistentBuffers.end())
+            *p++ = static_cast<uint32_t>(persistentBufferIt->second.second);
+        else if(auto scalarArg = dynamic_cast<const ScalarArgument*>(execution.executionArguments.at(u).get()))
+        {
+            for(const auto& val : scalarArg->scalarValues)
+                *p++ = val.getUnsigned();
+        }
+    }
+    return p;
+}
+
+void TestBenchmarks::testLaunchPlanUniforms()
+{
+    static constexpr std::size_t NUM_QPUS = 12;
+    static constexpr std::size_t NUM_GROUPS = 64;
+    static constexpr std::size_t NUM_LAUNCHES = 2000;
+
+    // all implicit UNIFORMs (without the work-group loop) and a mix of 8 buffer and scalar arguments
+    KernelHeader info(0);
+    info.uniformsUsed.value = (1u << 13) - 1u;
+    std::vector<std::unique_ptr<KernelArgument>> arguments;
+    for(unsigned i = 0; i < 8; ++i)
+    {
+        if(i % 2 == 0)
+            arguments.emplace_back(new BufferArgument(nullptr));
+        else
+        {
+            auto scalar = std::make_unique<ScalarArgument>(4);
+            for(uint32_t k = 0; k < 4; ++k)
+                scalar->addScalar(i * 4 + k);
+            arguments.emplace_back(std::move(scalar));
+        }
+    }
+
+    auto program = newOpenCLObject<Program>(toType<Context>(context), std::vector<char>{}, CreationType::BINARY);
+    TEST_ASSERT(program != nullptr);
+    auto kernel = newOpenCLObject<Kernel>(program, info);
+    TEST_ASSERT(kernel != nullptr);
+    if(!program || !kernel)
+        return;
+    KernelExecution execution(kernel);
+    execution.numDimensions = 1;
+    execution.globalOffsets = {0, 0, 0};
+    execution.globalSizes = {NUM_QPUS * NUM_GROUPS, 1, 1};
+    execution.localSizes = {NUM_QPUS, 1, 1};
+    for(unsigned i = 0; i < arguments.size(); ++i)
+    {
+        execution.executionArguments.emplace_back(arguments[i]->clone());
+        if(i % 2 == 0)
+            execution.persistentBuffers.emplace(i, std::make_pair(nullptr, DevicePointer{0}));
+    }
+
+    auto plan = LaunchPlan::create(info, arguments);
+    TEST_ASSERT(plan != nullptr);
+    if(!plan)
+        return;
+    const auto uniformsPerQPU = plan->getUniformsPerQPU();
+    TEST_ASSERT_EQUALS(13u + 4u + 4u * 4u, uniformsPerQPU);
+
+    std::vector<uint32_t> planBlock(NUM_QPUS * uniformsPerQPU);
+    std::vector<uint32_t> derivedBlock(NUM_QPUS * uniformsPerQPU);
+
+    auto start = Clock::now();
+    for(std::size_t launch = 0; launch < NUM_LAUNCHES; ++launch)
+    {
+        std::array<std::size_t, kernel_config::NUM_DIMENSIONS> groupIDs{0, 0, 0};
+        for(; groupIDs[0] < NUM_GROUPS; ++groupIDs[0])
+        {
+            uint32_t* p = derivedBlock.data();
+            for(std::size_t qpu = 0; qpu < NUM_QPUS; ++qpu)
+                p = deriveUniforms(p, execution, info.uniformsUsed, arguments.size(), groupIDs, qpu);
+        }
+    }
+    printTiming("UNIFORMs re-derived per QPU and work-group", Clock::now() - start, NUM_LAUNCHES);
+
+    start = Clock::now();
+    for(std::size_t launch = 0; launch < NUM_LAUNCHES; ++launch)
+    {
+        std::array<std::size_t, kernel_config::NUM_DIMENSIONS> groupIDs{0, 0, 0};
+        std::array<std::size_t, kernel_config::NUM_DIMENSIONS> localIDs{0, 0, 0};
+        TEST_ASSERT_EQUALS(CL_SUCCESS, plan->writeTemplate(planBlock.data(), execution, 0));
+        for(std::size_t qpu = 0; qpu < NUM_QPUS; ++qpu)
+        {
+            uint32_t* p = planBlock.data() + qpu * uniformsPerQPU;
+            if(qpu != 0)
+                std::copy_n(planBlock.data(), uniformsPerQPU, p);
+            localIDs[0] = qpu;
+            plan->setLocalIDs(p, localIDs, 1);
+        }
+        for(++groupIDs[0]; groupIDs[0] < NUM_GROUPS; ++groupIDs[0])
+        {
+            for(std::size_t qpu = 0; qpu < NUM_QPUS; ++qpu)
+                plan->setGroupIDs(planBlock.data() + qpu * uniformsPerQPU, groupIDs);
+        }
+    }
+    printTiming("UNIFORMs patched from launch plan", Clock::now() - start, NUM_LAUNCHES);
+
+    // both variants need to produce the same UNIFORMs for the last work-group
+    TEST_ASSERT(planBlock == derivedBlock);
+
+    ignoreReturnValue(kernel->release(), __FILE__, __LINE__, "Test cleanup");
+    ignoreReturnValue(program->release(), __FILE__, __LINE__, "Test cleanup");
+}
+
+void TestBenchmarks::testEventRoundTrips()
+{
+    static constexpr std::size_t NUM_ROUND_TRIPS = 1000;
+
+    // enqueue -> complete of a command without any actual work, i.e. the pure scheduling overhead
+    auto start = Clock::now();
+    for(std::size_t i = 0; i < NUM_ROUND_TRIPS; ++i)
+    {
+        cl_event event = nullptr;
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 0, nullptr, &event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clWaitForEvents)(1, &event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(event));
+    }
+    printTiming("Marker enqueue to completion", Clock::now() - start, NUM_ROUND_TRIPS);
+
+    // user event completion -> completion of the command waiting for it
+    start = Clock::now();
+    for(std::size_t i = 0; i < NUM_ROUND_TRIPS; ++i)
+    {
+        cl_int state = CL_SUCCESS;
+        cl_event userEvent = VC4CL_FUNC(clCreateUserEvent)(context, &state);
+        TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+        cl_event event = nullptr;
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 1, &userEvent, &event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clSetUserEventStatus)(userEvent, CL_COMPLETE));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clWaitForEvents)(1, &event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(userEvent));
+    }
+    printTiming("User event completion to dependent completion", Clock::now() - start, NUM_ROUND_TRIPS);
+
+    start = Clock::now();
+    for(std::size_t i = 0; i < NUM_ROUND_TRIPS; ++i)
+    {
+        cl_event event = nullptr;
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 0, nullptr, &event));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(event));
+    }
+    printTiming("Marker enqueue to finished queue", Clock::now() - start, NUM_ROUND_TRIPS);
+
+#if HAS_COMPILER
+    // enqueue -> complete of a trivial kernel, executed in the emulator for MOCK_HAL builds
+    static constexpr std::size_t NUM_KERNEL_ROUND_TRIPS = 20;
+    static const std::string source = "__kernel void trivial(__global int* out) { out[get_global_id(0)] = 42; }";
+    const char* sourceText = source.data();
+    const std::size_t sourceLength = source.size();
+    cl_int state = CL_SUCCESS;
+    cl_program program = VC4CL_FUNC(clCreateProgramWithSource)(context, 1, &sourceText, &sourceLength, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_device_id device_id = Platform::getVC4CLPlatform().VideoCoreIVGPU.toBase();
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clBuildProgram)(program, 1, &device_id, "", nullptr, nullptr));
+    cl_kernel kernel = VC4CL_FUNC(clCreateKernel)(program, "trivial", &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_mem buffer = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_WRITE_ONLY, 12 * sizeof(cl_int), nullptr, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clSetKernelArg)(kernel, 0, sizeof(cl_mem), &buffer);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+
+    if(state == CL_SUCCESS)
+    {
+        const std::size_t globalSize = 12;
+        start = Clock::now();
+        for(std::size_t i = 0; i < NUM_KERNEL_ROUND_TRIPS; ++i)
+        {
+            cl_event event = nullptr;
+            TEST_ASSERT_EQUALS(CL_SUCCESS,
+                VC4CL_FUNC(clEnqueueNDRangeKernel)(
+                    queue, kernel, 1, nullptr, &globalSize, &globalSize, 0, nullptr, &event));
+            TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clWaitForEvents)(1, &event));
+            TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(event));
+        }
+        printTiming("Trivial kernel enqueue to completion", Clock::now() - start, NUM_KERNEL_ROUND_TRIPS);
+    }
+
+    // release the objects on every path, e.g. if the program failed to build
+    if(buffer)
+        VC4CL_FUNC(clReleaseMemObject)(buffer);
+    if(kernel)
+        VC4CL_FUNC(clReleaseKernel)(kernel);
+    if(program)
+        VC4CL_FUNC(clReleaseProgram)(program);
+#endif
+}
+
+void TestBenchmarks::testConcurrentSubmission()
+{
+    static constexpr std::size_t NUM_PRODUCERS = 4;
+    static constexpr std::size_t NUM_COMMANDS_PER_PRODUCER = 5000;
+
+    cl_int state = CL_SUCCESS;
+    // block the queue until all commands are submitted to measure the pure submission overhead
+    cl_event userEvent = VC4CL_FUNC(clCreateUserEvent)(context, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 1, &userEvent, nullptr));
+
+    std::vector<std::thread> producers;
+    std::vector<cl_int> results(NUM_PRODUCERS, CL_SUCCESS);
+    auto start = Clock::now();
+    for(std::size_t p = 0; p < NUM_PRODUCERS; ++p)
+    {
+        producers.emplace_back([&, p]() {
+            for(std::size_t i = 0; i < NUM_COMMANDS_PER_PRODUCER; ++i)
+            {
+                auto status = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 0, nullptr, nullptr);
+                if(status != CL_SUCCESS)
+                    results[p] = status;
+            }
+        });
+    }
+    for(auto& producer : producers)
+        producer.join();
+    printTiming("Concurrent submission by " + std::to_string(NUM_PRODUCERS) + " threads", Clock::now() - start,
+        NUM_PRODUCERS * NUM_COMMANDS_PER_PRODUCER);
+    for(auto result : results)
+        TEST_ASSERT_EQUALS(CL_SUCCESS, result);
+
+    start = Clock::now();
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clSetUserEventStatus)(userEvent, CL_COMPLETE));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    printTiming("Execution of concurrently submitted commands", Clock::now() - start,
+        NUM_PRODUCERS * NUM_COMMANDS_PER_PRODUCER);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(userEvent));
+
+    // submission and execution in parallel
+    producers.clear();
+    start = Clock::now();
+    for(std::size_t p = 0; p < NUM_PRODUCERS; ++p)
+    {
+        producers.emplace_back([&, p]() {
+            for(std::size_t i = 0; i < NUM_COMMANDS_PER_PRODUCER; ++i)
+            {
+                auto status = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 0, nullptr, nullptr);
+                if(status != CL_SUCCESS)
+                    results[p] = status;
+            }
+        });
+    }
+    for(auto& producer : producers)
+        producer.join();
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    printTiming("Concurrent submission and execution by " + std::to_string(NUM_PRODUCERS) + " threads",
+        Clock::now() - start, NUM_PRODUCERS * NUM_COMMANDS_PER_PRODUCER);
+    for(auto result : results)
+        TEST_ASSERT_EQUALS(CL_SUCCESS, result);
+}
+
+void TestBenchmarks::testFillPatterns()
+{
+    static constexpr std::size_t NUM_ITERATIONS = 10;
+    static constexpr std::size_t NUM_BYTES = 4 * 1024 * 1024;
+    // not aligned to the cache line or to any pattern size
+    static constexpr std::size_t MISALIGNMENT = 3;
+
+    std::vector<uint8_t> pattern(128);
+    for(std::size_t i = 0; i < pattern.size(); ++i)
+        pattern[i] = static_cast<uint8_t>(i * 7 + 1);
+    std::vector<uint8_t> expected(NUM_BYTES + MISALIGNMENT);
+    std::vector<uint8_t> result(NUM_BYTES + MISALIGNMENT);
+
+    cl_int state = CL_SUCCESS;
+    cl_mem buffer = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_READ_WRITE, NUM_BYTES, nullptr, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    if(state != CL_SUCCESS)
+        return;
+
+    for(std::size_t patternSize = 1; patternSize <= pattern.size(); patternSize *= 2)
+    {
+        const auto suffix = " (" + std::to_string(patternSize) + "-byte pattern)";
+        // the size is not a multiple of the fill block size to also cover the tail
+        const std::size_t numBytes = NUM_BYTES - 3 * patternSize;
+
+        // the previous implementation, one copy per pattern
+        auto start = Clock::now();
+        for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+        {
+            for(std::size_t offset = 0; offset < numBytes; offset += patternSize)
+                memcpy(expected.data() + MISALIGNMENT + offset, pattern.data(), patternSize);
+        }
+        printTiming("Fill per pattern" + suffix, Clock::now() - start, NUM_ITERATIONS);
+
+        start = Clock::now();
+        for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+            fillMemory(result.data() + MISALIGNMENT, numBytes, pattern.data(), patternSize);
+        printTiming("Fill via replicated block" + suffix, Clock::now() - start, NUM_ITERATIONS);
+        TEST_ASSERT(std::equal(expected.begin() + MISALIGNMENT, expected.begin() + MISALIGNMENT + numBytes,
+            result.begin() + MISALIGNMENT));
+
+        start = Clock::now();
+        for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+        {
+            TEST_ASSERT_EQUALS(CL_SUCCESS,
+                VC4CL_FUNC(clEnqueueFillBuffer)(
+                    queue, buffer, pattern.data(), patternSize, patternSize, numBytes, 0, nullptr, nullptr));
+        }
+        TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+        printTiming("clEnqueueFillBuffer" + suffix, Clock::now() - start, NUM_ITERATIONS);
+        TEST_ASSERT_EQUALS(CL_SUCCESS,
+            VC4CL_FUNC(clEnqueueReadBuffer)(
+                queue, buffer, CL_TRUE, patternSize, numBytes, result.data(), 0, nullptr, nullptr));
+        TEST_ASSERT(std::equal(expected.begin() + MISALIGNMENT, expected.begin() + MISALIGNMENT + numBytes,
+            result.begin()));
+    }
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(buffer));
+}
+
+void TestBenchmarks::testRectTransfers()
+{
+    static constexpr std::size_t NUM_ITERATIONS = 10;
+    static constexpr std::size_t ROW_SIZE = 2048;
+    static constexpr std::size_t NUM_ROWS = 1024;
+    static constexpr std::size_t TILE_SIZE = 64;
+
+    std::vector<uint8_t> input(ROW_SIZE * NUM_ROWS);
+    for(std::size_t i = 0; i < input.size(); ++i)
+        input[i] = static_cast<uint8_t>(i * 13 + i / 251);
+    std::vector<uint8_t> result(input.size());
+
+    cl_int state = CL_SUCCESS;
+    cl_mem buffer = VC4CL_FUNC(clCreateBuffer)(
+        context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, input.size(), input.data(), &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    if(state != CL_SUCCESS)
+        return;
+
+    // contiguous rows, copied at once
+    const std::size_t origin[3] = {0, 0, 0};
+    const std::size_t fullRegion[3] = {ROW_SIZE, NUM_ROWS, 1};
+    auto start = Clock::now();
+    for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        TEST_ASSERT_EQUALS(CL_SUCCESS,
+            VC4CL_FUNC(clEnqueueReadBufferRect)(queue, buffer, CL_TRUE, origin, origin, fullRegion, ROW_SIZE, 0,
+                ROW_SIZE, 0, result.data(), 0, nullptr, nullptr));
+    }
+    printTiming("clEnqueueReadBufferRect (contiguous rows)", Clock::now() - start, NUM_ITERATIONS);
+    TEST_ASSERT(input == result);
+
+    // half of every row, split across the host threads
+    const std::size_t halfRegion[3] = {ROW_SIZE / 2, NUM_ROWS, 1};
+    std::fill(result.begin(), result.end(), 0);
+    start = Clock::now();
+    for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+    {
+        TEST_ASSERT_EQUALS(CL_SUCCESS,
+            VC4CL_FUNC(clEnqueueReadBufferRect)(queue, buffer, CL_TRUE, origin, origin, halfRegion, ROW_SIZE, 0,
+                ROW_SIZE, 0, result.data(), 0, nullptr, nullptr));
+    }
+    printTiming("clEnqueueReadBufferRect (half rows)", Clock::now() - start, NUM_ITERATIONS);
+    for(std::size_t row = 0; row < NUM_ROWS; ++row)
+    {
+        TEST_ASSERT(std::equal(input.begin() + static_cast<std::ptrdiff_t>(row * ROW_SIZE),
+            input.begin() + static_cast<std::ptrdiff_t>(row * ROW_SIZE + ROW_SIZE / 2),
+            result.begin() + static_cast<std::ptrdiff_t>(row * ROW_SIZE)));
+    }
+
+    // the whole buffer in small tiles, like e.g. a tile-based image pipeline would
+    std::fill(result.begin(), result.end(), 0);
+    const std::size_t tileRegion[3] = {TILE_SIZE, TILE_SIZE, 1};
+    start = Clock::now();
+    for(std::size_t y = 0; y < NUM_ROWS; y += TILE_SIZE)
+    {
+        for(std::size_t x = 0; x < ROW_SIZE; x += TILE_SIZE)
+        {
+            const std::size_t tileOrigin[3] = {x, y, 0};
+            TEST_ASSERT_EQUALS(CL_SUCCESS,
+                VC4CL_FUNC(clEnqueueReadBufferRect)(queue, buffer, CL_FALSE, tileOrigin, tileOrigin, tileRegion,
+                    ROW_SIZE, 0, ROW_SIZE, 0, result.data(), 0, nullptr, nullptr));
+        }
+    }
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    printTiming("clEnqueueReadBufferRect (64x64 tiles)", Clock::now() - start,
+        (ROW_SIZE / TILE_SIZE) * (NUM_ROWS / TILE_SIZE));
+    TEST_ASSERT(input == result);
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(buffer));
+}
+
+static const char* toString(CacheType type)
+{
+    switch(type)
+    {
+    case CacheType::UNCACHED:
+        return "uncached";
+    case CacheType::HOST_CACHED:
+        return "host-cached";
+    case CacheType::GPU_CACHED:
+        return "GPU-cached";
+    case CacheType::BOTH_CACHED:
+        return "host- and GPU-cached";
+    }
+    return "?";
+}
+
+void TestBenchmarks::testHostTransferBandwidth()
+{
+    static constexpr std::size_t NUM_ITERATIONS = 4;
+    static constexpr std::size_t NUM_BYTES = 4 * 1024 * 1024;
+    static const std::array<CacheType, 4> cacheTypes = {
+        CacheType::UNCACHED, CacheType::HOST_CACHED, CacheType::GPU_CACHED, CacheType::BOTH_CACHED};
+
+    // a buffer of every caching type (only on the actual hardware, the emulated memory is always cached). The copies
+    // into the first buffer are not aligned, to also cover the unaligned head and tail
+    std::array<std::unique_ptr<DeviceBuffer>, 4> buffers;
+    for(std::size_t i = 0; i < cacheTypes.size(); ++i)
+    {
+        buffers[i] = system()->allocateBuffer(NUM_BYTES + 64, "Benchmark buffer", cacheTypes[i]);
+        TEST_ASSERT(buffers[i] != nullptr);
+        if(!buffers[i])
+            return;
+        auto data = static_cast<uint8_t*>(buffers[i]->hostPointer);
+        for(std::size_t k = 0; k < NUM_BYTES + 64; ++k)
+            data[k] = static_cast<uint8_t>(k * (i + 3));
+    }
+
+    for(std::size_t s = 0; s < cacheTypes.size(); ++s)
+    {
+        for(std::size_t d = 0; d < cacheTypes.size(); ++d)
+        {
+            if(s == d)
+                continue;
+            const auto suffix =
+                std::string(" (") + toString(cacheTypes[s]) + " to " + toString(cacheTypes[d]) + ")";
+            auto source = static_cast<const uint8_t*>(buffers[s]->hostPointer);
+            auto destination = static_cast<uint8_t*>(buffers[d]->hostPointer) + (d == 0 ? 3 : 0);
+
+            auto start = Clock::now();
+            for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+                memcpy(destination, source, NUM_BYTES);
+            printBandwidth("Single memcpy" + suffix, Clock::now() - start, NUM_ITERATIONS * NUM_BYTES);
+
+            std::memset(destination, 0, NUM_BYTES);
+            start = Clock::now();
+            for(std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+                copyHostMemory(destination, cacheTypes[d], source, cacheTypes[s], NUM_BYTES);
+            printBandwidth("Host transfer engine" + suffix, Clock::now() - start, NUM_ITERATIONS * NUM_BYTES);
+            TEST_ASSERT(std::equal(source, source + NUM_BYTES, destination));
+        }
+    }
+    std::cout << "[Benchmark] Host transfer threads: " << getNumHostTransferThreads() << std::endl;
+}
+
+void TestBenchmarks::tear_down()
+{
+    VC4CL_FUNC(clReleaseCommandQueue)(queue);
+    VC4CL_FUNC(clReleaseContext)(context);
+}
@@ -0,0 +1,41 @@
+/*
+ * Author: doe300
+ *
+ * See the file "LICENSE" for the full license governing this code.
+ */
+
+#ifndef TESTBENCHMARKS_H
+#define TESTBENCHMARKS_H
+
+#include "src/vc4cl_config.h"
+
+#include "cpptest.h"
+
+/*
+ * Micro-benchmarks for the host-side overhead of the runtime.
+ *
+ * The benchmarks print their timings and only check the results for correctness. For comparable numbers, they should
+ * be run on a build with MOCK_HAL enabled (i.e. without any hardware access).
+ */
+class TestBenchmarks : public Test::Suite
+{
+public:
+    TestBenchmarks();
+
+    bool setup() override;
+
+    void testLaunchPlanUniforms();
+    void testEventRoundTrips();
+    void testConcurrentSubmission();
+    void testFillPatterns();
+    void testRectTransfers();
+    void testHostTransferBandwidth();
+
+    void tear_down() override;
+
+private:
+    cl_context context;
+    cl_command_queue queue;
+};
+
+#endif /* TESTBENCHMARKS_H */
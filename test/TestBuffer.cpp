@@ -4,19 +4,27 @@
  * See the file "LICENSE" for the full license governing this code.
  */
 
+#include <algorithm>
+#include <array>
 #include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
 
 #include "TestBuffer.h"
 
 #include "src/Buffer.h"
 #include "src/icd_loader.h"
 #include "src/Device.h"
+#include "src/hal/hal.h"
+#include "src/transfers.h"
 
 using namespace vc4cl;
 
 TestBuffer::TestBuffer() : num_callback_called(0), context(nullptr), buffer(nullptr), queue(nullptr), mapped_ptr(nullptr)
 {
     TEST_ADD(TestBuffer::testCreateBuffer);
+    TEST_ADD(TestBuffer::testCreateBufferFromHostPointer);
     TEST_ADD(TestBuffer::testCreateSubBuffer);
     TEST_ADD(TestBuffer::testEnqueueReadBuffer);
     TEST_ADD(TestBuffer::testEnqueueWriteBuffer);
@@ -26,10 +34,14 @@ TestBuffer::TestBuffer() : num_callback_called(0), context(nullptr), buffer(null
     TEST_ADD(TestBuffer::testEnqueueFillBufferRect);
     TEST_ADD(TestBuffer::testEnqueueCopyBuffer);
     TEST_ADD(TestBuffer::testEnqueueCopyBufferRect);
+#if HAS_COMPILER
+    TEST_ADD(TestBuffer::testQPUTransfers);
+#endif
     
     TEST_ADD(TestBuffer::testEnqueueMapBuffer);
     TEST_ADD(TestBuffer::testGetMemObjectInfo);
     TEST_ADD(TestBuffer::testEnqueueUnmapMemObject);
+    TEST_ADD(TestBuffer::testMapOverlappingRegions);
     TEST_ADD(TestBuffer::testEnqueueMigrateMemObjects);
     TEST_ADD(TestBuffer::testRetainMemObject);
     TEST_ADD(TestBuffer::testSetMemObjectDestructorCallback);
@@ -56,6 +68,85 @@ void TestBuffer::testCreateBuffer()
     buffer = VC4CL_FUNC(clCreateBuffer)(context, 0, 1024, nullptr, &errcode);
     TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
     TEST_ASSERT(buffer != nullptr);
+    // the device buffer is only allocated on first use
+    TEST_ASSERT(!toType<Buffer>(buffer)->deviceBuffer);
+    size_t size = 0;
+    errcode = VC4CL_FUNC(clGetMemObjectInfo)(buffer, CL_MEM_SIZE, sizeof(size), &size, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(1024u, size);
+}
+
+void TestBuffer::testCreateBufferFromHostPointer()
+{
+    // host memory owned by the application (here a shared memory file) is never re-mapped, but copied
+    const size_t size = 2 * PAGE_ALIGNMENT;
+    int memoryFd = memfd_create("TestBuffer", MFD_CLOEXEC);
+    TEST_ASSERT(memoryFd >= 0);
+    TEST_ASSERT_EQUALS(0, ftruncate(memoryFd, static_cast<off_t>(size)));
+    void* hostMemory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    TEST_ASSERT(hostMemory != MAP_FAILED);
+    memset(hostMemory, 0x42, size);
+
+    cl_int errcode = CL_SUCCESS;
+    cl_mem hostBuffer = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_USE_HOST_PTR, size, hostMemory, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(hostMemory != toType<Buffer>(hostBuffer)->deviceBuffer->hostPointer);
+    TEST_ASSERT_EQUALS(0x42, static_cast<uint8_t*>(toType<Buffer>(hostBuffer)->deviceBuffer->hostPointer)[size - 1]);
+    void* mappedPointer = VC4CL_FUNC(clEnqueueMapBuffer)(
+        queue, hostBuffer, CL_TRUE, CL_MAP_READ, 0, size, 0, nullptr, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(hostMemory, mappedPointer);
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueUnmapMemObject)(queue, hostBuffer, mappedPointer, 0, nullptr, nullptr));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(hostBuffer));
+    // the host memory is still backed by the shared memory file
+    const uint8_t value = 0x17;
+    TEST_ASSERT_EQUALS(1, pwrite(memoryFd, &value, 1, PAGE_ALIGNMENT));
+    TEST_ASSERT_EQUALS(0x17, static_cast<uint8_t*>(hostMemory)[PAGE_ALIGNMENT]);
+    munmap(hostMemory, size);
+    close(memoryFd);
+
+    // host memory owned by the runtime (e.g. a mapped buffer) is imported without copying
+    cl_mem ownerBuffer = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_ALLOC_HOST_PTR, size, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    auto ownerMemory = static_cast<uint8_t*>(VC4CL_FUNC(clEnqueueMapBuffer)(
+        queue, ownerBuffer, CL_TRUE, CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &errcode));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    memset(ownerMemory, 0x42, size);
+    cl_mem importedBuffer =
+        VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_USE_HOST_PTR, 1024, ownerMemory + 256, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(toType<Buffer>(ownerBuffer)->deviceBuffer == toType<Buffer>(importedBuffer)->deviceBuffer);
+    TEST_ASSERT_EQUALS(ownerMemory + 256, toType<Buffer>(importedBuffer)->getDeviceHostPointerWithOffset());
+    TEST_ASSERT_EQUALS(static_cast<uint32_t>(toType<Buffer>(ownerBuffer)->getDevicePointerWithOffset()) + 256,
+        static_cast<uint32_t>(toType<Buffer>(importedBuffer)->getDevicePointerWithOffset()));
+    // memory not aligned to the device buffer alignment or exceeding the owning buffer is copied
+    cl_mem unalignedBuffer =
+        VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_USE_HOST_PTR, 1024, ownerMemory + 4, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(toType<Buffer>(ownerBuffer)->deviceBuffer != toType<Buffer>(unalignedBuffer)->deviceBuffer);
+    cl_mem exceedingBuffer =
+        VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_USE_HOST_PTR, size, ownerMemory + 256, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(toType<Buffer>(ownerBuffer)->deviceBuffer != toType<Buffer>(exceedingBuffer)->deviceBuffer);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(exceedingBuffer));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(unalignedBuffer));
+
+    // both buffers access the same memory
+    errcode = VC4CL_FUNC(clEnqueueWriteBuffer)(queue, importedBuffer, CL_TRUE, 0, 1, &value, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(0x17, ownerMemory[256]);
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueUnmapMemObject)(queue, ownerBuffer, ownerMemory, 0, nullptr, nullptr));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    // the imported memory stays valid as long as any buffer uses it
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(ownerBuffer));
+    uint8_t result = 0;
+    errcode = VC4CL_FUNC(clEnqueueReadBuffer)(queue, importedBuffer, CL_TRUE, 0, 1, &result, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(0x17, result);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(importedBuffer));
 }
 
 void TestBuffer::testCreateSubBuffer()
@@ -88,6 +179,7 @@ void TestBuffer::testEnqueueReadBuffer()
     char tmp[1024];
     state = VC4CL_FUNC(clEnqueueReadBuffer)(queue, buffer, CL_TRUE, 256, 512, tmp, 0, nullptr, &event);
     TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT(toType<Buffer>(buffer)->deviceBuffer != nullptr);
     TEST_ASSERT(event != nullptr);
     TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(event)->getStatus());
     
@@ -116,7 +208,45 @@ void TestBuffer::testEnqueueWriteBuffer()
 
 void TestBuffer::testEnqueueReadBufferRect()
 {
+    static constexpr std::size_t ROW_SIZE = 256;
+    static constexpr std::size_t NUM_ROWS = 64;
+    cl_int errcode = CL_SUCCESS;
+    std::vector<uint8_t> input(ROW_SIZE * NUM_ROWS);
+    for(std::size_t i = 0; i < input.size(); ++i)
+        input[i] = static_cast<uint8_t>(i * 13 + i / 251);
+    cl_mem source = VC4CL_FUNC(clCreateBuffer)(
+        context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, input.size(), input.data(), &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+
+    // read the right half of every row into a host buffer with a different pitch
+    const std::size_t bufferOrigin[3] = {ROW_SIZE / 2, 0, 0};
+    const std::size_t hostOrigin[3] = {16, 0, 0};
+    const std::size_t region[3] = {ROW_SIZE / 2, NUM_ROWS, 1};
+    const std::size_t hostRowPitch = ROW_SIZE / 2 + 32;
+    std::vector<uint8_t> output(hostRowPitch * NUM_ROWS, 0x00);
+    errcode = VC4CL_FUNC(clEnqueueReadBufferRect)(queue, source, CL_TRUE, bufferOrigin, hostOrigin, region, ROW_SIZE,
+        0, hostRowPitch, 0, output.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    for(std::size_t i = 0; i < output.size(); ++i)
+    {
+        auto x = i % hostRowPitch;
+        auto y = i / hostRowPitch;
+        uint8_t expected = x >= 16 && x < 16 + ROW_SIZE / 2 ? input[y * ROW_SIZE + ROW_SIZE / 2 + x - 16] : 0x00;
+        TEST_ASSERT_EQUALS(static_cast<unsigned>(expected), static_cast<unsigned>(output[i]));
+        if(expected != output[i])
+            break;
+    }
+
+    // read the whole buffer as a contiguous region
+    const std::size_t origin[3] = {0, 0, 0};
+    const std::size_t fullRegion[3] = {ROW_SIZE, NUM_ROWS / 4, 4};
+    output.assign(input.size(), 0x00);
+    errcode = VC4CL_FUNC(clEnqueueReadBufferRect)(queue, source, CL_TRUE, origin, origin, fullRegion, ROW_SIZE,
+        ROW_SIZE * NUM_ROWS / 4, ROW_SIZE, ROW_SIZE * NUM_ROWS / 4, output.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(input == output);
 
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(source));
 }
 
 void TestBuffer::testEnqueueWriteBufferRect()
@@ -157,7 +287,151 @@ void TestBuffer::testEnqueueCopyBuffer()
 
 void TestBuffer::testEnqueueCopyBufferRect()
 {
+    cl_int errcode = CL_SUCCESS;
+    std::vector<uint8_t> input(4096);
+    for(std::size_t i = 0; i < input.size(); ++i)
+        input[i] = static_cast<uint8_t>(i * 3);
+    cl_mem source = VC4CL_FUNC(clCreateBuffer)(
+        context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, input.size(), input.data(), &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+
+    // the rows of the left half are copied into the interleaved right half of the same buffer, so the memory areas
+    // overlap while the actual regions do not
+    const std::size_t sourceOrigin[3] = {0, 0, 0};
+    const std::size_t destOrigin[3] = {64, 0, 0};
+    const std::size_t region[3] = {64, 8, 2};
+    errcode = VC4CL_FUNC(clEnqueueCopyBufferRect)(
+        queue, source, source, sourceOrigin, destOrigin, region, 128, 1024, 128, 1024, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    std::vector<uint8_t> output(input.size(), 0x00);
+    errcode = VC4CL_FUNC(clEnqueueReadBuffer)(
+        queue, source, CL_TRUE, 0, output.size(), output.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    for(std::size_t i = 0; i < output.size(); ++i)
+    {
+        auto x = i % 128;
+        auto y = (i % 1024) / 128;
+        auto z = i / 1024;
+        uint8_t expected = z < 2 && y < 8 && x >= 64 ? input[i - 64] : input[i];
+        TEST_ASSERT_EQUALS(static_cast<unsigned>(expected), static_cast<unsigned>(output[i]));
+        if(expected != output[i])
+            break;
+    }
+
+    // contiguous rows and slices are copied at once
+    cl_mem destination = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_READ_WRITE, input.size(), nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    const std::size_t contiguousRegion[3] = {256, 4, 2};
+    const std::size_t destOffset[3] = {0, 0, 1};
+    errcode = VC4CL_FUNC(clEnqueueCopyBufferRect)(queue, source, destination, sourceOrigin, destOffset,
+        contiguousRegion, 256, 1024, 256, 1024, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    errcode = VC4CL_FUNC(clEnqueueReadBuffer)(
+        queue, destination, CL_TRUE, 1024, 2048, output.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    std::vector<uint8_t> expected(input.size(), 0x00);
+    errcode = VC4CL_FUNC(clEnqueueReadBuffer)(
+        queue, source, CL_TRUE, 0, 2048, expected.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(std::equal(expected.begin(), expected.begin() + 2048, output.begin()));
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(source));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(destination));
+}
+
+void TestBuffer::testQPUTransfers()
+{
+    // lower the threshold to run the transfers on the QPUs and check that the unaligned head and tail parts are
+    // transferred correctly too
+    auto& transfers = QPUTransfers::getInstance();
+    const auto threshold = transfers.getThreshold();
+    transfers.setThreshold(QPUTransfers::VECTOR_SIZE);
+
+    static constexpr std::size_t SIZE = 4096;
+    cl_int errcode = CL_SUCCESS;
+    cl_mem source = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_READ_WRITE, SIZE, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    cl_mem destination = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_READ_WRITE, SIZE, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
 
+    std::vector<uint8_t> input(SIZE);
+    for(std::size_t i = 0; i < SIZE; ++i)
+        input[i] = static_cast<uint8_t>(i * 7);
+    std::vector<uint8_t> output(SIZE, 0x00);
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueWriteBuffer)(queue, source, CL_TRUE, 0, SIZE, input.data(), 0, nullptr, nullptr));
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueWriteBuffer)(queue, destination, CL_TRUE, 0, SIZE, output.data(), 0, nullptr, nullptr));
+
+    // the transfers need to actually run on the QPUs, not just fall back to the host
+    auto copiedRange = transfers.copyBuffer(*toType<Buffer>(source), 8, *toType<Buffer>(destination), 136, 3900);
+    TEST_ASSERT(copiedRange.size > 0);
+    TEST_ASSERT(copiedRange.offset + copiedRange.size <= 3900);
+
+    // copy with the same misalignment of the source and destination
+    TEST_ASSERT_EQUALS(
+        CL_SUCCESS, VC4CL_FUNC(clEnqueueCopyBuffer)(queue, source, destination, 8, 136, 3900, 0, nullptr, nullptr));
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueReadBuffer)(queue, destination, CL_TRUE, 0, SIZE, output.data(), 0, nullptr, nullptr));
+    for(std::size_t i = 0; i < SIZE; ++i)
+    {
+        auto expected = i >= 136 && i < 136 + 3900 ? input[i - 128] : 0x00;
+        TEST_ASSERT_EQUALS(static_cast<unsigned>(expected), static_cast<unsigned>(output[i]));
+        if(expected != output[i])
+            break;
+    }
+
+    // fill starting and ending in the middle of a vector and of the pattern
+    std::array<uint8_t, 16> pattern{};
+    for(std::size_t i = 0; i < pattern.size(); ++i)
+        pattern[i] = static_cast<uint8_t>(0x80 + i);
+    auto filledRange = transfers.fillBuffer(
+        *toType<Buffer>(destination), 48, 3008, std::vector<char>(pattern.begin(), pattern.end()));
+    TEST_ASSERT(filledRange.size > 0);
+    TEST_ASSERT(filledRange.offset + filledRange.size <= 3008);
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueFillBuffer)(
+            queue, destination, pattern.data(), pattern.size(), 48, 3008, 0, nullptr, nullptr));
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueReadBuffer)(queue, destination, CL_TRUE, 0, SIZE, output.data(), 0, nullptr, nullptr));
+    for(std::size_t i = 0; i < SIZE; ++i)
+    {
+        uint8_t expected = i >= 136 && i < 136 + 3900 ? input[i - 128] : 0x00;
+        if(i >= 48 && i < 48 + 3008)
+            expected = pattern[(i - 48) % pattern.size()];
+        TEST_ASSERT_EQUALS(static_cast<unsigned>(expected), static_cast<unsigned>(output[i]));
+        if(expected != output[i])
+            break;
+    }
+
+    // rectangular copy of whole vectors
+    const std::size_t sourceOrigin[3] = {64, 1, 0};
+    const std::size_t destOrigin[3] = {0, 2, 1};
+    const std::size_t region[3] = {128, 4, 2};
+    TEST_ASSERT(transfers.copyBufferRect(*toType<Buffer>(source), *toType<Buffer>(destination), {64, 1, 0}, 256, 1024,
+        {0, 2, 1}, 192, 1152, {128, 4, 2}));
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueCopyBufferRect)(
+            queue, source, destination, sourceOrigin, destOrigin, region, 256, 1024, 192, 1152, 0, nullptr, nullptr));
+    std::vector<uint8_t> previous(output);
+    TEST_ASSERT_EQUALS(CL_SUCCESS,
+        VC4CL_FUNC(clEnqueueReadBuffer)(queue, destination, CL_TRUE, 0, SIZE, output.data(), 0, nullptr, nullptr));
+    for(std::size_t i = 0; i < SIZE; ++i)
+    {
+        auto z = i / 1152;
+        auto y = (i % 1152) / 192;
+        auto x = i % 192;
+        uint8_t expected = previous[i];
+        if(z >= 1 && z < 1 + 2 && y >= 2 && y < 2 + 4 && x < 128)
+            expected = input[64 + x + (y - 2 + 1) * 256 + (z - 1) * 1024];
+        TEST_ASSERT_EQUALS(static_cast<unsigned>(expected), static_cast<unsigned>(output[i]));
+        if(expected != output[i])
+            break;
+    }
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(source));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(destination));
+    transfers.setThreshold(threshold);
 }
 
 void TestBuffer::testEnqueueMapBuffer()
@@ -254,9 +528,115 @@ void TestBuffer::testEnqueueUnmapMemObject()
     mapped_ptr = nullptr;
 }
 
+void TestBuffer::testMapOverlappingRegions()
+{
+    // the host memory is not page-aligned, so it is copied into a separate device buffer
+    std::vector<uint8_t> hostData(1024 + 64, 0x00);
+    uint8_t* hostMemory = hostData.data() + 16;
+    cl_int errcode = CL_SUCCESS;
+    cl_mem hostBuffer = VC4CL_FUNC(clCreateBuffer)(context, CL_MEM_USE_HOST_PTR, 1024, hostMemory, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    memset(hostMemory, 0x33, 1024);
+
+    // only the mapped region is copied into the host memory
+    auto first = static_cast<uint8_t*>(VC4CL_FUNC(clEnqueueMapBuffer)(
+        queue, hostBuffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, 512, 0, nullptr, nullptr, &errcode));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(hostMemory, first);
+    TEST_ASSERT_EQUALS(0x00, hostMemory[300]);
+    TEST_ASSERT_EQUALS(0x33, hostMemory[600]);
+    first[100] = 0x44;
+    first[300] = 0x55;
+
+    // the already mapped part of an overlapping mapping is not overwritten
+    auto second = static_cast<uint8_t*>(VC4CL_FUNC(clEnqueueMapBuffer)(
+        queue, hostBuffer, CL_TRUE, CL_MAP_WRITE, 256, 512, 0, nullptr, nullptr, &errcode));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(hostMemory + 256, second);
+    TEST_ASSERT_EQUALS(0x55, hostMemory[300]);
+    TEST_ASSERT_EQUALS(0x00, hostMemory[600]);
+    TEST_ASSERT_EQUALS(0x33, hostMemory[800]);
+
+    cl_uint mapCount = 0;
+    errcode = VC4CL_FUNC(clGetMemObjectInfo)(hostBuffer, CL_MEM_MAP_COUNT, sizeof(mapCount), &mapCount, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(2u, mapCount);
+
+    errcode = VC4CL_FUNC(clEnqueueUnmapMemObject)(queue, hostBuffer, second, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    errcode = VC4CL_FUNC(clEnqueueUnmapMemObject)(queue, hostBuffer, first, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+
+    // only the mapped regions are written back into the device buffer
+    auto devicePointer = static_cast<const uint8_t*>(toType<Buffer>(hostBuffer)->deviceBuffer->hostPointer);
+    TEST_ASSERT_EQUALS(0x44, devicePointer[100]);
+    TEST_ASSERT_EQUALS(0x55, devicePointer[300]);
+    TEST_ASSERT_EQUALS(0x00, devicePointer[800]);
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(hostBuffer));
+}
+
 void TestBuffer::testEnqueueMigrateMemObjects()
 {
+    cl_int errcode = CL_SUCCESS;
+    cl_mem buffers[2];
+    buffers[0] = VC4CL_FUNC(clCreateBuffer)(context, 0, 256, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    buffers[1] = VC4CL_FUNC(clCreateBuffer)(context, 0, 64 * 1024, nullptr, &errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(!toType<Buffer>(buffers[0])->deviceBuffer);
+    TEST_ASSERT(!toType<Buffer>(buffers[1])->deviceBuffer);
+
+    // migrating the buffers to the device allocates them
+    cl_event event = nullptr;
+    errcode = VC4CL_FUNC(clEnqueueMigrateMemObjects)(queue, 2, buffers, 0, 0, nullptr, &event);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(toType<Buffer>(buffers[0])->deviceBuffer != nullptr);
+    TEST_ASSERT(toType<Buffer>(buffers[1])->deviceBuffer != nullptr);
+    TEST_ASSERT_EQUALS(256u, toType<Buffer>(buffers[0])->deviceBuffer->size);
+    TEST_ASSERT_EQUALS(64u * 1024u, toType<Buffer>(buffers[1])->deviceBuffer->size);
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clWaitForEvents)(1, &event));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(event));
+
+    // migrating to the device cleans the host writes ahead of the next kernel execution
+    auto deviceBuffer = toType<Buffer>(buffers[1])->deviceBuffer;
+    std::vector<uint8_t> data(1024, 0x42);
+    errcode = VC4CL_FUNC(clEnqueueWriteBuffer)(
+        queue, buffers[1], CL_TRUE, 0, data.size(), data.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT(CoherenceState::HOST_OWNED == deviceBuffer->getCoherenceState());
+    errcode = VC4CL_FUNC(clEnqueueMigrateMemObjects)(queue, 1, &buffers[1], 0, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    TEST_ASSERT(CoherenceState::SHARED == deviceBuffer->getCoherenceState());
+
+    // undefined contents do not need to be cleaned at all
+    errcode = VC4CL_FUNC(clEnqueueWriteBuffer)(
+        queue, buffers[1], CL_TRUE, 0, data.size(), data.data(), 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    errcode = VC4CL_FUNC(clEnqueueMigrateMemObjects)(
+        queue, 1, &buffers[1], CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    TEST_ASSERT(CoherenceState::SHARED == deviceBuffer->getCoherenceState());
+    TEST_ASSERT(deviceBuffer->takeHostWrites().empty());
+
+    // migrating to the host invalidates the device writes ahead of the next host access
+    TEST_ASSERT(deviceBuffer->beginDeviceAccess(true));
+    TEST_ASSERT(CoherenceState::DEVICE_OWNED == deviceBuffer->getCoherenceState());
+    errcode = VC4CL_FUNC(clEnqueueMigrateMemObjects)(
+        queue, 1, &buffers[1], CL_MIGRATE_MEM_OBJECT_HOST, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, errcode);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clFinish)(queue));
+    TEST_ASSERT(CoherenceState::SHARED == deviceBuffer->getCoherenceState());
+
+    errcode = VC4CL_FUNC(clEnqueueMigrateMemObjects)(queue, 1, &buffers[1], 0x100, 0, nullptr, nullptr);
+    TEST_ASSERT_EQUALS(CL_INVALID_VALUE, errcode);
 
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(buffers[0]));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseMemObject)(buffers[1]));
 }
 
 void TestBuffer::testRetainMemObject()
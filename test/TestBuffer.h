@@ -19,6 +19,7 @@ public:
     bool setup() override;
     
     void testCreateBuffer();
+    void testCreateBufferFromHostPointer();
     void testCreateSubBuffer();
     void testEnqueueReadBuffer();
     void testEnqueueWriteBuffer();
@@ -28,9 +29,11 @@ public:
     void testEnqueueFillBufferRect();
     void testEnqueueCopyBuffer();
     void testEnqueueCopyBufferRect();
+    void testQPUTransfers();
     
     void testEnqueueMapBuffer();
     void testEnqueueUnmapMemObject();
+    void testMapOverlappingRegions();
     void testEnqueueMigrateMemObjects();
     void testGetMemObjectInfo();
     void testRetainMemObject();
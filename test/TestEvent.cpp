@@ -23,6 +23,8 @@ TestEvent::TestEvent() : event_count(0), context(nullptr), queue(nullptr), user_
     TEST_ADD(TestEvent::testEnqueueBarrierWithWaitList);
     TEST_ADD(TestEvent::testEnqueueMarkerWithWaitList);
     TEST_ADD(TestEvent::testGetEventProfilingInfo);
+    TEST_ADD(TestEvent::testIndependentQueues);
+    TEST_ADD(TestEvent::testOutOfOrderQueue);
     TEST_ADD(TestEvent::testRetainEvent);
     TEST_ADD(TestEvent::testReleaseEvent);
 
@@ -165,6 +167,93 @@ void TestEvent::testGetEventProfilingInfo()
     TEST_ASSERT(state != CL_SUCCESS);
 }
 
+void TestEvent::testIndependentQueues()
+{
+    cl_int state = CL_SUCCESS;
+    cl_command_queue otherQueue =
+        VC4CL_FUNC(clCreateCommandQueue)(context, Platform::getVC4CLPlatform().VideoCoreIVGPU.toBase(), 0, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_event userEvent = VC4CL_FUNC(clCreateUserEvent)(context, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+
+    // block the first queue on the user event
+    cl_event blockedEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(queue, 1, &userEvent, &blockedEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+
+    // events in the other queue are still executed
+    cl_event otherEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(otherQueue, 0, nullptr, &otherEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clWaitForEvents)(1, &otherEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(otherEvent)->getStatus());
+    TEST_ASSERT(!toType<Event>(blockedEvent)->isFinished());
+
+    // unblock the first queue
+    state = VC4CL_FUNC(clSetUserEventStatus)(userEvent, CL_COMPLETE);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clWaitForEvents)(1, &blockedEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(blockedEvent)->getStatus());
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(otherEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(blockedEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(userEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseCommandQueue)(otherQueue));
+}
+
+void TestEvent::testOutOfOrderQueue()
+{
+    cl_int state = CL_SUCCESS;
+    cl_command_queue outOfOrderQueue = VC4CL_FUNC(clCreateCommandQueue)(context,
+        Platform::getVC4CLPlatform().VideoCoreIVGPU.toBase(), CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_event blockingEvent = VC4CL_FUNC(clCreateUserEvent)(context, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_event completedEvent = VC4CL_FUNC(clCreateUserEvent)(context, &state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clSetUserEventStatus)(completedEvent, CL_COMPLETE));
+
+    cl_event blockedEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(outOfOrderQueue, 1, &blockingEvent, &blockedEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+
+    // an independent command enqueued later is not blocked by the previous command
+    cl_event independentEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(outOfOrderQueue, 1, &completedEvent, &independentEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clWaitForEvents)(1, &independentEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT(!toType<Event>(blockedEvent)->isFinished());
+
+    // a barrier waits for all previous commands and all following commands wait for the barrier
+    cl_event barrierEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueBarrierWithWaitList)(outOfOrderQueue, 0, nullptr, &barrierEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    cl_event fencedEvent = nullptr;
+    state = VC4CL_FUNC(clEnqueueMarkerWithWaitList)(outOfOrderQueue, 1, &completedEvent, &fencedEvent);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT(!toType<Event>(barrierEvent)->isFinished());
+    TEST_ASSERT(!toType<Event>(fencedEvent)->isFinished());
+
+    state = VC4CL_FUNC(clSetUserEventStatus)(blockingEvent, CL_COMPLETE);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clFinish)(outOfOrderQueue);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(blockedEvent)->getStatus());
+    TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(barrierEvent)->getStatus());
+    TEST_ASSERT_EQUALS(CL_COMPLETE, toType<Event>(fencedEvent)->getStatus());
+
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(fencedEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(barrierEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(independentEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(blockedEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(completedEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseEvent)(blockingEvent));
+    TEST_ASSERT_EQUALS(CL_SUCCESS, VC4CL_FUNC(clReleaseCommandQueue)(outOfOrderQueue));
+}
+
 void TestEvent::testRetainEvent()
 {
     TEST_ASSERT_EQUALS(1u, toType<Event>(user_event)->getReferences());
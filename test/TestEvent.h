@@ -29,6 +29,8 @@ public:
     void testEnqueueMarkerWithWaitList();
     void testEnqueueBarrierWithWaitList();
     void testGetEventProfilingInfo();
+    void testIndependentQueues();
+    void testOutOfOrderQueue();
     
     void testFlush();
     void testFinish();
@@ -10,6 +10,7 @@
 #include "src/icd_loader.h"
 
 #include <algorithm>
+#include <cstring>
 #include <numeric>
 
 using namespace vc4cl;
@@ -240,6 +241,20 @@ void TestImage::testHostsideRasterFormat()
 	TEST_ASSERT_EQUALS(CL_SUCCESS, status);
 	TEST_ASSERT(buffer == tmp);
 
+	//fill whole rows and a part of a row
+	Image* img = toType<Image>(image);
+	unsigned color = 0x11223344;
+	img->accessor->fillPixelData({0, 4, 0}, {2048, 3, 1}, &color);
+	memset(img->accessor->calculatePixelOffset(img->deviceBuffer->hostPointer, {0, 1024, 0}), 0, 2048 * sizeof(unsigned));
+	img->accessor->fillPixelData({1027, 1024, 0}, {17, 1, 1}, &color);
+	const unsigned* pixels = static_cast<const unsigned*>(img->deviceBuffer->hostPointer);
+	TEST_ASSERT(std::all_of(pixels + 4 * 2048, pixels + 7 * 2048, [&](unsigned val) { return val == color; }));
+	TEST_ASSERT(pixels[3 * 2048 + 2047] != color);
+	TEST_ASSERT(pixels[7 * 2048] != color);
+	//only the filled part of the row is overwritten
+	for(std::size_t i = 1024; i < 2048; ++i)
+		TEST_ASSERT_EQUALS(i >= 1027 && i < 1027 + 17 ? color : 0u, pixels[1024 * 2048 + i]);
+
 	status = VC4CL_FUNC(clReleaseMemObject(image));
 	TEST_ASSERT_EQUALS(CL_SUCCESS, status);
 }
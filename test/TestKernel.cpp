@@ -31,6 +31,7 @@ TestKernel::TestKernel() : context(nullptr), program(nullptr), queue(nullptr), i
     TEST_ADD(TestKernel::testEnqueueNativeKernel);
     TEST_ADD(TestKernel::testKernelResult);
     TEST_ADD(TestKernel::testEnqueueTask);
+    TEST_ADD(TestKernel::testReuseProgramImage);
     TEST_ADD(TestKernel::testRetainKernel);
     TEST_ADD(TestKernel::testReleaseKernel);
 }
@@ -296,6 +297,37 @@ void TestKernel::testEnqueueTask()
     VC4CL_FUNC(clReleaseEvent)(event);
 }
 
+void TestKernel::testReuseProgramImage()
+{
+    Program* prog = toType<Program>(program);
+    uint32_t imageAddress = 0;
+    {
+        auto image = prog->getDeviceImage();
+        TEST_ASSERT(image != nullptr);
+        if(!image)
+            return;
+        imageAddress = static_cast<uint32_t>(image->buffer->qpuPointer);
+        // the image contains the unmodified global data and the whole module binary
+        TEST_ASSERT_EQUALS(0, memcmp(image->buffer->hostPointer, prog->globalData.data(), image->globalDataSize));
+        TEST_ASSERT_EQUALS(0,
+            memcmp(reinterpret_cast<const uint8_t*>(image->buffer->hostPointer) + image->codeOffset,
+                prog->binaryCode.data(), prog->binaryCode.size() * sizeof(uint64_t)));
+    }
+
+    cl_event event = nullptr;
+    cl_int state = VC4CL_FUNC(clEnqueueTask)(queue, kernel, 0, nullptr, &event);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    state = VC4CL_FUNC(clWaitForEvents)(1, &event);
+    TEST_ASSERT_EQUALS(CL_SUCCESS, state);
+    VC4CL_FUNC(clReleaseEvent)(event);
+
+    // further executions do not upload the program again
+    auto image = prog->getDeviceImage();
+    TEST_ASSERT(image != nullptr);
+    if(image)
+        TEST_ASSERT_EQUALS(imageAddress, static_cast<uint32_t>(image->buffer->qpuPointer));
+}
+
 void TestKernel::testRetainKernel()
 {
     TEST_ASSERT_EQUALS(1u, toType<Kernel>(kernel)->getReferences());
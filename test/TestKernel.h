@@ -30,6 +30,7 @@ public:
     void prepareArgBuffer();
     void testEnqueueNDRangeKernel();
     void testEnqueueTask();
+    void testReuseProgramImage();
     void testEnqueueNativeKernel();
     void testKernelResult();
 
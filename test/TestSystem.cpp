@@ -5,15 +5,37 @@
  */
 
 #include "TestSystem.h"
+#include "src/hal/MemoryPool.h"
 #include "src/hal/V3D.h"
+#include "src/hal/VCHI.h"
+#include "src/hal/emulator.h"
 #include "src/hal/hal.h"
+#include "src/hal/userland.h"
+#include "src/vc4cl_config.h"
 
 #include <CL/cl_platform.h>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
 
 using namespace vc4cl;
 
 TestSystem::TestSystem()
 {
+    if(system()->getMemoryPoolIfAvailable())
+        TEST_ADD(TestSystem::testMemoryPool);
+    TEST_ADD(TestSystem::testMemoryMapper);
+    TEST_ADD(TestSystem::testHostWriteTracking);
+    if(system()->isEmulated)
+        TEST_ADD(TestSystem::testCoherenceStates);
+#if defined(MOCK_HAL) && MOCK_HAL
+    TEST_ADD(TestSystem::testVCHICompletions);
+#endif
+    TEST_ADD(TestSystem::testV3DProgramQueue);
+    TEST_ADD(TestSystem::testV3DCompletionWaiting);
+    TEST_ADD(TestSystem::testV3DCacheClearing);
     if(!system()->getV3DIfAvailable())
         return;
     TEST_ADD(TestSystem::testGetSystemInfo);
@@ -35,3 +57,525 @@ void TestSystem::testGetSystemInfo()
     res = v3d->getSystemInfo(SystemInfo::QPU_COUNT);
     TEST_ASSERT_EQUALS(12u, res);
 }
+
+void TestSystem::testMemoryPool()
+{
+    auto pool = system()->getMemoryPoolIfAvailable();
+    auto cacheType = system()->forcedCacheType.first ? system()->forcedCacheType.second : CacheType::BOTH_CACHED;
+    auto initialStats = pool->getStatistics(cacheType);
+
+    std::vector<std::unique_ptr<DeviceBuffer>> buffers;
+    for(unsigned i = 0; i < 3; ++i)
+        buffers.emplace_back(system()->allocateBuffer(100, "Test buffer", CacheType::BOTH_CACHED));
+    for(const auto& buffer : buffers)
+    {
+        TEST_ASSERT(!!buffer);
+        if(!buffer)
+            return;
+        TEST_ASSERT_EQUALS(100u, buffer->size);
+        TEST_ASSERT_EQUALS(0u, static_cast<uint32_t>(buffer->qpuPointer) % device_config::BUFFER_ALIGNMENT);
+        // all small buffers are sub-allocated from the same slab
+        TEST_ASSERT_EQUALS(buffers.front()->memHandle, buffer->memHandle);
+    }
+    // the buffers do not overlap
+    TEST_ASSERT(static_cast<uint32_t>(buffers[1]->qpuPointer) >= static_cast<uint32_t>(buffers[0]->qpuPointer) + 100u);
+    TEST_ASSERT(static_cast<uint32_t>(buffers[2]->qpuPointer) >= static_cast<uint32_t>(buffers[1]->qpuPointer) + 100u);
+
+    auto stats = pool->getStatistics(cacheType);
+    TEST_ASSERT_EQUALS(initialStats.numAllocations + 3u, stats.numAllocations);
+    TEST_ASSERT_EQUALS(initialStats.usedBytes + 3u * 128u, stats.usedBytes);
+    TEST_ASSERT(stats.reservedBytes >= stats.usedBytes);
+
+    // a released block is re-used for the next allocation of the same size class
+    auto releasedAddress = static_cast<uint32_t>(buffers[1]->qpuPointer);
+    buffers[1].reset();
+    buffers[1] = system()->allocateBuffer(120, "Test buffer", CacheType::BOTH_CACHED);
+    TEST_ASSERT(!!buffers[1]);
+    if(buffers[1])
+        TEST_ASSERT_EQUALS(releasedAddress, static_cast<uint32_t>(buffers[1]->qpuPointer));
+
+    // large buffers are not served by the pool
+    auto largeBuffer = system()->allocateBuffer(MemoryPool::MAX_BLOCK_SIZE + 1, "Test buffer", CacheType::BOTH_CACHED);
+    TEST_ASSERT(!!largeBuffer);
+    TEST_ASSERT_EQUALS(initialStats.numAllocations + 4u, pool->getStatistics(cacheType).numAllocations);
+    if(largeBuffer)
+        TEST_ASSERT(largeBuffer->memHandle != buffers.front()->memHandle);
+
+    largeBuffer.reset();
+    buffers.clear();
+    TEST_ASSERT_EQUALS(initialStats.usedBytes, pool->getStatistics(cacheType).usedBytes);
+}
+
+void TestSystem::testMemoryMapper()
+{
+    // Since we cannot access /dev/mem without root rights (and on non-Raspberry Pi systems), a temporary file is used
+    // as stand-in for the physical memory, similar to the emulated buffers
+    static constexpr uint32_t CHUNK_SIZE = 16 * V3D::MEMORY_PAGE_SIZE;
+    char fileName[] = "/tmp/vc4cl-memory-XXXXXX";
+    int fd = mkstemp(fileName);
+    TEST_ASSERT(fd >= 0);
+    if(fd < 0)
+        return;
+    TEST_ASSERT_EQUALS(0, ftruncate(fd, 4 * CHUNK_SIZE));
+    close(fd);
+
+    {
+        MemoryMapper mapper(fileName, O_RDWR, CHUNK_SIZE);
+        TEST_ASSERT_EQUALS(0u, mapper.getNumMappings());
+
+        // two areas in the same chunk share a single mapping
+        auto first = reinterpret_cast<uint8_t*>(mapper.mapMemory(CHUNK_SIZE + 64, 128));
+        auto second = reinterpret_cast<uint8_t*>(mapper.mapMemory(CHUNK_SIZE + 4096, 256));
+        TEST_ASSERT_EQUALS(1u, mapper.getNumMappings());
+        TEST_ASSERT_EQUALS(4096 - 64, second - first);
+
+        // an area in another chunk requires another mapping
+        auto third = reinterpret_cast<uint8_t*>(mapper.mapMemory(3 * CHUNK_SIZE, 64));
+        TEST_ASSERT_EQUALS(2u, mapper.getNumMappings());
+
+        // an area crossing a chunk boundary is mapped separately
+        auto crossing = reinterpret_cast<uint8_t*>(mapper.mapMemory(2 * CHUNK_SIZE - 64, 128));
+        TEST_ASSERT_EQUALS(3u, mapper.getNumMappings());
+
+        // all areas are backed by the same memory
+        memset(crossing, 0x42, 128);
+        auto direct = reinterpret_cast<uint8_t*>(mapper.mapDirect(2 * CHUNK_SIZE - 4096, 8192));
+        TEST_ASSERT_EQUALS(0x42, direct[4096 - 64]);
+        TEST_ASSERT_EQUALS(0x42, direct[4096 + 63]);
+        direct[4096 - 128] = 0x17;
+        TEST_ASSERT_EQUALS(0x17, first[CHUNK_SIZE - 64 - 128]);
+        unmapmem(direct, 8192);
+
+        mapper.unmapMemory(crossing, 128);
+        TEST_ASSERT_EQUALS(2u, mapper.getNumMappings());
+        mapper.unmapMemory(first, 128);
+        mapper.unmapMemory(second, 256);
+        mapper.unmapMemory(third, 64);
+        // idle chunks are kept mapped for re-use
+        TEST_ASSERT_EQUALS(2u, mapper.getNumMappings());
+        auto again = reinterpret_cast<uint8_t*>(mapper.mapMemory(CHUNK_SIZE + 64, 128));
+        TEST_ASSERT_EQUALS(first, again);
+        TEST_ASSERT_EQUALS(2u, mapper.getNumMappings());
+        mapper.unmapMemory(again, 128);
+    }
+    unlink(fileName);
+}
+
+void TestSystem::testHostWriteTracking()
+{
+    HostWriteTracker tracker(4096);
+    // a new buffer is completely flushed before its first use
+    auto ranges = tracker.takeRanges();
+    TEST_ASSERT_EQUALS(1u, ranges.size());
+    TEST_ASSERT_EQUALS(0u, ranges.front().offset);
+    TEST_ASSERT_EQUALS(4096u, ranges.front().size);
+    TEST_ASSERT(tracker.isClean());
+    TEST_ASSERT(tracker.takeRanges().empty());
+
+    // ranges are extended to whole cache lines and adjacent ranges are merged
+    tracker.addRange(10, 4);
+    tracker.addRange(100, 30);
+    tracker.addRange(1000, 1);
+    tracker.addRange(4090, 100);
+    tracker.addRange(5000, 100);
+    tracker.addRange(2000, 0);
+    TEST_ASSERT(!tracker.isClean());
+    ranges = tracker.takeRanges();
+    TEST_ASSERT_EQUALS(3u, ranges.size());
+    if(ranges.size() == 3)
+    {
+        TEST_ASSERT_EQUALS(0u, ranges[0].offset);
+        TEST_ASSERT_EQUALS(192u, ranges[0].size);
+        TEST_ASSERT_EQUALS(960u, ranges[1].offset);
+        TEST_ASSERT_EQUALS(64u, ranges[1].size);
+        TEST_ASSERT_EQUALS(4032u, ranges[2].offset);
+        TEST_ASSERT_EQUALS(64u, ranges[2].size);
+    }
+
+    // overlapping ranges are merged
+    tracker.addRange(256, 256);
+    tracker.addRange(1024, 256);
+    tracker.addRange(300, 800);
+    ranges = tracker.takeRanges();
+    TEST_ASSERT_EQUALS(1u, ranges.size());
+    if(!ranges.empty())
+    {
+        TEST_ASSERT_EQUALS(256u, ranges.front().offset);
+        TEST_ASSERT_EQUALS(1024u, ranges.front().size);
+    }
+
+    // too many distinct ranges are merged into a single one
+    HostWriteTracker fragmentedTracker(1024 * 1024);
+    fragmentedTracker.takeRanges();
+    for(uint32_t i = 1; i <= HostWriteTracker::MAX_RANGES + 1; ++i)
+        fragmentedTracker.addRange(i * 2 * HostWriteTracker::CACHE_LINE_SIZE, 1);
+    ranges = fragmentedTracker.takeRanges();
+    TEST_ASSERT_EQUALS(1u, ranges.size());
+    if(!ranges.empty())
+    {
+        TEST_ASSERT_EQUALS(2 * HostWriteTracker::CACHE_LINE_SIZE, ranges.front().offset);
+        TEST_ASSERT_EQUALS(
+            (2 * HostWriteTracker::MAX_RANGES + 1) * HostWriteTracker::CACHE_LINE_SIZE, ranges.front().size);
+    }
+
+    // only completely covered cache lines are removed, the last partial line of the buffer too
+    HostWriteTracker discardingTracker(1000);
+    discardingTracker.removeRange(100, 800);
+    ranges = discardingTracker.takeRanges();
+    TEST_ASSERT_EQUALS(2u, ranges.size());
+    if(ranges.size() == 2)
+    {
+        TEST_ASSERT_EQUALS(0u, ranges[0].offset);
+        TEST_ASSERT_EQUALS(128u, ranges[0].size);
+        TEST_ASSERT_EQUALS(896u, ranges[1].offset);
+        TEST_ASSERT_EQUALS(104u, ranges[1].size);
+    }
+    discardingTracker.addRange(0, 1000);
+    discardingTracker.removeRange(10, 20);
+    discardingTracker.removeRange(960, 100);
+    ranges = discardingTracker.takeRanges();
+    TEST_ASSERT_EQUALS(1u, ranges.size());
+    if(!ranges.empty())
+    {
+        TEST_ASSERT_EQUALS(0u, ranges.front().offset);
+        TEST_ASSERT_EQUALS(960u, ranges.front().size);
+    }
+
+    // buffers not written since the last clean are skipped
+    auto buffer = system()->allocateBuffer(1024, "Test buffer", CacheType::BOTH_CACHED);
+    TEST_ASSERT(!!buffer);
+    if(!buffer)
+        return;
+    system()->cleanCPUCache({buffer.get()});
+    TEST_ASSERT(system()->cleanCPUCache({buffer.get()}));
+    buffer->beginHostWrite(128, 16);
+    ranges = buffer->takeHostWrites();
+    TEST_ASSERT_EQUALS(1u, ranges.size());
+    if(!ranges.empty())
+    {
+        TEST_ASSERT_EQUALS(128u, ranges.front().offset);
+        TEST_ASSERT_EQUALS(64u, ranges.front().size);
+    }
+}
+
+void TestSystem::testCoherenceStates()
+{
+    auto buffer = system()->allocateBuffer(1000, "Test buffer", CacheType::BOTH_CACHED);
+    TEST_ASSERT(!!buffer);
+    if(!buffer)
+        return;
+    auto stats = getEmulatedCacheStatistics();
+
+    // a new buffer needs to be cleaned before its first use
+    TEST_ASSERT(CoherenceState::HOST_OWNED == buffer->getCoherenceState());
+    TEST_ASSERT(system()->cleanCPUCache({buffer.get()}));
+    TEST_ASSERT(CoherenceState::SHARED == buffer->getCoherenceState());
+    TEST_ASSERT_EQUALS(stats.numCleanedRanges + 1u, getEmulatedCacheStatistics().numCleanedRanges);
+
+    // reading the buffer from both sides does not require any cache maintenance
+    TEST_ASSERT(buffer->beginDeviceAccess(false));
+    buffer->beginHostRead();
+    TEST_ASSERT(CoherenceState::SHARED == buffer->getCoherenceState());
+
+    // host writes are cleaned before the next device access
+    buffer->beginHostWrite(100, 8);
+    buffer->beginHostWrite(960, 40);
+    TEST_ASSERT(CoherenceState::HOST_OWNED == buffer->getCoherenceState());
+    TEST_ASSERT(system()->cleanCPUCache({buffer.get()}));
+    TEST_ASSERT(buffer->beginDeviceAccess(true));
+    TEST_ASSERT(CoherenceState::DEVICE_OWNED == buffer->getCoherenceState());
+    TEST_ASSERT_EQUALS(stats.numCleanedRanges + 3u, getEmulatedCacheStatistics().numCleanedRanges);
+
+    // device writes are invalidated once before the host accesses the buffer
+    buffer->beginHostRead();
+    TEST_ASSERT(CoherenceState::SHARED == buffer->getCoherenceState());
+    buffer->beginHostRead();
+    buffer->beginHostWrite(0, 4);
+    TEST_ASSERT(CoherenceState::HOST_OWNED == buffer->getCoherenceState());
+    TEST_ASSERT_EQUALS(stats.numInvalidatedBuffers + 1u, getEmulatedCacheStatistics().numInvalidatedBuffers);
+
+    // accessing the buffer from the device without cleaning the host writes is detected
+    TEST_ASSERT(!buffer->beginDeviceAccess(false));
+    TEST_ASSERT_EQUALS(stats.numIncoherentAccesses + 1u, getEmulatedCacheStatistics().numIncoherentAccesses);
+    TEST_ASSERT(system()->cleanCPUCache({buffer.get()}));
+    TEST_ASSERT(buffer->beginDeviceAccess(false));
+
+    // parts of a buffer can be invalidated separately, e.g. the global data of a program image
+    TEST_ASSERT(system()->invalidateCPUCache(*buffer, ByteRange{0, 128}));
+    TEST_ASSERT(system()->invalidateCPUCache(*buffer, ByteRange{960, 40}));
+    TEST_ASSERT_EQUALS(stats.numInvalidatedBuffers + 3u, getEmulatedCacheStatistics().numInvalidatedBuffers);
+    TEST_ASSERT_EQUALS(stats.numInvalidOperations, getEmulatedCacheStatistics().numInvalidOperations);
+
+    // buffers not cached by the host never require any host CPU cache maintenance
+    auto uncachedBuffer = system()->allocateBuffer(1000, "Test buffer", CacheType::UNCACHED);
+    TEST_ASSERT(!!uncachedBuffer);
+    if(uncachedBuffer && !isHostCached(uncachedBuffer->cacheType))
+    {
+        stats = getEmulatedCacheStatistics();
+        uncachedBuffer->beginHostWrite(0, 1000);
+        TEST_ASSERT(system()->cleanCPUCache({uncachedBuffer.get()}));
+        TEST_ASSERT(uncachedBuffer->beginDeviceAccess(true));
+        uncachedBuffer->beginHostRead();
+        TEST_ASSERT(CoherenceState::SHARED == uncachedBuffer->getCoherenceState());
+        TEST_ASSERT_EQUALS(stats.numCleanedRanges, getEmulatedCacheStatistics().numCleanedRanges);
+        TEST_ASSERT_EQUALS(stats.numInvalidatedBuffers, getEmulatedCacheStatistics().numInvalidatedBuffers);
+    }
+
+    TEST_ASSERT_EQUALS(stats.numInvalidOperations, getEmulatedCacheStatistics().numInvalidOperations);
+}
+
+void TestSystem::testVCHICompletions()
+{
+#if defined(MOCK_HAL) && MOCK_HAL
+    // uses the fake GPU service, which only completes the jobs on request
+    VCHI vchi;
+    TEST_ASSERT_EQUALS(0u, mock_gpuserv_get_pending_jobs());
+
+    // launch messages of a single QPU for 2 work-groups, the addresses are never accessed
+    std::array<uint32_t, 4> launchMessages{};
+    std::vector<std::pair<uint32_t*, uint32_t>> batch{
+        std::make_pair(&launchMessages[0], 0x1000u), std::make_pair(&launchMessages[2], 0x1008u)};
+    std::chrono::milliseconds timeout{1};
+
+    // multiple submissions can be in flight at the same time
+    auto first = vchi.executeQPUBatch(1, batch, true, timeout);
+    auto second = vchi.executeQPU(1, batch.front(), false, timeout);
+    auto third = vchi.executeQPU(1, batch.back(), false, timeout);
+    TEST_ASSERT_EQUALS(4u, mock_gpuserv_get_pending_jobs());
+    TEST_ASSERT_EQUALS(3u, VCHI::getNumPendingSubmissions());
+
+    // the first submission is only completed with its last job
+    TEST_ASSERT_EQUALS(1u, mock_gpuserv_complete_jobs(1));
+    TEST_ASSERT_EQUALS(3u, VCHI::getNumPendingSubmissions());
+    TEST_ASSERT_EQUALS(2u, mock_gpuserv_complete_jobs(2));
+    TEST_ASSERT_EQUALS(1u, VCHI::getNumPendingSubmissions());
+    TEST_ASSERT(first.waitFor());
+    TEST_ASSERT(second.waitFor());
+
+    // the third submission times out and its late completion is ignored
+    TEST_ASSERT(!third.waitFor());
+    TEST_ASSERT_EQUALS(0u, VCHI::getNumPendingSubmissions());
+    TEST_ASSERT_EQUALS(1u, mock_gpuserv_complete_jobs(1));
+    TEST_ASSERT(!third.waitFor());
+
+    // invalid batches are rejected
+    TEST_ASSERT(!vchi.executeQPUBatch(1, {}, false, timeout).waitFor());
+    TEST_ASSERT_EQUALS(0u, mock_gpuserv_get_pending_jobs());
+#endif
+}
+
+void TestSystem::testV3DProgramQueue()
+{
+    // launch messages of 12 QPUs for 3 work-groups, the addresses are never accessed
+    std::array<uint32_t, 3 * 12 * 2> launchMessages{};
+    std::vector<std::pair<uint32_t*, unsigned>> batch;
+    for(unsigned i = 0; i < 3; ++i)
+        batch.emplace_back(&launchMessages[i * 12 * 2], 0x1000u + i * 12 * 2 * sizeof(uint32_t));
+    std::chrono::milliseconds timeout{100};
+    const uint32_t queueCapacity = V3D::PROGRAM_QUEUE_CAPACITY;
+
+    {
+        // the emulated registers complete one queued program per status read
+        auto registers = new EmulatedV3DRegisters(true);
+        V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::PIPELINED);
+
+        // the batch exceeds the queue capacity, the queue is refilled while submitting
+        auto result = v3d.executeQPUBatch(12, batch, true, timeout);
+        TEST_ASSERT(result.waitFor());
+        auto stats = registers->getStatistics();
+        TEST_ASSERT_EQUALS(36u, stats.numQueuedPrograms);
+        TEST_ASSERT_EQUALS(36u, stats.numCompletedPrograms);
+        TEST_ASSERT(stats.maxQueueLength <= queueCapacity);
+        TEST_ASSERT_EQUALS(0u, stats.numQueueOverflows);
+        TEST_ASSERT_EQUALS(1u, stats.numCountResets);
+
+        // the rolling 8-bit completed count is tracked across submissions without resetting it
+        for(unsigned i = 0; i < 10; ++i)
+        {
+            auto next = v3d.executeQPUBatch(12, batch, false, timeout);
+            TEST_ASSERT(next.waitFor());
+        }
+        stats = registers->getStatistics();
+        TEST_ASSERT_EQUALS(11u * 36u, stats.numQueuedPrograms);
+        TEST_ASSERT_EQUALS(11u * 36u, stats.numCompletedPrograms);
+        TEST_ASSERT_EQUALS(0u, stats.numQueueOverflows);
+        TEST_ASSERT_EQUALS(1u, stats.numCountResets);
+    }
+
+    {
+        // the emulated registers only complete the programs on request
+        auto registers = new EmulatedV3DRegisters(false);
+        V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::PIPELINED);
+
+        auto first = v3d.executeQPU(4, batch.front(), true, std::chrono::milliseconds{1});
+        auto second = v3d.executeQPU(4, batch.back(), false, std::chrono::milliseconds{1});
+        TEST_ASSERT_EQUALS(8u, v3d.getSystemInfo(SystemInfo::PROGRAM_QUEUE_LENGTH));
+        TEST_ASSERT_EQUALS(4u, registers->completePrograms(4));
+        // since the programs might finish out of order, the first submission is only known to be finished once the
+        // programs of the second submission finished too
+        TEST_ASSERT(!first.waitFor());
+        TEST_ASSERT_EQUALS(4u, registers->completePrograms(8));
+        TEST_ASSERT(second.waitFor());
+
+        // the queue is full, so the submission times out waiting for free entries
+        std::vector<std::pair<uint32_t*, unsigned>> largeBatch(5, batch.front());
+        auto failed = v3d.executeQPUBatch(4, largeBatch, false, std::chrono::milliseconds{50});
+        TEST_ASSERT_EQUALS(queueCapacity, v3d.getSystemInfo(SystemInfo::PROGRAM_QUEUE_LENGTH));
+        TEST_ASSERT_EQUALS(0u, v3d.getSystemInfo(SystemInfo::PROGRAM_QUEUE_FULL));
+        TEST_ASSERT_EQUALS(0u, registers->getStatistics().numQueueOverflows);
+        // the already queued programs still access the launch messages, so the failure is only reported after they
+        // finished
+        std::thread completer([registers, queueCapacity]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            registers->completePrograms(queueCapacity);
+        });
+        TEST_ASSERT(!failed.waitFor());
+        TEST_ASSERT_EQUALS(0u, v3d.getSystemInfo(SystemInfo::PROGRAM_QUEUE_LENGTH));
+        completer.join();
+    }
+
+    {
+        // the programs might finish out of order, e.g. if they have different runtimes
+        auto registers = new EmulatedV3DRegisters(false);
+        V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::PIPELINED);
+
+        // launch messages of a single QPU for 4 work-groups with distinct UNIFORM addresses
+        std::array<uint32_t, 4 * 2> messages{};
+        std::vector<std::pair<uint32_t*, unsigned>> blocks;
+        for(unsigned i = 0; i < 4; ++i)
+        {
+            messages[i * 2] = 0x1000u + i * 0x100u;
+            messages[i * 2 + 1] = 0x2000u;
+            blocks.emplace_back(&messages[i * 2], 0x3000u + i * 2 * sizeof(uint32_t));
+        }
+        auto first = v3d.executeQPUBatch(1, {blocks[0], blocks[1]}, true, timeout);
+        auto second = v3d.executeQPUBatch(1, {blocks[2], blocks[3]}, false, timeout);
+        TEST_ASSERT_EQUALS(4u, registers->startPrograms(4));
+        TEST_ASSERT_EQUALS(0u, v3d.getSystemInfo(SystemInfo::PROGRAM_QUEUE_LENGTH));
+
+        // the programs of the second batch and one of the first batch finish first, so the completed count already
+        // covers the number of programs of the first batch while its second program is still running
+        TEST_ASSERT(registers->completeProgram(0x1300u));
+        TEST_ASSERT(registers->completeProgram(0x1200u));
+        TEST_ASSERT(registers->completeProgram(0x1000u));
+        TEST_ASSERT(!registers->completeProgram(0x1000u));
+        std::thread completer([registers]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            registers->completeProgram(0x1100u);
+        });
+        TEST_ASSERT(first.waitFor());
+        TEST_ASSERT_EQUALS(4u, registers->getStatistics().numCompletedPrograms);
+        completer.join();
+        TEST_ASSERT(second.waitFor());
+    }
+
+    {
+        // in the single submission mode, the counts are reset for every submission
+        auto registers = new EmulatedV3DRegisters(true);
+        V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::SINGLE);
+        for(unsigned i = 0; i < 2; ++i)
+        {
+            auto result = v3d.executeQPU(12, batch.front(), true, timeout);
+            TEST_ASSERT(result.waitFor());
+        }
+        TEST_ASSERT_EQUALS(2u, registers->getStatistics().numCountResets);
+        TEST_ASSERT_EQUALS(0u, registers->getStatistics().numQueueOverflows);
+    }
+}
+
+void TestSystem::testV3DCompletionWaiting()
+{
+    // launch messages of 4 QPUs, the addresses are never accessed
+    std::array<uint32_t, 4 * 2> launchMessages{};
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        launchMessages[i * 2] = 0x1000u + i * 0x100u;
+        launchMessages[i * 2 + 1] = 0x2000u;
+    }
+    auto controlAddress = std::make_pair(launchMessages.data(), 0x3000u);
+
+    auto registers = new EmulatedV3DRegisters(false);
+    V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::SINGLE);
+    TEST_ASSERT_EQUALS(0, v3d.getExpectedRuntime(0x2000u, 4).count());
+
+    // the execution finishes after the initial active waiting window, so the waiting backs off with sleeps
+    auto result = v3d.executeQPU(4, controlAddress, true, std::chrono::milliseconds{1000});
+    std::thread completer([registers]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        registers->completePrograms(4);
+    });
+    TEST_ASSERT(result.waitFor());
+    completer.join();
+    auto learnedRuntime = v3d.getExpectedRuntime(0x2000u, 4);
+    TEST_ASSERT(learnedRuntime >= std::chrono::milliseconds{20});
+    // the runtime is learned per code address and number of programs
+    TEST_ASSERT_EQUALS(0, v3d.getExpectedRuntime(0x2000u, 8).count());
+
+    // faster executions reduce the learned runtime
+    result = v3d.executeQPU(4, controlAddress, false, std::chrono::milliseconds{1000});
+    TEST_ASSERT_EQUALS(4u, registers->completePrograms(4));
+    TEST_ASSERT(result.waitFor());
+    TEST_ASSERT(v3d.getExpectedRuntime(0x2000u, 4) < learnedRuntime);
+}
+
+void TestSystem::testV3DCacheClearing()
+{
+    // launch messages of 2 QPUs for 2 work-groups of the same kernel and one work-group of another kernel
+    std::array<uint32_t, 3 * 2 * 2> launchMessages{};
+    for(unsigned i = 0; i < 3 * 2; ++i)
+    {
+        launchMessages[i * 2] = 0x1000u + i * 0x100u;
+        launchMessages[i * 2 + 1] = i < 4 ? 0x2000u : 0x4000u;
+    }
+    std::vector<std::pair<uint32_t*, unsigned>> blocks;
+    for(unsigned i = 0; i < 3; ++i)
+        blocks.emplace_back(&launchMessages[i * 2 * 2], 0x3000u + i * 2 * 2 * sizeof(uint32_t));
+    std::chrono::milliseconds timeout{100};
+    const std::vector<uint32_t> l2Clear{V3D_L2CACTL_L2CCLR};
+    const uint32_t tmuCaches = V3D_SLCACTL_T0CCS | V3D_SLCACTL_T1CCS;
+
+    auto registers = new EmulatedV3DRegisters(true);
+    V3D v3d(std::unique_ptr<V3DRegisters>{registers}, V3DSubmissionMode::SINGLE);
+
+    // the first work-group of a kernel execution clears all caches
+    auto result = v3d.executeQPU(2, blocks[0], true, timeout);
+    TEST_ASSERT(result.waitFor());
+    TEST_ASSERT(l2Clear == registers->takeWrittenValues(V3D_L2CACTL));
+    auto sliceClears = registers->takeWrittenValues(V3D_SLCACTL);
+    TEST_ASSERT_EQUALS(1u, sliceClears.size());
+    TEST_ASSERT_EQUALS(V3D_SLCACTL_ICCS | V3D_SLCACTL_UCCS | tmuCaches, sliceClears.front());
+
+    // following work-groups of the same kernel only clear the caches containing the UNIFORMs
+    result = v3d.executeQPU(2, blocks[1], false, timeout);
+    TEST_ASSERT(result.waitFor());
+    TEST_ASSERT(l2Clear == registers->takeWrittenValues(V3D_L2CACTL));
+    sliceClears = registers->takeWrittenValues(V3D_SLCACTL);
+    TEST_ASSERT_EQUALS(1u, sliceClears.size());
+    TEST_ASSERT_EQUALS(V3D_SLCACTL_UCCS, sliceClears.front());
+
+    // changing the code clears the instruction caches
+    result = v3d.executeQPU(2, blocks[2], false, timeout);
+    TEST_ASSERT(result.waitFor());
+    sliceClears = registers->takeWrittenValues(V3D_SLCACTL);
+    TEST_ASSERT_EQUALS(1u, sliceClears.size());
+    TEST_ASSERT_EQUALS(V3D_SLCACTL_ICCS | V3D_SLCACTL_UCCS, sliceClears.front());
+    TEST_ASSERT(l2Clear == registers->takeWrittenValues(V3D_L2CACTL));
+
+    {
+        // in pipelined mode, the caches are cleared once per batch
+        auto pipelinedRegisters = new EmulatedV3DRegisters(true);
+        V3D pipelinedV3D(std::unique_ptr<V3DRegisters>{pipelinedRegisters}, V3DSubmissionMode::PIPELINED);
+        auto batchResult = pipelinedV3D.executeQPUBatch(2, {blocks[0], blocks[1]}, true, timeout);
+        TEST_ASSERT(batchResult.waitFor());
+        sliceClears = pipelinedRegisters->takeWrittenValues(V3D_SLCACTL);
+        TEST_ASSERT_EQUALS(1u, sliceClears.size());
+        TEST_ASSERT_EQUALS(V3D_SLCACTL_ICCS | V3D_SLCACTL_UCCS | tmuCaches, sliceClears.front());
+
+        batchResult = pipelinedV3D.executeQPUBatch(2, {blocks[0], blocks[1]}, false, timeout);
+        TEST_ASSERT(batchResult.waitFor());
+        sliceClears = pipelinedRegisters->takeWrittenValues(V3D_SLCACTL);
+        TEST_ASSERT_EQUALS(1u, sliceClears.size());
+        TEST_ASSERT_EQUALS(V3D_SLCACTL_UCCS, sliceClears.front());
+        TEST_ASSERT_EQUALS(2u, pipelinedRegisters->takeWrittenValues(V3D_L2CACTL).size());
+    }
+}
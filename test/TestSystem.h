@@ -15,6 +15,14 @@ public:
     TestSystem();
     
     void testGetSystemInfo();
+    void testMemoryPool();
+    void testMemoryMapper();
+    void testHostWriteTracking();
+    void testCoherenceStates();
+    void testVCHICompletions();
+    void testV3DProgramQueue();
+    void testV3DCompletionWaiting();
+    void testV3DCacheClearing();
 
 };
 
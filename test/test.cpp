@@ -9,6 +9,7 @@
 
 #include "cpptest-main.h"
 
+#include "TestBenchmarks.h"
 #include "TestBuffer.h"
 #include "TestCommandQueue.h"
 #include "TestContext.h"
@@ -66,6 +67,9 @@ int main(int argc, char** argv)
         Test::newInstance<TestExecutions>, "executions", "Tests the executions and results of a few selected kernels");
 #endif
 
+    Test::registerSuite(
+        Test::newInstance<TestBenchmarks>, "benchmarks", "Measures the host-side overhead of selected operations");
+
     std::vector<char*> args{};
     // we need this first argument, since the  cpptest-lite helper expects the first argument to be skipped (as if
     // passed directly the main arguments)
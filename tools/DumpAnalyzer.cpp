@@ -221,16 +221,19 @@ int main(int argc, char** argv)
      * | QPU UNIFORM pointer    |--------+ | |
      * | #UNIFORMS | iterations |        | | |
      * | UNIFORMS set bitmask   |        | | |
+     * | global data size       |        | | |
+     * | code size              |        | | |
      * +------------------------+<-------|-|-+
      * |  Data Segment          |        | |
-     * +------------------------+ <----+-|-+
-     * |  QPU Code              |      | |
-     * |  ...                   |      | |
-     * +------------------------+ <--+-|-+
-     * |  Uniforms              |    | |
-     * +------------------------+    | |
-     * |  QPU0 Uniform --------------+ |
-     * |  QPU0 Start   ----------------+
+     * |  (with stack-frames)   |        | |
+     * +------------------------+ <------|-+
+     * |  QPU Code              |        |
+     * |  ...                   |        |
+     * +------------------------+ <------+
+     * |  Uniforms              |
+     * +------------------------+
+     * |  QPU0 Uniform          |
+     * |  QPU0 Start            |
      * +------------------------+
      * |  0 word separator      |
      * +------------------------+ <- parameters (direct or memory buffer)
@@ -265,8 +268,10 @@ int main(int argc, char** argv)
     uniformsSet.value = implicitUniformBitset;
 
     // sizes in bytes
-    unsigned globalDataSize = qpuCodePointer - qpuBasePointer;
-    unsigned codeSize = qpuUniformPointer - qpuCodePointer;
+    unsigned globalDataSize;
+    unsigned codeSize;
+    f.read(reinterpret_cast<char*>(&globalDataSize), sizeof(unsigned));
+    f.read(reinterpret_cast<char*>(&codeSize), sizeof(unsigned));
     auto numInstructions = static_cast<unsigned>(codeSize / sizeof(uint64_t));
 
     printGlobalData(f, std::cout, globalDataSize);